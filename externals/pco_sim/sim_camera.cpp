@@ -0,0 +1,647 @@
+// Simulated sc2_cam API
+// Only the camera functions the samples use are implemented, all settings are
+// kept in memory and reflected in the frames and metadata the recorder delivers.
+
+#include "sim_internal.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace pco_sim
+{
+  static long envValue(const char* name, long defaultValue, long minValue, long maxValue)
+  {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0')
+      return defaultValue;
+    long parsed = std::strtol(value, nullptr, 10);
+    return std::min(std::max(parsed, minValue), maxValue);
+  }
+
+  const Config& config()
+  {
+    static const Config cfg = []()
+    {
+      Config c;
+      c.cameraCount = (int)envValue("PCO_SIM_CAMERAS", 1, 1, 64);
+      c.width = (WORD)envValue("PCO_SIM_WIDTH", 2048, 16, 0xFFF0) & 0xFFFE;
+      c.height = (WORD)envValue("PCO_SIM_HEIGHT", 2048, 16, 0xFFF0) & 0xFFFE;
+      c.frameRate = (double)envValue("PCO_SIM_FPS", 100, 1, 1000000);
+      c.bitDepth = (WORD)envValue("PCO_SIM_BITS", 16, 8, 16);
+      c.color = envValue("PCO_SIM_COLOR", 0, 0, 1) != 0;
+      c.recorderMemoryMB = (DWORD)envValue("PCO_SIM_RAM_MB", 1024, 1, 1 << 20);
+      c.camRamImages = (DWORD)envValue("PCO_SIM_CAMRAM_IMAGES", 1000, 1, 1 << 24);
+      c.openDelayMs = (DWORD)envValue("PCO_SIM_OPEN_MS", 0, 0, 60000);
+      c.armDelayMs = (DWORD)envValue("PCO_SIM_ARM_MS", 0, 0, 60000);
+      c.queryDelayMs = (DWORD)envValue("PCO_SIM_QUERY_MS", 0, 0, 60000);
+      c.camRamMBps = (DWORD)envValue("PCO_SIM_CAMRAM_MBPS", 0, 0, 100000);
+      c.lightPercent = (DWORD)envValue("PCO_SIM_LIGHT", 100, 0, 100000);
+      c.lightStepImage = (DWORD)envValue("PCO_SIM_LIGHT_STEP_IMAGE", 0, 0, 0x7FFFFFFF);
+      c.lightStepPercent = (DWORD)envValue("PCO_SIM_LIGHT_STEP", 100, 0, 100000);
+      return c;
+    }();
+    return cfg;
+  }
+
+  static std::mutex cameraMutex;
+
+  //Descriptor queries are round trips over the camera link
+  static void queryDelay()
+  {
+    if (config().queryDelayMs)
+      std::this_thread::sleep_for(std::chrono::milliseconds(config().queryDelayMs));
+  }
+
+  static std::vector<std::unique_ptr<Camera>>& cameras()
+  {
+    static std::vector<std::unique_ptr<Camera>> cams = []()
+    {
+      std::vector<std::unique_ptr<Camera>> v;
+      for (int i = 0; i < config().cameraCount; i++)
+      {
+        v.emplace_back(new Camera());
+        v.back()->index = i;
+        //Descending serial numbers, so the open order is not sorted by serial number
+        v.back()->serialNumber = 20000 - (DWORD)i * 10;
+      }
+      return v;
+    }();
+    return cams;
+  }
+
+  Camera* lookupCamera(HANDLE hCam)
+  {
+    for (auto& cam : cameras())
+    {
+      if (cam.get() == hCam && cam->open)
+        return cam.get();
+    }
+    return nullptr;
+  }
+
+  WORD roiWidth(const Camera& cam)
+  {
+    return (WORD)(cam.roiX1 - cam.roiX0 + 1);
+  }
+
+  WORD roiHeight(const Camera& cam)
+  {
+    return (WORD)(cam.roiY1 - cam.roiY0 + 1);
+  }
+
+  static double timebaseToSeconds(WORD timebase)
+  {
+    switch (timebase)
+    {
+    case TIMEBASE_NS: return 1e-9;
+    case TIMEBASE_US: return 1e-6;
+    default: return 1e-3;
+    }
+  }
+
+  DelayExposure delayExposure(const Camera& cam)
+  {
+    std::lock_guard<std::mutex> lock(cam.timingMutex);
+    return cam.timing;
+  }
+
+  void setDelayExposure(Camera& cam, const DelayExposure& timing)
+  {
+    std::lock_guard<std::mutex> lock(cam.timingMutex);
+    cam.timing = timing;
+  }
+
+  double exposureSeconds(const Camera& cam)
+  {
+    const DelayExposure timing = delayExposure(cam);
+    return timing.exposure * timebaseToSeconds(timing.exposureBase);
+  }
+
+  double framePeriodSeconds(const Camera& cam)
+  {
+    const DelayExposure timing = delayExposure(cam);
+    double readout = 1.0 / config().frameRate;
+    double exposure = timing.exposure * timebaseToSeconds(timing.exposureBase) +
+      timing.delay * timebaseToSeconds(timing.delayBase);
+    return std::max(readout, exposure);
+  }
+
+  bool waitForTrigger(Camera& cam, std::chrono::milliseconds timeout)
+  {
+    std::unique_lock<std::mutex> lock(cam.triggerMutex);
+    if (!cam.triggerCond.wait_for(lock, timeout, [&cam]() { return cam.pendingTriggers > 0; }))
+      return false;
+    cam.pendingTriggers--;
+    return true;
+  }
+
+  static void resetSettings(Camera& cam)
+  {
+    cam.roiX0 = 1;
+    cam.roiY0 = 1;
+    cam.roiX1 = config().width;
+    cam.roiY1 = config().height;
+    cam.recordingState = 0;
+    cam.timestampMode = TIMESTAMP_MODE_OFF;
+    cam.metadataMode = METADATA_MODE_OFF;
+    cam.bitAlignment = BIT_ALIGNMENT_MSB;
+    cam.triggerMode = TRIGGER_MODE_AUTOTRIGGER;
+    setDelayExposure(cam, DelayExposure());
+  }
+
+  static void createPattern(Camera& cam)
+  {
+    const Config& cfg = config();
+    const int maxValue = (1 << cfg.bitDepth) - 1;
+    const int darkOffset = 100 >> (16 - cfg.bitDepth);
+    const int range = (maxValue - darkOffset) / 2;
+    cam.pattern.resize((size_t)cfg.width * cfg.height);
+    for (int y = 0; y < cfg.height; y++)
+    {
+      WORD* row = cam.pattern.data() + (size_t)y * cfg.width;
+      for (int x = 0; x < cfg.width; x++)
+      {
+        //Diagonal gradient with some texture so that frames are not trivially compressible
+        int texture = ((x * 37) ^ (y * 91) ^ (cam.index * 53)) & 0xFF;
+        int value = darkOffset + (int)((long long)range * (x + y) / (cfg.width + cfg.height))
+          + (texture * (range / 4)) / 0xFF;
+        row[x] = (WORD)std::min(value, maxValue);
+      }
+    }
+  }
+
+  static BYTE toBCD(unsigned value)
+  {
+    return (BYTE)(((value / 10) % 10) << 4 | (value % 10));
+  }
+
+  static void toCalendar(const std::chrono::system_clock::time_point& tp, std::tm& tmOut, DWORD& usOut)
+  {
+    auto since = tp.time_since_epoch();
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(since);
+    usOut = (DWORD)std::chrono::duration_cast<std::chrono::microseconds>(since - secs).count();
+    std::time_t t = (std::time_t)secs.count();
+#ifdef _WIN32
+    gmtime_s(&tmOut, &t);
+#else
+    gmtime_r(&t, &tmOut);
+#endif
+  }
+
+  void renderFrame(const Camera& cam, const FrameInfo& frame,
+    WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1, WORD* dst)
+  {
+    const WORD patternWidth = config().width;
+    const size_t width = (size_t)roiX1 - roiX0 + 1;
+    const size_t height = (size_t)roiY1 - roiY0 + 1;
+    const WORD camHeight = roiHeight(cam);
+
+    //Rows are rotated by the image number, so consecutive frames differ
+    for (size_t y = 0; y < height; y++)
+    {
+      size_t srcY = cam.roiY0 - 1 + (roiY0 - 1 + y + frame.imageNumber) % camHeight;
+      const WORD* src = cam.pattern.data() + srcY * patternWidth + (cam.roiX0 - 1) + (roiX0 - 1);
+      std::memcpy(dst + y * width, src, width * sizeof(WORD));
+    }
+
+    //The signal above the dark offset is proportional to scene brightness and exposure time,
+    //the pattern itself is 100% brightness at 10 ms
+    const Config& cfg = config();
+    const DWORD light = cfg.lightStepImage != 0 && frame.imageNumber >= cfg.lightStepImage ?
+      cfg.lightStepPercent : cfg.lightPercent;
+    const double exposure = frame.exposure * timebaseToSeconds(frame.exposureBase);
+    const uint64_t gain = (uint64_t)(light / 100.0 * exposure / 0.010 * 65536.0 + 0.5);
+    if (gain != 65536)
+    {
+      const int maxValue = (1 << cfg.bitDepth) - 1;
+      const int darkOffset = 100 >> (16 - cfg.bitDepth);
+      for (size_t i = 0; i < width * height; i++)
+      {
+        const uint64_t signal = (uint64_t)std::max(dst[i] - darkOffset, 0) * gain >> 16;
+        dst[i] = (WORD)std::min<uint64_t>(darkOffset + signal, maxValue);
+      }
+    }
+
+    if (cam.timestampMode != TIMESTAMP_MODE_OFF && roiX0 == 1 && roiY0 == 1 && width >= 14)
+    {
+      //Binary timestamp: 14 pixel holding one BCD byte each
+      std::tm tmVal;
+      DWORD us;
+      toCalendar(frame.timestamp, tmVal, us);
+      DWORD counter = frame.imageNumber;
+      BYTE stamp[14] = {
+        toBCD(counter / 1000000), toBCD(counter / 10000), toBCD(counter / 100), toBCD(counter),
+        toBCD((tmVal.tm_year + 1900) / 100), toBCD(tmVal.tm_year % 100),
+        toBCD(tmVal.tm_mon + 1), toBCD(tmVal.tm_mday),
+        toBCD(tmVal.tm_hour), toBCD(tmVal.tm_min), toBCD(tmVal.tm_sec),
+        toBCD(us / 10000), toBCD(us / 100), toBCD(us) };
+      for (int i = 0; i < 14; i++)
+        dst[i] = stamp[i];
+    }
+
+    if (cam.bitAlignment == BIT_ALIGNMENT_MSB && config().bitDepth < 16)
+    {
+      const int shift = 16 - config().bitDepth;
+      for (size_t i = 0; i < width * height; i++)
+        dst[i] = (WORD)(dst[i] << shift);
+    }
+  }
+
+  void fillMetadata(const Camera& cam, const FrameInfo& frame, PCO_METADATA_STRUCT* metadata)
+  {
+    WORD size = metadata->wSize;
+    std::memset(metadata, 0, std::min<size_t>(size, sizeof(PCO_METADATA_STRUCT)));
+    metadata->wSize = size;
+    metadata->wVersion = 1;
+
+    std::tm tmVal;
+    DWORD us;
+    toCalendar(frame.timestamp, tmVal, us);
+    DWORD counter = frame.imageNumber;
+    metadata->bIMAGE_COUNTER_BCD[0] = toBCD(counter);
+    metadata->bIMAGE_COUNTER_BCD[1] = toBCD(counter / 100);
+    metadata->bIMAGE_COUNTER_BCD[2] = toBCD(counter / 10000);
+    metadata->bIMAGE_COUNTER_BCD[3] = toBCD(counter / 1000000);
+    metadata->bIMAGE_TIME_US_BCD[0] = toBCD(us);
+    metadata->bIMAGE_TIME_US_BCD[1] = toBCD(us / 100);
+    metadata->bIMAGE_TIME_US_BCD[2] = toBCD(us / 10000);
+    metadata->bIMAGE_TIME_SEC_BCD = toBCD(tmVal.tm_sec);
+    metadata->bIMAGE_TIME_MIN_BCD = toBCD(tmVal.tm_min);
+    metadata->bIMAGE_TIME_HOUR_BCD = toBCD(tmVal.tm_hour);
+    metadata->bIMAGE_TIME_DAY_BCD = toBCD(tmVal.tm_mday);
+    metadata->bIMAGE_TIME_MON_BCD = toBCD(tmVal.tm_mon + 1);
+    metadata->bIMAGE_TIME_YEAR_BCD = toBCD(tmVal.tm_year % 100);
+    metadata->bIMAGE_TIME_STATUS = 0x01;
+    metadata->wEXPOSURE_TIME_BASE = frame.exposureBase;
+    metadata->dwEXPOSURE_TIME = frame.exposure;
+    metadata->dwFRAMERATE_MILLIHZ = (DWORD)(1000.0 / framePeriodSeconds(cam));
+    metadata->sSENSOR_TEMPERATURE = 20;
+    metadata->wIMAGE_SIZE_X = roiWidth(cam);
+    metadata->wIMAGE_SIZE_Y = roiHeight(cam);
+    metadata->bBINNING_X = 1;
+    metadata->bBINNING_Y = 1;
+    metadata->dwSENSOR_READOUT_FREQUENCY = 100000000;
+    metadata->wSENSOR_CONV_FACTOR = 100;
+    metadata->dwCAMERA_SERIAL_NUMBER = cam.serialNumber;
+    metadata->wCAMERA_TYPE = CAMERATYPE_PCO_EDGE;
+    metadata->bBIT_RESOLUTION = (BYTE)config().bitDepth;
+    metadata->wDARK_OFFSET = (WORD)(100 >> (16 - config().bitDepth));
+    metadata->bTRIGGER_MODE = (BYTE)cam.triggerMode;
+    metadata->bIMAGE_TYPE = config().color ? 2 : 1;
+    metadata->wCOLOR_PATTERN = config().color ? 0x4231 : 0;
+  }
+
+  void fillTimestamp(const FrameInfo& frame, PCO_TIMESTAMP_STRUCT* timestamp)
+  {
+    std::tm tmVal;
+    DWORD us;
+    toCalendar(frame.timestamp, tmVal, us);
+    timestamp->dwImgCounter = frame.imageNumber;
+    timestamp->wYear = (WORD)(tmVal.tm_year + 1900);
+    timestamp->wMonth = (WORD)(tmVal.tm_mon + 1);
+    timestamp->wWday = (WORD)tmVal.tm_wday;
+    timestamp->wDay = (WORD)tmVal.tm_mday;
+    timestamp->wHour = (WORD)tmVal.tm_hour;
+    timestamp->wMinute = (WORD)tmVal.tm_min;
+    timestamp->wSecond = (WORD)tmVal.tm_sec;
+    timestamp->dwMicroSeconds = us;
+  }
+}
+
+using namespace pco_sim;
+
+int PCO_InitializeLib()
+{
+  return PCO_NOERROR;
+}
+
+int PCO_CleanupLib()
+{
+  return PCO_NOERROR;
+}
+
+int PCO_OpenCameraEx(HANDLE* ph, PCO_OpenStruct* strOpenStruct)
+{
+  if (ph == nullptr || strOpenStruct == nullptr)
+    return PCO_ERROR_WRONGVALUE;
+
+  Camera* opened = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(cameraMutex);
+    for (auto& cam : cameras())
+    {
+      if (cam->open)
+        continue;
+      if (cam->pattern.empty())
+        createPattern(*cam);
+      resetSettings(*cam);
+      cam->open = true;
+      opened = cam.get();
+      break;
+    }
+  }
+  if (opened == nullptr)
+    return PCO_ERROR_DRIVER_NOTINIT;
+
+  //Like the interface scan and the camera handshake, only the claimed camera is blocked meanwhile
+  std::this_thread::sleep_for(std::chrono::milliseconds(config().openDelayMs));
+  *ph = opened;
+  strOpenStruct->wCameraNumber = (WORD)opened->index;
+  return PCO_NOERROR;
+}
+
+int PCO_CloseCamera(HANDLE ph)
+{
+  std::lock_guard<std::mutex> lock(cameraMutex);
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  cam->open = false;
+  return PCO_NOERROR;
+}
+
+int PCO_ResetSettingsToDefault(HANDLE ph)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  resetSettings(*cam);
+  return PCO_NOERROR;
+}
+
+int PCO_ArmCamera(HANDLE ph)
+{
+  if (lookupCamera(ph) == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  std::this_thread::sleep_for(std::chrono::milliseconds(config().armDelayMs));
+  return PCO_NOERROR;
+}
+
+int PCO_GetCameraHealthStatus(HANDLE ph, DWORD* dwWarn, DWORD* dwErr, DWORD* dwStatus)
+{
+  if (lookupCamera(ph) == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (dwWarn) *dwWarn = 0;
+  if (dwErr) *dwErr = 0;
+  if (dwStatus) *dwStatus = 0;
+  return PCO_NOERROR;
+}
+
+int PCO_GetCameraType(HANDLE ph, PCO_CameraType* strCamType)
+{
+  queryDelay();
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  strCamType->wCamType = CAMERATYPE_PCO_EDGE;
+  strCamType->wCamSubType = 0;
+  strCamType->dwSerialNumber = cam->serialNumber;
+  strCamType->dwHWVersion = 0x0100;
+  strCamType->dwFWVersion = 0x0100;
+  strCamType->wInterfaceType = 0;
+  return PCO_NOERROR;
+}
+
+int PCO_GetCameraDescription(HANDLE ph, PCO_Description* strDescription)
+{
+  queryDelay();
+  if (lookupCamera(ph) == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  const Config& cfg = config();
+  WORD size = strDescription->wSize;
+  std::memset(strDescription, 0, std::min<size_t>(size, sizeof(PCO_Description)));
+  strDescription->wSize = size;
+  strDescription->wSensorTypeDESC = cfg.color ? 0x0011 : 0x0010;
+  strDescription->wMaxHorzResStdDESC = cfg.width;
+  strDescription->wMaxVertResStdDESC = cfg.height;
+  strDescription->wMaxHorzResExtDESC = cfg.width;
+  strDescription->wMaxVertResExtDESC = cfg.height;
+  strDescription->wDynResDESC = cfg.bitDepth;
+  strDescription->wMaxBinHorzDESC = 1;
+  strDescription->wMaxBinVertDESC = 1;
+  strDescription->wRoiHorStepsDESC = 2;
+  strDescription->wRoiVertStepsDESC = 2;
+  strDescription->wNumADCsDESC = 1;
+  strDescription->dwPixelRateDESC[0] = 100000000;
+  strDescription->dwMinExposureDESC = 1000;
+  strDescription->dwMaxExposureDESC = 10000;
+  strDescription->dwMinExposureStepDESC = 10;
+  strDescription->dwMaxDelayDESC = 10000;
+  strDescription->dwMinDelayStepDESC = 10;
+  //Upper left pixel is red
+  strDescription->wColorPatternDESC = cfg.color ? 0x4231 : 0;
+  return PCO_NOERROR;
+}
+
+int PCO_GetSizes(HANDLE ph, WORD* wXResAct, WORD* wYResAct, WORD* wXResMax, WORD* wYResMax)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (wXResAct) *wXResAct = roiWidth(*cam);
+  if (wYResAct) *wYResAct = roiHeight(*cam);
+  if (wXResMax) *wXResMax = config().width;
+  if (wYResMax) *wYResMax = config().height;
+  return PCO_NOERROR;
+}
+
+int PCO_GetROI(HANDLE ph, WORD* wRoiX0, WORD* wRoiY0, WORD* wRoiX1, WORD* wRoiY1)
+{
+  queryDelay();
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (wRoiX0) *wRoiX0 = cam->roiX0;
+  if (wRoiY0) *wRoiY0 = cam->roiY0;
+  if (wRoiX1) *wRoiX1 = cam->roiX1;
+  if (wRoiY1) *wRoiY1 = cam->roiY1;
+  return PCO_NOERROR;
+}
+
+int PCO_SetROI(HANDLE ph, WORD wRoiX0, WORD wRoiY0, WORD wRoiX1, WORD wRoiY1)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (wRoiX0 < 1 || wRoiY0 < 1 || wRoiX1 < wRoiX0 || wRoiY1 < wRoiY0 ||
+    wRoiX1 > config().width || wRoiY1 > config().height)
+    return PCO_ERROR_WRONGVALUE;
+  cam->roiX0 = wRoiX0;
+  cam->roiY0 = wRoiY0;
+  cam->roiX1 = wRoiX1;
+  cam->roiY1 = wRoiY1;
+  return PCO_NOERROR;
+}
+
+int PCO_GetRecordingState(HANDLE ph, WORD* wRecState)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  *wRecState = cam->recordingState;
+  return PCO_NOERROR;
+}
+
+int PCO_SetRecordingState(HANDLE ph, WORD wRecState)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  cam->recordingState = wRecState;
+  return PCO_NOERROR;
+}
+
+int PCO_SetRecorderSubmode(HANDLE ph, WORD)
+{
+  return lookupCamera(ph) ? PCO_NOERROR : PCO_ERROR_INVALIDHANDLE;
+}
+
+int PCO_GetTimestampMode(HANDLE ph, WORD* wTimeStampMode)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  *wTimeStampMode = cam->timestampMode;
+  return PCO_NOERROR;
+}
+
+int PCO_SetTimestampMode(HANDLE ph, WORD wTimeStampMode)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  cam->timestampMode = wTimeStampMode;
+  return PCO_NOERROR;
+}
+
+int PCO_GetMetaDataMode(HANDLE ph, WORD* wMetaDataMode, WORD* wMetaDataSize, WORD* wMetaDataVersion)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (wMetaDataMode) *wMetaDataMode = cam->metadataMode;
+  if (wMetaDataSize) *wMetaDataSize = (WORD)sizeof(PCO_METADATA_STRUCT);
+  if (wMetaDataVersion) *wMetaDataVersion = 1;
+  return PCO_NOERROR;
+}
+
+int PCO_SetMetaDataMode(HANDLE ph, WORD wMetaDataMode, WORD* wMetaDataSize, WORD* wMetaDataVersion)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  cam->metadataMode = wMetaDataMode;
+  if (wMetaDataSize) *wMetaDataSize = (WORD)sizeof(PCO_METADATA_STRUCT);
+  if (wMetaDataVersion) *wMetaDataVersion = 1;
+  return PCO_NOERROR;
+}
+
+int PCO_GetBitAlignment(HANDLE ph, WORD* wBitAlignment)
+{
+  queryDelay();
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  *wBitAlignment = cam->bitAlignment;
+  return PCO_NOERROR;
+}
+
+int PCO_SetBitAlignment(HANDLE ph, WORD wBitAlignment)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  cam->bitAlignment = wBitAlignment;
+  return PCO_NOERROR;
+}
+
+int PCO_GetDelayExposureTime(HANDLE ph, DWORD* dwDelay, DWORD* dwExposure, WORD* wTimeBaseDelay, WORD* wTimeBaseExposure)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  const DelayExposure timing = delayExposure(*cam);
+  if (dwDelay) *dwDelay = timing.delay;
+  if (dwExposure) *dwExposure = timing.exposure;
+  if (wTimeBaseDelay) *wTimeBaseDelay = timing.delayBase;
+  if (wTimeBaseExposure) *wTimeBaseExposure = timing.exposureBase;
+  return PCO_NOERROR;
+}
+
+int PCO_GetCOCRuntime(HANDLE ph, DWORD* dwTime_s, DWORD* dwTime_ns)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  const double period = framePeriodSeconds(*cam);
+  if (dwTime_s) *dwTime_s = (DWORD)period;
+  if (dwTime_ns) *dwTime_ns = (DWORD)((period - (DWORD)period) * 1e9 + 0.5);
+  return PCO_NOERROR;
+}
+
+int PCO_SetDelayExposureTime(HANDLE ph, DWORD dwDelay, DWORD dwExposure, WORD wTimeBaseDelay, WORD wTimeBaseExposure)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (wTimeBaseDelay > TIMEBASE_MS || wTimeBaseExposure > TIMEBASE_MS)
+    return PCO_ERROR_WRONGVALUE;
+  DelayExposure timing;
+  timing.delay = dwDelay;
+  timing.exposure = dwExposure;
+  timing.delayBase = wTimeBaseDelay;
+  timing.exposureBase = wTimeBaseExposure;
+  setDelayExposure(*cam, timing);
+  return PCO_NOERROR;
+}
+
+int PCO_GetTriggerMode(HANDLE ph, WORD* wTriggerMode)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  *wTriggerMode = cam->triggerMode;
+  return PCO_NOERROR;
+}
+
+int PCO_SetTriggerMode(HANDLE ph, WORD wTriggerMode)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  cam->triggerMode = wTriggerMode;
+  return PCO_NOERROR;
+}
+
+int PCO_ForceTrigger(HANDLE ph, WORD* wTriggered)
+{
+  Camera* cam = lookupCamera(ph);
+  if (cam == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  {
+    std::lock_guard<std::mutex> lock(cam->triggerMutex);
+    cam->pendingTriggers++;
+  }
+  cam->triggerCond.notify_all();
+  if (wTriggered)
+    *wTriggered = 1;
+  return PCO_NOERROR;
+}
+
+int PCO_GetColorCorrectionMatrix(HANDLE ph, double* pdMatrix)
+{
+  queryDelay();
+  if (lookupCamera(ph) == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  //Mild saturation boost, rows sum up to 1
+  const double ccm[9] = { 1.2, -0.1, -0.1,
+                          -0.1, 1.2, -0.1,
+                          -0.1, -0.1, 1.2 };
+  std::memcpy(pdMatrix, ccm, sizeof(ccm));
+  return PCO_NOERROR;
+}
@@ -0,0 +1,184 @@
+// Simulated pco_convert API
+// Implements a plain bilinear demosaic and linear display scaling, which is
+// good enough to produce plausible images and realistic per frame cost.
+
+#include "sim_internal.h"
+
+#include <pco_convexport.h>
+#include <pco_convstructures.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace pco_sim
+{
+  struct Converter
+  {
+    int type = 0;
+    PCO_SensorInfo sensor;
+    PCO_Display display;
+  };
+
+  static std::mutex converterMutex;
+  static std::vector<Converter*> converters;
+
+  static Converter* lookupConverter(HANDLE hConv)
+  {
+    std::lock_guard<std::mutex> lock(converterMutex);
+    for (Converter* conv : converters)
+    {
+      if (conv == hConv)
+        return conv;
+    }
+    return nullptr;
+  }
+
+  static int sampleValue(const Converter& conv, int raw)
+  {
+    if (conv.sensor.iSensorInfoBits & CONVERT_SENSOR_UPPERALIGNED)
+      raw >>= (16 - conv.sensor.iDataBits);
+    return raw;
+  }
+
+  static BYTE scaleTo8(const Converter& conv, int value)
+  {
+    const int lo = conv.display.iScale_min;
+    const int hi = std::max(conv.display.iScale_max, lo + 1);
+    int scaled = (value - lo) * 255 / (hi - lo);
+    return (BYTE)std::min(std::max(scaled, 0), 255);
+  }
+}
+
+using namespace pco_sim;
+
+int PCO_ConvertCreate(HANDLE* ph, PCO_SensorInfo* strSensor, int iConvertType)
+{
+  if (ph == nullptr || strSensor == nullptr || strSensor->iDataBits < 8 || strSensor->iDataBits > 16)
+    return PCO_ERROR_WRONGVALUE;
+
+  std::unique_ptr<Converter> conv(new Converter());
+  conv->type = iConvertType;
+  conv->sensor = *strSensor;
+  std::memset(&conv->display, 0, sizeof(PCO_Display));
+  conv->display.wSize = sizeof(PCO_Display);
+  conv->display.iScale_maxmax = (1 << strSensor->iDataBits) - 1;
+  conv->display.iScale_min = strSensor->iDarkOffset;
+  conv->display.iScale_max = conv->display.iScale_maxmax;
+  conv->display.iColor_temp = 6500;
+  conv->display.iGamma = 100;
+
+  std::lock_guard<std::mutex> lock(converterMutex);
+  converters.push_back(conv.get());
+  *ph = conv.release();
+  return PCO_NOERROR;
+}
+
+int PCO_ConvertDelete(HANDLE ph)
+{
+  Converter* conv = lookupConverter(ph);
+  if (conv == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  {
+    std::lock_guard<std::mutex> lock(converterMutex);
+    converters.erase(std::find(converters.begin(), converters.end(), conv));
+  }
+  delete conv;
+  return PCO_NOERROR;
+}
+
+int PCO_ConvertGetDisplay(HANDLE ph, PCO_Display* pDisplay)
+{
+  Converter* conv = lookupConverter(ph);
+  if (conv == nullptr || pDisplay == nullptr)
+    return PCO_ERROR_WRONGVALUE;
+  WORD size = pDisplay->wSize;
+  std::memcpy(pDisplay, &conv->display, std::min<size_t>(size, sizeof(PCO_Display)));
+  pDisplay->wSize = size;
+  return PCO_NOERROR;
+}
+
+int PCO_ConvertSetDisplay(HANDLE ph, PCO_Display* pDisplay)
+{
+  Converter* conv = lookupConverter(ph);
+  if (conv == nullptr || pDisplay == nullptr)
+    return PCO_ERROR_WRONGVALUE;
+  std::memcpy(&conv->display, pDisplay, std::min<size_t>(pDisplay->wSize, sizeof(PCO_Display)));
+  conv->display.wSize = sizeof(PCO_Display);
+  return PCO_NOERROR;
+}
+
+int PCO_Convert16TO8(HANDLE ph, int mode, int, int width, int height, WORD* b16, BYTE* b8)
+{
+  Converter* conv = lookupConverter(ph);
+  if (conv == nullptr || b16 == nullptr || b8 == nullptr || width <= 0 || height <= 0)
+    return PCO_ERROR_WRONGVALUE;
+  const bool flip = (mode & CONVERT_MODE_OUT_FLIPIMAGE) != 0;
+  for (int y = 0; y < height; y++)
+  {
+    const WORD* src = b16 + (size_t)y * width;
+    BYTE* dst = b8 + (size_t)(flip ? height - 1 - y : y) * width;
+    for (int x = 0; x < width; x++)
+      dst[x] = scaleTo8(*conv, sampleValue(*conv, src[x]));
+  }
+  return PCO_NOERROR;
+}
+
+int PCO_Convert16TOCOL(HANDLE ph, int mode, int iColorMode, int width, int height, WORD* b16, BYTE* b8)
+{
+  Converter* conv = lookupConverter(ph);
+  if (conv == nullptr || b16 == nullptr || b8 == nullptr || width < 2 || height < 2)
+    return PCO_ERROR_WRONGVALUE;
+
+  //Color mode 0..3 as computed by getColorMode(), position of the red pixel in the 2x2 cell
+  const int redX = (iColorMode & 0x01) ? 0 : 1;
+  const int redY = (iColorMode & 0x02) ? 0 : 1;
+  const bool flip = (mode & CONVERT_MODE_OUT_FLIPIMAGE) != 0;
+  const SRGBCOLCORRCOEFF& cc = conv->sensor.strColorCoeff;
+
+  auto px = [&](int x, int y)
+  {
+    x = std::min(std::max(x, 0), width - 1);
+    y = std::min(std::max(y, 0), height - 1);
+    return sampleValue(*conv, b16[(size_t)y * width + x]);
+  };
+
+  for (int y = 0; y < height; y++)
+  {
+    BYTE* dst = b8 + (size_t)(flip ? height - 1 - y : y) * width * 3;
+    for (int x = 0; x < width; x++)
+    {
+      const bool onRedRow = ((y & 1) == redY);
+      const bool onRedCol = ((x & 1) == redX);
+      int r, g, b;
+      int cross = (px(x - 1, y) + px(x + 1, y) + px(x, y - 1) + px(x, y + 1)) / 4;
+      int diag = (px(x - 1, y - 1) + px(x + 1, y - 1) + px(x - 1, y + 1) + px(x + 1, y + 1)) / 4;
+      int horz = (px(x - 1, y) + px(x + 1, y)) / 2;
+      int vert = (px(x, y - 1) + px(x, y + 1)) / 2;
+      if (onRedRow && onRedCol)
+      {
+        r = px(x, y); g = cross; b = diag;
+      }
+      else if (!onRedRow && !onRedCol)
+      {
+        b = px(x, y); g = cross; r = diag;
+      }
+      else if (onRedRow)
+      {
+        g = px(x, y); r = horz; b = vert;
+      }
+      else
+      {
+        g = px(x, y); b = horz; r = vert;
+      }
+
+      double rc = cc.da11 * r + cc.da12 * g + cc.da13 * b;
+      double gc = cc.da21 * r + cc.da22 * g + cc.da23 * b;
+      double bc = cc.da31 * r + cc.da32 * g + cc.da33 * b;
+      dst[x * 3 + 0] = scaleTo8(*conv, (int)bc);
+      dst[x * 3 + 1] = scaleTo8(*conv, (int)gc);
+      dst[x * 3 + 2] = scaleTo8(*conv, (int)rc);
+    }
+  }
+  return PCO_NOERROR;
+}
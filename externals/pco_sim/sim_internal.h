@@ -0,0 +1,127 @@
+#pragma once
+
+// Internal state shared by the simulated sc2_cam, pco_recorder and pco_convert
+// implementations. Nothing in here is part of the pco API, the samples only
+// ever see the exported PCO_* functions.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <pco_linux_defs.h>
+#include <sc2_sdkaddendum.h>
+#include <pco_device.h>
+#include <pco_camexport.h>
+
+#include <sc2_defs.h>
+#include <sc2_common.h>
+#include <pco_err.h>
+#include <sc2_sdkstructures.h>
+#include <sc2_camexport.h>
+
+namespace pco_sim
+{
+  // Simulator configuration, read once from the environment:
+  //   PCO_SIM_CAMERAS        number of cameras that can be opened (default 1)
+  //   PCO_SIM_WIDTH          sensor width in pixel (default 2048)
+  //   PCO_SIM_HEIGHT         sensor height in pixel (default 2048)
+  //   PCO_SIM_FPS            maximum frame rate in Hz (default 100)
+  //   PCO_SIM_BITS           dynamic resolution in bit, 8..16 (default 16)
+  //   PCO_SIM_COLOR          1 to simulate a color (bayer) sensor (default 0)
+  //   PCO_SIM_RAM_MB         recorder memory budget in MB (default 1024)
+  //   PCO_SIM_CAMRAM_IMAGES  images per camera internal RAM segment (default 1000)
+  //   PCO_SIM_CAMRAM_MBPS    readout rate of the camera internal RAM in MB/s (default 0, unlimited)
+  //   PCO_SIM_LIGHT          scene brightness in percent, the signal is proportional to
+  //                          brightness and exposure time, 100% at 10 ms is the plain pattern (default 100)
+  //   PCO_SIM_LIGHT_STEP_IMAGE  image number from which PCO_SIM_LIGHT_STEP applies (default 0, no step)
+  //   PCO_SIM_LIGHT_STEP     scene brightness in percent after the step (default 100)
+  struct Config
+  {
+    int cameraCount;
+    WORD width;
+    WORD height;
+    double frameRate;
+    WORD bitDepth;
+    bool color;
+    DWORD recorderMemoryMB;
+    DWORD camRamImages;
+    DWORD openDelayMs;                               //Time PCO_OpenCameraEx takes
+    DWORD armDelayMs;                                //Time PCO_ArmCamera takes
+    DWORD queryDelayMs;                              //Round trip of the descriptor queries
+    DWORD camRamMBps;                                //Link rate of the CamRam readout, 0 for unlimited
+    DWORD lightPercent;
+    DWORD lightStepImage;
+    DWORD lightStepPercent;
+  };
+
+  const Config& config();
+
+  // Delay and exposure time as set with PCO_SetDelayExposureTime
+  struct DelayExposure
+  {
+    DWORD delay = 0;
+    DWORD exposure = 10;
+    WORD delayBase = TIMEBASE_MS;
+    WORD exposureBase = TIMEBASE_MS;
+  };
+
+  struct Camera
+  {
+    int index = 0;
+    std::atomic<bool> open{ false };                 //Read without cameraMutex by lookupCamera()
+    DWORD serialNumber = 0;
+
+    WORD roiX0 = 1, roiY0 = 1, roiX1 = 0, roiY1 = 0;
+    WORD recordingState = 0;
+    WORD timestampMode = TIMESTAMP_MODE_OFF;
+    WORD metadataMode = METADATA_MODE_OFF;
+    WORD bitAlignment = BIT_ALIGNMENT_MSB;
+    //Read by the recorder thread while recording, without a lock
+    std::atomic<WORD> triggerMode{ TRIGGER_MODE_AUTOTRIGGER };
+    //Delay and exposure can be changed while the recorder thread is recording,
+    //so they are only set and read together (see delayExposure / setDelayExposure)
+    mutable std::mutex timingMutex;
+    DelayExposure timing;
+
+    // Software triggers, consumed by the recorder acquisition thread
+    std::mutex triggerMutex;
+    std::condition_variable triggerCond;
+    DWORD pendingTriggers = 0;
+
+    // Full sensor test pattern, generated once when the camera is opened
+    std::vector<WORD> pattern;
+  };
+
+  Camera* lookupCamera(HANDLE hCam);
+
+  WORD roiWidth(const Camera& cam);
+  WORD roiHeight(const Camera& cam);
+  DelayExposure delayExposure(const Camera& cam);
+  void setDelayExposure(Camera& cam, const DelayExposure& timing);
+  double exposureSeconds(const Camera& cam);
+  double framePeriodSeconds(const Camera& cam);
+
+  // Waits for one software trigger, returns false if none arrived until timeout
+  bool waitForTrigger(Camera& cam, std::chrono::milliseconds timeout);
+
+  // Per frame information the recorder keeps instead of the pixel data,
+  // the pixels are rendered from the camera pattern on copy
+  struct FrameInfo
+  {
+    DWORD imageNumber;
+    std::chrono::system_clock::time_point timestamp;
+    DWORD exposure;
+    WORD exposureBase;
+  };
+
+  // Renders the (1 based, inclusive) region of frame into dst
+  void renderFrame(const Camera& cam, const FrameInfo& frame,
+    WORD roiX0, WORD roiY0, WORD roiX1, WORD roiY1, WORD* dst);
+
+  void fillMetadata(const Camera& cam, const FrameInfo& frame,
+    PCO_METADATA_STRUCT* metadata);
+  void fillTimestamp(const FrameInfo& frame, PCO_TIMESTAMP_STRUCT* timestamp);
+}
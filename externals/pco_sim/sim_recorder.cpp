@@ -0,0 +1,565 @@
+// Simulated pco_recorder API
+// Every camera gets an acquisition thread that produces frames at the simulated
+// frame rate (or on PCO_ForceTrigger in software trigger mode). Only the frame
+// information is stored, pixel data is rendered from the camera test pattern
+// when an image is copied, so large recordings do not need any real memory.
+
+#include "sim_internal.h"
+
+#include <pco_recorder_export.h>
+#include <pco_recorder_defines.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+namespace pco_sim
+{
+  struct RecorderCamera
+  {
+    Camera* cam = nullptr;
+    DWORD distribution = 1;
+    DWORD maxImgCount = 0;
+    DWORD reqImgCount = 0;
+
+    //Guarded by Recorder::mutex
+    std::deque<FrameInfo> frames;
+    DWORD nextImageNumber = 1;
+    bool hasLastCopied = false;
+    FrameInfo lastCopiedFrame{};
+    bool running = false;
+    bool buffersFull = false;
+    bool fifoOverflow = false;
+    DWORD startTime = 0;
+    DWORD stopTime = 0;
+
+    std::atomic<bool> stopRequest{ false };
+    std::thread worker;
+  };
+
+  struct Recorder
+  {
+    WORD mode = 0;
+    WORD type = 0;
+    bool initialized = false;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<RecorderCamera>> cams;
+  };
+
+  static std::mutex recorderListMutex;
+  static std::vector<Recorder*> recorders;
+
+  static Recorder* lookupRecorder(HANDLE hRec)
+  {
+    std::lock_guard<std::mutex> lock(recorderListMutex);
+    for (Recorder* rec : recorders)
+    {
+      if (rec == hRec)
+        return rec;
+    }
+    return nullptr;
+  }
+
+  static RecorderCamera* lookupRecorderCamera(Recorder* rec, HANDLE hCam)
+  {
+    for (auto& rc : rec->cams)
+    {
+      if (rc->cam == hCam)
+        return rc.get();
+    }
+    return nullptr;
+  }
+
+  static DWORD tickMs()
+  {
+    return (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static bool stopsWhenFull(const Recorder& rec)
+  {
+    return rec.mode == PCO_RECORDER_MODE_CAMRAM ||
+      rec.mode == PCO_RECORDER_MODE_FILE ||
+      rec.type == PCO_RECORDER_MEMORY_SEQUENCE;
+  }
+
+  // Stores one new frame, returns false if the recording is complete
+  static bool storeFrame(Recorder& rec, RecorderCamera& rc)
+  {
+    std::lock_guard<std::mutex> lock(rec.mutex);
+    FrameInfo frame;
+    frame.imageNumber = rc.nextImageNumber++;
+    frame.timestamp = std::chrono::system_clock::now();
+    const DelayExposure timing = delayExposure(*rc.cam);
+    frame.exposure = timing.exposure;
+    frame.exposureBase = timing.exposureBase;
+
+    if (rc.frames.size() >= rc.reqImgCount)
+    {
+      if (rec.mode == PCO_RECORDER_MODE_MEMORY && rec.type == PCO_RECORDER_MEMORY_RINGBUF)
+      {
+        rc.frames.pop_front();
+        rc.buffersFull = true;
+      }
+      else if (rec.mode == PCO_RECORDER_MODE_MEMORY && rec.type == PCO_RECORDER_MEMORY_FIFO)
+      {
+        //Consumer is too slow, the frame is lost
+        rc.fifoOverflow = true;
+        return true;
+      }
+    }
+    rc.frames.push_back(frame);
+
+    if (stopsWhenFull(rec) && rc.frames.size() >= rc.reqImgCount)
+    {
+      rc.buffersFull = true;
+      return false;
+    }
+    return true;
+  }
+
+  static void acquisitionThread(Recorder* rec, RecorderCamera* rc)
+  {
+    Camera& cam = *rc->cam;
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(framePeriodSeconds(cam)));
+    auto nextFrame = std::chrono::steady_clock::now() + period;
+
+    while (!rc->stopRequest)
+    {
+      //The exposure time can change while recording
+      period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(framePeriodSeconds(cam)));
+      if (cam.triggerMode == TRIGGER_MODE_SOFTWARETRIGGER)
+      {
+        if (!waitForTrigger(cam, std::chrono::milliseconds(10)))
+          continue;
+        //Exposure and readout still take their time
+        std::this_thread::sleep_for(period);
+      }
+      else
+      {
+        std::this_thread::sleep_until(nextFrame);
+        nextFrame += period;
+      }
+      if (rc->stopRequest)
+        break;
+      if (!storeFrame(*rec, *rc))
+        break;
+    }
+
+    std::lock_guard<std::mutex> lock(rec->mutex);
+    rc->running = false;
+    rc->stopTime = tickMs();
+    cam.recordingState = 0;
+  }
+
+  static void stopCamera(RecorderCamera& rc)
+  {
+    rc.stopRequest = true;
+    if (rc.worker.joinable())
+      rc.worker.join();
+  }
+
+  // Maps a recorder index to the stored frame, depending on the recorder type
+  static const FrameInfo* frameAt(const Recorder& rec, const RecorderCamera& rc, DWORD index)
+  {
+    if (rc.frames.empty())
+      return nullptr;
+    if (index == PCO_RECORDER_LATEST_IMAGE)
+      return &rc.frames.back();
+    if (rec.mode == PCO_RECORDER_MODE_MEMORY && rec.type == PCO_RECORDER_MEMORY_FIFO)
+      return &rc.frames.front(); //Index is ignored, always the oldest image
+    if (index >= rc.frames.size())
+      return nullptr;
+    return &rc.frames[index];
+  }
+
+  // Minimal uncompressed, single strip tiff writer
+  static bool writeTiff(const char* path, const void* data, WORD width, WORD height,
+    WORD samplesPerPixel, WORD bitsPerSample, bool bgr, bool bottomUp, bool overwrite)
+  {
+    if (!overwrite)
+    {
+      std::ifstream existing(path);
+      if (existing.good())
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+      return false;
+
+    const DWORD bytesPerSample = bitsPerSample / 8;
+    const DWORD lineBytes = (DWORD)width * samplesPerPixel * bytesPerSample;
+    const DWORD imageBytes = lineBytes * height;
+    const WORD entryCount = 10;
+    const DWORD ifdOffset = 8;
+    const DWORD bitsOffset = ifdOffset + 2 + entryCount * 12 + 4;
+    const DWORD dataOffset = bitsOffset + 8;
+
+    auto put16 = [&file](WORD v) { file.write((const char*)&v, 2); };
+    auto put32 = [&file](DWORD v) { file.write((const char*)&v, 4); };
+    auto entry = [&](WORD tag, WORD type, DWORD count, DWORD value)
+    {
+      put16(tag);
+      put16(type);
+      put32(count);
+      if (type == 3 && count == 1)
+      {
+        put16((WORD)value);
+        put16(0);
+      }
+      else
+        put32(value);
+    };
+
+    file.write("II", 2);
+    put16(42);
+    put32(ifdOffset);
+    put16(entryCount);
+    entry(256, 3, 1, width);
+    entry(257, 3, 1, height);
+    entry(258, 3, samplesPerPixel, samplesPerPixel == 1 ? bitsPerSample : bitsOffset);
+    entry(259, 3, 1, 1);
+    entry(262, 3, 1, samplesPerPixel == 1 ? 1 : 2);
+    entry(273, 4, 1, dataOffset);
+    entry(277, 3, 1, samplesPerPixel);
+    entry(278, 3, 1, height);
+    entry(279, 4, 1, imageBytes);
+    entry(284, 3, 1, 1);
+    put32(0);
+    for (int i = 0; i < 4; i++)
+      put16(bitsPerSample);
+
+    std::vector<char> line(lineBytes);
+    for (DWORD y = 0; y < height; y++)
+    {
+      DWORD srcY = bottomUp ? height - 1 - y : y;
+      std::memcpy(line.data(), (const char*)data + (size_t)srcY * lineBytes, lineBytes);
+      if (bgr && samplesPerPixel == 3 && bytesPerSample == 1)
+      {
+        for (DWORD x = 0; x < width; x++)
+          std::swap(line[x * 3], line[x * 3 + 2]);
+      }
+      else if (bgr && samplesPerPixel == 3)
+      {
+        WORD* px = (WORD*)line.data();
+        for (DWORD x = 0; x < width; x++)
+          std::swap(px[x * 3], px[x * 3 + 2]);
+      }
+      file.write(line.data(), lineBytes);
+    }
+    return (bool)file;
+  }
+}
+
+using namespace pco_sim;
+
+int PCO_RecorderResetLib(bool)
+{
+  std::vector<Recorder*> toDelete;
+  {
+    std::lock_guard<std::mutex> lock(recorderListMutex);
+    toDelete.swap(recorders);
+  }
+  for (Recorder* rec : toDelete)
+  {
+    for (auto& rc : rec->cams)
+      stopCamera(*rc);
+    delete rec;
+  }
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderCreate(HANDLE* phRec, HANDLE* phCamArr, const DWORD* dwImgDistributionArr,
+  WORD wArrLength, WORD wRecMode, const char*, DWORD* dwMaxImgCountArr)
+{
+  if (phRec == nullptr || phCamArr == nullptr || wArrLength == 0)
+    return PCO_ERROR_WRONGVALUE;
+  if (wRecMode != PCO_RECORDER_MODE_FILE && wRecMode != PCO_RECORDER_MODE_MEMORY &&
+    wRecMode != PCO_RECORDER_MODE_CAMRAM)
+    return PCO_ERROR_WRONGVALUE;
+
+  std::unique_ptr<Recorder> rec(new Recorder());
+  rec->mode = wRecMode;
+  double weightedFrameBytes = 0.0;
+  for (WORD i = 0; i < wArrLength; i++)
+  {
+    Camera* cam = lookupCamera(phCamArr[i]);
+    if (cam == nullptr)
+      return PCO_ERROR_INVALIDHANDLE;
+    std::unique_ptr<RecorderCamera> rc(new RecorderCamera());
+    rc->cam = cam;
+    rc->distribution = dwImgDistributionArr ? std::max<DWORD>(dwImgDistributionArr[i], 1) : 1;
+    weightedFrameBytes += (double)rc->distribution * roiWidth(*cam) * roiHeight(*cam) * sizeof(WORD);
+    rec->cams.push_back(std::move(rc));
+  }
+
+  //Memory is shared according to the distribution weights
+  const double budget = (double)config().recorderMemoryMB * 1024.0 * 1024.0;
+  for (WORD i = 0; i < wArrLength; i++)
+  {
+    RecorderCamera& rc = *rec->cams[i];
+    if (wRecMode == PCO_RECORDER_MODE_CAMRAM)
+      rc.maxImgCount = config().camRamImages;
+    else if (wRecMode == PCO_RECORDER_MODE_FILE)
+      rc.maxImgCount = 0x7FFFFFFF;
+    else
+      rc.maxImgCount = std::max<DWORD>((DWORD)(budget / weightedFrameBytes * rc.distribution), 1);
+    if (dwMaxImgCountArr)
+      dwMaxImgCountArr[i] = rc.maxImgCount;
+  }
+
+  std::lock_guard<std::mutex> lock(recorderListMutex);
+  recorders.push_back(rec.get());
+  *phRec = rec.release();
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderDelete(HANDLE phRec)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  {
+    std::lock_guard<std::mutex> lock(recorderListMutex);
+    recorders.erase(std::find(recorders.begin(), recorders.end(), rec));
+  }
+  for (auto& rc : rec->cams)
+    stopCamera(*rc);
+  delete rec;
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderInit(HANDLE phRec, DWORD* dwImgCountArr, WORD wArrLength, WORD wType,
+  WORD, const char*, WORD*)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (dwImgCountArr == nullptr || wArrLength != rec->cams.size())
+    return PCO_ERROR_WRONGVALUE;
+
+  std::lock_guard<std::mutex> lock(rec->mutex);
+  for (WORD i = 0; i < wArrLength; i++)
+  {
+    RecorderCamera& rc = *rec->cams[i];
+    if (rc.running)
+      return PCO_ERROR_WRONGVALUE;
+    if (dwImgCountArr[i] == 0 || dwImgCountArr[i] > rc.maxImgCount)
+      return PCO_ERROR_WRONGVALUE;
+    rc.reqImgCount = dwImgCountArr[i];
+    //Camera internal memory keeps its images until the next record
+    if (rec->mode != PCO_RECORDER_MODE_CAMRAM)
+      rc.frames.clear();
+  }
+  rec->type = wType;
+  rec->initialized = true;
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderGetSettings(HANDLE phRec, HANDLE phCam, DWORD* dwRecmode, DWORD* dwMaxImgCount,
+  DWORD* dwReqImgCount, WORD* wWidth, WORD* wHeight, WORD* wMetadataLines)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  RecorderCamera* rc = lookupRecorderCamera(rec, phCam);
+  if (rc == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (dwRecmode) *dwRecmode = rec->mode;
+  if (dwMaxImgCount) *dwMaxImgCount = rc->maxImgCount;
+  if (dwReqImgCount) *dwReqImgCount = rc->reqImgCount;
+  if (wWidth) *wWidth = roiWidth(*rc->cam);
+  if (wHeight) *wHeight = roiHeight(*rc->cam);
+  if (wMetadataLines) *wMetadataLines = 0;
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderStartRecord(HANDLE phRec, HANDLE phCam)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (!rec->initialized)
+    return PCO_ERROR_NOTINIT;
+
+  for (auto& rc : rec->cams)
+  {
+    if (phCam != nullptr && rc->cam != phCam)
+      continue;
+    {
+      std::lock_guard<std::mutex> lock(rec->mutex);
+      if (rc->running)
+        continue;
+    }
+    stopCamera(*rc);
+    std::lock_guard<std::mutex> lock(rec->mutex);
+    rc->frames.clear();
+    rc->nextImageNumber = 1;
+    rc->hasLastCopied = false;
+    rc->buffersFull = false;
+    rc->fifoOverflow = false;
+    rc->running = true;
+    rc->startTime = tickMs();
+    rc->stopTime = 0;
+    rc->stopRequest = false;
+    rc->cam->recordingState = 1;
+    rc->worker = std::thread(acquisitionThread, rec, rc.get());
+  }
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderStopRecord(HANDLE phRec, HANDLE phCam)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  //Returns when the acquisition has really stopped, like the pco.recorder does
+  for (auto& rc : rec->cams)
+  {
+    if (phCam == nullptr || rc->cam == phCam)
+      stopCamera(*rc);
+  }
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderGetStatus(HANDLE phRec, HANDLE phCam, bool* bIsRunning, bool* bAutoExpState,
+  DWORD* dwLastError, DWORD* dwProcImgCount, DWORD* dwReqImgCount, bool* bBuffersFull,
+  bool* bFIFOOverflow, DWORD* dwStartTime, DWORD* dwStopTime)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  RecorderCamera* rc = lookupRecorderCamera(rec, phCam);
+  if (rc == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+
+  std::lock_guard<std::mutex> lock(rec->mutex);
+  if (bIsRunning) *bIsRunning = rc->running;
+  if (bAutoExpState) *bAutoExpState = false;
+  if (dwLastError) *dwLastError = PCO_NOERROR;
+  if (dwProcImgCount) *dwProcImgCount = (DWORD)rc->frames.size();
+  if (dwReqImgCount) *dwReqImgCount = rc->reqImgCount;
+  if (bBuffersFull) *bBuffersFull = rc->buffersFull;
+  if (bFIFOOverflow) *bFIFOOverflow = rc->fifoOverflow;
+  if (dwStartTime) *dwStartTime = rc->startTime;
+  if (dwStopTime) *dwStopTime = rc->stopTime;
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderCopyImage(HANDLE phRec, HANDLE phCam, DWORD dwImgIdx, WORD wRoiX0, WORD wRoiY0,
+  WORD wRoiX1, WORD wRoiY1, WORD* wImgBuf, DWORD* dwImgNumber, PCO_METADATA_STRUCT* metadata,
+  PCO_TIMESTAMP_STRUCT* timestamp)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  RecorderCamera* rc = lookupRecorderCamera(rec, phCam);
+  if (rc == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  if (wImgBuf == nullptr || wRoiX0 < 1 || wRoiY0 < 1 || wRoiX1 < wRoiX0 || wRoiY1 < wRoiY0 ||
+    wRoiX1 > roiWidth(*rc->cam) || wRoiY1 > roiHeight(*rc->cam))
+    return PCO_ERROR_WRONGVALUE;
+
+  FrameInfo frame;
+  {
+    std::lock_guard<std::mutex> lock(rec->mutex);
+    //Camera internal memory can only be read while the camera is not recording
+    if (rec->mode == PCO_RECORDER_MODE_CAMRAM && rc->running && dwImgIdx != PCO_RECORDER_LATEST_IMAGE)
+      return PCO_ERROR_WRONGVALUE;
+    const FrameInfo* found = frameAt(*rec, *rc, dwImgIdx);
+    if (found == nullptr)
+      return PCO_ERROR_WRONGVALUE;
+    frame = *found;
+    if (rec->mode == PCO_RECORDER_MODE_MEMORY && rec->type == PCO_RECORDER_MEMORY_FIFO &&
+      dwImgIdx != PCO_RECORDER_LATEST_IMAGE)
+      rc->frames.pop_front();
+    rc->lastCopiedFrame = frame;
+    rc->hasLastCopied = true;
+  }
+
+  const auto copyStart = std::chrono::steady_clock::now();
+  renderFrame(*rc->cam, frame, wRoiX0, wRoiY0, wRoiX1, wRoiY1, wImgBuf);
+  //Images from the camera internal memory come over the link at a limited rate
+  if (rec->mode == PCO_RECORDER_MODE_CAMRAM && dwImgIdx != PCO_RECORDER_LATEST_IMAGE && config().camRamMBps)
+  {
+    const double bytes = (double)(wRoiX1 - wRoiX0 + 1) * (wRoiY1 - wRoiY0 + 1) * sizeof(WORD);
+    std::this_thread::sleep_until(copyStart + std::chrono::duration<double>(bytes / (config().camRamMBps * 1e6)));
+  }
+  if (dwImgNumber)
+    *dwImgNumber = frame.imageNumber;
+  if (metadata && rc->cam->metadataMode == METADATA_MODE_ON)
+    fillMetadata(*rc->cam, frame, metadata);
+  if (timestamp)
+    fillTimestamp(frame, timestamp);
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderExportImage(HANDLE phRec, HANDLE phCam, DWORD dwImgIdx, const char* szFilePath, bool bOverwrite)
+{
+  Recorder* rec = lookupRecorder(phRec);
+  if (rec == nullptr)
+    return PCO_ERROR_INVALIDHANDLE;
+  RecorderCamera* rc = lookupRecorderCamera(rec, phCam);
+  if (rc == nullptr || szFilePath == nullptr)
+    return PCO_ERROR_WRONGVALUE;
+
+  FrameInfo frame;
+  {
+    std::lock_guard<std::mutex> lock(rec->mutex);
+    if (rec->mode == PCO_RECORDER_MODE_MEMORY && rec->type == PCO_RECORDER_MEMORY_FIFO)
+    {
+      //For FIFO always the image of the last copy is exported
+      if (!rc->hasLastCopied)
+        return PCO_ERROR_WRONGVALUE;
+      frame = rc->lastCopiedFrame;
+    }
+    else
+    {
+      const FrameInfo* found = frameAt(*rec, *rc, dwImgIdx);
+      if (found == nullptr)
+        return PCO_ERROR_WRONGVALUE;
+      frame = *found;
+    }
+  }
+
+  const WORD width = roiWidth(*rc->cam);
+  const WORD height = roiHeight(*rc->cam);
+  std::vector<WORD> image((size_t)width * height);
+  renderFrame(*rc->cam, frame, 1, 1, width, height, image.data());
+  if (!writeTiff(szFilePath, image.data(), width, height, 1, 16, false, false, bOverwrite))
+    return PCO_ERROR_NOFILE;
+  return PCO_NOERROR;
+}
+
+int PCO_RecorderSaveImage(void* pImgBuf, WORD wWidth, WORD wHeight, WORD wFileType, bool bIsBitmap,
+  const char* szFilePath, bool bOverwrite, PCO_METADATA_STRUCT*)
+{
+  if (pImgBuf == nullptr || szFilePath == nullptr || wWidth == 0 || wHeight == 0)
+    return PCO_ERROR_WRONGVALUE;
+
+  bool ok = false;
+  switch (wFileType)
+  {
+  case FILESAVE_IMAGE_BW_8:
+    ok = writeTiff(szFilePath, pImgBuf, wWidth, wHeight, 1, 8, false, bIsBitmap, bOverwrite);
+    break;
+  case FILESAVE_IMAGE_BW_16:
+    ok = writeTiff(szFilePath, pImgBuf, wWidth, wHeight, 1, 16, false, bIsBitmap, bOverwrite);
+    break;
+  case FILESAVE_IMAGE_BGR_8:
+    ok = writeTiff(szFilePath, pImgBuf, wWidth, wHeight, 3, 8, true, bIsBitmap, bOverwrite);
+    break;
+  case FILESAVE_IMAGE_BGR_16:
+    ok = writeTiff(szFilePath, pImgBuf, wWidth, wHeight, 3, 16, true, bIsBitmap, bOverwrite);
+    break;
+  default:
+    return PCO_ERROR_WRONGVALUE;
+  }
+  return ok ? PCO_NOERROR : PCO_ERROR_NOFILE;
+}
@@ -0,0 +1,588 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifdef PCO_LINUX
+#include <pco_linux_defs.h>
+#include <sc2_sdkaddendum.h>
+#include <pco_device.h>
+#include <pco_camexport.h>
+#else
+#define NOMINMAX
+
+#include <Windows.h>
+#include <tchar.h>
+#endif
+
+//SDK Includes
+#define PCO_SENSOR_CREATE_OBJECT //To get PCO_SENSOR_TYPE_DEF
+#include <sc2_defs.h>
+#include <sc2_common.h>
+#include <pco_err.h>
+#include <sc2_sdkstructures.h>
+#include <sc2_camexport.h>
+
+//Recorder Includes
+#include <pco_recorder_export.h>
+#include <pco_recorder_defines.h>
+
+//Convert Includes
+#include <pco_color_corr_coeff.h>
+#include <pco_convexport.h>
+#include <pco_convstructures.h>
+
+//Common sample helpers
+#include <Demosaic.h>
+#include <FrameCompression.h>
+#include <FrameStats.h>
+#include <ImageBufferPool.h>
+#include <PackedFrame.h>
+#include <ParallelReadout.h>
+#include <RawStream.h>
+#include <ToneMap.h>
+
+#ifndef PCO_BENCH_VERSION
+#define PCO_BENCH_VERSION "unknown"
+#endif
+#ifndef PCO_BENCH_BUILD_TYPE
+#define PCO_BENCH_BUILD_TYPE ""
+#endif
+#ifndef PCO_BENCH_COMPILER
+#define PCO_BENCH_COMPILER "unknown"
+#endif
+#ifndef PCO_BENCH_CXX_FLAGS
+#define PCO_BENCH_CXX_FLAGS ""
+#endif
+//GCC and clang tell if the optimizer ran, with MSVC only a debug build is known to be unoptimized
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && !defined(_DEBUG))
+#define PCO_BENCH_OPTIMIZED true
+#else
+#define PCO_BENCH_OPTIMIZED false
+#endif
+
+//Benchmark suite for the copy, convert, statistics, save and allocation paths of the samples
+//Every path is measured on synthetic frames (see makeSyntheticFrame() in FrameCompression.h)
+//for all combinations of the resolutions and bit depths below.
+//The results are written as csv, one line per measurement, lines starting with # describe the host:
+//  benchmark,variant,isa,threads,width,height,bits,iterations,ms,mpixel_s,gb_s,error,ratio
+//ms is the time per image, gb_s refers to the 16 bit input image, so all lines of an image size
+//can be compared directly. error is the pco error code of the path (0x00000000 if ok).
+//ratio is the compression ratio (16 bit image size / compressed size) of the compress lines, empty otherwise.
+//
+//Usage: Benchmark [-o file] [-t seconds] [-c]
+//  -o  write the csv to file instead of stdout
+//  -t  minimum measuring time per line, default 0.2 s
+//  -c  also measure PCO_RecorderCopyImage and the compression of recorded images with the first camera found
+
+struct BenchSize
+{
+    WORD width;
+    WORD height;
+};
+
+const BenchSize benchSizes[] = { { 1024, 1024 }, { 2048, 2048 }, { 4096, 3072 } };
+const WORD benchBits[] = { 12, 14, 16 };
+const CpuIsa benchIsas[] = { CpuIsa::Scalar, CpuIsa::SSE41, CpuIsa::AVX2 };
+
+class BenchReport
+{
+public:
+    BenchReport(FILE* out, double minSeconds) : m_out(out), m_minSeconds(minSeconds) {}
+
+    void printHeader()
+    {
+        fprintf(m_out, "# pco.recorder samples benchmark %s\n", PCO_BENCH_VERSION);
+#ifdef PCO_BENCH_SIMULATOR
+        fprintf(m_out, "# backend=simulator build=%s\n", PCO_BENCH_BUILD_TYPE);
+#else
+        fprintf(m_out, "# backend=pco build=%s\n", PCO_BENCH_BUILD_TYPE);
+#endif
+        fprintf(m_out, "# compiler=%s flags=%s optimized=%s\n", PCO_BENCH_COMPILER, PCO_BENCH_CXX_FLAGS,
+            PCO_BENCH_OPTIMIZED ? "yes" : "no");
+        fprintf(m_out, "# cpu=%s\n", cpuName().c_str());
+        fprintf(m_out, "# hardware_threads=%u best_isa=%s min_seconds=%.3f\n",
+            std::max(1u, std::thread::hardware_concurrency()), cpuIsaName(bestCpuIsa()), m_minSeconds);
+        fprintf(m_out, "benchmark,variant,isa,threads,width,height,bits,iterations,ms,mpixel_s,gb_s,error,ratio\n");
+        fflush(m_out);
+    }
+
+    //Runs run() once as warm up and then until the minimum time has passed (at least 3 times)
+    //run() handles imagesPerRun images and returns a pco error code
+    //ratio is written for compression lines only, a value of 0 leaves the column empty
+    template <class F>
+    void measure(const char* benchmark, const char* variant, const char* isa, unsigned threads,
+        WORD width, WORD height, WORD bits, F&& run, int imagesPerRun = 1, double ratio = 0.0)
+    {
+        int iRet = run();
+        int iterations = 0;
+        double seconds = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        while (iRet == PCO_NOERROR && (iterations < 3 || seconds < m_minSeconds))
+        {
+            iRet = run();
+            iterations++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        const double images = (double)iterations * imagesPerRun;
+        const double ms = images > 0.0 ? seconds * 1e3 / images : 0.0;
+        const double pixels = (double)width * height;
+        fprintf(m_out, "%s,%s,%s,%u,%u,%u,%u,%.0f,%.4f,%.1f,%.3f,0x%08X,", benchmark, variant, isa, threads,
+            width, height, bits, images, ms, ms > 0.0 ? pixels / ms / 1e3 : 0.0,
+            ms > 0.0 ? pixels * sizeof(WORD) / ms / 1e6 : 0.0, (unsigned)iRet);
+        if (ratio > 0.0)
+            fprintf(m_out, "%.3f", ratio);
+        fprintf(m_out, "\n");
+        fflush(m_out);
+    }
+
+private:
+    static std::string cpuName()
+    {
+        std::string name = "unknown";
+#ifdef PCO_LINUX
+        FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+        if (cpuinfo == nullptr)
+            return name;
+        char line[256];
+        while (fgets(line, sizeof(line), cpuinfo))
+        {
+            const char* colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon != nullptr)
+            {
+                name = colon + 1;
+                name.erase(0, name.find_first_not_of(" \t"));
+                name.erase(name.find_last_not_of(" \t\r\n") + 1);
+                break;
+            }
+        }
+        fclose(cpuinfo);
+#endif
+        //The name is written as one csv comment, keep it free of separators
+        for (char& c : name)
+            if (c == ',')
+                c = ' ';
+        return name;
+    }
+
+    FILE* m_out;
+    double m_minSeconds;
+};
+
+//Writes to one byte per page, a buffer is only really allocated when it is used first
+static void touchPages(void* buffer, size_t bytes)
+{
+    volatile BYTE* p = static_cast<BYTE*>(buffer);
+    for (size_t i = 0; i < bytes; i += ImageBufferPool::PageSize)
+        p[i] = 1;
+}
+
+static void benchCopy(BenchReport& report, const WORD* image, WORD width, WORD height, WORD bits,
+    ImageBufferPool& pool)
+{
+    const size_t bytes = (size_t)width * height * sizeof(WORD);
+    WORD* copy = pool.acquireImage<WORD>(width, height);
+    report.measure("copy", "memcpy", "-", 1, width, height, bits,
+        [&]() { memcpy(copy, image, bytes); return (int)PCO_NOERROR; });
+
+    //Host ring of packed images (see PackedFrame.h), a 16 bit image is only copied
+    if (bits < 16)
+    {
+        BYTE* buffer = static_cast<BYTE*>(pool.acquire(packedImageBytes(width, height, bits)));
+        PackedFrame frame(buffer, width, height, bits);
+        for (CpuIsa isa : benchIsas)
+        {
+            if (isa > bestCpuIsa())
+                continue;
+            PackedFrameCodec codec(isa);
+            report.measure("copy", "pack", cpuIsaName(isa), 1, width, height, bits,
+                [&]() { return codec.pack(image, frame); });
+            report.measure("copy", "unpack", cpuIsaName(isa), 1, width, height, bits,
+                [&]() { return codec.unpack(frame, copy); });
+        }
+        pool.release(buffer);
+    }
+    pool.release(copy);
+}
+
+static void benchConvert(BenchReport& report, WORD* image, WORD width, WORD height, WORD bits,
+    ImageBufferPool& pool)
+{
+    BYTE* mono = pool.acquireImage<BYTE>(width, height);
+    BYTE* color = pool.acquireImage<BYTE>(width, height, 3);
+
+    //Same converter setup as in ColorConvertExample, with an identity color matrix
+    const int darkOffset = 100;
+    PCO_SensorInfo sensorStruct;
+    memset(&sensorStruct, 0, sizeof(sensorStruct));
+    sensorStruct.wSize = sizeof(PCO_SensorInfo);
+    sensorStruct.iDataBits = bits;
+    sensorStruct.iSensorInfoBits = CONVERT_SENSOR_COLORIMAGE;
+    sensorStruct.iDarkOffset = darkOffset;
+    sensorStruct.strColorCoeff.da11 = 1.0;
+    sensorStruct.strColorCoeff.da22 = 1.0;
+    sensorStruct.strColorCoeff.da33 = 1.0;
+    const int colorMode = 0;
+    const int convertMode = CONVERT_MODE_OUT_DOADSHARPEN |
+        CONVERT_MODE_OUT_FLIPIMAGE |
+        CONVERT_MODE_OUT_DOPCODEBAYER |
+        CONVERT_MODE_OUT_DOBLUR;
+
+    HANDLE hConv = NULL;
+    int iRet = PCO_ConvertCreate(&hConv, &sensorStruct, PCO_COLOR_CONVERT);
+    report.measure("convert", "PCO_Convert16TO8", "-", 1, width, height, bits,
+        [&]() { return iRet != PCO_NOERROR ? iRet : PCO_Convert16TO8(hConv, 0, colorMode, width, height, image, mono); });
+    report.measure("convert", "PCO_Convert16TOCOL", "-", 1, width, height, bits,
+        [&]() { return iRet != PCO_NOERROR ? iRet : PCO_Convert16TOCOL(hConv, convertMode, colorMode, width, height,
+            image, color); });
+    if (iRet == PCO_NOERROR)
+        PCO_ConvertDelete(hConv);
+
+    ToneMapSettings toneMapSettings;
+    toneMapSettings.dataBits = bits;
+    toneMapSettings.black = darkOffset;
+    DemosaicSettings demosaicSettings = makeDemosaicSettings(sensorStruct, colorMode);
+    demosaicSettings.bgr = true;
+    demosaicSettings.flip = true;
+    for (CpuIsa isa : benchIsas)
+    {
+        if (isa > bestCpuIsa())
+            continue;
+        ToneMapLut toneMap(isa);
+        toneMap.update(toneMapSettings);
+        report.measure("convert", "ToneMap mono8", cpuIsaName(isa), 1, width, height, bits,
+            [&]() { return toneMap.toMono8(image, width, height, mono); });
+        report.measure("convert", "ToneMap bgr8", cpuIsaName(isa), 1, width, height, bits,
+            [&]() { return toneMap.toBgr8(image, width, height, color); });
+        //Per channel tables of a demosaiced image, in place
+        ToneMapSettings channels[3] = { toneMapSettings, toneMapSettings, toneMapSettings };
+        channels[0].black = channels[1].black = channels[2].black = 0;
+        toneMap.updateChannels(channels);
+        report.measure("convert", "ToneMap bgr8 channels", cpuIsaName(isa), 1, width, height, bits,
+            [&]() { return toneMap.bgr8ToBgr8(color, width, height, color); });
+        if (isa == CpuIsa::Scalar)
+        {
+            //Every run changes the settings, so the tables are built again
+            ToneMapSettings rebuildSettings = toneMapSettings;
+            report.measure("convert", "ToneMap rebuild", cpuIsaName(isa), 1, width, height, bits,
+                [&]()
+                {
+                    rebuildSettings.black = rebuildSettings.black == darkOffset ? darkOffset + 1 : darkOffset;
+                    return toneMap.update(rebuildSettings) ? (int)PCO_NOERROR : (int)PCO_ERROR_WRONGVALUE;
+                });
+        }
+
+        demosaicSettings.algorithm = DemosaicAlgorithm::Bilinear;
+        Demosaic bilinear(demosaicSettings, isa);
+        report.measure("convert", "Demosaic Bilinear", cpuIsaName(isa), 1, width, height, bits,
+            [&]() { return bilinear.convert(image, width, height, color); });
+        demosaicSettings.algorithm = DemosaicAlgorithm::EdgeAware;
+        Demosaic edgeAware(demosaicSettings, isa);
+        report.measure("convert", "Demosaic EdgeAware", cpuIsaName(isa), 1, width, height, bits,
+            [&]() { return edgeAware.convert(image, width, height, color); });
+    }
+    pool.release(color);
+    pool.release(mono);
+}
+
+//Encode and decode of one image, both lines carry the compression ratio of the image
+static void benchCompression(BenchReport& report, const char* encodeVariant, const char* decodeVariant,
+    const WORD* image, WORD width, WORD height, WORD bits, CpuIsa isa, unsigned threads, ImageBufferPool& pool)
+{
+    const size_t capacity = FrameCompressor::maxCompressedBytes(width, height);
+    BYTE* compressed = static_cast<BYTE*>(pool.acquire(capacity));
+    WORD* restored = pool.acquireImage<WORD>(width, height);
+    FrameCompressor compressor(bits, BIT_ALIGNMENT_LSB, threads, isa);
+    size_t bytes = 0;
+    int iRet = compressor.compress(image, width, height, compressed, capacity, bytes);
+    const double ratio = iRet == PCO_NOERROR && bytes > 0 ? (double)width * height * sizeof(WORD) / bytes : 0.0;
+    report.measure("compress", encodeVariant, cpuIsaName(isa), threads, width, height, bits,
+        [&]() { return compressor.compress(image, width, height, compressed, capacity, bytes); }, 1, ratio);
+    //Every version has to restore the image exactly, else decode reports an error
+    memset(restored, 0, (size_t)width * height * sizeof(WORD));
+    int exact = compressor.decompress(compressed, bytes, restored, width, height);
+    if (exact == PCO_NOERROR && memcmp(restored, image, (size_t)width * height * sizeof(WORD)) != 0)
+        exact = PCO_ERROR_WRONGVALUE;
+    report.measure("compress", decodeVariant, cpuIsaName(isa), threads, width, height, bits,
+        [&]() { return exact != PCO_NOERROR ? exact : compressor.decompress(compressed, bytes, restored, width, height); },
+        1, ratio);
+    pool.release(restored);
+    pool.release(compressed);
+}
+
+static void benchStats(BenchReport& report, const WORD* image, WORD width, WORD height, WORD bits,
+    ImageBufferPool& pool)
+{
+    const unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    FrameStats stats;
+    for (int run = 0; run < 4; run++)
+    {
+        //Every instruction set with one thread, then the best one with all threads
+        const CpuIsa isa = run < 3 ? benchIsas[run] : bestCpuIsa();
+        const unsigned threads = run < 3 ? 1 : hardwareThreads;
+        if (isa > bestCpuIsa() || (run == 3 && threads == 1))
+            continue;
+        FrameStatsSettings settings;
+        settings.bits = bits;
+        settings.threadCount = threads;
+        FrameStatsKernel kernel(settings, isa);
+        report.measure("stats", "FrameStatsKernel", cpuIsaName(isa), threads, width, height, bits,
+            [&]() { return kernel.compute(image, width, height, stats); });
+    }
+
+    for (int run = 0; run < 4; run++)
+    {
+        const CpuIsa isa = run < 3 ? benchIsas[run] : bestCpuIsa();
+        const unsigned threads = run < 3 ? 1 : hardwareThreads;
+        if (isa > bestCpuIsa() || (run == 3 && threads == 1))
+            continue;
+        benchCompression(report, "encode", "decode", image, width, height, bits, isa, threads, pool);
+    }
+}
+
+static void benchSave(BenchReport& report, WORD* image, WORD width, WORD height, WORD bits,
+    ImageBufferPool& pool)
+{
+    //The files are written to the working directory and removed afterwards
+    //The times include the page cache of the file system, not the speed of the disk
+    const char* tiffPath = "bench.tif";
+    const char* rawPath = "bench.raw";
+    report.measure("save", "tiff mono16", "-", 1, width, height, bits,
+        [&]() { return PCO_RecorderSaveImage(image, width, height, FILESAVE_IMAGE_BW_16, false, tiffPath, true, NULL); });
+
+    BYTE* color = pool.acquireImage<BYTE>(width, height, 3);
+    memset(color, 0x80, (size_t)width * height * 3);
+    report.measure("save", "tiff bgr8", "-", 1, width, height, bits,
+        [&]() { return PCO_RecorderSaveImage(color, width, height, FILESAVE_IMAGE_BGR_8, true, tiffPath, true, NULL); });
+    pool.release(color);
+    remove(tiffPath);
+
+    //A raw stream is written in blocks, every run writes a complete file of some images
+    const int imagesPerFile = 8;
+    report.measure("save", "RawStreamWriter", "-", 1, width, height, bits,
+        [&]()
+        {
+            RawStreamWriter writer;
+            int iRet = writer.open(rawPath, width, height);
+            for (int i = 0; i < imagesPerFile && iRet == PCO_NOERROR; i++)
+                iRet = writer.append(image, i + 1, NULL);
+            int closeRet = writer.close();
+            return iRet != PCO_NOERROR ? iRet : closeRet;
+        }, imagesPerFile);
+    remove(rawPath);
+    remove((std::string(rawPath) + ".idx").c_str());
+}
+
+static void benchAllocation(BenchReport& report, WORD width, WORD height, WORD bits)
+{
+    //Time until a buffer for one image is ready to be written, including the page faults
+    const size_t bytes = (size_t)width * height * sizeof(WORD);
+    report.measure("alloc", "malloc", "-", 1, width, height, bits,
+        [&]()
+        {
+            void* buffer = malloc(bytes);
+            if (buffer == nullptr)
+                return (int)PCO_ERROR_NOMEMORY;
+            touchPages(buffer, bytes);
+            free(buffer);
+            return (int)PCO_NOERROR;
+        });
+
+    //A new pool has to allocate, with huge pages if they are available
+    const bool hugePages[] = { false, true };
+    for (bool huge : hugePages)
+        report.measure("alloc", huge ? "ImageBufferPool new hugepages" : "ImageBufferPool new", "-", 1,
+            width, height, bits,
+            [&]()
+            {
+                ImageBufferPool pool(huge);
+                void* buffer = pool.acquire(bytes);
+                if (buffer == nullptr)
+                    return (int)PCO_ERROR_NOMEMORY;
+                touchPages(buffer, bytes);
+                return (int)PCO_NOERROR;
+            });
+
+    //Steady state of an acquisition loop, the released buffer is handed out again
+    ImageBufferPool pool(false);
+    report.measure("alloc", "ImageBufferPool reuse", "-", 1, width, height, bits,
+        [&]()
+        {
+            void* buffer = pool.acquire(bytes);
+            if (buffer == nullptr)
+                return (int)PCO_ERROR_NOMEMORY;
+            touchPages(buffer, bytes);
+            pool.release(buffer);
+            return (int)PCO_NOERROR;
+        });
+}
+
+//Records some images with the first camera into the recorder memory and measures the readout
+//The image size and bit depth are the ones of the camera
+static int benchRecorderCopy(BenchReport& report)
+{
+    int iRet = PCO_InitializeLib();
+    if (iRet != PCO_NOERROR)
+        return iRet;
+
+    HANDLE hCam = 0;
+    PCO_OpenStruct camstruct;
+    memset(&camstruct, 0, sizeof(camstruct));
+    camstruct.wSize = sizeof(PCO_OpenStruct);
+    camstruct.wInterfaceType = 0xFFFF;
+    iRet = PCO_OpenCameraEx(&hCam, &camstruct);
+    if (iRet != PCO_NOERROR)
+    {
+        PCO_CleanupLib();
+        return iRet;
+    }
+    PCO_SetRecordingState(hCam, 0);
+    PCO_SetBitAlignment(hCam, BIT_ALIGNMENT_LSB);
+    PCO_SetDelayExposureTime(hCam, 0, 1, TIMEBASE_MS, TIMEBASE_MS);
+    PCO_ArmCamera(hCam);
+
+    PCO_Description descStruct;
+    descStruct.wSize = sizeof(PCO_Description);
+    iRet = PCO_GetCameraDescription(hCam, &descStruct);
+    const WORD dynRes = iRet == PCO_NOERROR ? descStruct.wDynResDESC : 16;
+
+    HANDLE hRec = NULL;
+    DWORD imgDistribution = 1, maxImgCount = 0;
+    PCO_RecorderResetLib(false);
+    iRet = PCO_RecorderCreate(&hRec, &hCam, &imgDistribution, 1, PCO_RECORDER_MODE_MEMORY, "C", &maxImgCount);
+    DWORD reqImgCount = std::min<DWORD>(50, maxImgCount);
+    if (iRet == PCO_NOERROR)
+        iRet = PCO_RecorderInit(hRec, &reqImgCount, 1, PCO_RECORDER_MEMORY_SEQUENCE, 0, NULL, NULL);
+    WORD imgWidth = 0, imgHeight = 0;
+    if (iRet == PCO_NOERROR)
+        iRet = PCO_RecorderGetSettings(hRec, hCam, NULL, NULL, NULL, &imgWidth, &imgHeight, NULL);
+    if (iRet == PCO_NOERROR)
+        iRet = PCO_RecorderStartRecord(hRec, NULL);
+
+    bool acquisitionRunning = iRet == PCO_NOERROR;
+    while (acquisitionRunning)
+    {
+        if (PCO_RecorderGetStatus(hRec, hCam, &acquisitionRunning,
+            NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != PCO_NOERROR)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    DWORD procImgCount = 0;
+    if (iRet == PCO_NOERROR)
+        iRet = PCO_RecorderGetStatus(hRec, hCam, NULL, NULL, NULL,
+            &procImgCount, NULL, NULL, NULL, NULL, NULL);
+
+    if (iRet == PCO_NOERROR && procImgCount > 0)
+    {
+        ImageBufferPool pool(false);
+        WORD* image = pool.acquireImage<WORD>(imgWidth, imgHeight);
+        PCO_METADATA_STRUCT metadata;
+        metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+        DWORD index = 0, imgNumber = 0;
+        report.measure("copy", "PCO_RecorderCopyImage", "-", 1, imgWidth, imgHeight, dynRes,
+            [&]()
+            {
+                index = (index + 1) % procImgCount;
+                return PCO_RecorderCopyImage(hRec, hCam, index, 1, 1, imgWidth, imgHeight, image,
+                    &imgNumber, &metadata, NULL);
+            });
+
+        //Compression of a recorded image, camera noise compresses worse than the synthetic frames
+        const unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+        if (PCO_RecorderCopyImage(hRec, hCam, 0, 1, 1, imgWidth, imgHeight, image, NULL, NULL, NULL) == PCO_NOERROR)
+            benchCompression(report, "encode recorded", "decode recorded", image, imgWidth, imgHeight, dynRes,
+                bestCpuIsa(), hardwareThreads, pool);
+        pool.release(image);
+
+        //All images of the recording per run, with 1, 2, 4, ... workers up to one per hardware thread
+        for (unsigned threads = 1; ; threads = std::min(threads * 2, hardwareThreads))
+        {
+            ParallelReadout readout(hRec, hCam, imgWidth, imgHeight, threads, &pool);
+            report.measure("copy", "ParallelReadout", "-", threads, imgWidth, imgHeight, dynRes,
+                [&]() { return readout.run(0, procImgCount, nullptr); }, (int)procImgCount);
+            if (threads == hardwareThreads)
+                break;
+        }
+    }
+
+    if (hRec != NULL)
+        PCO_RecorderDelete(hRec);
+    PCO_CloseCamera(hCam);
+    PCO_CleanupLib();
+    return iRet;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* outputPath = nullptr;
+    double minSeconds = 0.2;
+    bool recorderCopy = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            minSeconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0)
+            recorderCopy = true;
+        else
+        {
+            printf("Usage: %s [-o file] [-t seconds] [-c]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    FILE* out = stdout;
+    if (outputPath != nullptr)
+    {
+        out = fopen(outputPath, "w");
+        if (out == nullptr)
+        {
+            printf("Cannot create %s\n", outputPath);
+            return -1;
+        }
+    }
+
+    BenchReport report(out, minSeconds);
+    report.printHeader();
+    if (!PCO_BENCH_OPTIMIZED)
+        fprintf(stderr, "Warning: the benchmark is not optimized, the results are not meaningful\n");
+
+    //All buffers come from one pool, like in the samples
+    ImageBufferPool pool(false);
+    std::vector<WORD> synthetic;
+    for (const BenchSize& size : benchSizes)
+    {
+        for (WORD bits : benchBits)
+        {
+            if (out != stdout)
+                printf("%ux%u %u bit\n", size.width, size.height, bits);
+            makeSyntheticFrame(synthetic, size.width, size.height, bits);
+            WORD* image = pool.acquireImage<WORD>(size.width, size.height);
+            memcpy(image, synthetic.data(), synthetic.size() * sizeof(WORD));
+
+            benchCopy(report, image, size.width, size.height, bits, pool);
+            benchConvert(report, image, size.width, size.height, bits, pool);
+            benchStats(report, image, size.width, size.height, bits, pool);
+            benchSave(report, image, size.width, size.height, bits, pool);
+            benchAllocation(report, size.width, size.height, bits);
+            pool.release(image);
+        }
+    }
+
+    if (recorderCopy)
+    {
+        int iRet = benchRecorderCopy(report);
+        if (iRet != PCO_NOERROR)
+            fprintf(stderr, "Recorder copy benchmark failed: 0x%08X\n", (unsigned)iRet);
+    }
+
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -2,6 +2,8 @@
 #include <cstring>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <algorithm>
 
 #ifdef PCO_LINUX
 #include <pco_linux_defs.h>
@@ -32,6 +34,13 @@
 #include <pco_convexport.h>
 #include <pco_convstructures.h>
 
+//Common sample helpers
+#include <CameraDescriptorCache.h>
+#include <Demosaic.h>
+#include <FramePipeline.h>
+#include <ImageBufferPool.h>
+#include <ToneMap.h>
+
 #define CAMCOUNT    1
 
 //Compute the color mode according to pattern and x0 and y0
@@ -109,33 +118,42 @@ int main()
 
   //Set up color conversion
   ///////////////////////////////////////////////////////
-  WORD alignment;
+  //The camera descriptors are taken from a cache file if it has an entry for this camera
+  //(same serial number and firmware version), only a cold start queries all of them
+  CameraDescriptorCache descriptorCache;
+  descriptorCache.load();
+  CameraDescriptor cameraDesc;
+  bool cacheHit = false;
+  auto queryStart = std::chrono::steady_clock::now();
+  iRet = descriptorCache.get(hCamArr[0], cameraDesc, &cacheHit);
+  if (iRet != PCO_NOERROR)
+  {
+    //Without the descriptors neither the color pattern nor the bit depth are known
+    printf("Camera descriptors could not be read: %x\n", iRet);
+    PCO_CloseCamera(hCamArr[0]);
+    PCO_CleanupLib();
+    return -1;
+  }
+  printf("Camera descriptors %s in %.1f ms\n", cacheHit ? "from cache" : "queried",
+    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - queryStart).count());
+
+  //Bit alignment and ROI are settings, they are read from the camera and not cached
+  WORD alignment = BIT_ALIGNMENT_LSB;
   iRet = PCO_GetBitAlignment(hCamArr[0], &alignment);
 
   //Get Camera Type
-  WORD cameraType;
-  PCO_CameraType camTypeStruct;
-  camTypeStruct.wSize = sizeof(PCO_CameraType);
-  iRet = PCO_GetCameraType(hCamArr[0], &camTypeStruct);
-  cameraType = camTypeStruct.wCamType;
+  WORD cameraType = cameraDesc.type.wCamType;
 
   //Get Sensor description
-  WORD dynRes;
-  WORD sensorTypeDesc;
-  PCO_Description descStruct;
-  descStruct.wSize = sizeof(PCO_Description);
-  iRet = PCO_GetCameraDescription(hCamArr[0], &descStruct);
-
-  sensorTypeDesc = descStruct.wSensorTypeDESC;
-  dynRes = descStruct.wDynResDESC;
+  const PCO_Description& descStruct = cameraDesc.description;
+  WORD dynRes = descStruct.wDynResDESC;
 
   //Get ROI
   WORD roiX0 = 0, roiY0 = 0, roiX1 = 0, roiY1 = 0;
   iRet = PCO_GetROI(hCamArr[0], &roiX0, &roiY0, &roiX1, &roiY1);
 
   //Get CCM
-  double ccm[9];
-  iRet = PCO_GetColorCorrectionMatrix(hCamArr[0], ccm);
+  const double* ccm = cameraDesc.ccm;
 
   //Set sensor info Bits
   int sensorInfoBits = CONVERT_SENSOR_COLORIMAGE;
@@ -167,18 +185,25 @@ int main()
   sensorStruct.hCamera = hCamArr[0];
 
   //Create Convert
-  iRet = PCO_ConvertCreate(&hConv, &sensorStruct, PCO_COLOR_CONVERT);
-
-  //This part is optional, only to create a nice looking image, adapt as needed
-  //Get display struct
-  PCO_Display strDisplay;
-  strDisplay.wSize = sizeof(PCO_Display);
-  iRet = PCO_ConvertGetDisplay(hConv, &strDisplay);
-
-  //Update display information
-  strDisplay.dwProcessingFlags |= PROCESS_REC2020;
-  strDisplay.iColor_saturation = 15; //15% Saturation is just a default value
-  iRet = PCO_ConvertSetDisplay(hConv, &strDisplay);
+  //The conversion runs on several worker threads later, each of them gets its own converter
+  auto createConverter = [&](HANDLE* phConv)
+    {
+      int err = PCO_ConvertCreate(phConv, &sensorStruct, PCO_COLOR_CONVERT);
+      if (err != PCO_NOERROR)
+        return err;
+
+      //This part is optional, only to create a nice looking image, adapt as needed
+      //Get display struct
+      PCO_Display strDisplay;
+      strDisplay.wSize = sizeof(PCO_Display);
+      err = PCO_ConvertGetDisplay(*phConv, &strDisplay);
+
+      //Update display information
+      strDisplay.dwProcessingFlags |= PROCESS_REC2020;
+      strDisplay.iColor_saturation = 15; //15% Saturation is just a default value
+      return PCO_ConvertSetDisplay(*phConv, &strDisplay);
+    };
+  iRet = createConverter(&hConv);
   ///////////////////////////////////////////////////////
 
   //Set image distribution to 1 since only one camera is used
@@ -227,63 +252,164 @@ int main()
     std::this_thread::sleep_for(std::chrono::milliseconds((100)));
   }
 
-  //Allocate memory for one image and one color image
-  WORD* imgBuffer = NULL;
-  imgBuffer = new WORD[(__int64)imgWidth * (__int64)imgHeight];
-
-  BYTE* colorImgBuffer = NULL;
-  colorImgBuffer = new BYTE[(__int64)imgWidth * (__int64)imgHeight * 3];
+  //Conversion parameters are the same for all images of the recording
+  //Note if you use a soft roi in PCO_RecorderCopyImage you will have to consider this also
+  //for the colorMode
+  int colorMode = getColorMode(descStruct.wColorPatternDESC, roiX0, roiY0);
+
+  //Only some default processing features the should produce a quite "nice looking" color image, adapt as needed
+  //Compare the color conversion dialog in pco.camware
+  //Now you will get an bottom up image with bgr (= Bitmap style)
+  //This can directly be saved
+  //If you need RGB Top Bottom you have to remove the CONVERT_MODE_OUT_FLIPIMAGE and switch colors after conversion manually
+  const int convertMode = CONVERT_MODE_OUT_DOADSHARPEN |
+    CONVERT_MODE_OUT_FLIPIMAGE |
+    CONVERT_MODE_OUT_DOPCODEBAYER |
+    CONVERT_MODE_OUT_DOBLUR;
+
+  //Built-in demosaic as alternative to PCO_Convert16TOCOL, with the same color pattern and matrix
+  //Output is also a bottom up bgr image like with CONVERT_MODE_OUT_FLIPIMAGE
+  DemosaicSettings demosaicSettings = makeDemosaicSettings(sensorStruct, colorMode);
+  demosaicSettings.algorithm = DemosaicAlgorithm::EdgeAware;
+  demosaicSettings.bgr = true;
+  demosaicSettings.flip = true;
+  Demosaic demosaic(demosaicSettings);
 
   //Get number of finally recorded images
   DWORD procImgCount = 0;
   iRet = PCO_RecorderGetStatus(hRec, hCamArr[0], NULL, NULL, NULL,
     &procImgCount, NULL, NULL, NULL, NULL, NULL);
 
-  //Get the images and print image counter
-  PCO_METADATA_STRUCT metadata;
-  metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+  //The images are processed in a pipeline (see FramePipeline.h):
+  //one thread copies the images from the recorder, a pool of workers converts them to color
+  //and the images are saved in the order of recording
+  struct ColorFrame
+  {
+    WORD* image;
+    BYTE* colorImage;
+    DWORD imgNumber;
+    PCO_METADATA_STRUCT metadata;
+  };
+  unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<HANDLE> workerConv(workerCount, NULL);
+  int convError = PCO_NOERROR;
+  for (unsigned w = 0; w < workerCount && convError == PCO_NOERROR; w++)
+    convError = createConverter(&workerConv[w]);
+
+  //Get memory for the images from the buffer pool, two frames per worker keep all stages busy
+  //The buffers are page aligned, pass true to use huge pages for large sensors
+  ImageBufferPool bufferPool(false);
+  std::vector<ColorFrame> frames(workerCount * 2);
+  std::vector<ColorFrame*> framePtrs;
+  for (ColorFrame& frame : frames)
+  {
+    frame.image = bufferPool.acquireImage<WORD>(imgWidth, imgHeight);
+    frame.colorImage = bufferPool.acquireImage<BYTE>(imgWidth, imgHeight, 3);
+    frame.metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    framePtrs.push_back(&frame);
+  }
+  FramePipeline<ColorFrame> pipeline(framePtrs, workerCount);
+
   bool imageSaved = false;
-  DWORD imgNumber = 0;
-  for (DWORD i = 0; i < procImgCount; i++)
+  if (convError != PCO_NOERROR)
   {
-    iRet = PCO_RecorderCopyImage(hRec, hCamArr[0], i,
-      1, 1, imgWidth, imgHeight, imgBuffer,
-      &imgNumber, &metadata, NULL);
-    if (iRet == PCO_NOERROR)
-    {
-      printf("Image Number: %d \n", imgNumber);
-
-      //Convert to color
-      int colorMode = getColorMode(descStruct.wColorPatternDESC, roiX0, roiY0);
-      //Note if you use a soft roi in PCO_RecorderCopyImage you will have to consider this also
-
-      //Only some default processing features the should produce a quite "nice looking" color image, adapt as needed
-      //Compare the color conversion dialog in pco.camware
-      int mode = CONVERT_MODE_OUT_DOADSHARPEN |
-        CONVERT_MODE_OUT_FLIPIMAGE |
-        CONVERT_MODE_OUT_DOADSHARPEN |
-        CONVERT_MODE_OUT_DOPCODEBAYER |
-        CONVERT_MODE_OUT_DOBLUR;
-
-      //Now you will get an bottom up image with bgr (= Bitmap style)
-      //This can directly be saved
-      //If you need RGB Top Bottom you have to remove the CONVERT_MODE_OUT_FLIPIMAGE and switch colors after conversion manually
-      iRet = PCO_Convert16TOCOL(hConv, mode, colorMode, imgWidth, imgHeight, imgBuffer, colorImgBuffer);
-
-      //Save first color image as tiff in the binary folder
-      //just to have some output
-      if ((iRet == PCO_NOERROR) && (!imageSaved))
+    //Every worker needs a converter, the images are not converted if one of them is missing
+    printf("Color converter could not be created: %x\n", convError);
+  }
+  else
+  {
+    iRet = pipeline.run(procImgCount,
+      [&](ColorFrame& frame, DWORD index)
+      {
+        //Copy stage
+        return PCO_RecorderCopyImage(hRec, hCamArr[0], index,
+          1, 1, imgWidth, imgHeight, frame.image,
+          &frame.imgNumber, &frame.metadata, NULL);
+      },
+      [&](ColorFrame& frame, unsigned worker)
+      {
+        //Convert stage
+        return PCO_Convert16TOCOL(workerConv[worker], convertMode, colorMode, imgWidth, imgHeight,
+          frame.image, frame.colorImage);
+      },
+      [&](ColorFrame& frame, DWORD)
       {
-        iRet = PCO_RecorderSaveImage(colorImgBuffer,
-          imgWidth, imgHeight, FILESAVE_IMAGE_BGR_8,
-          true, "test.tif", true, &metadata);
-        if (iRet == PCO_NOERROR)
-          imageSaved = true;
-      }
+        //Save stage, images arrive in the order of recording
+        printf("Image Number: %d \n", frame.imgNumber);
+
+        //Save first color image as tiff in the binary folder
+        //just to have some output
+        if (!imageSaved)
+        {
+          int err = PCO_RecorderSaveImage(frame.colorImage,
+            imgWidth, imgHeight, FILESAVE_IMAGE_BGR_8,
+            true, "test.tif", true, &frame.metadata);
+          if (err == PCO_NOERROR)
+            imageSaved = true;
+
+          //Same image with the built-in demosaic
+          if (demosaic.convert(frame.image, imgWidth, imgHeight, frame.colorImage) == PCO_NOERROR)
+            PCO_RecorderSaveImage(frame.colorImage, imgWidth, imgHeight, FILESAVE_IMAGE_BGR_8,
+              true, "test_demosaic.tif", true, &frame.metadata);
+        }
+        return PCO_NOERROR;
+      });
+    if (iRet != PCO_NOERROR)
+      printf("Error in color pipeline: %x\n", iRet);
+    printPipelineStats(pipeline.stats());
+  }
+
+  //Display images of the first image
+  if (procImgCount > 0 && PCO_RecorderCopyImage(hRec, hCamArr[0], 0, 1, 1, imgWidth, imgHeight,
+    frames[0].image, NULL, NULL, NULL) == PCO_NOERROR)
+  {
+    const WORD* imgBuffer = frames[0].image;
+
+    //8 bit display conversion with lookup tables, e.g. for a live view
+    //The tables follow the display settings of the converter and the dynamic range of the camera
+    //In a live loop call update() for every frame, the tables are only rebuilt if the settings changed
+    PCO_Display strDisplay;
+    strDisplay.wSize = sizeof(PCO_Display);
+    iRet = PCO_ConvertGetDisplay(hConv, &strDisplay);
+    ToneMapSettings toneMapSettings = makeToneMapSettings(strDisplay, dynRes, alignment == BIT_ALIGNMENT_MSB);
+    ToneMapLut toneMap;
+    BYTE* displayImage = frames[0].colorImage;
+    if ((descStruct.wSensorTypeDESC & 0x0001) == 0)
+    {
+      //Mono sensor: the 16 bit image is mapped directly, to gray and to a pseudo color palette
+      toneMap.update(toneMapSettings);
+      if (toneMap.toMono8(imgBuffer, imgWidth, imgHeight, displayImage) == PCO_NOERROR)
+        PCO_RecorderSaveImage(displayImage, imgWidth, imgHeight, FILESAVE_IMAGE_BW_8,
+          false, "test_mono.tif", true, NULL);
+      toneMapSettings.palette = ToneMapPalette::Pseudo;
+      toneMap.update(toneMapSettings);
+      if (toneMap.toBgr8(imgBuffer, imgWidth, imgHeight, displayImage, true) == PCO_NOERROR)
+        PCO_RecorderSaveImage(displayImage, imgWidth, imgHeight, FILESAVE_IMAGE_BGR_8,
+          true, "test_pseudo.tif", true, NULL);
+    }
+    else if (demosaic.convert(imgBuffer, imgWidth, imgHeight, displayImage) == PCO_NOERROR)
+    {
+      //Color sensor: the demosaic already scales [dark offset, white level] linearly to 8 bit,
+      //so the tables of the channels only add contrast, gamma and the transfer curve of the display
+      toneMapSettings.black = 0;
+      toneMapSettings.white = 0;
+      ToneMapSettings channels[3] = { toneMapSettings, toneMapSettings, toneMapSettings };
+      toneMap.updateChannels(channels);
+      if (toneMap.bgr8ToBgr8(displayImage, imgWidth, imgHeight, displayImage) == PCO_NOERROR)
+        PCO_RecorderSaveImage(displayImage, imgWidth, imgHeight, FILESAVE_IMAGE_BGR_8,
+          true, "test_display.tif", true, NULL);
     }
   }
-  delete[] imgBuffer;
-  delete[] colorImgBuffer;
+  for (ColorFrame& frame : frames)
+  {
+    bufferPool.release(frame.image);
+    bufferPool.release(frame.colorImage);
+  }
+  for (HANDLE conv : workerConv)
+  {
+    if (conv != NULL)
+      PCO_ConvertDelete(conv);
+  }
 
   //Delete Convert
   iRet = PCO_ConvertDelete(hConv);
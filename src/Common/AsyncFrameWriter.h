@@ -0,0 +1,577 @@
+#pragma once
+
+// Asynchronous writer stage for the raw stream format of RawStream.h
+// The producer hands over filled image buffers with submit(), which returns as
+// soon as the write is queued. When the write has completed, the buffer is
+// given back with the release callback (e.g. to an ImageBufferPool). At most
+// maxInFlight writes are pending, submit() blocks if the limit is reached.
+// If submit() fails, the buffer is given back with the release callback, too.
+//
+// On Linux the file is opened with O_DIRECT and the writes are queued with
+// io_uring (raw system calls, no liburing needed). If io_uring is not available
+// at build or run time, or on Windows, a small thread pool does positional
+// writes instead. O_DIRECT needs page aligned buffers whose size is a multiple
+// of 4 KB, buffers from ImageBufferPool fulfill this. If the file system does
+// not support O_DIRECT, the file is opened normally.
+
+#include "PcoSdk.h"
+#include "RawStream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef PCO_LINUX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PCO_HAVE_IO_URING
+#endif
+#endif
+
+struct AsyncWriterStats
+{
+  uint64_t framesWritten = 0;
+  uint64_t bytesWritten = 0;
+  double seconds = 0.0;
+  double lastSecondMBps = 0.0;                       //Throughput of the last full second
+  unsigned maxInFlight = 0;                          //Highest number of pending writes
+  bool ioUring = false;
+  bool directIO = false;
+
+  double averageMBps() const
+  {
+    return seconds > 0.0 ? bytesWritten / seconds / (1024.0 * 1024.0) : 0.0;
+  }
+};
+
+class AsyncFrameWriter
+{
+public:
+  //Called from a writer thread when the buffer is no longer needed
+  using ReleaseCallback = std::function<void(WORD* buffer)>;
+
+  //fallbackThreads is the number of write threads if io_uring can not be used
+  explicit AsyncFrameWriter(unsigned maxInFlight = 32, unsigned fallbackThreads = 4)
+    : m_maxInFlight(std::max(maxInFlight, 1u)), m_fallbackThreads(std::max(fallbackThreads, 1u))
+  {
+  }
+
+  ~AsyncFrameWriter()
+  {
+    close();
+  }
+
+  AsyncFrameWriter(const AsyncFrameWriter&) = delete;
+  AsyncFrameWriter& operator=(const AsyncFrameWriter&) = delete;
+
+  //Creates path and path.idx
+  int open(const std::string& path, WORD imgWidth, WORD imgHeight, ReleaseCallback release)
+  {
+    close();
+    m_imgWidth = imgWidth;
+    m_imgHeight = imgHeight;
+    m_stride = rawStreamFrameStride(imgWidth, imgHeight);
+    m_release = std::move(release);
+    m_frames = 0;
+    m_error = PCO_NOERROR;
+    m_stats = AsyncWriterStats();
+    m_stats.directIO = openFile(path);
+    if (!isOpen())
+      return PCO_ERROR_NOFILE;
+    m_index = std::fopen((path + ".idx").c_str(), "wb");
+    if (m_index == nullptr)
+    {
+      closeFile();
+      return PCO_ERROR_NOFILE;
+    }
+
+    m_startTime = std::chrono::steady_clock::now();
+    m_windowStart = m_startTime;
+    m_windowBytes = 0;
+    m_stopping = false;
+#ifdef PCO_HAVE_IO_URING
+    m_stats.ioUring = setupRing();
+    if (m_stats.ioUring)
+      m_workers.emplace_back(&AsyncFrameWriter::completionThread, this);
+#endif
+    if (!m_stats.ioUring)
+    {
+      for (unsigned i = 0; i < m_fallbackThreads; i++)
+        m_workers.emplace_back(&AsyncFrameWriter::writeThread, this);
+    }
+    return writeHeaders();
+  }
+
+  //Queues the image for writing, the buffer belongs to the writer until it is released
+  //(also if an error is returned)
+  int submit(WORD* buffer, DWORD imgNumber, const PCO_METADATA_STRUCT* metadata)
+  {
+    if (!isOpen())
+      return reject(buffer, PCO_ERROR_NOTINIT);
+    if (m_stats.directIO && ((uintptr_t)buffer % RawStreamAlignment) != 0)
+      return reject(buffer, PCO_ERROR_WRONGVALUE);
+
+    const uint64_t offset = RawStreamAlignment + m_frames * m_stride;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [this]() { return m_inFlight < m_maxInFlight || m_error != PCO_NOERROR; });
+      if (m_error != PCO_NOERROR)
+      {
+        const int error = m_error;
+        lock.unlock();
+        return reject(buffer, error);
+      }
+      m_inFlight++;
+      m_stats.maxInFlight = std::max(m_stats.maxInFlight, m_inFlight);
+    }
+    m_frames++;
+
+    RawIndexEntry entry = makeRawIndexEntry(offset, imgNumber, m_imgWidth, m_imgHeight, metadata);
+    if (std::fwrite(&entry, sizeof(entry), 1, m_index) != 1)
+      setError(PCO_ERROR_DISKFULL);
+
+    Job job = { buffer, offset };
+#ifdef PCO_HAVE_IO_URING
+    if (m_stats.ioUring)
+      return queueRingWrite(job);
+#endif
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.push_back(job);
+    }
+    m_jobCond.notify_one();
+    return PCO_NOERROR;
+  }
+
+  //Waits for all pending writes, updates the headers and closes the files
+  int close()
+  {
+    if (!isOpen())
+      return PCO_NOERROR;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [this]() { return m_inFlight == 0; });
+      m_stopping = true;
+    }
+    m_jobCond.notify_all();
+#ifdef PCO_HAVE_IO_URING
+    if (m_stats.ioUring)
+      queueRingStop();
+#endif
+    for (auto& worker : m_workers)
+      worker.join();
+    m_workers.clear();
+#ifdef PCO_HAVE_IO_URING
+    if (m_stats.ioUring)
+      teardownRing();
+#endif
+
+    if (m_error == PCO_NOERROR)
+      m_error = writeHeaders();
+    std::fclose(m_index);
+    m_index = nullptr;
+    closeFile();
+    m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+    return m_error;
+  }
+
+  AsyncWriterStats stats() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    AsyncWriterStats stats = m_stats;
+    if (isOpen())
+      stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+    return stats;
+  }
+
+private:
+  struct Job
+  {
+    WORD* buffer;
+    uint64_t offset;
+  };
+
+  //Returns true if the file could be opened for direct IO
+  bool openFile(const std::string& path)
+  {
+#ifdef PCO_LINUX
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (m_fd >= 0)
+      return true;
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return false;
+#else
+    m_file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+    if (m_file != INVALID_HANDLE_VALUE)
+      return true;
+    m_file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return false;
+#endif
+  }
+
+  bool isOpen() const
+  {
+#ifdef PCO_LINUX
+    return m_fd >= 0;
+#else
+    return m_file != INVALID_HANDLE_VALUE;
+#endif
+  }
+
+  void closeFile()
+  {
+#ifdef PCO_LINUX
+    ::close(m_fd);
+    m_fd = -1;
+#else
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+#endif
+  }
+
+  //Writes the whole block at offset, returns false on error
+  bool positionalWrite(const void* data, size_t bytes, uint64_t offset)
+  {
+#ifdef PCO_LINUX
+    const char* ptr = static_cast<const char*>(data);
+    while (bytes > 0)
+    {
+      ssize_t written = pwrite(m_fd, ptr, bytes, (off_t)offset);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      ptr += written;
+      bytes -= (size_t)written;
+      offset += (uint64_t)written;
+    }
+    return true;
+#else
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD written = 0;
+    return WriteFile(m_file, data, (DWORD)bytes, &written, &overlapped) && written == bytes;
+#endif
+  }
+
+  int writeHeaders()
+  {
+    RawStreamHeader header = makeRawStreamHeader(m_imgWidth, m_imgHeight, m_frames);
+
+    //Direct IO needs an aligned buffer for the header block, too
+    void* block = m_headerPool.acquire(RawStreamAlignment);
+    std::memset(block, 0, RawStreamAlignment);
+    std::memcpy(block, &header, sizeof(header));
+    bool ok = positionalWrite(block, RawStreamAlignment, 0);
+    m_headerPool.release(block);
+
+    RawIndexHeader indexHeader = makeRawIndexHeader(m_frames);
+    ok = ok && std::fseek(m_index, 0, SEEK_SET) == 0 &&
+      std::fwrite(&indexHeader, sizeof(indexHeader), 1, m_index) == 1 &&
+      std::fseek(m_index, 0, SEEK_END) == 0;
+    return ok ? PCO_NOERROR : PCO_ERROR_DISKFULL;
+  }
+
+  void setError(int error)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_error == PCO_NOERROR)
+        m_error = error;
+    }
+    m_cond.notify_all();
+  }
+
+  //Gives back a buffer which was not queued
+  int reject(WORD* buffer, int error)
+  {
+    if (m_release && buffer != nullptr)
+      m_release(buffer);
+    return error;
+  }
+
+  //Bookkeeping after a write has finished, on the writer threads
+  void completed(const Job& job, bool ok)
+  {
+    if (m_release)
+      m_release(job.buffer);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!ok && m_error == PCO_NOERROR)
+        m_error = PCO_ERROR_DISKFULL;
+      if (ok)
+      {
+        m_stats.framesWritten++;
+        m_stats.bytesWritten += m_stride;
+        m_windowBytes += m_stride;
+      }
+      auto now = std::chrono::steady_clock::now();
+      double window = std::chrono::duration<double>(now - m_windowStart).count();
+      if (window >= 1.0)
+      {
+        m_stats.lastSecondMBps = m_windowBytes / window / (1024.0 * 1024.0);
+        m_windowStart = now;
+        m_windowBytes = 0;
+      }
+      m_inFlight--;
+    }
+    m_cond.notify_all();
+  }
+
+  void writeThread()
+  {
+    while (true)
+    {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_jobCond.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+        if (m_jobs.empty())
+          return;
+        job = m_jobs.front();
+        m_jobs.pop_front();
+      }
+      completed(job, positionalWrite(job.buffer, (size_t)m_stride, job.offset));
+    }
+  }
+
+#ifdef PCO_HAVE_IO_URING
+  static const uint64_t StopTag = ~0ull;
+
+  bool setupRing()
+  {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    unsigned entries = 1;
+    while (entries < m_maxInFlight + 1)
+      entries <<= 1;
+    m_ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (m_ringFd < 0)
+      return false;
+
+    m_sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      m_sqRingBytes = m_cqRingBytes = std::max(m_sqRingBytes, m_cqRingBytes);
+    m_sqRing = mmap(nullptr, m_sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      m_ringFd, IORING_OFF_SQ_RING);
+    m_cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sqRing :
+      mmap(nullptr, m_cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+    m_sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqesBytes, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES));
+    if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED)
+    {
+      m_sqes = nullptr;
+      teardownRing();
+      return false;
+    }
+
+    char* sq = static_cast<char*>(m_sqRing);
+    char* cq = static_cast<char*>(m_cqRing);
+    m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    m_ringJobs.assign(params.sq_entries, Job{ nullptr, 0 });
+    m_ringSlotBusy.assign(params.sq_entries, 0);
+    m_freeSlots.clear();
+    for (unsigned slot = params.sq_entries; slot > 0; slot--)
+      m_freeSlots.push_back(slot - 1);
+    return true;
+  }
+
+  void teardownRing()
+  {
+    if (m_sqes != nullptr)
+      munmap(m_sqes, m_sqesBytes);
+    if (m_cqRing != nullptr && m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+      munmap(m_cqRing, m_cqRingBytes);
+    if (m_sqRing != nullptr && m_sqRing != MAP_FAILED)
+      munmap(m_sqRing, m_sqRingBytes);
+    if (m_ringFd >= 0)
+      ::close(m_ringFd);
+    m_sqes = nullptr;
+    m_sqRing = m_cqRing = nullptr;
+    m_ringFd = -1;
+  }
+
+  //Puts one entry into the submission queue and tells the kernel about it
+  bool pushSqe(uint8_t opcode, const void* data, unsigned bytes, uint64_t offset, uint64_t tag)
+  {
+    std::lock_guard<std::mutex> lock(m_sqMutex);
+    unsigned tail = *m_sqTail;
+    unsigned index = tail & m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = m_fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = bytes;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+    //Once the tail is published the kernel may consume the entry, so an interrupted or busy call is
+    //repeated until it did. Without SQPOLL only io_uring_enter consumes entries, on any other error
+    //the entry was not taken and the tail is set back, so it can not complete later.
+    while (true)
+    {
+      long submitted = syscall(__NR_io_uring_enter, m_ringFd, 1, 0, 0, nullptr, 0);
+      if (submitted == 1)
+        return true;
+      if (submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+      {
+        std::this_thread::yield();
+        continue;
+      }
+      __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+      return false;
+    }
+  }
+
+  //Takes a free job slot, the slot is given back when its write has completed. Writes may complete
+  //in any order, so a slot is only reused after the kernel reported it.
+  bool takeRingSlot(const Job& job, uint64_t& tag)
+  {
+    std::lock_guard<std::mutex> lock(m_slotMutex);
+    if (m_freeSlots.empty())
+      return false;
+    unsigned slot = m_freeSlots.back();
+    m_freeSlots.pop_back();
+    assert(!m_ringSlotBusy[slot]);
+    m_ringSlotBusy[slot] = 1;
+    m_ringJobs[slot] = job;
+    tag = slot;
+    return true;
+  }
+
+  Job giveRingSlot(uint64_t tag)
+  {
+    std::lock_guard<std::mutex> lock(m_slotMutex);
+    assert(tag < m_ringJobs.size() && m_ringSlotBusy[tag]);
+    Job job = m_ringJobs[tag];
+    m_ringJobs[tag] = Job{ nullptr, 0 };
+    m_ringSlotBusy[tag] = 0;
+    m_freeSlots.push_back((unsigned)tag);
+    return job;
+  }
+
+  int queueRingWrite(const Job& job)
+  {
+    //The number of pending writes is limited to m_maxInFlight, which is smaller than the ring,
+    //so a slot is always free
+    uint64_t tag = 0;
+    if (!takeRingSlot(job, tag))
+    {
+      setError(PCO_ERROR_NOMEMORY);
+      completed(job, false);
+      return m_error;
+    }
+    if (!pushSqe(IORING_OP_WRITE, job.buffer, (unsigned)m_stride, job.offset, tag))
+    {
+      completed(giveRingSlot(tag), false);
+      return m_error;
+    }
+    return PCO_NOERROR;
+  }
+
+  void queueRingStop()
+  {
+    pushSqe(IORING_OP_NOP, nullptr, 0, 0, StopTag);
+  }
+
+  void completionThread()
+  {
+    while (true)
+    {
+      syscall(__NR_io_uring_enter, m_ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      unsigned head = *m_cqHead;
+      unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+      bool stop = false;
+      for (; head != tail; head++)
+      {
+        const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+        if (cqe.user_data == StopTag)
+        {
+          stop = true;
+          continue;
+        }
+        completed(giveRingSlot(cqe.user_data), cqe.res == (int)m_stride);
+      }
+      __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+      if (stop)
+        return;
+    }
+  }
+
+  int m_ringFd = -1;
+  void* m_sqRing = nullptr;
+  void* m_cqRing = nullptr;
+  size_t m_sqRingBytes = 0;
+  size_t m_cqRingBytes = 0;
+  size_t m_sqesBytes = 0;
+  io_uring_sqe* m_sqes = nullptr;
+  unsigned* m_sqTail = nullptr;
+  unsigned* m_sqArray = nullptr;
+  unsigned m_sqMask = 0;
+  unsigned* m_cqHead = nullptr;
+  unsigned* m_cqTail = nullptr;
+  unsigned m_cqMask = 0;
+  io_uring_cqe* m_cqes = nullptr;
+  std::mutex m_sqMutex;
+  std::mutex m_slotMutex;
+  std::vector<Job> m_ringJobs;
+  std::vector<char> m_ringSlotBusy;
+  std::vector<unsigned> m_freeSlots;
+#endif
+
+  unsigned m_maxInFlight;
+  unsigned m_fallbackThreads;
+#ifdef PCO_LINUX
+  int m_fd = -1;
+#else
+  HANDLE m_file = INVALID_HANDLE_VALUE;
+#endif
+  std::FILE* m_index = nullptr;
+  ImageBufferPool m_headerPool;
+  WORD m_imgWidth = 0;
+  WORD m_imgHeight = 0;
+  uint64_t m_stride = 0;
+  uint64_t m_frames = 0;
+  ReleaseCallback m_release;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::condition_variable m_jobCond;
+  std::deque<Job> m_jobs;
+  std::vector<std::thread> m_workers;
+  unsigned m_inFlight = 0;
+  bool m_stopping = false;
+  int m_error = PCO_NOERROR;
+  AsyncWriterStats m_stats;
+  std::chrono::steady_clock::time_point m_startTime;
+  std::chrono::steady_clock::time_point m_windowStart;
+  uint64_t m_windowBytes = 0;
+};
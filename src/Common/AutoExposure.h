@@ -0,0 +1,295 @@
+#pragma once
+
+// Closed loop auto exposure on the live image stream
+// AutoExposure::update() gets the statistics of every image (see FrameStats.h)
+// and keeps a percentile of the histogram (e.g. 99%) at a target level of the
+// dynamic range. The signal above the dark offset is proportional to the
+// exposure time, so the new exposure is the current one scaled by target signal
+// / measured signal. The step is damped and limited, and a clipped histogram
+// (percentile in the top bin or too many saturated pixels) shortens the
+// exposure by the largest step, since the real level is unknown.
+//
+// The exposure is changed with PCO_SetDelayExposureTime while the camera keeps
+// recording, without PCO_ArmCamera or a restart of the recorder. Images already
+// in the FIFO were taken with the old exposure: with metadata, images with an
+// other exposure time are skipped, without metadata a number of images after
+// every change. The camera rounds the exposure (e.g. to its line time), so the
+// metadata is compared with the value read back after setting, not the request. Updates are also limited to one per minInterval.
+// restore() sets the delay and exposure back to the values init() found, so the
+// camera is left as it was.
+//
+// Convergence is reported in images: from the start, or from the first image
+// which left the tolerance again (e.g. after a change of the lighting), to the
+// first image within the tolerance.
+
+#include "PcoSdk.h"
+#include "FrameStats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+struct AutoExposureSettings
+{
+  double percentile = 0.99;                          //Histogram percentile which is controlled
+  double targetLevel = 0.75;                         //Target of the percentile, fraction of the dynamic range
+  double tolerance = 0.05;                           //Converged within +-5% of the target signal
+  double damping = 0.8;                              //Fraction of the correction applied per update
+  double maxStep = 4.0;                              //Largest change of the exposure per update (factor)
+  DWORD minImagesBetween = 2;                        //Images with the new exposure before the next update
+  std::chrono::milliseconds minInterval{ 50 };       //Shortest time between two updates
+  double minExposure = 0.0;                          //Limits in seconds, 0 for the camera description
+  double maxExposure = 0.0;
+};
+
+struct AutoExposureStats
+{
+  DWORD images = 0;
+  DWORD skipped = 0;                                 //Taken with an older exposure
+  DWORD updates = 0;
+  DWORD rateLimited = 0;
+  DWORD failures = 0;                                //Rejected by PCO_SetDelayExposureTime
+  DWORD episodes = 0;                                //Times the controller had to (re)converge
+  DWORD lastConvergenceImages = 0;
+  DWORD maxConvergenceImages = 0;
+  bool converged = false;
+  double level = 0.0;                                //Percentile of the last evaluated image
+  double maxSetSeconds = 0.0;                        //Longest PCO_SetDelayExposureTime call
+};
+
+class AutoExposure
+{
+public:
+  explicit AutoExposure(HANDLE hCam, const AutoExposureSettings& settings = AutoExposureSettings())
+    : m_hCam(hCam), m_settings(settings)
+  {
+  }
+
+  //Reads the current delay and exposure and the limits of the camera
+  //bits is the dynamic resolution, darkOffset is used for images without metadata
+  int init(WORD bits, WORD darkOffset = 0)
+  {
+    m_fullScale = (double)((1u << std::min<WORD>(std::max<WORD>(bits, 1), 16)) - 1);
+    m_darkOffset = darkOffset;
+
+    int iRet = PCO_GetDelayExposureTime(m_hCam, &m_delay, &m_initialExposure, &m_delayBase, &m_initialExposureBase);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    m_exposure = m_initialExposure * timebaseSeconds(m_initialExposureBase);
+    m_initialized = true;
+
+    PCO_Description desc;
+    desc.wSize = sizeof(PCO_Description);
+    iRet = PCO_GetCameraDescription(m_hCam, &desc);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    //Minimum exposure of the description is in ns, maximum in ms
+    m_minExposure = std::max(m_settings.minExposure, desc.dwMinExposureDESC * 1e-9);
+    m_maxExposure = desc.dwMaxExposureDESC * 1e-3;
+    if (m_settings.maxExposure > 0.0)
+      m_maxExposure = std::min(m_maxExposure, m_settings.maxExposure);
+    m_maxExposure = std::max(m_maxExposure, m_minExposure);
+
+    m_stats = AutoExposureStats();
+    m_stats.episodes = 1;
+    m_converging = true;
+    m_episodeImages = 0;
+    m_imagesSinceUpdate = 0;
+    m_lastUpdate = std::chrono::steady_clock::now() - m_settings.minInterval;
+    return PCO_NOERROR;
+  }
+
+  //Call for every image of the stream, in order. Returns the error of PCO_SetDelayExposureTime
+  //if the new exposure could not be set.
+  int update(const FrameStats& stats, const PCO_METADATA_STRUCT* metadata = nullptr)
+  {
+    m_stats.images++;
+    if (m_converging)
+      m_episodeImages++;
+    if (!stats.valid || stats.histogram.empty())
+      return PCO_NOERROR;
+
+    //Images which were exposed before the last change do not tell anything about the new exposure
+    const bool hasExposure = metadata != nullptr && metadata->dwEXPOSURE_TIME != 0;
+    if (hasExposure)
+    {
+      const double exposure = metadata->dwEXPOSURE_TIME * timebaseSeconds(metadata->wEXPOSURE_TIME_BASE);
+      if (std::fabs(exposure / m_exposure - 1.0) > 0.01)
+      {
+        m_stats.skipped++;
+        return PCO_NOERROR;
+      }
+    }
+    m_imagesSinceUpdate++;
+    if (!hasExposure && m_stats.updates > 0 && m_imagesSinceUpdate <= m_settings.minImagesBetween)
+    {
+      m_stats.skipped++;
+      return PCO_NOERROR;
+    }
+
+    bool clipped = false;
+    m_stats.level = percentileLevel(stats, m_settings.percentile, clipped);
+    double pixels = 0.0;
+    for (DWORD count : stats.histogram)
+      pixels += count;
+    clipped = clipped || stats.saturated > (1.0 - m_settings.percentile) * pixels;
+
+    const double dark = hasExposure && metadata->wDARK_OFFSET ? metadata->wDARK_OFFSET : m_darkOffset;
+    const double signal = m_stats.level - dark;
+    const double targetSignal = m_settings.targetLevel * m_fullScale - dark;
+    double ratio = m_settings.maxStep;
+    if (clipped)
+      ratio = 1.0 / m_settings.maxStep;
+    else if (signal >= 1.0)
+      ratio = targetSignal / signal;
+
+    if (!clipped && std::fabs(ratio - 1.0) <= m_settings.tolerance)
+    {
+      if (m_converging)
+      {
+        m_stats.lastConvergenceImages = m_episodeImages;
+        m_stats.maxConvergenceImages = std::max(m_stats.maxConvergenceImages, m_episodeImages);
+        m_converging = false;
+      }
+      m_stats.converged = true;
+      return PCO_NOERROR;
+    }
+    if (!m_converging)
+    {
+      m_converging = true;
+      m_episodeImages = 1;
+      m_stats.episodes++;
+    }
+    m_stats.converged = false;
+
+    const auto now = std::chrono::steady_clock::now();
+    if (m_imagesSinceUpdate < m_settings.minImagesBetween || now - m_lastUpdate < m_settings.minInterval)
+    {
+      m_stats.rateLimited++;
+      return PCO_NOERROR;
+    }
+    ratio = std::min(std::max(ratio, 1.0 / m_settings.maxStep), m_settings.maxStep);
+    const double exposure = std::min(std::max(m_exposure * std::pow(ratio, m_settings.damping), m_minExposure),
+      m_maxExposure);
+    //At a limit of the camera nothing more can be done
+    if (std::fabs(exposure / m_exposure - 1.0) < 0.001)
+      return PCO_NOERROR;
+    return apply(exposure, now);
+  }
+
+  //Sets the delay and exposure read by init() again, nothing to do if init() failed
+  int restore()
+  {
+    if (!m_initialized)
+      return PCO_NOERROR;
+    int iRet = PCO_SetDelayExposureTime(m_hCam, m_delay, m_initialExposure, m_delayBase, m_initialExposureBase);
+    if (iRet == PCO_NOERROR)
+      m_exposure = m_initialExposure * timebaseSeconds(m_initialExposureBase);
+    return iRet;
+  }
+
+  double exposureSeconds() const
+  {
+    return m_exposure;
+  }
+
+  bool converged() const
+  {
+    return m_stats.converged;
+  }
+
+  const AutoExposureStats& stats() const
+  {
+    return m_stats;
+  }
+
+  //Level below which the fraction percentile of the pixels is, from the center of the histogram bin
+  //clipped is set if it is in the top bin, where the real level is unknown
+  static double percentileLevel(const FrameStats& stats, double percentile, bool& clipped)
+  {
+    double pixels = 0.0;
+    for (DWORD count : stats.histogram)
+      pixels += count;
+    const double threshold = percentile * pixels;
+    double cumulative = 0.0;
+    size_t bin = 0;
+    for (; bin + 1 < stats.histogram.size(); bin++)
+    {
+      cumulative += stats.histogram[bin];
+      if (cumulative >= threshold)
+        break;
+    }
+    clipped = bin + 1 >= stats.histogram.size();
+    return (bin + 0.5) * (double)(1u << stats.binShift);
+  }
+
+  void printStats() const
+  {
+    printf("Auto exposure: %.3f ms, %.0f%% percentile at %.0f (target %.0f), %s\n", m_exposure * 1e3,
+      m_settings.percentile * 100.0, m_stats.level, m_settings.targetLevel * m_fullScale,
+      m_stats.converged ? "converged" : "not converged");
+    printf("%u images, %u convergence%s, last after %u images, longest %u images\n", (unsigned)m_stats.images,
+      (unsigned)m_stats.episodes, m_stats.episodes == 1 ? "" : "s", (unsigned)m_stats.lastConvergenceImages,
+      (unsigned)m_stats.maxConvergenceImages);
+    printf("%u updates (longest %.2f ms), %u images with an older exposure, %u rate limited, %u failed\n",
+      (unsigned)m_stats.updates, m_stats.maxSetSeconds * 1e3, (unsigned)m_stats.skipped,
+      (unsigned)m_stats.rateLimited, (unsigned)m_stats.failures);
+  }
+
+private:
+  static double timebaseSeconds(WORD timebase)
+  {
+    return timebase == TIMEBASE_NS ? 1e-9 : timebase == TIMEBASE_US ? 1e-6 : 1e-3;
+  }
+
+  int apply(double exposure, std::chrono::steady_clock::time_point now)
+  {
+    //Finest time base which can hold the value
+    WORD base = TIMEBASE_NS;
+    if (exposure >= 4.0)
+      base = TIMEBASE_MS;
+    else if (exposure >= 1e-3)
+      base = TIMEBASE_US;
+    const DWORD value = std::max<DWORD>((DWORD)std::lround(exposure / timebaseSeconds(base)), 1);
+
+    const auto start = std::chrono::steady_clock::now();
+    int iRet = PCO_SetDelayExposureTime(m_hCam, m_delay, value, m_delayBase, base);
+    m_stats.maxSetSeconds = std::max(m_stats.maxSetSeconds,
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (iRet != PCO_NOERROR)
+    {
+      m_stats.failures++;
+      return iRet;
+    }
+    //The camera may have rounded the value, the images will show the one it uses
+    DWORD delay = 0, actual = 0;
+    WORD delayBase = 0, actualBase = 0;
+    if (PCO_GetDelayExposureTime(m_hCam, &delay, &actual, &delayBase, &actualBase) == PCO_NOERROR && actual != 0)
+      m_exposure = actual * timebaseSeconds(actualBase);
+    else
+      m_exposure = value * timebaseSeconds(base);
+    m_stats.updates++;
+    m_imagesSinceUpdate = 0;
+    m_lastUpdate = now;
+    return PCO_NOERROR;
+  }
+
+  HANDLE m_hCam;
+  AutoExposureSettings m_settings;
+  double m_fullScale = 65535.0;
+  double m_darkOffset = 0.0;
+  DWORD m_delay = 0;
+  WORD m_delayBase = TIMEBASE_MS;
+  DWORD m_initialExposure = 10;                      //As read by init(), for restore()
+  WORD m_initialExposureBase = TIMEBASE_MS;
+  bool m_initialized = false;
+  double m_exposure = 0.01;
+  double m_minExposure = 0.0;
+  double m_maxExposure = 1.0;
+  bool m_converging = true;
+  DWORD m_episodeImages = 0;
+  DWORD m_imagesSinceUpdate = 0;
+  std::chrono::steady_clock::time_point m_lastUpdate;
+  AutoExposureStats m_stats;
+};
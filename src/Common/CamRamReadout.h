@@ -0,0 +1,395 @@
+#pragma once
+
+// Pipelined readout of a camera internal memory (PCO_RECORDER_CAMRAM_SEQUENTIAL)
+// Reading a RAM segment image by image with PCO_RecorderCopyImage leaves the
+// link idle while an image is processed or written, and a full segment can take
+// minutes. CamRamReadout copies on its own thread into a few buffers, so the
+// transfer of image i+1 runs while image i is processed on the calling thread.
+// The process callback gets the images strictly in index order.
+//
+// After every processed image the next index is written to a checkpoint file,
+// together with what identifies the recording (serial number, RAM segment,
+// image count, image size, and image number and metadata time stamp of the
+// first and the last image). Image numbers restart with every record, so only
+// the time stamps tell a new recording of the same length apart; they need
+// METADATA_MODE_ON. If the dump is interrupted, the next run on the same
+// recording resumes at that index. A checkpoint of another recording is
+// ignored. The file is removed when all images are read, and should be
+// discarded with discardCheckpoint() when a new record is started.
+
+#include "PcoSdk.h"
+#include "FramePipeline.h"
+#include "ImageBufferPool.h"
+#include "ParallelReadout.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CamRamCheckpoint
+{
+  char magic[8];
+  uint32_t version;
+  DWORD serialNumber;
+  WORD ramSegment;
+  WORD imgWidth;
+  WORD imgHeight;
+  DWORD imgCount;
+  DWORD firstImgNumber;                              //Image number at index 0
+  DWORD lastImgNumber;                               //Image number at index imgCount - 1
+  BYTE firstImgTime[9];                              //bIMAGE_TIME_US_BCD ... bIMAGE_TIME_YEAR_BCD of index 0
+  BYTE lastImgTime[9];                               //Same for index imgCount - 1
+  DWORD nextIndex;                                   //Images before this index are done
+};
+
+struct CamRamProgress
+{
+  DWORD done = 0;                                    //Including the images of a previous run
+  DWORD total = 0;
+  double megabytesPerSecond = 0.0;                   //Since the last progress report
+  double etaSeconds = 0.0;
+};
+
+struct CamRamReadoutStats
+{
+  DWORD frames = 0;                                  //Read in this run
+  DWORD resumedAt = 0;                               //First index of this run
+  uint64_t bytes = 0;
+  double seconds = 0.0;
+  double copySeconds = 0.0;                          //Transfer thread
+  double processSeconds = 0.0;                       //Process callback
+
+  double megabytesPerSecond() const
+  {
+    return seconds > 0.0 ? bytes / seconds / 1e6 : 0.0;
+  }
+};
+
+class CamRamReadout
+{
+public:
+  //Called on the thread of run(), in index order, an error stops the readout
+  using FrameCallback = std::function<int(ReadoutFrame& frame)>;
+  using ProgressCallback = std::function<void(const CamRamProgress& progress)>;
+
+  //depth is the number of image buffers, so up to depth - 1 images are copied ahead
+  CamRamReadout(HANDLE hRec, HANDLE hCam, WORD ramSegment,
+    const std::string& checkpointPath = "camram_readout.chk", unsigned depth = 3,
+    ImageBufferPool* pool = nullptr)
+    : m_hRec(hRec), m_hCam(hCam), m_ramSegment(ramSegment), m_checkpointPath(checkpointPath),
+    m_depth(std::max(depth, 2u)), m_pool(pool)
+  {
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+  }
+
+  CamRamReadout(const CamRamReadout&) = delete;
+  CamRamReadout& operator=(const CamRamReadout&) = delete;
+
+  //Reads the first count images (0 for all recorded ones), starting at the checkpoint if there is one
+  //Returns PCO_NOERROR also if the readout was aborted, check complete() for that
+  int run(FrameCallback process, ProgressCallback progress = nullptr, DWORD count = 0)
+  {
+    m_stats = CamRamReadoutStats();
+    m_complete = false;
+    m_abort = false;
+
+    int iRet = prepare(count);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    if (count == 0)
+    {
+      m_complete = true;
+      return PCO_NOERROR;
+    }
+    m_stats.resumedAt = m_checkpoint.nextIndex;
+
+    m_checkpointFile = fopen(m_checkpointPath.c_str(), "wb");
+    writeCheckpoint();
+
+    const size_t imageBytes = (size_t)m_imgWidth * m_imgHeight * sizeof(WORD);
+    BoundedQueue<WORD*> freeBuffers(m_depth);
+    BoundedQueue<Slot> copied(m_depth);
+    std::vector<WORD*> buffers;
+    for (unsigned i = 0; i < m_depth && iRet == PCO_NOERROR; i++)
+    {
+      buffers.push_back(m_pool->acquireImage<WORD>(m_imgWidth, m_imgHeight));
+      if (buffers.back() == nullptr)
+        iRet = PCO_ERROR_NOMEMORY;
+      else
+        freeBuffers.push(buffers.back());
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    auto reportTime = startTime;
+    DWORD reportDone = m_checkpoint.nextIndex;
+    std::atomic<bool> stop{ false };
+
+    //Transfer thread: copies the images in index order into the free buffers
+    std::thread copyThread([&]()
+      {
+        for (DWORD index = m_checkpoint.nextIndex; index < count && !stop && !m_abort; index++)
+        {
+          Slot slot;
+          if (!freeBuffers.pop(slot.frame.image))
+            break;
+          slot.frame.index = index;
+          slot.frame.imgWidth = m_imgWidth;
+          slot.frame.imgHeight = m_imgHeight;
+          slot.frame.metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+          const auto copyStart = std::chrono::steady_clock::now();
+          slot.error = PCO_RecorderCopyImage(m_hRec, m_hCam, index, 1, 1, m_imgWidth, m_imgHeight,
+            slot.frame.image, &slot.frame.imgNumber, &slot.frame.metadata, NULL);
+          m_stats.copySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - copyStart).count();
+          const bool failed = slot.error != PCO_NOERROR;
+          if (!copied.push(slot) || failed)
+            break;
+        }
+        copied.close();
+      });
+
+    Slot slot;
+    while (iRet == PCO_NOERROR && !m_abort && copied.pop(slot))
+    {
+      iRet = slot.error;
+      if (iRet == PCO_NOERROR && process)
+      {
+        const auto processStart = std::chrono::steady_clock::now();
+        iRet = process(slot.frame);
+        m_stats.processSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - processStart).count();
+      }
+      freeBuffers.push(slot.frame.image);
+      if (iRet != PCO_NOERROR)
+        break;
+
+      m_stats.frames++;
+      m_stats.bytes += imageBytes;
+      m_checkpoint.nextIndex = slot.frame.index + 1;
+      writeCheckpoint();
+
+      const auto now = std::chrono::steady_clock::now();
+      const bool last = m_checkpoint.nextIndex == count;
+      if (progress && (last || now - reportTime >= m_progressInterval))
+      {
+        CamRamProgress p;
+        p.done = m_checkpoint.nextIndex;
+        p.total = count;
+        const double windowSeconds = std::chrono::duration<double>(now - reportTime).count();
+        if (windowSeconds > 0.0)
+          p.megabytesPerSecond = (p.done - reportDone) * (double)imageBytes / windowSeconds / 1e6;
+        if (p.megabytesPerSecond > 0.0)
+          p.etaSeconds = (p.total - p.done) * (double)imageBytes / (p.megabytesPerSecond * 1e6);
+        progress(p);
+        reportTime = now;
+        reportDone = p.done;
+      }
+    }
+
+    //Wake up the transfer thread if it waits for a buffer or a free slot
+    stop = true;
+    freeBuffers.close();
+    while (copied.pop(slot))
+    {
+    }
+    copyThread.join();
+    m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    for (WORD* buffer : buffers)
+      m_pool->release(buffer);
+
+    if (m_checkpointFile != nullptr)
+      fclose(m_checkpointFile);
+    m_checkpointFile = nullptr;
+    m_complete = iRet == PCO_NOERROR && m_checkpoint.nextIndex == count;
+    if (m_complete)
+      remove(m_checkpointPath.c_str());
+    return iRet;
+  }
+
+  //True if there is a checkpoint of an interrupted readout of the images in the camera (with the same count)
+  //nextIndex() is the index the readout continues at
+  bool hasCheckpoint(DWORD count = 0)
+  {
+    return prepare(count) == PCO_NOERROR && m_checkpoint.nextIndex > 0;
+  }
+
+  //Removes the checkpoint file, call it when a new record overwrites the images in the camera
+  void discardCheckpoint()
+  {
+    remove(m_checkpointPath.c_str());
+    m_checkpoint.nextIndex = 0;
+  }
+
+  //Stops the readout after the image which is processed, can be called from any thread
+  //The checkpoint is kept, so the next run continues there
+  void abort()
+  {
+    m_abort = true;
+  }
+
+  //True if all requested images were read in the last run
+  bool complete() const
+  {
+    return m_complete;
+  }
+
+  //Index the next run starts at
+  DWORD nextIndex() const
+  {
+    return m_checkpoint.nextIndex;
+  }
+
+  void setProgressInterval(std::chrono::milliseconds interval)
+  {
+    m_progressInterval = interval;
+  }
+
+  const CamRamReadoutStats& stats() const
+  {
+    return m_stats;
+  }
+
+  void printStats() const
+  {
+    printf("CamRam readout: %u images (from index %u) in %.3f s, %.1f MB/s%s\n", (unsigned)m_stats.frames,
+      (unsigned)m_stats.resumedAt, m_stats.seconds, m_stats.megabytesPerSecond(),
+      m_complete ? "" : ", not complete");
+    const double frames = std::max<DWORD>(m_stats.frames, 1);
+    printf("Per image: copy %.2f ms, process %.2f ms, total %.2f ms\n", m_stats.copySeconds * 1000.0 / frames,
+      m_stats.processSeconds * 1000.0 / frames, m_stats.seconds * 1000.0 / frames);
+  }
+
+  static void printProgress(const CamRamProgress& progress)
+  {
+    printf("%u/%u images, %.1f MB/s, ETA %.1f s\n", (unsigned)progress.done, (unsigned)progress.total,
+      progress.megabytesPerSecond, progress.etaSeconds);
+  }
+
+private:
+  struct Slot
+  {
+    ReadoutFrame frame;
+    int error = PCO_NOERROR;
+  };
+
+  //Limits count to the recorded images and sets the checkpoint to the saved one if it belongs to this recording
+  int prepare(DWORD& count)
+  {
+    DWORD procImgCount = 0;
+    int iRet = PCO_RecorderGetStatus(m_hRec, m_hCam, NULL, NULL, NULL, &procImgCount,
+      NULL, NULL, NULL, NULL, NULL);
+    if (iRet == PCO_NOERROR)
+      iRet = PCO_RecorderGetSettings(m_hRec, m_hCam, NULL, NULL, NULL, &m_imgWidth, &m_imgHeight, NULL);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    if (count == 0 || count > procImgCount)
+      count = procImgCount;
+    memset(&m_checkpoint, 0, sizeof(m_checkpoint));
+    if (count == 0)
+      return PCO_NOERROR;
+
+    iRet = identify(count, m_checkpoint);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    CamRamCheckpoint saved;
+    if (readCheckpoint(saved) && sameRecording(saved, m_checkpoint) && saved.nextIndex < count)
+      m_checkpoint.nextIndex = saved.nextIndex;
+    return PCO_NOERROR;
+  }
+
+  //Everything that identifies the recording, nextIndex is 0
+  int identify(DWORD count, CamRamCheckpoint& checkpoint)
+  {
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    memcpy(checkpoint.magic, "PCOCRAM", 8);
+    checkpoint.version = 2;
+    checkpoint.ramSegment = m_ramSegment;
+    checkpoint.imgWidth = m_imgWidth;
+    checkpoint.imgHeight = m_imgHeight;
+    checkpoint.imgCount = count;
+
+    PCO_CameraType camType;
+    memset(&camType, 0, sizeof(camType));
+    camType.wSize = sizeof(PCO_CameraType);
+    int iRet = PCO_GetCameraType(m_hCam, &camType);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    checkpoint.serialNumber = camType.dwSerialNumber;
+
+    iRet = identifyImage(0, checkpoint.firstImgNumber, checkpoint.firstImgTime);
+    if (iRet == PCO_NOERROR)
+      iRet = identifyImage(count - 1, checkpoint.lastImgNumber, checkpoint.lastImgTime);
+    return iRet;
+  }
+
+  //Image number and time stamp from the metadata, a single pixel is enough to get them
+  int identifyImage(DWORD index, DWORD& imgNumber, BYTE time[9])
+  {
+    WORD pixel = 0;
+    PCO_METADATA_STRUCT metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    int iRet = PCO_RecorderCopyImage(m_hRec, m_hCam, index, 1, 1, 1, 1, &pixel, &imgNumber, &metadata, NULL);
+    const BYTE stamp[9] = { metadata.bIMAGE_TIME_US_BCD[0], metadata.bIMAGE_TIME_US_BCD[1],
+      metadata.bIMAGE_TIME_US_BCD[2], metadata.bIMAGE_TIME_SEC_BCD, metadata.bIMAGE_TIME_MIN_BCD,
+      metadata.bIMAGE_TIME_HOUR_BCD, metadata.bIMAGE_TIME_DAY_BCD, metadata.bIMAGE_TIME_MON_BCD,
+      metadata.bIMAGE_TIME_YEAR_BCD };
+    memcpy(time, stamp, sizeof(stamp));
+    return iRet;
+  }
+
+  static bool sameRecording(const CamRamCheckpoint& a, const CamRamCheckpoint& b)
+  {
+    return memcmp(a.magic, b.magic, sizeof(a.magic)) == 0 && a.version == b.version &&
+      a.serialNumber == b.serialNumber && a.ramSegment == b.ramSegment && a.imgWidth == b.imgWidth &&
+      a.imgHeight == b.imgHeight && a.imgCount == b.imgCount && a.firstImgNumber == b.firstImgNumber &&
+      a.lastImgNumber == b.lastImgNumber && memcmp(a.firstImgTime, b.firstImgTime, sizeof(a.firstImgTime)) == 0 &&
+      memcmp(a.lastImgTime, b.lastImgTime, sizeof(a.lastImgTime)) == 0;
+  }
+
+  bool readCheckpoint(CamRamCheckpoint& checkpoint) const
+  {
+    FILE* file = fopen(m_checkpointPath.c_str(), "rb");
+    if (file == nullptr)
+      return false;
+    const bool ok = fread(&checkpoint, sizeof(checkpoint), 1, file) == 1;
+    fclose(file);
+    return ok;
+  }
+
+  //Overwrites the record in place and hands it to the OS, so it survives if the process is killed
+  void writeCheckpoint()
+  {
+    if (m_checkpointFile == nullptr)
+      return;
+    fseek(m_checkpointFile, 0, SEEK_SET);
+    fwrite(&m_checkpoint, sizeof(m_checkpoint), 1, m_checkpointFile);
+    fflush(m_checkpointFile);
+  }
+
+  HANDLE m_hRec;
+  HANDLE m_hCam;
+  WORD m_ramSegment;
+  std::string m_checkpointPath;
+  unsigned m_depth;
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  WORD m_imgWidth = 0;
+  WORD m_imgHeight = 0;
+  CamRamCheckpoint m_checkpoint = {};
+  FILE* m_checkpointFile = nullptr;
+  std::atomic<bool> m_abort{ false };
+  bool m_complete = false;
+  std::chrono::milliseconds m_progressInterval{ 500 };
+  CamRamReadoutStats m_stats;
+};
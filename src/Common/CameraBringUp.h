@@ -0,0 +1,155 @@
+#pragma once
+
+// Parallel bring-up of all connected cameras
+// Opening a camera (with a scan of all interfaces), resetting it to default,
+// applying the settings and arming it can take seconds per camera. Done one
+// camera after the other, the startup time of a rig grows with the camera
+// count. bringUpCameras() runs these steps on several threads: every thread
+// opens the next camera which is not open yet, configures and arms it, and
+// continues with the next one until no further camera is found. It returns
+// when all threads are done, so all cameras are armed at that point and the
+// startup takes about as long as the slowest camera (as long as there are at
+// least as many threads as cameras).
+
+#include "PcoSdk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct BringUpTiming
+{
+  HANDLE hCam = NULL;
+  DWORD serialNumber = 0;
+  unsigned thread = 0;                               //Thread which brought up the camera
+  double openMs = 0.0;
+  double resetMs = 0.0;                              //Recording off and reset to default
+  double configureMs = 0.0;
+  double armMs = 0.0;
+  int error = PCO_NOERROR;
+
+  double totalMs() const
+  {
+    return openMs + resetMs + configureMs + armMs;
+  }
+};
+
+struct CameraBringUp
+{
+  std::vector<BringUpTiming> cameras;                //In the order the cameras were opened
+  unsigned threads = 0;
+  double seconds = 0.0;                              //Until all cameras were armed
+};
+
+//Applies the settings to one camera, is called concurrently for different cameras
+using CameraConfigureCallback = std::function<int(HANDLE hCam)>;
+
+// Opens, configures and arms all cameras which are found, with threadCount cameras at a time
+// The handles are appended to hCams in the order the cameras were opened (also on error, so
+// they can be closed). Returns the first error of configure or arm (or PCO_NOERROR).
+inline int bringUpCameras(std::vector<HANDLE>& hCams, const CameraConfigureCallback& configure,
+  CameraBringUp* report = nullptr, unsigned threadCount = 16)
+{
+  threadCount = std::max(threadCount, 1u);
+  std::mutex mutex;
+  std::vector<BringUpTiming> timings;
+  int error = PCO_NOERROR;
+  const auto startTime = std::chrono::steady_clock::now();
+
+  auto bringUp = [&](unsigned thread)
+    {
+      auto lap = std::chrono::steady_clock::now();
+      auto elapsedMs = [&lap]()
+        {
+          const auto now = std::chrono::steady_clock::now();
+          const double ms = std::chrono::duration<double, std::milli>(now - lap).count();
+          lap = now;
+          return ms;
+        };
+
+      while (true)
+      {
+        BringUpTiming timing;
+        timing.thread = thread;
+        lap = std::chrono::steady_clock::now();
+
+        //Open the next camera, the scan of all interfaces only finds cameras which are not open yet
+        PCO_OpenStruct camstruct;
+        memset(&camstruct, 0, sizeof(camstruct));
+        camstruct.wSize = sizeof(PCO_OpenStruct);
+        camstruct.wInterfaceType = 0xFFFF;
+        if (PCO_OpenCameraEx(&timing.hCam, &camstruct) != PCO_NOERROR)
+          break;
+        timing.openMs = elapsedMs();
+
+        PCO_CameraType camType;
+        camType.wSize = sizeof(PCO_CameraType);
+        if (PCO_GetCameraType(timing.hCam, &camType) == PCO_NOERROR)
+          timing.serialNumber = camType.dwSerialNumber;
+
+        //Make sure recording is off and reset to default
+        timing.error = PCO_SetRecordingState(timing.hCam, 0);
+        if (timing.error == PCO_NOERROR)
+          timing.error = PCO_ResetSettingsToDefault(timing.hCam);
+        timing.resetMs = elapsedMs();
+
+        if (timing.error == PCO_NOERROR && configure)
+          timing.error = configure(timing.hCam);
+        timing.configureMs = elapsedMs();
+
+        //Arm camera after all settings are done
+        if (timing.error == PCO_NOERROR)
+          timing.error = PCO_ArmCamera(timing.hCam);
+        timing.armMs = elapsedMs();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        hCams.push_back(timing.hCam);
+        timings.push_back(timing);
+        if (error == PCO_NOERROR)
+          error = timing.error;
+      }
+    };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < threadCount; t++)
+    threads.emplace_back(bringUp, t);
+  //Barrier: every camera is armed (or failed) after this
+  for (auto& t : threads)
+    t.join();
+
+  if (report != nullptr)
+  {
+    report->cameras = timings;
+    report->threads = threadCount;
+    report->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  }
+  return error;
+}
+
+inline void printBringUp(const CameraBringUp& report)
+{
+  std::vector<BringUpTiming> cameras = report.cameras;
+  std::sort(cameras.begin(), cameras.end(),
+    [](const BringUpTiming& a, const BringUpTiming& b) { return a.serialNumber < b.serialNumber; });
+
+  double sumMs = 0.0, slowestMs = 0.0;
+  printf("%-12s%8s%10s%10s%12s%10s%10s\n", "Serial", "thread", "open ms", "reset ms", "config ms",
+    "arm ms", "total ms");
+  for (const BringUpTiming& c : cameras)
+  {
+    printf("%-12u%8u%10.1f%10.1f%12.1f%10.1f%10.1f", (unsigned)c.serialNumber, c.thread, c.openMs,
+      c.resetMs, c.configureMs, c.armMs, c.totalMs());
+    if (c.error != PCO_NOERROR)
+      printf("  error %x", (unsigned)c.error);
+    printf("\n");
+    sumMs += c.totalMs();
+    slowestMs = std::max(slowestMs, c.totalMs());
+  }
+  printf("%u cameras ready after %.1f ms with %u threads (slowest camera %.1f ms, one after another %.1f ms)\n",
+    (unsigned)cameras.size(), report.seconds * 1000.0, report.threads, slowestMs, sumMs);
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+// On-disk cache of camera descriptors, keyed by serial number
+// Before a converter can be created, the samples read the camera type, the
+// description and the color correction matrix. Every query is a round trip over
+// the camera link. The cache keeps these values in a file, so on a warm start
+// only PCO_GetCameraType is queried: it gives the serial number and the
+// hardware and firmware versions, and the cached entry is only used if all of
+// them still match.
+// Only properties of the camera are cached. Settings like ROI and bit alignment
+// can change between runs and have to be read (or taken from what was set).
+
+#include "PcoSdk.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+struct CameraDescriptor
+{
+  PCO_CameraType type = {};
+  PCO_Description description = {};
+  double ccm[9] = {};
+};
+
+// Reads all descriptor values from the camera, the camera type only if knownType is not given
+inline int queryCameraDescriptor(HANDLE hCam, CameraDescriptor& desc, const PCO_CameraType* knownType = nullptr)
+{
+  int iRet = PCO_NOERROR;
+  if (knownType != nullptr)
+    desc.type = *knownType;
+  else
+  {
+    memset(&desc.type, 0, sizeof(desc.type));
+    desc.type.wSize = sizeof(PCO_CameraType);
+    iRet = PCO_GetCameraType(hCam, &desc.type);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+  }
+  memset(&desc.description, 0, sizeof(desc.description));
+  desc.description.wSize = sizeof(PCO_Description);
+  iRet = PCO_GetCameraDescription(hCam, &desc.description);
+  if (iRet == PCO_NOERROR)
+    iRet = PCO_GetColorCorrectionMatrix(hCam, desc.ccm);
+  return iRet;
+}
+
+class CameraDescriptorCache
+{
+public:
+  explicit CameraDescriptorCache(const std::string& path = "pco_camera_cache.bin")
+    : m_path(path)
+  {
+  }
+
+  //Reads the cache file, a missing or invalid file gives an empty cache and PCO_ERROR_NOFILE
+  int load()
+  {
+    m_entries.clear();
+    FILE* file = fopen(m_path.c_str(), "rb");
+    if (file == nullptr)
+      return PCO_ERROR_NOFILE;
+
+    FileHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && isCompatible(header);
+    for (uint32_t i = 0; valid && i < header.count; i++)
+    {
+      CameraDescriptor desc;
+      valid = fread(&desc, sizeof(desc), 1, file) == 1;
+      if (valid)
+        m_entries[desc.type.dwSerialNumber] = desc;
+    }
+    fclose(file);
+    if (!valid)
+    {
+      m_entries.clear();
+      return PCO_ERROR_NOFILE;
+    }
+    return PCO_NOERROR;
+  }
+
+  int save() const
+  {
+    FILE* file = fopen(m_path.c_str(), "wb");
+    if (file == nullptr)
+      return PCO_ERROR_NOFILE;
+    FileHeader header = makeHeader();
+    header.count = (uint32_t)m_entries.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const auto& entry : m_entries)
+      ok = ok && fwrite(&entry.second, sizeof(CameraDescriptor), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    return ok ? PCO_NOERROR : PCO_ERROR_DISKFULL;
+  }
+
+  //Gets the descriptor of the camera, from the cache if the entry is still valid,
+  //otherwise it is read from the camera, added to the cache and the file is saved
+  //hit is set to true if the cached entry was used
+  int get(HANDLE hCam, CameraDescriptor& desc, bool* hit = nullptr)
+  {
+    if (hit != nullptr)
+      *hit = false;
+
+    //The cheap check: serial number and versions of the connected camera
+    PCO_CameraType type;
+    memset(&type, 0, sizeof(type));
+    type.wSize = sizeof(PCO_CameraType);
+    int iRet = PCO_GetCameraType(hCam, &type);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+
+    auto entry = m_entries.find(type.dwSerialNumber);
+    if (entry != m_entries.end() && matches(entry->second.type, type))
+    {
+      desc = entry->second;
+      if (hit != nullptr)
+        *hit = true;
+      return PCO_NOERROR;
+    }
+
+    iRet = queryCameraDescriptor(hCam, desc, &type);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    m_entries[desc.type.dwSerialNumber] = desc;
+    //The cache is only an optimization, a file which can not be written is no error
+    save();
+    return PCO_NOERROR;
+  }
+
+  //Removes the entry of the camera, e.g. after a firmware update that kept the version
+  void invalidate(DWORD serialNumber)
+  {
+    m_entries.erase(serialNumber);
+  }
+
+  size_t size() const
+  {
+    return m_entries.size();
+  }
+
+private:
+  struct FileHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t descriptorSize;                         //Guards against different SDK structure layouts
+    uint32_t typeSize;
+    uint32_t descriptionSize;
+    uint32_t count;
+  };
+
+  static FileHeader makeHeader()
+  {
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PCODESC", 8);
+    header.version = 2;
+    header.descriptorSize = sizeof(CameraDescriptor);
+    header.typeSize = sizeof(PCO_CameraType);
+    header.descriptionSize = sizeof(PCO_Description);
+    return header;
+  }
+
+  static bool isCompatible(const FileHeader& header)
+  {
+    const FileHeader expected = makeHeader();
+    return memcmp(header.magic, expected.magic, sizeof(expected.magic)) == 0 &&
+      header.version == expected.version && header.descriptorSize == expected.descriptorSize &&
+      header.typeSize == expected.typeSize && header.descriptionSize == expected.descriptionSize;
+  }
+
+  static bool matches(const PCO_CameraType& cached, const PCO_CameraType& current)
+  {
+    return cached.dwSerialNumber == current.dwSerialNumber && cached.wCamType == current.wCamType &&
+      cached.wCamSubType == current.wCamSubType && cached.dwHWVersion == current.dwHWVersion &&
+      cached.dwFWVersion == current.dwFWVersion && cached.wInterfaceType == current.wInterfaceType;
+  }
+
+  std::string m_path;
+  std::map<DWORD, CameraDescriptor> m_entries;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+// Run time selection of the instruction set for the vectorized helpers
+// The kernels are compiled for SSE4.1 and AVX2 with function attributes, so the
+// samples need no special compiler flags, and bestCpuIsa() checks once what the
+// CPU supports. Every helper with SIMD paths takes a CpuIsa and falls back to
+// the best available one, so a lower one can be requested e.g. for benchmarks.
+// On other architectures only the scalar paths are built.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PCO_CPU_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PCO_TARGET_SSE41
+#define PCO_TARGET_AVX2
+#else
+#define PCO_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define PCO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+enum class CpuIsa
+{
+  Scalar,
+  SSE41,
+  AVX2
+};
+
+inline const char* cpuIsaName(CpuIsa isa)
+{
+  switch (isa)
+  {
+  case CpuIsa::SSE41:
+    return "SSE4.1";
+  case CpuIsa::AVX2:
+    return "AVX2";
+  default:
+    return "Scalar";
+  }
+}
+
+// Best instruction set supported by the CPU
+inline CpuIsa bestCpuIsa()
+{
+#ifdef PCO_CPU_X86
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  const int maxLeaf = info[0];
+  __cpuid(info, 1);
+  const bool sse41 = (info[2] & (1 << 19)) != 0;
+  //AVX needs the OS to save the ymm registers
+  const bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+  bool avx2 = false;
+  if (avx && maxLeaf >= 7)
+  {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  const bool sse41 = __builtin_cpu_supports("sse4.1");
+  const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+  if (avx2)
+    return CpuIsa::AVX2;
+  if (sse41)
+    return CpuIsa::SSE41;
+#endif
+  return CpuIsa::Scalar;
+}
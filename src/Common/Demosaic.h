@@ -0,0 +1,410 @@
+#pragma once
+
+// Bayer demosaic of 16 bit raw images to 8 bit BGR / RGB
+// Alternative to PCO_Convert16TOCOL which can be vectorized and parallelized.
+// Two interpolations are available:
+//  - Bilinear: average of the nearest pixels of the missing color
+//  - EdgeAware: like bilinear, but green at red and blue pixels is taken from
+//    the direction (horizontal or vertical) with the smaller gradient
+// After interpolation the dark offset is removed, the color correction matrix
+// is applied and the range [darkOffset, whiteLevel] is scaled to 8 bit.
+//
+// There is a scalar reference path and SSE4.1 / AVX2 paths, which are selected
+// at run time. The interpolation results of all paths are identical, the final
+// 8 bit values may differ by one because of float rounding.
+// Rows can be converted independently, so a frame can be split between threads.
+
+#include "PcoSdk.h"
+#include "CpuDispatch.h"
+
+#include <pco_convstructures.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+enum class DemosaicAlgorithm
+{
+  Bilinear,
+  EdgeAware
+};
+
+struct DemosaicSettings
+{
+  int colorMode = 0;                                 //See getColorMode() in ColorConvertExample
+  int dataBits = 16;
+  bool upperAligned = false;                         //Data is MSB aligned (BIT_ALIGNMENT_MSB)
+  int darkOffset = 0;
+  int whiteLevel = 0;                                //0: (1 << dataBits) - 1
+  float ccm[9] = { 1.0f, 0.0f, 0.0f,                 //Row major, applied to (r, g, b)
+                   0.0f, 1.0f, 0.0f,
+                   0.0f, 0.0f, 1.0f };
+  DemosaicAlgorithm algorithm = DemosaicAlgorithm::Bilinear;
+  bool bgr = true;                                   //false: RGB
+  bool flip = false;                                 //Bottom up, like CONVERT_MODE_OUT_FLIPIMAGE
+};
+
+// Settings from the PCO_SensorInfo which is used for PCO_ConvertCreate
+inline DemosaicSettings makeDemosaicSettings(const PCO_SensorInfo& sensor, int colorMode)
+{
+  DemosaicSettings settings;
+  settings.colorMode = colorMode;
+  settings.dataBits = sensor.iDataBits;
+  settings.upperAligned = (sensor.iSensorInfoBits & CONVERT_SENSOR_UPPERALIGNED) != 0;
+  settings.darkOffset = sensor.iDarkOffset;
+  const SRGBCOLCORRCOEFF& cc = sensor.strColorCoeff;
+  const double ccm[9] = { cc.da11, cc.da12, cc.da13, cc.da21, cc.da22, cc.da23, cc.da31, cc.da32, cc.da33 };
+  for (int i = 0; i < 9; i++)
+    settings.ccm[i] = (float)ccm[i];
+  return settings;
+}
+
+class Demosaic
+{
+public:
+  explicit Demosaic(const DemosaicSettings& settings, CpuIsa isa = bestCpuIsa())
+    : m_settings(settings), m_isa(std::min(isa, bestCpuIsa()))
+  {
+    m_redX = (settings.colorMode & 0x01) ? 0 : 1;
+    m_redY = (settings.colorMode & 0x02) ? 0 : 1;
+    m_shift = settings.upperAligned ? std::max(16 - settings.dataBits, 0) : 0;
+    const int whiteLevel = settings.whiteLevel > 0 ? settings.whiteLevel : (1 << settings.dataBits) - 1;
+    const float scale = 255.0f / (float)std::max(whiteLevel - settings.darkOffset, 1);
+    for (int i = 0; i < 9; i++)
+      m_matrix[i] = settings.ccm[i] * scale;
+  }
+
+  CpuIsa isa() const
+  {
+    return m_isa;
+  }
+
+  //out has to hold width * height * 3 bytes
+  int convert(const WORD* raw, int width, int height, BYTE* out) const
+  {
+    return convertRows(raw, width, height, out, 0, height);
+  }
+
+  //Converts the output rows [firstRow, firstRow + rowCount), can be called from several threads
+  int convertRows(const WORD* raw, int width, int height, BYTE* out, int firstRow, int rowCount) const
+  {
+    if (raw == nullptr || out == nullptr || width < 2 || height < 2 ||
+      firstRow < 0 || rowCount < 0 || firstRow + rowCount > height)
+      return PCO_ERROR_WRONGVALUE;
+
+    //Room for the mirrored border pixels and reads past the end of the row
+    const size_t rowLength = (size_t)width + 2 + VectorPixels;
+    Scratch& scratch = scratchBuffers();
+    scratch.rows.assign(rowLength * 3, 0);
+    scratch.planes.assign(((size_t)width + VectorPixels) * 6, 0);
+    WORD* ring[3] = { &scratch.rows[0], &scratch.rows[rowLength], &scratch.rows[rowLength * 2] };
+    int ringRow[3] = { -2, -2, -2 };
+
+    for (int y = firstRow; y < firstRow + rowCount; y++)
+    {
+      //Prepared rows y - 1, y, y + 1, each source row is prepared once
+      const WORD* rows[3];
+      for (int i = 0; i < 3; i++)
+      {
+        const int src = mirror(y - 1 + i, height);
+        int slot = src % 3;
+        if (ringRow[slot] != src)
+        {
+          prepareRow(raw + (size_t)src * width, width, ring[slot]);
+          ringRow[slot] = src;
+        }
+        rows[i] = ring[slot];
+      }
+      convertRow(rows, width, y, out + (size_t)(m_settings.flip ? height - 1 - y : y) * width * 3, scratch);
+    }
+    return PCO_NOERROR;
+  }
+
+private:
+  static const int VectorPixels = 16;
+
+  struct Scratch
+  {
+    std::vector<WORD> rows;
+    std::vector<WORD> planes;
+  };
+
+  //Per thread buffers, so convertRows does not allocate once they are large enough
+  static Scratch& scratchBuffers()
+  {
+    static thread_local Scratch scratch;
+    return scratch;
+  }
+
+  //Reflects the index at the border, so neighbours keep the Bayer color
+  static int mirror(int i, int size)
+  {
+    if (i < 0)
+      return 1;
+    if (i >= size)
+      return size - 2;
+    return i;
+  }
+
+  //LSB aligns the data and removes the dark offset, pixel x is stored at dst[x + 1]
+  void prepareRow(const WORD* src, int width, WORD* dst) const
+  {
+    const int shift = m_shift;
+    const int dark = m_settings.darkOffset;
+    for (int x = 0; x < width; x++)
+    {
+      int value = (src[x] >> shift) - dark;
+      dst[x + 1] = (WORD)(value > 0 ? value : 0);
+    }
+    dst[0] = dst[2];
+    dst[width + 1] = dst[width - 1];
+  }
+
+  static WORD avg(WORD a, WORD b)
+  {
+    return (WORD)((a + b + 1) >> 1);
+  }
+
+  void convertRow(const WORD* rows[3], int width, int y, BYTE* dst, Scratch& scratch) const
+  {
+    const size_t planeLength = (size_t)width + VectorPixels;
+    WORD* rowColor = &scratch.planes[0];             //Red on red rows, blue on blue rows
+    WORD* green = &scratch.planes[planeLength];
+    WORD* otherColor = &scratch.planes[planeLength * 2];
+    BYTE* out8 = reinterpret_cast<BYTE*>(&scratch.planes[planeLength * 3]);
+
+    const bool redRow = (y & 1) == m_redY;
+    //Column of the red or blue pixel in this row, blue is diagonal to red
+    const int colorX = redRow ? m_redX : 1 - m_redX;
+    const bool edgeAware = m_settings.algorithm == DemosaicAlgorithm::EdgeAware;
+    switch (m_isa)
+    {
+#ifdef PCO_CPU_X86
+    case CpuIsa::AVX2:
+      interpolateAvx2(rows, width, colorX, edgeAware, rowColor, green, otherColor);
+      break;
+    case CpuIsa::SSE41:
+      interpolateSse41(rows, width, colorX, edgeAware, rowColor, green, otherColor);
+      break;
+#endif
+    default:
+      interpolateScalar(rows, width, colorX, edgeAware, rowColor, green, otherColor);
+      break;
+    }
+
+    const WORD* r = redRow ? rowColor : otherColor;
+    const WORD* b = redRow ? otherColor : rowColor;
+    BYTE* r8 = out8;
+    BYTE* g8 = out8 + planeLength;
+    BYTE* b8 = out8 + planeLength * 2;
+    switch (m_isa)
+    {
+#ifdef PCO_CPU_X86
+    case CpuIsa::AVX2:
+      colorAvx2(r, green, b, width, r8, g8, b8);
+      break;
+    case CpuIsa::SSE41:
+      colorSse41(r, green, b, width, r8, g8, b8);
+      break;
+#endif
+    default:
+      colorScalar(r, green, b, width, r8, g8, b8);
+      break;
+    }
+
+    const BYTE* first = m_settings.bgr ? b8 : r8;
+    const BYTE* last = m_settings.bgr ? r8 : b8;
+    for (int x = 0; x < width; x++)
+    {
+      dst[x * 3 + 0] = first[x];
+      dst[x * 3 + 1] = g8[x];
+      dst[x * 3 + 2] = last[x];
+    }
+  }
+
+  static void interpolateScalar(const WORD* rows[3], int width, int colorX, bool edgeAware,
+    WORD* rowColor, WORD* green, WORD* otherColor)
+  {
+    const WORD* up = rows[0] + 1;
+    const WORD* cur = rows[1] + 1;
+    const WORD* down = rows[2] + 1;
+    for (int x = 0; x < width; x++)
+    {
+      const WORD h = avg(cur[x - 1], cur[x + 1]);
+      const WORD v = avg(up[x], down[x]);
+      if ((x & 1) != colorX)
+      {
+        rowColor[x] = h;
+        green[x] = cur[x];
+        otherColor[x] = v;
+        continue;
+      }
+      WORD g = avg(h, v);
+      if (edgeAware)
+      {
+        const int gradH = std::abs(cur[x - 1] - cur[x + 1]);
+        const int gradV = std::abs(up[x] - down[x]);
+        if (gradH < gradV)
+          g = h;
+        else if (gradV < gradH)
+          g = v;
+      }
+      rowColor[x] = cur[x];
+      green[x] = g;
+      otherColor[x] = avg(avg(up[x - 1], up[x + 1]), avg(down[x - 1], down[x + 1]));
+    }
+  }
+
+  static BYTE toByte(float value)
+  {
+    const long i = std::lrint(value);
+    return (BYTE)(i < 0 ? 0 : (i > 255 ? 255 : i));
+  }
+
+  void colorScalar(const WORD* r, const WORD* g, const WORD* b, int width,
+    BYTE* r8, BYTE* g8, BYTE* b8) const
+  {
+    const float* m = m_matrix;
+    for (int x = 0; x < width; x++)
+    {
+      const float rf = r[x], gf = g[x], bf = b[x];
+      r8[x] = toByte(m[0] * rf + m[1] * gf + m[2] * bf);
+      g8[x] = toByte(m[3] * rf + m[4] * gf + m[5] * bf);
+      b8[x] = toByte(m[6] * rf + m[7] * gf + m[8] * bf);
+    }
+  }
+
+#ifdef PCO_CPU_X86
+  PCO_TARGET_SSE41 static void interpolateSse41(const WORD* rows[3], int width, int colorX, bool edgeAware,
+    WORD* rowColor, WORD* green, WORD* otherColor)
+  {
+    const WORD* up = rows[0];
+    const WORD* cur = rows[1];
+    const WORD* down = rows[2];
+    //Lanes of the red or blue pixels
+    const __m128i isColor = colorX ? _mm_set1_epi32((int)0xFFFF0000) : _mm_set1_epi32(0x0000FFFF);
+    for (int x = 0; x < width; x += 8)
+    {
+      const __m128i c = _mm_loadu_si128((const __m128i*)(cur + x + 1));
+      const __m128i l = _mm_loadu_si128((const __m128i*)(cur + x));
+      const __m128i r = _mm_loadu_si128((const __m128i*)(cur + x + 2));
+      const __m128i u = _mm_loadu_si128((const __m128i*)(up + x + 1));
+      const __m128i d = _mm_loadu_si128((const __m128i*)(down + x + 1));
+      const __m128i diag = _mm_avg_epu16(
+        _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(up + x)), _mm_loadu_si128((const __m128i*)(up + x + 2))),
+        _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(down + x)), _mm_loadu_si128((const __m128i*)(down + x + 2))));
+      const __m128i h = _mm_avg_epu16(l, r);
+      const __m128i v = _mm_avg_epu16(u, d);
+      __m128i g = _mm_avg_epu16(h, v);
+      if (edgeAware)
+      {
+        const __m128i gradH = _mm_or_si128(_mm_subs_epu16(l, r), _mm_subs_epu16(r, l));
+        const __m128i gradV = _mm_or_si128(_mm_subs_epu16(u, d), _mm_subs_epu16(d, u));
+        const __m128i minGrad = _mm_min_epu16(gradH, gradV);
+        const __m128i equal = _mm_cmpeq_epi16(gradH, gradV);
+        g = _mm_blendv_epi8(g, h, _mm_andnot_si128(equal, _mm_cmpeq_epi16(minGrad, gradH)));
+        g = _mm_blendv_epi8(g, v, _mm_andnot_si128(equal, _mm_cmpeq_epi16(minGrad, gradV)));
+      }
+      _mm_storeu_si128((__m128i*)(rowColor + x), _mm_blendv_epi8(h, c, isColor));
+      _mm_storeu_si128((__m128i*)(green + x), _mm_blendv_epi8(c, g, isColor));
+      _mm_storeu_si128((__m128i*)(otherColor + x), _mm_blendv_epi8(v, diag, isColor));
+    }
+  }
+
+  PCO_TARGET_SSE41 void colorSse41(const WORD* r, const WORD* g, const WORD* b, int width,
+    BYTE* r8, BYTE* g8, BYTE* b8) const
+  {
+    __m128 m[9];
+    for (int i = 0; i < 9; i++)
+      m[i] = _mm_set1_ps(m_matrix[i]);
+    for (int x = 0; x < width; x += 8)
+    {
+      __m128i channel[3];
+      for (int half = 0; half < 2; half++)
+      {
+        const int offset = x + half * 4;
+        const __m128 rf = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(r + offset))));
+        const __m128 gf = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(g + offset))));
+        const __m128 bf = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(b + offset))));
+        for (int c = 0; c < 3; c++)
+        {
+          const __m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[c * 3], rf), _mm_mul_ps(m[c * 3 + 1], gf)),
+            _mm_mul_ps(m[c * 3 + 2], bf));
+          const __m128i i32 = _mm_cvtps_epi32(value);
+          channel[c] = half ? _mm_packs_epi32(channel[c], i32) : i32;
+        }
+      }
+      //Saturating pack clamps to [0, 255]
+      _mm_storel_epi64((__m128i*)(r8 + x), _mm_packus_epi16(channel[0], channel[0]));
+      _mm_storel_epi64((__m128i*)(g8 + x), _mm_packus_epi16(channel[1], channel[1]));
+      _mm_storel_epi64((__m128i*)(b8 + x), _mm_packus_epi16(channel[2], channel[2]));
+    }
+  }
+
+  PCO_TARGET_AVX2 static void interpolateAvx2(const WORD* rows[3], int width, int colorX, bool edgeAware,
+    WORD* rowColor, WORD* green, WORD* otherColor)
+  {
+    const WORD* up = rows[0];
+    const WORD* cur = rows[1];
+    const WORD* down = rows[2];
+    const __m256i isColor = colorX ? _mm256_set1_epi32((int)0xFFFF0000) : _mm256_set1_epi32(0x0000FFFF);
+    for (int x = 0; x < width; x += 16)
+    {
+      const __m256i c = _mm256_loadu_si256((const __m256i*)(cur + x + 1));
+      const __m256i l = _mm256_loadu_si256((const __m256i*)(cur + x));
+      const __m256i r = _mm256_loadu_si256((const __m256i*)(cur + x + 2));
+      const __m256i u = _mm256_loadu_si256((const __m256i*)(up + x + 1));
+      const __m256i d = _mm256_loadu_si256((const __m256i*)(down + x + 1));
+      const __m256i diag = _mm256_avg_epu16(
+        _mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(up + x)), _mm256_loadu_si256((const __m256i*)(up + x + 2))),
+        _mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(down + x)), _mm256_loadu_si256((const __m256i*)(down + x + 2))));
+      const __m256i h = _mm256_avg_epu16(l, r);
+      const __m256i v = _mm256_avg_epu16(u, d);
+      __m256i g = _mm256_avg_epu16(h, v);
+      if (edgeAware)
+      {
+        const __m256i gradH = _mm256_or_si256(_mm256_subs_epu16(l, r), _mm256_subs_epu16(r, l));
+        const __m256i gradV = _mm256_or_si256(_mm256_subs_epu16(u, d), _mm256_subs_epu16(d, u));
+        const __m256i minGrad = _mm256_min_epu16(gradH, gradV);
+        const __m256i equal = _mm256_cmpeq_epi16(gradH, gradV);
+        g = _mm256_blendv_epi8(g, h, _mm256_andnot_si256(equal, _mm256_cmpeq_epi16(minGrad, gradH)));
+        g = _mm256_blendv_epi8(g, v, _mm256_andnot_si256(equal, _mm256_cmpeq_epi16(minGrad, gradV)));
+      }
+      _mm256_storeu_si256((__m256i*)(rowColor + x), _mm256_blendv_epi8(h, c, isColor));
+      _mm256_storeu_si256((__m256i*)(green + x), _mm256_blendv_epi8(c, g, isColor));
+      _mm256_storeu_si256((__m256i*)(otherColor + x), _mm256_blendv_epi8(v, diag, isColor));
+    }
+  }
+
+  PCO_TARGET_AVX2 void colorAvx2(const WORD* r, const WORD* g, const WORD* b, int width,
+    BYTE* r8, BYTE* g8, BYTE* b8) const
+  {
+    __m256 m[9];
+    for (int i = 0; i < 9; i++)
+      m[i] = _mm256_set1_ps(m_matrix[i]);
+    for (int x = 0; x < width; x += 8)
+    {
+      const __m256 rf = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(r + x))));
+      const __m256 gf = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(g + x))));
+      const __m256 bf = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(b + x))));
+      BYTE* dst[3] = { r8, g8, b8 };
+      for (int c = 0; c < 3; c++)
+      {
+        const __m256 value = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[c * 3], rf), _mm256_mul_ps(m[c * 3 + 1], gf)),
+          _mm256_mul_ps(m[c * 3 + 2], bf));
+        const __m256i i32 = _mm256_cvtps_epi32(value);
+        //Saturating packs clamp to [0, 255]
+        const __m128i i16 = _mm_packs_epi32(_mm256_castsi256_si128(i32), _mm256_extracti128_si256(i32, 1));
+        _mm_storel_epi64((__m128i*)(dst[c] + x), _mm_packus_epi16(i16, i16));
+      }
+    }
+  }
+#endif
+
+  DemosaicSettings m_settings;
+  CpuIsa m_isa;
+  int m_redX = 0;
+  int m_redY = 0;
+  int m_shift = 0;
+  float m_matrix[9];
+};
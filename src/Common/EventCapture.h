@@ -0,0 +1,338 @@
+#pragma once
+
+// Event capture with a PCO_RECORDER_MEMORY_RINGBUF recording
+// The ring buffer always holds the latest images, the recording runs for as
+// long as needed. When an event occurs (trigger() from any thread, or
+// triggerAt() with the image number of an external event), the pre-event images
+// up to the event and the post-event images after it are copied into a clip,
+// while the recording continues. So memory and disk use depend on the number of
+// events, not on the length of the session.
+//
+// The clips are built on a capture thread: the pre-event images are copied at
+// once, oldest first (they are overwritten first), the post-event images as
+// soon as they are recorded. The ring buffer needs to hold the pre-event images
+// plus the images recorded while they are copied, images which were overwritten
+// before they could be copied are counted as lost. Events are handled one after
+// the other, overlapping clips get their own copy of the shared images.
+//
+// Images are looked up by image number: a copy of a single pixel gives the
+// image number at an index, the full image is only copied at the index where
+// the image number matches. The index is first guessed from the last probe,
+// assuming consecutive images at consecutive indices. If a few guesses miss,
+// every index of the ring is probed once, so an other arrangement of the images
+// in the ring only costs time.
+
+#include "PcoSdk.h"
+#include "FifoConsumer.h"
+#include "ImageBufferPool.h"
+#include "ParallelReadout.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct EventClip
+{
+  DWORD event = 0;                                   //Events are numbered from 1
+  DWORD eventImgNumber = 0;                          //Latest image when the event occurred
+  std::vector<ReadoutFrame> frames;                  //Ordered by image number, buffers from the pool
+  DWORD lost = 0;                                    //Overwritten before they could be copied
+};
+
+struct EventCaptureStats
+{
+  DWORD events = 0;
+  DWORD clips = 0;
+  DWORD frames = 0;                                  //Images in all clips
+  DWORD lost = 0;
+  double copySeconds = 0.0;
+  double seconds = 0.0;
+};
+
+class EventCapture
+{
+public:
+  //Called on the capture thread for every complete clip, give the images back with release()
+  using ClipCallback = std::function<void(EventClip& clip)>;
+
+  EventCapture(HANDLE hRec, HANDLE hCam, DWORD preFrames, DWORD postFrames, ImageBufferPool* pool = nullptr,
+    const BackoffPolicy& policy = BackoffPolicy())
+    : m_hRec(hRec), m_hCam(hCam), m_preFrames(std::max<DWORD>(preFrames, 1)), m_postFrames(postFrames),
+    m_pool(pool), m_policy(policy)
+  {
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+  }
+
+  ~EventCapture()
+  {
+    stop();
+  }
+
+  EventCapture(const EventCapture&) = delete;
+  EventCapture& operator=(const EventCapture&) = delete;
+
+  //Starts the capture thread, the ring buffer recording should already run
+  int start(ClipCallback onClip)
+  {
+    int iRet = PCO_RecorderGetSettings(m_hRec, m_hCam, NULL, NULL, NULL, &m_imgWidth, &m_imgHeight, NULL);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    m_onClip = std::move(onClip);
+    m_stop = false;
+    m_stats = EventCaptureStats();
+    m_startTime = std::chrono::steady_clock::now();
+    m_thread = std::thread(&EventCapture::run, this);
+    return PCO_NOERROR;
+  }
+
+  //Completes the clips of all events so far (the post-event images end with the recording) and ends the thread
+  void stop()
+  {
+    if (!m_thread.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+    m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+  }
+
+  //Software event: the clip is built around the latest recorded image
+  int trigger()
+  {
+    DWORD imgNumber = 0;
+    int iRet = latestImageNumber(imgNumber);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    return triggerAt(imgNumber);
+  }
+
+  //Event at a known image, e.g. from an external signal which is found in the metadata
+  int triggerAt(DWORD imgNumber)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_thread.joinable() || m_stop)
+        return PCO_ERROR_NOTINIT;
+      m_events.push_back(Event{ ++m_eventCount, imgNumber });
+    }
+    m_cond.notify_one();
+    return PCO_NOERROR;
+  }
+
+  //Gives the images of the clip back to the pool
+  void release(EventClip& clip)
+  {
+    for (ReadoutFrame& frame : clip.frames)
+      m_pool->release(frame.image);
+    clip.frames.clear();
+  }
+
+  //Images the ring buffer should at least hold, copyFrames is the number of images recorded while
+  //the pre-event images are copied (the copy rate compared to the frame rate)
+  DWORD minRingImages(DWORD copyFrames) const
+  {
+    return m_preFrames + copyFrames;
+  }
+
+  //After stop()
+  const EventCaptureStats& stats() const
+  {
+    return m_stats;
+  }
+
+  void printStats() const
+  {
+    printf("Event capture: %u events, %u clips with %u images (%u pre, %u post each), %u images lost\n",
+      (unsigned)m_stats.events, (unsigned)m_stats.clips, (unsigned)m_stats.frames, (unsigned)m_preFrames,
+      (unsigned)m_postFrames, (unsigned)m_stats.lost);
+    printf("%.2f ms per image copy, %.1f MB of images in %.2f s\n",
+      m_stats.frames ? m_stats.copySeconds * 1000.0 / m_stats.frames : 0.0,
+      (double)m_stats.frames * m_imgWidth * m_imgHeight * sizeof(WORD) / 1e6, m_stats.seconds);
+  }
+
+private:
+  struct Event
+  {
+    DWORD event;
+    DWORD imgNumber;
+  };
+
+  void run()
+  {
+    while (true)
+    {
+      Event event;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_stop || !m_events.empty(); });
+        if (m_events.empty())
+          break;
+        event = m_events.front();
+        m_events.pop_front();
+      }
+      m_stats.events++;
+
+      EventClip clip;
+      clip.event = event.event;
+      clip.eventImgNumber = event.imgNumber;
+      const DWORD first = event.imgNumber > m_preFrames ? event.imgNumber - m_preFrames + 1 : 1;
+      const DWORD last = event.imgNumber + m_postFrames;
+      for (DWORD imgNumber = first; imgNumber <= last; imgNumber++)
+      {
+        if (!waitForImage(imgNumber))
+          break;
+        ReadoutFrame frame;
+        const auto copyStart = std::chrono::steady_clock::now();
+        int iRet = copyImage(imgNumber, frame);
+        m_stats.copySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - copyStart).count();
+        if (iRet == PCO_NOERROR)
+          clip.frames.push_back(frame);
+        else
+          clip.lost++;
+      }
+
+      m_stats.clips++;
+      m_stats.frames += (DWORD)clip.frames.size();
+      m_stats.lost += clip.lost;
+      if (m_onClip)
+        m_onClip(clip);
+      else
+        release(clip);
+    }
+  }
+
+  //Waits until the image is recorded, returns false if the recording stopped before
+  bool waitForImage(DWORD imgNumber)
+  {
+    Backoff backoff(m_policy);
+    while (true)
+    {
+      DWORD latest = 0;
+      if (latestImageNumber(latest) == PCO_NOERROR && latest >= imgNumber)
+        return true;
+      bool isRunning = false;
+      if (PCO_RecorderGetStatus(m_hRec, m_hCam, &isRunning, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL)
+        != PCO_NOERROR || !isRunning)
+        return latestImageNumber(latest) == PCO_NOERROR && latest >= imgNumber;
+      backoff.wait();
+    }
+  }
+
+  int latestImageNumber(DWORD& imgNumber)
+  {
+    return probe(PCO_RECORDER_LATEST_IMAGE, imgNumber);
+  }
+
+  //Image number at the index, with a copy of a single pixel
+  int probe(DWORD index, DWORD& imgNumber)
+  {
+    WORD pixel = 0;
+    return PCO_RecorderCopyImage(m_hRec, m_hCam, index, 1, 1, 1, 1, &pixel, &imgNumber, NULL, NULL);
+  }
+
+  //Copies the image with the image number, PCO_ERROR_WRONGVALUE if it is no longer in the ring buffer
+  int copyImage(DWORD imgNumber, ReadoutFrame& frame)
+  {
+    frame.imgWidth = m_imgWidth;
+    frame.imgHeight = m_imgHeight;
+    frame.metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    frame.image = m_pool->acquireImage<WORD>(m_imgWidth, m_imgHeight);
+    if (frame.image == nullptr)
+      return PCO_ERROR_NOMEMORY;
+
+    //The index of the image is guessed from the last image number found, every probe corrects the guess
+    int64_t count = 0;
+    bool lost = false;
+    for (int attempt = 0; attempt < 4 && !lost; attempt++)
+    {
+      DWORD procImgCount = 0, reqImgCount = 0;
+      int iRet = PCO_RecorderGetStatus(m_hRec, m_hCam, NULL, NULL, NULL, &procImgCount, &reqImgCount,
+        NULL, NULL, NULL, NULL);
+      count = iRet == PCO_NOERROR ? std::min(procImgCount, reqImgCount) : 0;
+      if (count == 0)
+        break;
+      const DWORD index = (DWORD)((((int64_t)imgNumber + m_indexOffset) % count + count) % count);
+      DWORD found = 0;
+      if (probe(index, found) != PCO_NOERROR)
+      {
+        count = 0;
+        break;
+      }
+      if (found == imgNumber)
+      {
+        if (copyAt(index, imgNumber, frame))
+          return PCO_NOERROR;
+        continue;
+      }
+      m_indexOffset = (int64_t)index - found;
+      //An older image than the oldest one in the ring is lost
+      lost = found > imgNumber && (int64_t)found - imgNumber >= count;
+    }
+
+    //The guesses missed, the images are not where consecutive indices would put them
+    for (int64_t index = 0; !lost && index < count; index++)
+    {
+      DWORD found = 0;
+      if (probe((DWORD)index, found) != PCO_NOERROR)
+        break;
+      if (found == imgNumber && copyAt((DWORD)index, imgNumber, frame))
+      {
+        m_indexOffset = index - found;
+        return PCO_NOERROR;
+      }
+    }
+    m_pool->release(frame.image);
+    frame.image = nullptr;
+    return PCO_ERROR_WRONGVALUE;
+  }
+
+  //Copies the image at the index, false if it is not the image with the number (any more)
+  bool copyAt(DWORD index, DWORD imgNumber, ReadoutFrame& frame)
+  {
+    DWORD found = 0;
+    int iRet = PCO_RecorderCopyImage(m_hRec, m_hCam, index, 1, 1, m_imgWidth, m_imgHeight, frame.image,
+      &found, &frame.metadata, NULL);
+    //The image could have been overwritten between probe and copy
+    if (iRet != PCO_NOERROR || found != imgNumber)
+      return false;
+    frame.index = index;
+    frame.imgNumber = imgNumber;
+    return true;
+  }
+
+  HANDLE m_hRec;
+  HANDLE m_hCam;
+  DWORD m_preFrames;
+  DWORD m_postFrames;
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  BackoffPolicy m_policy;
+  ClipCallback m_onClip;
+  WORD m_imgWidth = 0;
+  WORD m_imgHeight = 0;
+  int64_t m_indexOffset = 0;                         //Index minus image number of the last probe
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<Event> m_events;
+  DWORD m_eventCount = 0;
+  bool m_stop = false;
+  std::chrono::steady_clock::time_point m_startTime;
+  EventCaptureStats m_stats;
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+// Acquisition thread for PCO_RECORDER_MEMORY_FIFO
+// Instead of calling PCO_RecorderGetStatus back to back, the consumer thread
+// backs off while the FIFO is empty: it spins for a few polls, then yields,
+// then sleeps with exponentially growing intervals. As soon as an image is
+// available the backoff is reset. This keeps the latency low while images are
+// streaming, but does not burn a whole core while waiting.
+// All images reported by one status call are copied as a batch, see FifoDrain.h
+
+#include "PcoSdk.h"
+#include "FifoDrain.h"
+#include "FrameLoss.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef PCO_LINUX
+#include <time.h>
+#endif
+
+// CPU time consumed by the calling thread in seconds
+inline double threadCpuSeconds()
+{
+#ifdef PCO_LINUX
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+  FILETIME creationTime, exitTime, kernelTime, userTime;
+  GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+  ULARGE_INTEGER kernel, user;
+  kernel.LowPart = kernelTime.dwLowDateTime;
+  kernel.HighPart = kernelTime.dwHighDateTime;
+  user.LowPart = userTime.dwLowDateTime;
+  user.HighPart = userTime.dwHighDateTime;
+  return (double)(kernel.QuadPart + user.QuadPart) * 1e-7; //100 ns units
+#endif
+}
+
+// Configures how the consumer waits while no image is available
+struct BackoffPolicy
+{
+  unsigned spinCount = 0;                            //Status polls without any pause
+  unsigned yieldCount = 4;                           //Polls with a thread yield in between
+  std::chrono::microseconds minSleep{ 100 };         //First sleep interval
+  std::chrono::microseconds maxSleep{ 2000 };        //Sleep interval is doubled up to this
+};
+
+class Backoff
+{
+public:
+  explicit Backoff(const BackoffPolicy& policy) : m_policy(policy), m_sleep(policy.minSleep) {}
+
+  void reset()
+  {
+    m_attempt = 0;
+    m_sleep = m_policy.minSleep;
+  }
+
+  void wait()
+  {
+    if (m_attempt < m_policy.spinCount)
+    {
+      m_attempt++;
+      return;
+    }
+    if (m_attempt < m_policy.spinCount + m_policy.yieldCount)
+    {
+      m_attempt++;
+      std::this_thread::yield();
+      return;
+    }
+    std::this_thread::sleep_for(m_sleep);
+    m_sleep = std::min(m_sleep * 2, m_policy.maxSleep);
+  }
+
+private:
+  BackoffPolicy m_policy;
+  unsigned m_attempt = 0;
+  std::chrono::microseconds m_sleep;
+};
+
+struct FifoConsumerStats
+{
+  DWORD framesDelivered = 0;
+  DWORD batches = 0;                                 //Status polls which delivered images
+  DWORD statusPolls = 0;
+  DWORD emptyPolls = 0;
+  double cpuSeconds = 0.0;                           //CPU time of the consumer thread
+  double wallSeconds = 0.0;
+
+  double cpuSecondsPerFrame() const
+  {
+    return framesDelivered ? cpuSeconds / framesDelivered : 0.0;
+  }
+
+  double framesPerBatch() const
+  {
+    return batches ? (double)framesDelivered / batches : 0.0;
+  }
+};
+
+class FifoConsumer
+{
+public:
+  //Called on the consumer thread for every copied image
+  using FrameCallback = std::function<void(const WORD* image, DWORD imgNumber,
+    const PCO_METADATA_STRUCT& metadata, DWORD fillLevel)>;
+
+  //batchSize is the maximum number of images copied per status call
+  //The image buffers are taken from pool, if given
+  FifoConsumer(HANDLE hRec, HANDLE hCam, WORD imgWidth, WORD imgHeight,
+    const BackoffPolicy& policy = BackoffPolicy(), DWORD batchSize = 16,
+    ImageBufferPool* pool = nullptr)
+    : m_hRec(hRec), m_hCam(hCam), m_imgWidth(imgWidth), m_imgHeight(imgHeight), m_policy(policy),
+    m_batchSize(std::max<DWORD>(batchSize, 1)), m_ring(m_batchSize, imgWidth, imgHeight, pool)
+  {
+  }
+
+  ~FifoConsumer()
+  {
+    join();
+  }
+
+  FifoConsumer(const FifoConsumer&) = delete;
+  FifoConsumer& operator=(const FifoConsumer&) = delete;
+
+  //Start the consumer thread, record has to be started already
+  void start(FrameCallback callback)
+  {
+    m_callback = std::move(callback);
+    m_finished = false;
+    m_thread = std::thread(&FifoConsumer::run, this);
+  }
+
+  //Waits until the recorder stopped and the FIFO is drained, or the timeout elapsed
+  //Returns true if the consumer has finished
+  template <class Rep, class Period>
+  bool waitFor(const std::chrono::duration<Rep, Period>& timeout)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_cond.wait_for(lock, timeout, [this]() { return m_finished; });
+  }
+
+  //Waits for the consumer thread, returns the first error (or PCO_NOERROR)
+  int join()
+  {
+    if (m_thread.joinable())
+      m_thread.join();
+    return m_error;
+  }
+
+  const FifoConsumerStats& stats() const
+  {
+    return m_stats;
+  }
+
+  //Records the latency of every image as camera cam, call before start()
+  void setLatencyRecorder(LatencyRecorder* recorder, WORD cam = 0)
+  {
+    m_latency = recorder;
+    m_latencyCam = cam;
+  }
+
+  //Counts lost images and tracks the fill level as camera cam, call before start()
+  void setLossMonitor(FrameLossMonitor* monitor, WORD cam = 0)
+  {
+    m_loss = monitor;
+    m_lossCam = cam;
+  }
+
+  //Computes the statistics of every image right after its copy, call before start()
+  void setFrameStats(const FrameStatsSettings& settings)
+  {
+    m_statsKernel.reset(new FrameStatsKernel(settings));
+  }
+
+  //Only from within the frame callback (before takeImage): statistics of the image,
+  //nullptr if setFrameStats() was not called
+  const FrameStats* imageStats(const WORD* image) const
+  {
+    const DrainedFrame* frame = m_ring.find(image);
+    return frame != nullptr && m_statsKernel ? &frame->stats : nullptr;
+  }
+
+  //Only from within the frame callback: keeps the image buffer instead of copying it
+  //The buffer has to be released to the pool given in the constructor afterwards
+  WORD* takeImage(const WORD* image)
+  {
+    return m_ring.take(image);
+  }
+
+private:
+  void run()
+  {
+    auto startTime = std::chrono::steady_clock::now();
+    double startCpu = threadCpuSeconds();
+    Backoff backoff(m_policy);
+
+    bool isRunning = true;
+    DWORD procImgCount = 0;
+    while (true)
+    {
+      int iRet = PCO_RecorderGetStatus(m_hRec, m_hCam, &isRunning,
+        NULL, NULL, &procImgCount, NULL, NULL, NULL, NULL, NULL);
+      m_stats.statusPolls++;
+      if (iRet != PCO_NOERROR)
+      {
+        m_error = iRet;
+        break;
+      }
+      if (m_loss != nullptr)
+        m_loss->fillLevel(m_lossCam, procImgCount);
+      if (procImgCount == 0)
+      {
+        //Nothing left to read
+        if (!isRunning)
+          break;
+        m_stats.emptyPolls++;
+        backoff.wait();
+        continue;
+      }
+      backoff.reset();
+
+      DWORD delivered = 0;
+      iRet = drainFifo(m_hRec, m_hCam, m_imgWidth, m_imgHeight,
+        procImgCount, m_batchSize, m_ring, delivered, m_statsKernel.get());
+      m_stats.batches++;
+      m_stats.framesDelivered += delivered;
+      for (DWORD i = 0; i < delivered && (m_latency != nullptr || m_loss != nullptr); i++)
+      {
+        const DrainedFrame& frame = m_ring.back(delivered - 1 - i);
+        if (m_latency != nullptr)
+          m_latency->record(m_latencyCam, frame.imgNumber, frame.metadata, frame.hostUs, frame.copyUs);
+        if (m_loss != nullptr)
+          m_loss->frameReceived(m_lossCam, frame.imgNumber);
+      }
+      if (m_callback)
+      {
+        for (DWORD i = 0; i < delivered; i++)
+        {
+          const DrainedFrame& frame = m_ring.back(delivered - 1 - i);
+          m_callback(frame.image, frame.imgNumber, frame.metadata, procImgCount - i);
+        }
+      }
+      if (iRet != PCO_NOERROR)
+      {
+        m_error = iRet;
+        PCO_RecorderStopRecord(m_hRec, m_hCam);
+        break;
+      }
+    }
+
+    m_stats.cpuSeconds = threadCpuSeconds() - startCpu;
+    m_stats.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_finished = true;
+    }
+    m_cond.notify_all();
+  }
+
+  HANDLE m_hRec;
+  HANDLE m_hCam;
+  WORD m_imgWidth;
+  WORD m_imgHeight;
+  BackoffPolicy m_policy;
+  DWORD m_batchSize;
+  FrameRing m_ring;
+  FrameCallback m_callback;
+  LatencyRecorder* m_latency = nullptr;
+  WORD m_latencyCam = 0;
+  FrameLossMonitor* m_loss = nullptr;
+  WORD m_lossCam = 0;
+  std::unique_ptr<FrameStatsKernel> m_statsKernel;
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  bool m_finished = false;
+  int m_error = PCO_NOERROR;
+  FifoConsumerStats m_stats;
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+// Batched readout for PCO_RECORDER_MEMORY_FIFO
+// One PCO_RecorderGetStatus call tells how many images are waiting, drainFifo()
+// then copies up to that many images back to back into a ring of pre-allocated
+// destination buffers, so the cost of the status call is shared by the batch.
+// If a FrameStatsKernel is given, the statistics of every image are computed
+// right after its copy, while it is still in the cache.
+
+#include "PcoSdk.h"
+#include "FrameStats.h"
+#include "ImageBufferPool.h"
+#include "Latency.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct DrainedFrame
+{
+  WORD* image = nullptr;
+  DWORD imgNumber = 0;
+  PCO_METADATA_STRUCT metadata;
+  int64_t hostUs = 0;                                //Host time when the copy returned, see hostTimeUs()
+  uint32_t copyUs = 0;                               //Duration of PCO_RecorderCopyImage
+  FrameStats stats;                                  //Only valid with a FrameStatsKernel
+};
+
+// Fixed number of image buffers that are reused in round robin order
+// The buffers are taken from pool, or from a private pool if none is given
+class FrameRing
+{
+public:
+  FrameRing(DWORD slotCount, WORD imgWidth, WORD imgHeight, ImageBufferPool* pool = nullptr)
+    : m_pool(pool), m_slots(slotCount), m_imgWidth(imgWidth), m_imgHeight(imgHeight)
+  {
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+    for (DWORD i = 0; i < slotCount; i++)
+    {
+      m_slots[i].image = m_pool->acquireImage<WORD>(imgWidth, imgHeight);
+      m_slots[i].metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    }
+  }
+
+  ~FrameRing()
+  {
+    for (DrainedFrame& slot : m_slots)
+      m_pool->release(slot.image);
+  }
+
+  FrameRing(const FrameRing&) = delete;
+  FrameRing& operator=(const FrameRing&) = delete;
+
+  DWORD size() const
+  {
+    return (DWORD)m_slots.size();
+  }
+
+  //Slot the next image is copied to
+  DrainedFrame& head()
+  {
+    return m_slots[m_head];
+  }
+
+  void advance()
+  {
+    m_head = (m_head + 1) % m_slots.size();
+  }
+
+  //Recently filled slot, 0 is the newest
+  const DrainedFrame& back(DWORD age) const
+  {
+    return m_slots[(m_head + m_slots.size() - 1 - age % m_slots.size()) % m_slots.size()];
+  }
+
+  //Slot holding image, nullptr if image is not in the ring
+  const DrainedFrame* find(const WORD* image) const
+  {
+    for (const DrainedFrame& slot : m_slots)
+      if (slot.image == image)
+        return &slot;
+    return nullptr;
+  }
+
+  //Hands the buffer of the slot holding image over to the caller, who has to
+  //give it back to the pool. The slot gets a new buffer from the pool.
+  //Returns nullptr if image is not in the ring or no buffer could be allocated.
+  WORD* take(const WORD* image)
+  {
+    for (DrainedFrame& slot : m_slots)
+    {
+      if (slot.image != image)
+        continue;
+      WORD* replacement = m_pool->acquireImage<WORD>(m_imgWidth, m_imgHeight);
+      if (replacement == nullptr)
+        return nullptr;
+      WORD* taken = slot.image;
+      slot.image = replacement;
+      return taken;
+    }
+    return nullptr;
+  }
+
+private:
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  std::vector<DrainedFrame> m_slots;
+  WORD m_imgWidth;
+  WORD m_imgHeight;
+  size_t m_head = 0;
+};
+
+// Copies min(available, maxFrames, ring size) images from the FIFO into the ring
+// available is the fill level reported by the last PCO_RecorderGetStatus call
+// The copied images are ring.back(delivered - 1) (oldest) ... ring.back(0) (newest)
+inline int drainFifo(HANDLE hRec, HANDLE hCam, WORD imgWidth, WORD imgHeight,
+  DWORD available, DWORD maxFrames, FrameRing& ring, DWORD& delivered,
+  FrameStatsKernel* statsKernel = nullptr)
+{
+  delivered = 0;
+  DWORD count = std::min(std::min(available, maxFrames), ring.size());
+  for (DWORD i = 0; i < count; i++)
+  {
+    DrainedFrame& slot = ring.head();
+    auto copyStart = std::chrono::steady_clock::now();
+    int iRet = PCO_RecorderCopyImage(hRec, hCam, 0,
+      1, 1, imgWidth, imgHeight, slot.image,
+      &slot.imgNumber, &slot.metadata, NULL);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    slot.hostUs = hostTimeUs();
+    slot.copyUs = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - copyStart).count();
+    if (statsKernel != nullptr)
+      statsKernel->compute(slot.image, imgWidth, imgHeight, slot.stats);
+    ring.advance();
+    delivered++;
+  }
+  return PCO_NOERROR;
+}
@@ -0,0 +1,627 @@
+#pragma once
+
+// Lossless compression of 16 bit camera images
+// Streaming is limited by the disk bandwidth long before the CPU, so images are
+// compressed between PCO_RecorderCopyImage and the writer. The format is made
+// for camera data:
+//  - every pixel is predicted from its left neighbour (the first pixel of a row
+//    from the pixel above), the residuals are taken modulo 2^bits, where bits is
+//    the dynamic resolution of the camera (wDynResDESC), and zigzag coded, so a
+//    residual never needs more than bits bits
+//  - the residuals of 32 pixels are a block, which is stored with the bit width
+//    of its largest residual as bit planes: for every bit one 32 bit word with
+//    that bit of all 32 pixels. So noise costs its real bit count and a block
+//    never needs more than 1 + 4 * bits bytes.
+//  - the image is split into tiles of whole rows which are coded independently,
+//    so one image can be compressed and decompressed with several threads
+// Images with MSB bit alignment are shifted down first. If an image has pixels
+// that do not fit into bits (or low bits set with MSB alignment), it is stored
+// with 16 bit residuals, so the compression is always lossless.
+//
+// Compressed image: CompressedFrameHeader | end offset of every tile (uint32) | tiles
+//
+// Residuals and bit planes are computed with SSE4.1 or AVX2 if available
+// (CpuIsa of CpuDispatch.h), all versions produce identical data.
+
+#include "PcoSdk.h"
+#include "CpuDispatch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+struct CompressedFrameHeader
+{
+  char magic[4];                                     //"PCZ1"
+  uint16_t imgWidth;
+  uint16_t imgHeight;
+  uint8_t bits;                                      //Bits of the residuals
+  uint8_t shift;                                     //Pixels were shifted right by this (MSB alignment)
+  uint16_t rowsPerTile;
+  uint32_t tileCount;
+  uint32_t payloadBytes;                             //Tiles, after the tile table
+};
+
+class FrameCompressor
+{
+public:
+  //bits is the dynamic resolution of the camera, bitAlignment as set with PCO_SetBitAlignment
+  //threadCount 0 uses one thread per hardware thread for the tiles of an image
+  explicit FrameCompressor(WORD bits = 16, WORD bitAlignment = BIT_ALIGNMENT_LSB, unsigned threadCount = 1,
+    CpuIsa isa = bestCpuIsa())
+    : m_bits((WORD)std::min(std::max((int)bits, 1), 16)), m_bitAlignment(bitAlignment),
+    m_isa(std::min(isa, bestCpuIsa()))
+  {
+    m_threadCount = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  CpuIsa isa() const
+  {
+    return m_isa;
+  }
+
+  unsigned threadCount() const
+  {
+    return m_threadCount;
+  }
+
+  //Size of the buffer compress() needs in the worst case
+  static size_t maxCompressedBytes(WORD width, WORD height)
+  {
+    const unsigned rows = rowsPerTile(width);
+    const size_t tiles = (height + rows - 1) / rows;
+    return sizeof(CompressedFrameHeader) + tiles * sizeof(uint32_t) + (size_t)height * maxRowBytes(width);
+  }
+
+  //Compresses the image into dst (at least maxCompressedBytes()), bytes is the compressed size
+  int compress(const WORD* image, WORD width, WORD height, BYTE* dst, size_t capacity, size_t& bytes) const
+  {
+    bytes = 0;
+    if (image == nullptr || dst == nullptr || width == 0 || height == 0)
+      return PCO_ERROR_WRONGVALUE;
+    if (capacity < maxCompressedBytes(width, height))
+      return PCO_ERROR_NOMEMORY;
+
+    CompressedFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PCZ1", 4);
+    header.imgWidth = width;
+    header.imgHeight = height;
+    header.bits = (uint8_t)m_bits;
+    header.shift = m_bitAlignment == BIT_ALIGNMENT_MSB ? (uint8_t)(16 - m_bits) : 0;
+    header.rowsPerTile = (uint16_t)rowsPerTile(width);
+    header.tileCount = (height + header.rowsPerTile - 1) / header.rowsPerTile;
+    //Pixels outside of the dynamic range would be lost, code them with all 16 bits
+    if (header.bits < 16 && !fitsBits(image, (size_t)width * height, header.bits, header.shift))
+    {
+      header.bits = 16;
+      header.shift = 0;
+    }
+
+    //Every tile is coded at its worst case position, then they are moved together
+    uint32_t* tileEnds = reinterpret_cast<uint32_t*>(dst + sizeof(header));
+    BYTE* payload = dst + sizeof(header) + header.tileCount * sizeof(uint32_t);
+    const size_t tileCapacity = header.rowsPerTile * maxRowBytes(width);
+    std::vector<size_t> tileBytes(header.tileCount, 0);
+    forEachTile(header.tileCount, [&](unsigned tile, std::vector<WORD>& scratch)
+      {
+        const unsigned y0 = tile * header.rowsPerTile;
+        const unsigned rows = std::min<unsigned>(header.rowsPerTile, height - y0);
+        tileBytes[tile] = encodeTile(image + (size_t)y0 * width, width, rows, header,
+          payload + tile * tileCapacity, scratch);
+      });
+
+    size_t offset = 0;
+    for (uint32_t tile = 0; tile < header.tileCount; tile++)
+    {
+      if (tile > 0)
+        memmove(payload + offset, payload + tile * tileCapacity, tileBytes[tile]);
+      offset += tileBytes[tile];
+      const uint32_t end = (uint32_t)offset;
+      memcpy(tileEnds + tile, &end, sizeof(end));
+    }
+    header.payloadBytes = (uint32_t)offset;
+    memcpy(dst, &header, sizeof(header));
+    bytes = sizeof(header) + header.tileCount * sizeof(uint32_t) + offset;
+    return PCO_NOERROR;
+  }
+
+  //Decompresses an image of compress(), width and height have to match the image
+  int decompress(const BYTE* src, size_t bytes, WORD* image, WORD width, WORD height) const
+  {
+    CompressedFrameHeader header;
+    if (src == nullptr || image == nullptr || bytes < sizeof(header))
+      return PCO_ERROR_WRONGVALUE;
+    memcpy(&header, src, sizeof(header));
+    if (memcmp(header.magic, "PCZ1", 4) != 0 || header.imgWidth != width || header.imgHeight != height ||
+      header.bits < 1 || header.bits > 16 || header.rowsPerTile == 0 ||
+      header.tileCount != (height + header.rowsPerTile - 1u) / header.rowsPerTile ||
+      bytes < sizeof(header) + header.tileCount * sizeof(uint32_t) + header.payloadBytes)
+      return PCO_ERROR_WRONGVALUE;
+
+    const BYTE* tileTable = src + sizeof(header);
+    const BYTE* payload = tileTable + header.tileCount * sizeof(uint32_t);
+    std::atomic<bool> valid{ true };
+    forEachTile(header.tileCount, [&](unsigned tile, std::vector<WORD>& scratch)
+      {
+        uint32_t begin = 0, end = 0;
+        if (tile > 0)
+          memcpy(&begin, tileTable + (tile - 1) * sizeof(uint32_t), sizeof(begin));
+        memcpy(&end, tileTable + tile * sizeof(uint32_t), sizeof(end));
+        const unsigned y0 = tile * header.rowsPerTile;
+        const unsigned rows = std::min<unsigned>(header.rowsPerTile, height - y0);
+        if (begin > end || end > header.payloadBytes ||
+          !decodeTile(payload + begin, end - begin, image + (size_t)y0 * width, width, rows, header, scratch))
+          valid = false;
+      });
+    return valid ? PCO_NOERROR : PCO_ERROR_WRONGVALUE;
+  }
+
+private:
+  static const unsigned BlockPixels = 32;
+
+  static unsigned rowsPerTile(WORD width)
+  {
+    //About 64K pixels per tile
+    return std::max(1u, std::min(0xFFFFu, 65536u / std::max<unsigned>(width, 1)));
+  }
+
+  static size_t maxRowBytes(WORD width)
+  {
+    return (size_t)(width + BlockPixels - 1) / BlockPixels * (1 + 4 * 16);
+  }
+
+  template <class F>
+  void forEachTile(unsigned tileCount, F&& work) const
+  {
+    const unsigned threads = std::min(m_threadCount, tileCount);
+    if (threads <= 1)
+    {
+      std::vector<WORD> scratch;
+      for (unsigned tile = 0; tile < tileCount; tile++)
+        work(tile, scratch);
+      return;
+    }
+    std::atomic<unsigned> next{ 0 };
+    auto worker = [&]()
+      {
+        std::vector<WORD> scratch;
+        for (unsigned tile = next++; tile < tileCount; tile = next++)
+          work(tile, scratch);
+      };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+      pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool)
+      t.join();
+  }
+
+  bool fitsBits(const WORD* image, size_t count, unsigned bits, unsigned shift) const
+  {
+    //Bits which have to be zero: above the dynamic range (LSB) or below it (MSB)
+    const WORD forbidden = shift ? (WORD)((1u << shift) - 1) : (WORD)~((1u << bits) - 1);
+    size_t i = 0;
+    WORD any = 0;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      i = orAvx2(image, count, any);
+    else if (m_isa == CpuIsa::SSE41)
+      i = orSse41(image, count, any);
+#endif
+    for (; i < count; i++)
+      any |= image[i];
+    return (any & forbidden) == 0;
+  }
+
+  //Codes the rows of one tile, returns the number of bytes
+  size_t encodeTile(const WORD* image, WORD width, unsigned rows, const CompressedFrameHeader& header,
+    BYTE* dst, std::vector<WORD>& scratch) const
+  {
+    const size_t padded = (width + BlockPixels - 1) / BlockPixels * BlockPixels;
+    scratch.assign(padded, 0);
+    const WORD mask = (WORD)((1u << header.bits) - 1);
+    BYTE* out = dst;
+    for (unsigned y = 0; y < rows; y++)
+    {
+      const WORD* row = image + (size_t)y * width;
+      const WORD above = y > 0 ? (WORD)(row[-(int)width] >> header.shift) : 0;
+      residuals(row, width, above, header.shift, header.bits, mask, scratch.data());
+      for (size_t block = 0; block < padded; block += BlockPixels)
+        out = pack(scratch.data() + block, out);
+    }
+    return (size_t)(out - dst);
+  }
+
+  bool decodeTile(const BYTE* src, size_t bytes, WORD* image, WORD width, unsigned rows,
+    const CompressedFrameHeader& header, std::vector<WORD>& scratch) const
+  {
+    const size_t padded = (width + BlockPixels - 1) / BlockPixels * BlockPixels;
+    scratch.assign(padded, 0);
+    const WORD mask = (WORD)((1u << header.bits) - 1);
+    const BYTE* in = src;
+    const BYTE* end = src + bytes;
+    for (unsigned y = 0; y < rows; y++)
+    {
+      for (size_t block = 0; block < padded; block += BlockPixels)
+      {
+        if (in >= end || *in > header.bits || in + 1 + 4 * *in > end)
+          return false;
+        in = unpack(in, scratch.data() + block);
+      }
+      WORD* row = image + (size_t)y * width;
+      const WORD above = y > 0 ? (WORD)(row[-(int)width] >> header.shift) : 0;
+      reconstruct(scratch.data(), width, above, header.shift, header.bits, mask, row);
+    }
+    return in == end;
+  }
+
+  //Zigzag code of a residual modulo 2^bits, fits into bits
+  static WORD zigzag(WORD r, unsigned bits, WORD mask)
+  {
+    return (WORD)((((unsigned)r << 1) & mask) ^ (((r >> (bits - 1)) & 1) ? mask : 0));
+  }
+
+  static WORD unzigzag(WORD z, WORD mask)
+  {
+    return (WORD)((z >> 1) ^ ((z & 1) ? mask : 0));
+  }
+
+  void residuals(const WORD* row, WORD width, WORD above, unsigned shift, unsigned bits, WORD mask,
+    WORD* out) const
+  {
+    out[0] = zigzag((WORD)(((row[0] >> shift) - above) & mask), bits, mask);
+    size_t x = 1;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      x = residualsAvx2(row, width, shift, bits, mask, out);
+    else if (m_isa == CpuIsa::SSE41)
+      x = residualsSse41(row, width, shift, bits, mask, out);
+#endif
+    for (; x < width; x++)
+      out[x] = zigzag((WORD)(((row[x] >> shift) - (row[x - 1] >> shift)) & mask), bits, mask);
+  }
+
+  void reconstruct(const WORD* residual, WORD width, WORD above, unsigned shift, unsigned bits, WORD mask,
+    WORD* row) const
+  {
+    (void)bits;
+    WORD previous = above;
+    size_t x = 0;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      x = reconstructAvx2(residual, width, shift, mask, previous, row);
+    else if (m_isa == CpuIsa::SSE41)
+      x = reconstructSse41(residual, width, shift, mask, previous, row);
+#endif
+    for (; x < width; x++)
+    {
+      previous = (WORD)((previous + unzigzag(residual[x], mask)) & mask);
+      row[x] = (WORD)(previous << shift);
+    }
+  }
+
+  //Block of 32 residuals: bit width, then one 32 bit word per bit plane
+  BYTE* pack(const WORD* z, BYTE* out) const
+  {
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      return packAvx2(z, out);
+    if (m_isa == CpuIsa::SSE41)
+      return packSse41(z, out);
+#endif
+    WORD any = 0;
+    for (unsigned i = 0; i < BlockPixels; i++)
+      any |= z[i];
+    const unsigned width = bitWidth(any);
+    *out++ = (BYTE)width;
+    for (unsigned k = 0; k < width; k++)
+    {
+      uint32_t plane = 0;
+      for (unsigned i = 0; i < BlockPixels; i++)
+        plane |= (uint32_t)((z[i] >> k) & 1) << i;
+      memcpy(out, &plane, sizeof(plane));
+      out += sizeof(plane);
+    }
+    return out;
+  }
+
+  const BYTE* unpack(const BYTE* in, WORD* z) const
+  {
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      return unpackAvx2(in, z);
+    if (m_isa == CpuIsa::SSE41)
+      return unpackSse41(in, z);
+#endif
+    const unsigned width = *in++;
+    for (unsigned i = 0; i < BlockPixels; i++)
+      z[i] = 0;
+    for (unsigned k = 0; k < width; k++)
+    {
+      uint32_t plane;
+      memcpy(&plane, in, sizeof(plane));
+      in += sizeof(plane);
+      for (unsigned i = 0; i < BlockPixels; i++)
+        z[i] |= (WORD)(((plane >> i) & 1) << k);
+    }
+    return in;
+  }
+
+  static unsigned bitWidth(WORD value)
+  {
+    unsigned width = 0;
+    while (value >> width)
+      width++;
+    return width;
+  }
+
+#ifdef PCO_CPU_X86
+  PCO_TARGET_SSE41 static size_t orSse41(const WORD* image, size_t count, WORD& any)
+  {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(image + i)));
+    acc = _mm_or_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_or_si128(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_or_si128(acc, _mm_srli_si128(acc, 2));
+    any |= (WORD)_mm_extract_epi16(acc, 0);
+    return i;
+  }
+
+  PCO_TARGET_SSE41 static __m128i zigzagSse41(__m128i r, __m128i bitsMinus1, __m128i mask)
+  {
+    const __m128i sign = _mm_sub_epi16(_mm_setzero_si128(), _mm_srl_epi16(r, bitsMinus1));
+    return _mm_and_si128(_mm_xor_si128(_mm_slli_epi16(r, 1), sign), mask);
+  }
+
+  PCO_TARGET_SSE41 static size_t residualsSse41(const WORD* row, size_t width, unsigned shift, unsigned bits,
+    WORD mask, WORD* out)
+  {
+    const __m128i shiftCount = _mm_cvtsi32_si128((int)shift);
+    const __m128i bitsMinus1 = _mm_cvtsi32_si128((int)bits - 1);
+    const __m128i m = _mm_set1_epi16((short)mask);
+    size_t x = 1;
+    for (; x + 8 <= width; x += 8)
+    {
+      const __m128i cur = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(row + x)), shiftCount);
+      const __m128i left = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(row + x - 1)), shiftCount);
+      const __m128i r = _mm_and_si128(_mm_sub_epi16(cur, left), m);
+      _mm_storeu_si128((__m128i*)(out + x), zigzagSse41(r, bitsMinus1, m));
+    }
+    return x;
+  }
+
+  PCO_TARGET_SSE41 static size_t reconstructSse41(const WORD* residual, size_t width, unsigned shift, WORD mask,
+    WORD& previous, WORD* row)
+  {
+    const __m128i shiftCount = _mm_cvtsi32_si128((int)shift);
+    const __m128i m = _mm_set1_epi16((short)mask);
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i carry = _mm_set1_epi16((short)previous);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+      const __m128i z = _mm_loadu_si128((const __m128i*)(residual + x));
+      const __m128i sign = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(z, one), one), m);
+      __m128i r = _mm_xor_si128(_mm_srli_epi16(z, 1), sign);
+      //Prefix sum of the 8 residuals
+      r = _mm_add_epi16(r, _mm_slli_si128(r, 2));
+      r = _mm_add_epi16(r, _mm_slli_si128(r, 4));
+      r = _mm_add_epi16(r, _mm_slli_si128(r, 8));
+      const __m128i value = _mm_and_si128(_mm_add_epi16(r, carry), m);
+      _mm_storeu_si128((__m128i*)(row + x), _mm_sll_epi16(value, shiftCount));
+      carry = _mm_shufflehi_epi16(value, 0xFF);
+      carry = _mm_unpackhi_epi64(carry, carry);
+    }
+    previous = (WORD)_mm_extract_epi16(carry, 0);
+    return x;
+  }
+
+  PCO_TARGET_SSE41 static BYTE* packSse41(const WORD* z, BYTE* out)
+  {
+    __m128i v0 = _mm_loadu_si128((const __m128i*)z);
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(z + 8));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(z + 16));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(z + 24));
+    __m128i any = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+    any = _mm_or_si128(any, _mm_srli_si128(any, 8));
+    any = _mm_or_si128(any, _mm_srli_si128(any, 4));
+    any = _mm_or_si128(any, _mm_srli_si128(any, 2));
+    const unsigned width = bitWidth((WORD)_mm_extract_epi16(any, 0));
+    *out++ = (BYTE)width;
+    if (width == 0)
+      return out;
+    //The top bit of every word is the current plane, from the highest plane down
+    const __m128i shiftCount = _mm_cvtsi32_si128(16 - (int)width);
+    v0 = _mm_sll_epi16(v0, shiftCount);
+    v1 = _mm_sll_epi16(v1, shiftCount);
+    v2 = _mm_sll_epi16(v2, shiftCount);
+    v3 = _mm_sll_epi16(v3, shiftCount);
+    for (int k = (int)width - 1; k >= 0; k--)
+    {
+      const uint32_t lo = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(v0, v1));
+      const uint32_t hi = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(v2, v3));
+      const uint32_t plane = lo | (hi << 16);
+      memcpy(out + k * 4, &plane, sizeof(plane));
+      v0 = _mm_add_epi16(v0, v0);
+      v1 = _mm_add_epi16(v1, v1);
+      v2 = _mm_add_epi16(v2, v2);
+      v3 = _mm_add_epi16(v3, v3);
+    }
+    return out + width * 4;
+  }
+
+  PCO_TARGET_SSE41 static const BYTE* unpackSse41(const BYTE* in, WORD* z)
+  {
+    const unsigned width = *in++;
+    const __m128i select = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    __m128i acc[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+    for (unsigned k = 0; k < width; k++)
+    {
+      uint32_t plane;
+      memcpy(&plane, in + k * 4, sizeof(plane));
+      const __m128i bit = _mm_set1_epi16((short)(1 << k));
+      for (int j = 0; j < 4; j++)
+      {
+        const __m128i bits = _mm_set1_epi16((short)((plane >> (8 * j)) & 0xFF));
+        const __m128i set = _mm_cmpeq_epi16(_mm_and_si128(bits, select), select);
+        acc[j] = _mm_or_si128(acc[j], _mm_and_si128(set, bit));
+      }
+    }
+    for (int j = 0; j < 4; j++)
+      _mm_storeu_si128((__m128i*)(z + 8 * j), acc[j]);
+    return in + width * 4;
+  }
+
+  PCO_TARGET_AVX2 static size_t orAvx2(const WORD* image, size_t count, WORD& any)
+  {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(image + i)));
+    __m128i a = _mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    a = _mm_or_si128(a, _mm_srli_si128(a, 8));
+    a = _mm_or_si128(a, _mm_srli_si128(a, 4));
+    a = _mm_or_si128(a, _mm_srli_si128(a, 2));
+    any |= (WORD)_mm_extract_epi16(a, 0);
+    return i;
+  }
+
+  PCO_TARGET_AVX2 static size_t residualsAvx2(const WORD* row, size_t width, unsigned shift, unsigned bits,
+    WORD mask, WORD* out)
+  {
+    const __m128i shiftCount = _mm_cvtsi32_si128((int)shift);
+    const __m128i bitsMinus1 = _mm_cvtsi32_si128((int)bits - 1);
+    const __m256i m = _mm256_set1_epi16((short)mask);
+    size_t x = 1;
+    for (; x + 16 <= width; x += 16)
+    {
+      const __m256i cur = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i*)(row + x)), shiftCount);
+      const __m256i left = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i*)(row + x - 1)), shiftCount);
+      const __m256i r = _mm256_and_si256(_mm256_sub_epi16(cur, left), m);
+      const __m256i sign = _mm256_sub_epi16(_mm256_setzero_si256(), _mm256_srl_epi16(r, bitsMinus1));
+      _mm256_storeu_si256((__m256i*)(out + x),
+        _mm256_and_si256(_mm256_xor_si256(_mm256_slli_epi16(r, 1), sign), m));
+    }
+    return x;
+  }
+
+  PCO_TARGET_AVX2 static size_t reconstructAvx2(const WORD* residual, size_t width, unsigned shift, WORD mask,
+    WORD& previous, WORD* row)
+  {
+    const __m128i shiftCount = _mm_cvtsi32_si128((int)shift);
+    const __m256i m = _mm256_set1_epi16((short)mask);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i lastWord = _mm256_set1_epi16(0x0F0E);
+    __m256i carry = _mm256_set1_epi16((short)previous);
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+      const __m256i z = _mm256_loadu_si256((const __m256i*)(residual + x));
+      const __m256i sign = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_and_si256(z, one), one), m);
+      __m256i r = _mm256_xor_si256(_mm256_srli_epi16(z, 1), sign);
+      //Prefix sum in both 128 bit lanes, then the sum of the low lane is added to the high lane
+      r = _mm256_add_epi16(r, _mm256_slli_si256(r, 2));
+      r = _mm256_add_epi16(r, _mm256_slli_si256(r, 4));
+      r = _mm256_add_epi16(r, _mm256_slli_si256(r, 8));
+      const __m256i lowSum = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r, r, 0x08), lastWord);
+      r = _mm256_add_epi16(r, lowSum);
+      const __m256i value = _mm256_and_si256(_mm256_add_epi16(r, carry), m);
+      _mm256_storeu_si256((__m256i*)(row + x), _mm256_sll_epi16(value, shiftCount));
+      carry = _mm256_shuffle_epi8(_mm256_permute2x128_si256(value, value, 0x11), lastWord);
+    }
+    previous = (WORD)_mm256_extract_epi16(carry, 0);
+    return x;
+  }
+
+  PCO_TARGET_AVX2 static BYTE* packAvx2(const WORD* z, BYTE* out)
+  {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)z);
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(z + 16));
+    const __m256i both = _mm256_or_si256(v0, v1);
+    __m128i any = _mm_or_si128(_mm256_castsi256_si128(both), _mm256_extracti128_si256(both, 1));
+    any = _mm_or_si128(any, _mm_srli_si128(any, 8));
+    any = _mm_or_si128(any, _mm_srli_si128(any, 4));
+    any = _mm_or_si128(any, _mm_srli_si128(any, 2));
+    const unsigned width = bitWidth((WORD)_mm_extract_epi16(any, 0));
+    *out++ = (BYTE)width;
+    if (width == 0)
+      return out;
+    //The top bit of every word is the current plane, from the highest plane down
+    const __m128i shiftCount = _mm_cvtsi32_si128(16 - (int)width);
+    v0 = _mm256_sll_epi16(v0, shiftCount);
+    v1 = _mm256_sll_epi16(v1, shiftCount);
+    for (int k = (int)width - 1; k >= 0; k--)
+    {
+      //packs works per 128 bit lane, the permute brings the bytes back into pixel order
+      const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(v0, v1), 0xD8);
+      const uint32_t plane = (uint32_t)_mm256_movemask_epi8(packed);
+      memcpy(out + k * 4, &plane, sizeof(plane));
+      v0 = _mm256_add_epi16(v0, v0);
+      v1 = _mm256_add_epi16(v1, v1);
+    }
+    return out + width * 4;
+  }
+
+  PCO_TARGET_AVX2 static const BYTE* unpackAvx2(const BYTE* in, WORD* z)
+  {
+    const unsigned width = *in++;
+    //Byte i of the mask gets the plane byte i / 8, then the bit i % 8 is tested
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+      2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i select = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    for (unsigned k = 0; k < width; k++)
+    {
+      int plane;
+      memcpy(&plane, in + k * 4, sizeof(plane));
+      const __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(plane), spread);
+      const __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+      const __m256i bit = _mm256_set1_epi16((short)(1 << k));
+      acc0 = _mm256_or_si256(acc0, _mm256_and_si256(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(set)), bit));
+      acc1 = _mm256_or_si256(acc1, _mm256_and_si256(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(set, 1)), bit));
+    }
+    _mm256_storeu_si256((__m256i*)z, acc0);
+    _mm256_storeu_si256((__m256i*)(z + 16), acc1);
+    return in + width * 4;
+  }
+#endif
+
+  WORD m_bits;
+  WORD m_bitAlignment;
+  CpuIsa m_isa;
+  unsigned m_threadCount;
+};
+
+// Test image with the statistics of a camera image: smooth illumination with shot noise and read noise
+inline void makeSyntheticFrame(std::vector<WORD>& image, WORD width, WORD height, WORD bits)
+{
+  image.resize((size_t)width * height);
+  const double maxValue = (double)((1u << bits) - 1);
+  uint32_t state = 0x12345678;
+  auto uniform = [&state]()
+    {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return (state & 0xFFFFFF) / (double)0x1000000;
+    };
+  for (WORD y = 0; y < height; y++)
+    for (WORD x = 0; x < width; x++)
+    {
+      //Vignetted illumination, up to about half of the range
+      const double dx = (x - width / 2.0) / width, dy = (y - height / 2.0) / height;
+      const double signal = 100.0 + maxValue * 0.5 * (1.0 - 1.5 * (dx * dx + dy * dy));
+      //Approximately normal distributed noise (sum of uniform values)
+      const double normal = (uniform() + uniform() + uniform() + uniform() - 2.0) * 1.732;
+      const double noise = normal * std::sqrt(signal * 0.5 + 4.0);
+      image[(size_t)y * width + x] = (WORD)std::min(std::max(signal + noise, 0.0), maxValue);
+    }
+}
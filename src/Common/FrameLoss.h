@@ -0,0 +1,152 @@
+#pragma once
+
+// Frame loss accounting
+// The image numbers of consecutive images of a camera increase by one. If the
+// consumer can not keep up and the FIFO overflows, the recorder drops images,
+// which shows up as a gap in the image numbers. The monitor counts these gaps
+// and the number of lost images. Additionally it tracks the FIFO fill level:
+// the highest level seen and how long the level was at or above a threshold
+// (a fraction of the FIFO size), which shows how close a setup is to losing
+// images before it actually does.
+
+#include "PcoSdk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+struct FrameLossStats
+{
+  DWORD frames = 0;                                  //Images received
+  DWORD lostFrames = 0;                              //Images missing in the sequence
+  DWORD gaps = 0;                                    //Number of gaps
+  DWORD largestGap = 0;
+  DWORD outOfOrder = 0;                              //Repeated or decreasing image numbers
+  DWORD firstImgNumber = 0;
+  DWORD lastImgNumber = 0;
+  DWORD fillCapacity = 0;                            //FIFO size, 0 if not known
+  DWORD fillHighWater = 0;
+  double secondsAboveThreshold = 0.0;
+  double seconds = 0.0;                              //Time between first and last fill level update
+
+  bool lossFree() const
+  {
+    return lostFrames == 0 && outOfOrder == 0;
+  }
+};
+
+// Loss counters for several cameras, all functions are thread safe
+class FrameLossMonitor
+{
+public:
+  //threshold is the fill level fraction which counts as critical
+  explicit FrameLossMonitor(WORD camCount = 1, double threshold = 0.8)
+    : m_threshold(threshold), m_cameras(std::max<WORD>(camCount, 1))
+  {
+  }
+
+  //FIFO size of the camera, e.g. the required image count of PCO_RecorderInit
+  void setCapacity(WORD cam, DWORD capacity)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    camera(cam).stats.fillCapacity = capacity;
+  }
+
+  //Call for every image in the order of reception
+  void frameReceived(WORD cam, DWORD imgNumber)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    FrameLossStats& stats = camera(cam).stats;
+    if (stats.frames == 0)
+      stats.firstImgNumber = imgNumber;
+    else if (imgNumber <= stats.lastImgNumber)
+      stats.outOfOrder++;
+    else if (imgNumber > stats.lastImgNumber + 1)
+    {
+      const DWORD lost = imgNumber - stats.lastImgNumber - 1;
+      stats.lostFrames += lost;
+      stats.gaps++;
+      stats.largestGap = std::max(stats.largestGap, lost);
+    }
+    if (stats.frames == 0 || imgNumber > stats.lastImgNumber)
+      stats.lastImgNumber = imgNumber;
+    stats.frames++;
+  }
+
+  //Call with the fill level of every status poll
+  void fillLevel(WORD cam, DWORD level)
+  {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Camera& c = camera(cam);
+    FrameLossStats& stats = c.stats;
+    if (c.hasLevel)
+    {
+      //The previous level is assumed to last until now
+      const double elapsed = std::chrono::duration<double>(now - c.lastUpdate).count();
+      stats.seconds += elapsed;
+      if (c.aboveThreshold)
+        stats.secondsAboveThreshold += elapsed;
+    }
+    stats.fillHighWater = std::max(stats.fillHighWater, level);
+    c.aboveThreshold = stats.fillCapacity > 0 && level >= m_threshold * stats.fillCapacity;
+    c.lastUpdate = now;
+    c.hasLevel = true;
+  }
+
+  FrameLossStats stats(WORD cam) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cameras[std::min<size_t>(cam, m_cameras.size() - 1)].stats;
+  }
+
+  bool lossFree() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const Camera& c : m_cameras)
+    {
+      if (!c.stats.lossFree())
+        return false;
+    }
+    return true;
+  }
+
+  void print() const
+  {
+    printf("%-10s%10s%10s%8s%10s%12s%12s%14s\n", "Camera", "images", "lost", "gaps", "largest", "unordered",
+      "high water", "above limit");
+    for (WORD cam = 0; cam < m_cameras.size(); cam++)
+    {
+      FrameLossStats s = stats(cam);
+      char highWater[32];
+      if (s.fillCapacity)
+        snprintf(highWater, sizeof(highWater), "%u/%u", (unsigned)s.fillHighWater, (unsigned)s.fillCapacity);
+      else
+        snprintf(highWater, sizeof(highWater), "%u", (unsigned)s.fillHighWater);
+      printf("%-10d%10u%10u%8u%10u%12u%12s%12.3f s\n", cam, (unsigned)s.frames, (unsigned)s.lostFrames,
+        (unsigned)s.gaps, (unsigned)s.largestGap, (unsigned)s.outOfOrder, highWater, s.secondsAboveThreshold);
+    }
+    printf("Fill level limit %.0f%% of the FIFO, %s\n", m_threshold * 100.0,
+      lossFree() ? "no images lost" : "IMAGES LOST");
+  }
+
+private:
+  struct Camera
+  {
+    FrameLossStats stats;
+    std::chrono::steady_clock::time_point lastUpdate;
+    bool hasLevel = false;
+    bool aboveThreshold = false;
+  };
+
+  Camera& camera(WORD cam)
+  {
+    return m_cameras[std::min<size_t>(cam, m_cameras.size() - 1)];
+  }
+
+  double m_threshold;
+  mutable std::mutex m_mutex;
+  std::vector<Camera> m_cameras;
+};
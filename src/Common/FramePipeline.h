@@ -0,0 +1,264 @@
+#pragma once
+
+// Three stage pipeline for image processing
+//   source (one thread) -> process (worker pool) -> sink (one thread)
+// The stages are connected by bounded queues and work on a fixed set of frame
+// objects, which are handed out again after the sink is done with them. So the
+// number of frames in flight (and the memory) is limited by the frame count,
+// and a slow stage throttles the stages in front of it.
+// The sink gets the frames strictly in source order, although the workers can
+// finish them in any order.
+
+#include "PcoSdk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Queue with a maximum size, push blocks while it is full and pop while it is empty
+template <class T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t capacity) : m_capacity(std::max<size_t>(capacity, 1)) {}
+
+  //Returns false if the queue was closed
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notFull.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+    if (m_closed)
+      return false;
+    m_items.push_back(std::move(item));
+    lock.unlock();
+    m_notEmpty.notify_one();
+    return true;
+  }
+
+  //Returns false if the queue is closed and empty
+  bool pop(T& item)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+    if (m_items.empty())
+      return false;
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    lock.unlock();
+    m_notFull.notify_one();
+    return true;
+  }
+
+  //Wakes up all waiting threads, remaining items can still be popped
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_notEmpty.notify_all();
+    m_notFull.notify_all();
+  }
+
+private:
+  size_t m_capacity;
+  std::mutex m_mutex;
+  std::condition_variable m_notEmpty;
+  std::condition_variable m_notFull;
+  std::deque<T> m_items;
+  bool m_closed = false;
+};
+
+struct PipelineStats
+{
+  DWORD frames = 0;
+  unsigned workers = 0;
+  double seconds = 0.0;
+  double sourceSeconds = 0.0;                        //Time spent in the stage callbacks
+  double processSeconds = 0.0;                       //Sum over all workers
+  double sinkSeconds = 0.0;
+
+  double framesPerSecond() const
+  {
+    return seconds > 0.0 ? frames / seconds : 0.0;
+  }
+};
+
+template <class Frame>
+class FramePipeline
+{
+public:
+  //source fills the frame with index 0 ... count - 1 (on the source thread)
+  using SourceCallback = std::function<int(Frame& frame, DWORD index)>;
+  //worker is 0 ... workerCount - 1, e.g. to use one converter per worker
+  using ProcessCallback = std::function<int(Frame& frame, unsigned worker)>;
+  using SinkCallback = std::function<int(Frame& frame, DWORD index)>;
+
+  //frames are the objects which are passed through the stages, at least one
+  //per worker plus one for source and sink is needed to keep all stages busy
+  //workerCount 0 uses one worker per hardware thread
+  FramePipeline(std::vector<Frame*> frames, unsigned workerCount = 0)
+    : m_frames(std::move(frames))
+  {
+    m_workerCount = workerCount ? workerCount : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  unsigned workerCount() const
+  {
+    return m_workerCount;
+  }
+
+  //Runs all stages for count frames, returns the first error of any stage (or PCO_NOERROR)
+  int run(DWORD count, SourceCallback source, ProcessCallback process, SinkCallback sink)
+  {
+    if (m_frames.empty())
+      return PCO_ERROR_WRONGVALUE;
+    const size_t depth = m_frames.size();
+    BoundedQueue<Slot> freeQueue(depth);
+    BoundedQueue<Slot> workQueue(depth);
+    BoundedQueue<Slot> doneQueue(depth);
+    for (Frame* frame : m_frames)
+      freeQueue.push(Slot{ frame, 0 });
+
+    m_error = PCO_NOERROR;
+    m_stats = PipelineStats();
+    m_stats.workers = m_workerCount;
+    auto startTime = std::chrono::steady_clock::now();
+
+    auto abort = [&](int error)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_error == PCO_NOERROR)
+          m_error = error;
+      }
+      freeQueue.close();
+      workQueue.close();
+      doneQueue.close();
+    };
+
+    std::thread sourceThread([&]()
+      {
+        for (DWORD index = 0; index < count; index++)
+        {
+          Slot slot;
+          if (!freeQueue.pop(slot))
+            break;
+          slot.index = index;
+          int iRet = timed(m_stats.sourceSeconds, [&]() { return source(*slot.frame, index); });
+          if (iRet != PCO_NOERROR)
+          {
+            abort(iRet);
+            break;
+          }
+          if (!workQueue.push(slot))
+            break;
+        }
+        workQueue.close();
+      });
+
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> running(m_workerCount);
+    for (unsigned worker = 0; worker < m_workerCount; worker++)
+    {
+      workers.emplace_back([&, worker]()
+        {
+          double busy = 0.0;
+          Slot slot;
+          while (workQueue.pop(slot))
+          {
+            int iRet = process ? timed(busy, [&]() { return process(*slot.frame, worker); }) : PCO_NOERROR;
+            if (iRet != PCO_NOERROR)
+            {
+              abort(iRet);
+              break;
+            }
+            if (!doneQueue.push(slot))
+              break;
+          }
+          {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.processSeconds += busy;
+          }
+          //The last worker ends the sink
+          if (--running == 0)
+            doneQueue.close();
+        });
+    }
+
+    //The sink runs on the calling thread and puts the frames back into order
+    std::map<DWORD, Slot> pending;
+    DWORD next = 0;
+    int sinkError = PCO_NOERROR;
+    Slot slot;
+    while (sinkError == PCO_NOERROR && next < count && doneQueue.pop(slot))
+    {
+      pending[slot.index] = slot;
+      for (auto it = pending.find(next); it != pending.end(); it = pending.find(next))
+      {
+        sinkError = sink ? timed(m_stats.sinkSeconds, [&]() { return sink(*it->second.frame, next); }) : PCO_NOERROR;
+        freeQueue.push(it->second);
+        pending.erase(it);
+        next++;
+        if (sinkError != PCO_NOERROR)
+          break;
+      }
+    }
+    //Unblock the other stages if the sink stopped early
+    abort(sinkError);
+
+    sourceThread.join();
+    for (auto& w : workers)
+      w.join();
+
+    m_stats.frames = next;
+    m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    return m_error;
+  }
+
+  const PipelineStats& stats() const
+  {
+    return m_stats;
+  }
+
+private:
+  struct Slot
+  {
+    Frame* frame;
+    DWORD index;
+  };
+
+  template <class F>
+  static int timed(double& seconds, F&& function)
+  {
+    auto start = std::chrono::steady_clock::now();
+    int iRet = function();
+    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return iRet;
+  }
+
+  std::vector<Frame*> m_frames;
+  unsigned m_workerCount;
+  std::mutex m_mutex;
+  int m_error = PCO_NOERROR;
+  PipelineStats m_stats;
+};
+
+// Prints the throughput and the average time per frame of every stage
+inline void printPipelineStats(const PipelineStats& stats)
+{
+  const double frames = std::max<DWORD>(stats.frames, 1);
+  printf("Pipeline: %d images in %.3f s (%.1f images/s) with %u workers\n",
+    stats.frames, stats.seconds, stats.framesPerSecond(), stats.workers);
+  printf("Per image: source %.2f ms, process %.2f ms (%.2f ms spread over the workers), sink %.2f ms\n",
+    stats.sourceSeconds * 1000.0 / frames, stats.processSeconds * 1000.0 / frames,
+    stats.processSeconds * 1000.0 / frames / std::max(stats.workers, 1u), stats.sinkSeconds * 1000.0 / frames);
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+// Groups the images of several cameras into frame sets
+// Every camera has its own reader thread (e.g. a FifoConsumer) which adds its
+// images with add(). Images of different cameras belong to the same set if
+// their image numbers are equal, or if their metadata timestamps differ by no
+// more than a tolerance (needs METADATA_MODE_ON). Complete sets are handed to
+// the processing thread through a lock-free queue (pop()).
+// A set which is not complete after maxWait is discarded and counted as
+// incomplete, so a camera that lost an image does not hold back the others and
+// the latency of the sets stays bounded. The images of discarded sets are
+// given back with the release callback.
+
+#include "PcoSdk.h"
+#include "Metadata.h"
+#include "SpscQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+enum class FrameSetMatch
+{
+  ImageNumber,
+  Timestamp
+};
+
+struct SetFrame
+{
+  WORD* image = nullptr;
+  DWORD imgNumber = 0;
+  int64_t timestampUs = 0;                           //Camera timestamp, see metadataTimestampUs()
+  PCO_METADATA_STRUCT metadata;
+};
+
+struct FrameSet
+{
+  DWORD imgNumber = 0;                               //Image number of the first image of the set
+  int64_t timestampUs = 0;                           //Timestamp of the first image of the set
+  int64_t skewUs = 0;                                //Largest timestamp difference within the set
+  int64_t assemblyUs = 0;                            //Host time between first and last image of the set
+  std::vector<SetFrame> frames;                      //One image per camera
+};
+
+struct FrameSetStats
+{
+  uint64_t framesAdded = 0;
+  uint64_t completeSets = 0;
+  uint64_t incompleteSets = 0;                       //Discarded after maxWait
+  uint64_t droppedSets = 0;                          //Complete, but the output queue was full
+  int64_t maxAssemblyUs = 0;
+  int64_t maxSkewUs = 0;
+  std::vector<uint64_t> missingFrames;               //Per camera, images missing in incomplete sets
+};
+
+class FrameSetAssembler
+{
+public:
+  using ReleaseCallback = std::function<void(WORD cam, WORD* image)>;
+
+  //toleranceUs is only used for FrameSetMatch::Timestamp
+  //queueCapacity is the number of complete sets which can wait for pop()
+  FrameSetAssembler(WORD camCount, FrameSetMatch match, int64_t toleranceUs = 1000,
+    std::chrono::milliseconds maxWait = std::chrono::milliseconds(500), size_t queueCapacity = 16,
+    ReleaseCallback release = nullptr)
+    : m_camCount(std::max<WORD>(camCount, 1)), m_match(match), m_toleranceUs(toleranceUs),
+    m_maxWait(maxWait), m_release(std::move(release)), m_queue(queueCapacity)
+  {
+    m_stats.missingFrames.assign(m_camCount, 0);
+  }
+
+  ~FrameSetAssembler()
+  {
+    flush();
+    FrameSet set;
+    while (pop(set))
+      release(set);
+  }
+
+  FrameSetAssembler(const FrameSetAssembler&) = delete;
+  FrameSetAssembler& operator=(const FrameSetAssembler&) = delete;
+
+  //Called by the reader thread of camera cam, the image belongs to the assembler until released
+  void add(WORD cam, WORD* image, DWORD imgNumber, const PCO_METADATA_STRUCT& metadata)
+  {
+    if (cam >= m_camCount)
+    {
+      if (m_release)
+        m_release(cam, image);
+      return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.framesAdded++;
+    expireLocked(now);
+
+    SetFrame frame;
+    frame.image = image;
+    frame.imgNumber = imgNumber;
+    frame.timestampUs = metadataTimestampUs(metadata);
+    frame.metadata = metadata;
+
+    auto pending = findLocked(cam, frame);
+    if (pending == m_pending.end())
+    {
+      Pending created;
+      created.set.imgNumber = imgNumber;
+      created.set.timestampUs = frame.timestampUs;
+      created.set.frames.resize(m_camCount);
+      created.firstArrival = now;
+      m_pending.push_back(std::move(created));
+      pending = m_pending.end() - 1;
+    }
+    pending->set.frames[cam] = frame;
+    pending->count++;
+    if (pending->count < m_camCount)
+      return;
+
+    //Complete
+    FrameSet& set = pending->set;
+    int64_t minTime = INT64_MAX, maxTime = INT64_MIN;
+    for (const SetFrame& f : set.frames)
+    {
+      minTime = std::min(minTime, f.timestampUs);
+      maxTime = std::max(maxTime, f.timestampUs);
+    }
+    set.skewUs = maxTime - minTime;
+    set.assemblyUs = std::chrono::duration_cast<std::chrono::microseconds>(now - pending->firstArrival).count();
+    m_stats.maxSkewUs = std::max(m_stats.maxSkewUs, set.skewUs);
+    m_stats.maxAssemblyUs = std::max(m_stats.maxAssemblyUs, set.assemblyUs);
+    if (m_queue.push(std::move(set)))
+      m_stats.completeSets++;
+    else
+    {
+      m_stats.droppedSets++;
+      release(pending->set);
+    }
+    m_pending.erase(pending);
+  }
+
+  //Takes the next complete set, only from one thread, does not block
+  //The images have to be given back with release() (or directly) after processing
+  bool pop(FrameSet& set)
+  {
+    return m_queue.pop(set);
+  }
+
+  //Gives all images of the set to the release callback
+  void release(FrameSet& set)
+  {
+    for (WORD cam = 0; cam < set.frames.size(); cam++)
+    {
+      if (set.frames[cam].image != nullptr && m_release)
+        m_release(cam, set.frames[cam].image);
+      set.frames[cam].image = nullptr;
+    }
+  }
+
+  //Discards the sets which waited longer than maxWait, is also done by add()
+  void expire()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    expireLocked(std::chrono::steady_clock::now());
+  }
+
+  //Discards all incomplete sets, e.g. after the record was stopped
+  void flush()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (!m_pending.empty())
+      discardOldestLocked();
+  }
+
+  FrameSetStats stats() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+  }
+
+  void print() const
+  {
+    FrameSetStats s = stats();
+    printf("Frame sets: %llu complete, %llu incomplete, %llu dropped (queue full), %llu images added\n",
+      (unsigned long long)s.completeSets, (unsigned long long)s.incompleteSets,
+      (unsigned long long)s.droppedSets, (unsigned long long)s.framesAdded);
+    printf("Max timestamp skew within a set %lld us, max assembly time %lld us\n",
+      (long long)s.maxSkewUs, (long long)s.maxAssemblyUs);
+    for (WORD cam = 0; cam < s.missingFrames.size(); cam++)
+    {
+      if (s.missingFrames[cam])
+        printf("Camera %d was missing in %llu sets\n", cam, (unsigned long long)s.missingFrames[cam]);
+    }
+  }
+
+private:
+  struct Pending
+  {
+    FrameSet set;
+    WORD count = 0;
+    std::chrono::steady_clock::time_point firstArrival;
+  };
+
+  std::deque<Pending>::iterator findLocked(WORD cam, const SetFrame& frame)
+  {
+    auto best = m_pending.end();
+    int64_t bestDistance = INT64_MAX;
+    for (auto it = m_pending.begin(); it != m_pending.end(); ++it)
+    {
+      if (it->set.frames[cam].image != nullptr)
+        continue;
+      if (m_match == FrameSetMatch::ImageNumber)
+      {
+        if (it->set.imgNumber == frame.imgNumber)
+          return it;
+        continue;
+      }
+      const int64_t distance = std::abs(it->set.timestampUs - frame.timestampUs);
+      if (distance <= m_toleranceUs && distance < bestDistance)
+      {
+        best = it;
+        bestDistance = distance;
+      }
+    }
+    return best;
+  }
+
+  void expireLocked(std::chrono::steady_clock::time_point now)
+  {
+    //Sets are created in time order, so the oldest one is always at the front
+    while (!m_pending.empty() && now - m_pending.front().firstArrival > m_maxWait)
+      discardOldestLocked();
+  }
+
+  void discardOldestLocked()
+  {
+    Pending& oldest = m_pending.front();
+    m_stats.incompleteSets++;
+    for (WORD cam = 0; cam < m_camCount; cam++)
+    {
+      if (oldest.set.frames[cam].image == nullptr)
+        m_stats.missingFrames[cam]++;
+    }
+    release(oldest.set);
+    m_pending.pop_front();
+  }
+
+  WORD m_camCount;
+  FrameSetMatch m_match;
+  int64_t m_toleranceUs;
+  std::chrono::milliseconds m_maxWait;
+  ReleaseCallback m_release;
+
+  mutable std::mutex m_mutex;
+  std::deque<Pending> m_pending;
+  FrameSetStats m_stats;
+  SpscQueue<FrameSet> m_queue;
+};
@@ -0,0 +1,362 @@
+#pragma once
+
+// Per image statistics for quality control
+// FrameStatsKernel computes min, max, mean, variance, a histogram and the number
+// of saturated pixels in a single pass over the image. It is meant to run right
+// after PCO_RecorderCopyImage, while the image is still in the cache, so the
+// statistics cost no extra pass over memory (see FifoConsumer::setFrameStats and
+// ParallelReadout::setFrameStats, which store them next to the metadata).
+// Min, max, sums and the saturation count are computed with SSE4.1 or AVX2 if
+// available (CpuIsa of CpuDispatch.h), the histogram with several sub
+// histograms to avoid store to load stalls on equal bins. Large images can be
+// split into stripes of rows for several threads.
+// The kernel keeps the partial results of the stripes and the stripe threads
+// for its lifetime, so compute() neither allocates nor starts threads. For the
+// same reason compute() must not be called from several threads at once, every
+// thread which computes statistics needs its own kernel.
+
+#include "PcoSdk.h"
+#include "CpuDispatch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct FrameStatsSettings
+{
+  WORD bits = 16;                                    //Dynamic resolution (wDynResDESC), range of the histogram
+  WORD binCount = 256;                               //Rounded down to a power of 2, at most 2^bits
+  WORD saturation = 0;                               //Pixels >= this are saturated, 0 for 2^bits - 1
+  unsigned threadCount = 1;                          //Threads per image, 0 for one per hardware thread
+};
+
+struct FrameStats
+{
+  WORD minValue = 0;
+  WORD maxValue = 0;
+  double mean = 0.0;
+  double variance = 0.0;
+  DWORD saturated = 0;
+  WORD binShift = 0;                                 //Bin of a pixel is value >> binShift
+  std::vector<DWORD> histogram;
+  bool valid = false;
+};
+
+class FrameStatsKernel
+{
+public:
+  explicit FrameStatsKernel(const FrameStatsSettings& settings = FrameStatsSettings(),
+    CpuIsa isa = bestCpuIsa())
+    : m_settings(settings), m_isa(std::min(isa, bestCpuIsa()))
+  {
+    m_settings.bits = std::min<WORD>(std::max<WORD>(m_settings.bits, 1), 16);
+    WORD binBits = 0;
+    while (binBits < m_settings.bits && (2u << binBits) <= m_settings.binCount)
+      binBits++;
+    m_settings.binCount = (WORD)(1u << binBits);
+    m_binShift = (WORD)(m_settings.bits - binBits);
+    if (m_settings.saturation == 0)
+      m_settings.saturation = (WORD)((1u << m_settings.bits) - 1);
+    if (m_settings.threadCount == 0)
+      m_settings.threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    m_partials.resize(std::min(m_settings.threadCount, MaxStripes));
+    for (Partial& partial : m_partials)
+      partial.histogram.resize((size_t)SubHistograms * m_settings.binCount);
+    for (unsigned s = 1; s < m_partials.size(); s++)
+      m_workers.emplace_back(&FrameStatsKernel::stripeWorker, this, s);
+  }
+
+  ~FrameStatsKernel()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_exit = true;
+    }
+    m_jobCond.notify_all();
+    for (auto& worker : m_workers)
+      worker.join();
+  }
+
+  FrameStatsKernel(const FrameStatsKernel&) = delete;
+  FrameStatsKernel& operator=(const FrameStatsKernel&) = delete;
+
+  const FrameStatsSettings& settings() const
+  {
+    return m_settings;
+  }
+
+  CpuIsa isa() const
+  {
+    return m_isa;
+  }
+
+  //Statistics of the image, the histogram vector of stats is reused
+  //Not thread safe, see above
+  int compute(const WORD* image, WORD width, WORD height, FrameStats& stats)
+  {
+    stats.valid = false;
+    if (image == nullptr || width == 0 || height == 0)
+      return PCO_ERROR_WRONGVALUE;
+
+    const unsigned count = std::min<unsigned>((unsigned)m_partials.size(), height);
+    if (count <= 1)
+      accumulate(image, width, 0, height, m_partials[0]);
+    else
+    {
+      //Stripe 0 on this thread, the others on the stripe workers
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job.image = image;
+        m_job.width = width;
+        m_job.height = height;
+        m_job.stripes = count;
+        m_pending = count - 1;
+        m_generation++;
+      }
+      m_jobCond.notify_all();
+      accumulate(image, width, 0, height / count, m_partials[0]);
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_doneCond.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+    stats.histogram.resize(m_settings.binCount);
+    std::fill(stats.histogram.begin(), stats.histogram.end(), 0);
+    uint64_t sum = 0, sumSquares = 0, saturated = 0;
+    WORD minValue = 0xFFFF, maxValue = 0;
+    for (unsigned s = 0; s < std::max(count, 1u); s++)
+    {
+      const Partial& partial = m_partials[s];
+      sum += partial.sum;
+      sumSquares += partial.sumSquares;
+      saturated += partial.saturated;
+      minValue = std::min(minValue, partial.minValue);
+      maxValue = std::max(maxValue, partial.maxValue);
+      for (size_t b = 0; b < partial.histogram.size(); b++)
+        stats.histogram[b % m_settings.binCount] += partial.histogram[b];
+    }
+    const double pixels = (double)width * height;
+    stats.minValue = minValue;
+    stats.maxValue = maxValue;
+    stats.mean = sum / pixels;
+    stats.variance = std::max(0.0, sumSquares / pixels - stats.mean * stats.mean);
+    stats.saturated = (DWORD)saturated;
+    stats.binShift = m_binShift;
+    stats.valid = true;
+    return PCO_NOERROR;
+  }
+
+private:
+  static constexpr unsigned MaxStripes = 64;
+  static const unsigned SubHistograms = 4;
+
+  struct Partial
+  {
+    uint64_t sum = 0;
+    uint64_t sumSquares = 0;
+    uint64_t saturated = 0;
+    WORD minValue = 0xFFFF;
+    WORD maxValue = 0;
+    std::vector<DWORD> histogram;                    //SubHistograms * binCount
+  };
+
+  struct StripeJob
+  {
+    const WORD* image = nullptr;
+    WORD width = 0;
+    WORD height = 0;
+    unsigned stripes = 0;
+  };
+
+  //Waits for the next image and accumulates its stripe, if the image has that many
+  void stripeWorker(unsigned stripe)
+  {
+    uint64_t done = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+      m_jobCond.wait(lock, [&]() { return m_exit || m_generation != done; });
+      if (m_exit)
+        return;
+      done = m_generation;
+      const StripeJob job = m_job;
+      if (stripe >= job.stripes)
+        continue;
+      lock.unlock();
+      accumulate(job.image, job.width, job.height * stripe / job.stripes, job.height * (stripe + 1) / job.stripes,
+        m_partials[stripe]);
+      lock.lock();
+      if (--m_pending == 0)
+        m_doneCond.notify_one();
+    }
+  }
+
+  void accumulate(const WORD* image, WORD width, unsigned y0, unsigned y1, Partial& p) const
+  {
+    p.sum = 0;
+    p.sumSquares = 0;
+    p.saturated = 0;
+    p.minValue = 0xFFFF;
+    p.maxValue = 0;
+    std::fill(p.histogram.begin(), p.histogram.end(), 0);
+    DWORD* histogram = p.histogram.data();
+    const unsigned lastBin = m_settings.binCount - 1u;
+    const unsigned shift = m_binShift;
+    for (unsigned y = y0; y < y1; y++)
+    {
+      const WORD* row = image + (size_t)y * width;
+      size_t x = 0;
+#ifdef PCO_CPU_X86
+      if (m_isa == CpuIsa::AVX2)
+        x = rowAvx2(row, width, p);
+      else if (m_isa == CpuIsa::SSE41)
+        x = rowSse41(row, width, p);
+      //The vector kernels leave the histogram to this loop, the row is in L1
+      histogramRow(row, x, shift, lastBin, histogram);
+#endif
+      for (; x < width; x++)
+      {
+        const WORD v = row[x];
+        p.sum += v;
+        p.sumSquares += (uint64_t)v * v;
+        p.saturated += v >= m_settings.saturation;
+        p.minValue = std::min(p.minValue, v);
+        p.maxValue = std::max(p.maxValue, v);
+        histogram[(x % SubHistograms) * m_settings.binCount + std::min<unsigned>(v >> shift, lastBin)]++;
+      }
+    }
+  }
+
+  void histogramRow(const WORD* row, size_t count, unsigned shift, unsigned lastBin, DWORD* histogram) const
+  {
+    DWORD* h0 = histogram;
+    DWORD* h1 = h0 + m_settings.binCount;
+    DWORD* h2 = h1 + m_settings.binCount;
+    DWORD* h3 = h2 + m_settings.binCount;
+    for (size_t i = 0; i + 4 <= count; i += 4)
+    {
+      h0[std::min<unsigned>(row[i] >> shift, lastBin)]++;
+      h1[std::min<unsigned>(row[i + 1] >> shift, lastBin)]++;
+      h2[std::min<unsigned>(row[i + 2] >> shift, lastBin)]++;
+      h3[std::min<unsigned>(row[i + 3] >> shift, lastBin)]++;
+    }
+  }
+
+#ifdef PCO_CPU_X86
+  PCO_TARGET_SSE41 static uint64_t horizontalSum64(__m128i v)
+  {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, v);
+    return lanes[0] + lanes[1];
+  }
+
+  //Adds the 32 bit lanes to the 64 bit sums: even lanes directly, odd lanes shifted down
+  PCO_TARGET_SSE41 static void addSse41(__m128i v32, __m128i& sum, __m128i& squares)
+  {
+    const __m128i odd = _mm_srli_epi64(v32, 32);
+    sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_and_si128(v32, _mm_set1_epi64x(0xFFFFFFFF)), odd));
+    squares = _mm_add_epi64(squares, _mm_add_epi64(_mm_mul_epu32(v32, v32), _mm_mul_epu32(odd, odd)));
+  }
+
+  PCO_TARGET_SSE41 size_t rowSse41(const WORD* row, size_t width, Partial& p) const
+  {
+    __m128i minV = _mm_set1_epi16((short)p.minValue);
+    __m128i maxV = _mm_set1_epi16((short)p.maxValue);
+    __m128i sum = _mm_setzero_si128(), squares = _mm_setzero_si128();
+    //Counts down by one per saturated pixel, a row has less than 2^16 / 8 iterations per lane
+    __m128i saturated = _mm_setzero_si128();
+    const __m128i threshold = _mm_set1_epi16((short)m_settings.saturation);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+      const __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+      minV = _mm_min_epu16(minV, v);
+      maxV = _mm_max_epu16(maxV, v);
+      saturated = _mm_add_epi16(saturated, _mm_cmpeq_epi16(_mm_max_epu16(v, threshold), v));
+      addSse41(_mm_cvtepu16_epi32(v), sum, squares);
+      addSse41(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)), sum, squares);
+    }
+    minV = _mm_minpos_epu16(minV);
+    p.minValue = (WORD)_mm_extract_epi16(minV, 0);
+    //Max as min of the complement
+    maxV = _mm_minpos_epu16(_mm_xor_si128(maxV, _mm_set1_epi16(-1)));
+    p.maxValue = (WORD)~_mm_extract_epi16(maxV, 0);
+    p.sum += horizontalSum64(sum);
+    p.sumSquares += horizontalSum64(squares);
+    const __m128i counts = _mm_madd_epi16(_mm_sub_epi16(_mm_setzero_si128(), saturated), _mm_set1_epi16(1));
+    p.saturated += (uint32_t)_mm_extract_epi32(counts, 0) + (uint32_t)_mm_extract_epi32(counts, 1) +
+      (uint32_t)_mm_extract_epi32(counts, 2) + (uint32_t)_mm_extract_epi32(counts, 3);
+    return x;
+  }
+
+  PCO_TARGET_AVX2 static void addAvx2(__m256i v32, __m256i& sum, __m256i& squares)
+  {
+    const __m256i odd = _mm256_srli_epi64(v32, 32);
+    sum = _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_and_si256(v32, _mm256_set1_epi64x(0xFFFFFFFF)), odd));
+    squares = _mm256_add_epi64(squares, _mm256_add_epi64(_mm256_mul_epu32(v32, v32), _mm256_mul_epu32(odd, odd)));
+  }
+
+  PCO_TARGET_AVX2 size_t rowAvx2(const WORD* row, size_t width, Partial& p) const
+  {
+    __m256i minV = _mm256_set1_epi16((short)p.minValue);
+    __m256i maxV = _mm256_set1_epi16((short)p.maxValue);
+    __m256i sum = _mm256_setzero_si256(), squares = _mm256_setzero_si256();
+    __m256i saturated = _mm256_setzero_si256();
+    const __m256i threshold = _mm256_set1_epi16((short)m_settings.saturation);
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+      const __m256i v = _mm256_loadu_si256((const __m256i*)(row + x));
+      minV = _mm256_min_epu16(minV, v);
+      maxV = _mm256_max_epu16(maxV, v);
+      saturated = _mm256_add_epi16(saturated, _mm256_cmpeq_epi16(_mm256_max_epu16(v, threshold), v));
+      addAvx2(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), sum, squares);
+      addAvx2(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)), sum, squares);
+    }
+    const __m128i min128 = _mm_min_epu16(_mm256_castsi256_si128(minV), _mm256_extracti128_si256(minV, 1));
+    const __m128i max128 = _mm_max_epu16(_mm256_castsi256_si128(maxV), _mm256_extracti128_si256(maxV, 1));
+    p.minValue = (WORD)_mm_extract_epi16(_mm_minpos_epu16(min128), 0);
+    p.maxValue = (WORD)~_mm_extract_epi16(_mm_minpos_epu16(_mm_xor_si128(max128, _mm_set1_epi16(-1))), 0);
+    const __m128i sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    const __m128i squares128 = _mm_add_epi64(_mm256_castsi256_si128(squares), _mm256_extracti128_si256(squares, 1));
+    p.sum += horizontalSum64(sum128);
+    p.sumSquares += horizontalSum64(squares128);
+    const __m256i counts = _mm256_madd_epi16(_mm256_sub_epi16(_mm256_setzero_si256(), saturated),
+      _mm256_set1_epi16(1));
+    const __m128i counts128 = _mm_add_epi32(_mm256_castsi256_si128(counts), _mm256_extracti128_si256(counts, 1));
+    p.saturated += (uint32_t)_mm_extract_epi32(counts128, 0) + (uint32_t)_mm_extract_epi32(counts128, 1) +
+      (uint32_t)_mm_extract_epi32(counts128, 2) + (uint32_t)_mm_extract_epi32(counts128, 3);
+    return x;
+  }
+#endif
+
+  FrameStatsSettings m_settings;
+  CpuIsa m_isa;
+  WORD m_binShift = 0;
+  std::vector<Partial> m_partials;                   //One per stripe, written by the thread of that stripe
+  std::vector<std::thread> m_workers;                //Stripes 1 and up
+  std::mutex m_mutex;
+  std::condition_variable m_jobCond;
+  std::condition_variable m_doneCond;
+  StripeJob m_job;
+  uint64_t m_generation = 0;                         //Counts the images handed to the workers
+  unsigned m_pending = 0;                            //Stripes of the current image not done yet
+  bool m_exit = false;
+};
+
+// One line with the image number and, if they are valid, the statistics
+inline void printFrameStats(DWORD imgNumber, const FrameStats& stats)
+{
+  if (!stats.valid)
+  {
+    printf("Image Number: %d\n", imgNumber);
+    return;
+  }
+  printf("Image Number: %d \tmin %u max %u mean %.1f std %.1f saturated %u\n", imgNumber, stats.minValue,
+    stats.maxValue, stats.mean, std::sqrt(stats.variance), (unsigned)stats.saturated);
+}
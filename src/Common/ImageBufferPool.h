@@ -0,0 +1,233 @@
+#pragma once
+
+// Pool of image buffers
+// Buffers are page aligned (so also 64 byte aligned for cache lines and AVX-512)
+// and their size is a multiple of 4 KB, as needed for O_DIRECT file writes.
+// They can optionally be backed by 2 MB huge pages, which reduces TLB misses on
+// large sensors.
+// Released buffers are kept and handed out again for any request that fits,
+// so after the first frames an acquisition loop does no heap allocation at all,
+// even if buffers are passed between cameras with different image sizes.
+// All functions are thread safe, one pool can be shared by several cameras.
+
+#include "PcoSdk.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifdef PCO_LINUX
+#include <sys/mman.h>
+#endif
+
+class ImageBufferPool
+{
+public:
+  static const size_t PageSize = 4096;
+  static const size_t HugePageSize = 2 * 1024 * 1024;
+
+  explicit ImageBufferPool(bool useHugePages = false) : m_useHugePages(useHugePages) {}
+
+  ~ImageBufferPool()
+  {
+    for (auto& entry : m_blocks)
+      freeBlock(entry.first, entry.second);
+  }
+
+  ImageBufferPool(const ImageBufferPool&) = delete;
+  ImageBufferPool& operator=(const ImageBufferPool&) = delete;
+
+  //Returns a buffer of at least bytes size, reuses a released one if possible
+  void* acquire(size_t bytes)
+  {
+    const size_t size = roundUp(bytes);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    //Smallest free buffer which is large enough, but do not waste more than twice the size
+    auto it = m_free.lower_bound(size);
+    if (it != m_free.end() && it->first <= 2 * size)
+    {
+      void* buffer = it->second;
+      m_free.erase(it);
+      m_blocks[buffer].inUse = true;
+      return buffer;
+    }
+
+    Block block;
+    block.size = size;
+    block.inUse = true;
+    void* buffer = allocateBlock(block);
+    if (buffer != nullptr)
+    {
+      m_blocks[buffer] = block;
+      m_allocations++;
+      m_allocatedBytes += size;
+    }
+    return buffer;
+  }
+
+  template <class T>
+  T* acquireImage(WORD width, WORD height, int channels = 1)
+  {
+    return static_cast<T*>(acquire((size_t)width * height * channels * sizeof(T)));
+  }
+
+  //Gives the buffer back to the pool, it is not freed before the pool is destroyed.
+  //Returns false and ignores the buffer if it is not from this pool or was already released,
+  //otherwise two later acquire calls would hand out the same buffer.
+  bool release(void* buffer)
+  {
+    if (buffer == nullptr)
+      return false;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_blocks.find(buffer);
+    if (it == m_blocks.end() || !it->second.inUse)
+      return false;
+    it->second.inUse = false;
+    m_free.emplace(it->second.size, buffer);
+    return true;
+  }
+
+  //Allocates count buffers of bytes size up front and puts them into the free list
+  void reserve(size_t bytes, size_t count)
+  {
+    std::vector<void*> buffers;
+    for (size_t i = 0; i < count; i++)
+      buffers.push_back(acquire(bytes));
+    for (void* buffer : buffers)
+      release(buffer);
+  }
+
+  //Number of real allocations, stays constant in steady state
+  size_t allocations() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_allocations;
+  }
+
+  size_t allocatedBytes() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_allocatedBytes;
+  }
+
+  //Number of buffers which are backed by huge pages
+  size_t hugePageBuffers() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t count = 0;
+    for (auto& entry : m_blocks)
+      count += entry.second.hugePages ? 1 : 0;
+    return count;
+  }
+
+private:
+  struct Block
+  {
+    size_t size = 0;
+    bool hugePages = false;
+    bool mapped = false;
+    bool inUse = false;
+  };
+
+  size_t roundUp(size_t bytes) const
+  {
+    const size_t granularity = m_useHugePages ? HugePageSize : PageSize;
+    return ((bytes + granularity - 1) / granularity) * granularity;
+  }
+
+  void* allocateBlock(Block& block)
+  {
+#ifdef PCO_LINUX
+    if (m_useHugePages)
+    {
+      //Explicit huge pages first, these need reserved pages (vm.nr_hugepages)
+      void* buffer = mmap(nullptr, block.size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (buffer != MAP_FAILED)
+      {
+        block.hugePages = true;
+        block.mapped = true;
+        return buffer;
+      }
+    }
+    void* buffer = nullptr;
+    const size_t alignment = m_useHugePages ? HugePageSize : PageSize;
+    if (posix_memalign(&buffer, alignment, block.size) != 0)
+      return nullptr;
+    //Otherwise ask for transparent huge pages
+    if (m_useHugePages)
+      block.hugePages = madvise(buffer, block.size, MADV_HUGEPAGE) == 0;
+    return buffer;
+#else
+    if (m_useHugePages)
+    {
+      //Needs the "Lock pages in memory" privilege
+      SIZE_T largePage = GetLargePageMinimum();
+      if (largePage > 0)
+      {
+        SIZE_T size = ((block.size + largePage - 1) / largePage) * largePage;
+        void* buffer = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (buffer != nullptr)
+        {
+          block.hugePages = true;
+          block.mapped = true;
+          return buffer;
+        }
+      }
+    }
+    return _aligned_malloc(block.size, PageSize);
+#endif
+  }
+
+  static void freeBlock(void* buffer, const Block& block)
+  {
+#ifdef PCO_LINUX
+    if (block.mapped)
+      munmap(buffer, block.size);
+    else
+      free(buffer);
+#else
+    if (block.mapped)
+      VirtualFree(buffer, 0, MEM_RELEASE);
+    else
+      _aligned_free(buffer);
+#endif
+  }
+
+  bool m_useHugePages;
+  mutable std::mutex m_mutex;
+  std::unordered_map<void*, Block> m_blocks;
+  std::multimap<size_t, void*> m_free;
+  size_t m_allocations = 0;
+  size_t m_allocatedBytes = 0;
+};
+
+// Pre-allocates buffersPerCamera image buffers for every camera of the recorder,
+// sized from PCO_RecorderGetSettings
+inline int reserveRecorderBuffers(ImageBufferPool& pool, HANDLE hRec, HANDLE* hCamArr,
+  WORD camCount, size_t buffersPerCamera)
+{
+  //Keep all buffers until every camera is done, otherwise cameras would share them
+  std::vector<void*> buffers;
+  int iRet = PCO_NOERROR;
+  for (WORD i = 0; i < camCount && iRet == PCO_NOERROR; i++)
+  {
+    WORD imgWidth = 0, imgHeight = 0;
+    iRet = PCO_RecorderGetSettings(hRec, hCamArr[i], NULL, NULL,
+      NULL, &imgWidth, &imgHeight, NULL);
+    for (size_t j = 0; j < buffersPerCamera && iRet == PCO_NOERROR; j++)
+    {
+      WORD* buffer = pool.acquireImage<WORD>(imgWidth, imgHeight);
+      if (buffer == nullptr)
+        iRet = PCO_ERROR_NOMEMORY;
+      else
+        buffers.push_back(buffer);
+    }
+  }
+  for (void* buffer : buffers)
+    pool.release(buffer);
+  return iRet;
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+// Per frame latency instrumentation
+// For every frame the camera timestamp (from the metadata), the host time when
+// PCO_RecorderCopyImage returned and the duration of the copy are recorded.
+// Camera and host clock are not synchronized, so the transit time is reported
+// relative to the fastest frame: the smallest (host - camera) difference is
+// taken as clock offset plus minimum transit time, and the histogram shows how
+// much longer the other frames took. Spikes in the copy time point to the host,
+// spikes in the transit time with a normal copy time to the camera or link.
+//
+// The histograms are log-linear (HDR style): values up to 127 us are exact,
+// above that every power of two is split into 64 buckets (< 1.6% error).
+//
+// The samples are kept in a ring of maxSamples entries per camera, which is
+// allocated up front, so recording does not allocate on the acquisition thread.
+// The copy histogram covers all frames, the transit histogram and the csv the
+// frames still in the ring. Accessors return copies taken under the lock.
+
+#include "PcoSdk.h"
+#include "Metadata.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Host wall clock in microseconds since 1970-01-01 (UTC), comparable to metadataTimestampUs()
+inline int64_t hostTimeUs()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class LatencyHistogram
+{
+public:
+  static const int SubBucketBits = 7;
+  static const int MaxValueBits = 40;                //Values are clamped to about 12 days in us
+
+  LatencyHistogram() : m_counts(bucketCount(), 0) {}
+
+  void record(int64_t us)
+  {
+    const uint64_t value = (uint64_t)std::max<int64_t>(us, 0);
+    m_counts[bucketIndex(value)]++;
+    m_count++;
+    m_sum += (double)value;
+    m_min = std::min(m_min, value);
+    m_max = std::max(m_max, value);
+  }
+
+  void reset()
+  {
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    m_count = 0;
+    m_sum = 0.0;
+    m_min = UINT64_MAX;
+    m_max = 0;
+  }
+
+  uint64_t count() const
+  {
+    return m_count;
+  }
+
+  uint64_t min() const
+  {
+    return m_count ? m_min : 0;
+  }
+
+  uint64_t max() const
+  {
+    return m_max;
+  }
+
+  double mean() const
+  {
+    return m_count ? m_sum / m_count : 0.0;
+  }
+
+  //Value below which percent of the recorded values are (highest value of the bucket)
+  uint64_t percentile(double percent) const
+  {
+    if (m_count == 0)
+      return 0;
+    const uint64_t target = std::max<uint64_t>(1, (uint64_t)(percent / 100.0 * m_count + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_counts.size(); i++)
+    {
+      seen += m_counts[i];
+      if (seen >= target)
+        return std::min(bucketHighestValue(i), m_max);
+    }
+    return m_max;
+  }
+
+private:
+  static const uint64_t SubBuckets = 1ull << SubBucketBits;
+  static const uint64_t HalfSubBuckets = SubBuckets / 2;
+
+  static size_t bucketCount()
+  {
+    return (size_t)(SubBuckets + (MaxValueBits - SubBucketBits) * HalfSubBuckets);
+  }
+
+  static size_t bucketIndex(uint64_t value)
+  {
+    value = std::min<uint64_t>(value, (1ull << MaxValueBits) - 1);
+    if (value < SubBuckets)
+      return (size_t)value;
+    int msb = 63;
+    while (!(value >> msb))
+      msb--;
+    //value >> shift is in [64, 128)
+    const int shift = msb - (SubBucketBits - 1);
+    return (size_t)(SubBuckets + (shift - 1) * HalfSubBuckets + ((value >> shift) - HalfSubBuckets));
+  }
+
+  static uint64_t bucketHighestValue(size_t index)
+  {
+    if (index < SubBuckets)
+      return index;
+    const int shift = (int)((index - SubBuckets) / HalfSubBuckets) + 1;
+    const uint64_t mantissa = (index - SubBuckets) % HalfSubBuckets + HalfSubBuckets;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> m_counts;
+  uint64_t m_count = 0;
+  double m_sum = 0.0;
+  uint64_t m_min = UINT64_MAX;
+  uint64_t m_max = 0;
+};
+
+struct LatencySample
+{
+  DWORD imgNumber;
+  int64_t cameraUs;                                  //Camera timestamp, 0 if not available
+  int64_t hostUs;                                    //Host time after the copy returned
+  uint32_t copyUs;                                   //Duration of PCO_RecorderCopyImage
+};
+
+// Latency samples and histograms for several cameras, record() is thread safe
+class LatencyRecorder
+{
+public:
+  //maxSamples per camera, the oldest samples are overwritten (about 24 bytes each)
+  explicit LatencyRecorder(WORD camCount = 1, size_t maxSamples = 65536)
+    : m_cameras(std::max<WORD>(camCount, 1))
+  {
+    for (Camera& camera : m_cameras)
+      camera.samples.resize(std::max<size_t>(maxSamples, 1));
+  }
+
+  void record(WORD cam, DWORD imgNumber, const PCO_METADATA_STRUCT& metadata, int64_t hostUs, uint32_t copyUs)
+  {
+    LatencySample sample = { imgNumber, metadataTimestampUs(metadata), hostUs, copyUs };
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Camera& camera = m_cameras[std::min<size_t>(cam, m_cameras.size() - 1)];
+    camera.samples[camera.next] = sample;
+    camera.next = (camera.next + 1) % camera.samples.size();
+    camera.count = std::min(camera.count + 1, camera.samples.size());
+    camera.copy.record(copyUs);
+  }
+
+  //Samples still in the ring, oldest first, empty for an unknown camera
+  std::vector<LatencySample> samples(WORD cam) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (cam >= m_cameras.size())
+      return std::vector<LatencySample>();
+    return orderedSamples(m_cameras[cam]);
+  }
+
+  LatencyHistogram copyHistogram(WORD cam) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (cam >= m_cameras.size())
+      return LatencyHistogram();
+    return m_cameras[cam].copy;
+  }
+
+  //Transit time relative to the fastest frame, see above, minOffsetUs gets the smallest (host - camera)
+  LatencyHistogram transitHistogram(WORD cam, int64_t* minOffsetUs = nullptr) const
+  {
+    const std::vector<LatencySample> samples = this->samples(cam);
+    int64_t minOffset = INT64_MAX;
+    for (const LatencySample& sample : samples)
+    {
+      if (sample.cameraUs != 0)
+        minOffset = std::min(minOffset, sample.hostUs - sample.cameraUs);
+    }
+    LatencyHistogram histogram;
+    for (const LatencySample& sample : samples)
+    {
+      if (sample.cameraUs != 0)
+        histogram.record(sample.hostUs - sample.cameraUs - minOffset);
+    }
+    if (minOffsetUs != nullptr)
+      *minOffsetUs = histogram.count() ? minOffset : 0;
+    return histogram;
+  }
+
+  //Prints p50 / p99 / p99.9 / max of copy and transit time for every camera
+  void print() const
+  {
+    printf("%-20s%10s%10s%10s%10s%10s\n", "Latency [us]", "count", "p50", "p99", "p99.9", "max");
+    for (WORD cam = 0; cam < m_cameras.size(); cam++)
+    {
+      int64_t minOffset = 0;
+      LatencyHistogram transit = transitHistogram(cam, &minOffset);
+      printRow(cam, "copy", copyHistogram(cam));
+      printRow(cam, "transit", transit);
+      if (transit.count())
+        printf("Camera %d: transit relative to the fastest frame, host - camera clock was at least %lld us\n",
+          cam, (long long)minOffset);
+    }
+  }
+
+  //Writes all samples as csv (camera, image number, camera time, host time, copy time)
+  bool writeCsv(const std::string& path) const
+  {
+    std::FILE* file = std::fopen(path.c_str(), "w");
+    if (file == nullptr)
+      return false;
+    std::fprintf(file, "camera,imgNumber,cameraUs,hostUs,copyUs\n");
+    for (WORD cam = 0; cam < m_cameras.size(); cam++)
+    {
+      for (const LatencySample& sample : samples(cam))
+        std::fprintf(file, "%u,%u,%lld,%lld,%u\n", (unsigned)cam, (unsigned)sample.imgNumber,
+          (long long)sample.cameraUs, (long long)sample.hostUs, (unsigned)sample.copyUs);
+    }
+    return std::fclose(file) == 0;
+  }
+
+private:
+  struct Camera
+  {
+    std::vector<LatencySample> samples;              //Ring, next is the oldest entry once it is full
+    size_t next = 0;
+    size_t count = 0;
+    LatencyHistogram copy;
+  };
+
+  static std::vector<LatencySample> orderedSamples(const Camera& camera)
+  {
+    std::vector<LatencySample> samples;
+    samples.reserve(camera.count);
+    const size_t first = camera.count < camera.samples.size() ? 0 : camera.next;
+    for (size_t i = 0; i < camera.count; i++)
+      samples.push_back(camera.samples[(first + i) % camera.samples.size()]);
+    return samples;
+  }
+
+  static void printRow(WORD cam, const char* name, const LatencyHistogram& histogram)
+  {
+    char label[32];
+    snprintf(label, sizeof(label), "Camera %d %s", cam, name);
+    printf("%-20s%10llu%10llu%10llu%10llu%10llu\n", label, (unsigned long long)histogram.count(),
+      (unsigned long long)histogram.percentile(50.0), (unsigned long long)histogram.percentile(99.0),
+      (unsigned long long)histogram.percentile(99.9), (unsigned long long)histogram.max());
+  }
+
+  mutable std::mutex m_mutex;
+  std::vector<Camera> m_cameras;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+// Rate limited, binned live preview while a camera records to its internal memory
+// During a CamRam recording only PCO_RECORDER_LATEST_IMAGE can be copied. Copied
+// in a loop without pause, every preview image is a full frame transfer over
+// the camera link, which competes with the readout afterwards. LivePreview
+// limits the transfers in two ways:
+//  - only a soft ROI of the image is copied (e.g. the center part of interest)
+//  - the preview rate is capped by maxFps and by a link budget in MB/s, the
+//    rate is reduced so the transferred bytes per second stay below the budget
+// On the host the ROI is binned 1x1, 2x2 or 4x4 (average of the pixels), so the
+// preview image is small and still uses the full 16 bit range.
+
+#include "PcoSdk.h"
+#include "ImageBufferPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+struct LivePreviewSettings
+{
+  //Soft ROI (1 based, inclusive like PCO_RecorderCopyImage), 0 uses the full image
+  WORD roiX0 = 0, roiY0 = 0, roiX1 = 0, roiY1 = 0;
+  WORD binning = 2;                                  //1, 2 or 4
+  double maxFps = 10.0;
+  double budgetMBps = 0.0;                           //Link budget for the preview, 0 for no budget
+};
+
+struct LivePreviewStats
+{
+  DWORD frames = 0;
+  DWORD errors = 0;
+  uint64_t bytes = 0;                                //Transferred from the camera
+  double copySeconds = 0.0;                          //Sum of the PCO_RecorderCopyImage calls
+  double seconds = 0.0;
+
+  double framesPerSecond() const
+  {
+    return seconds > 0.0 ? frames / seconds : 0.0;
+  }
+  double megabytesPerSecond() const
+  {
+    return seconds > 0.0 ? bytes / seconds / 1e6 : 0.0;
+  }
+};
+
+class LivePreview
+{
+public:
+  LivePreview(HANDLE hRec, HANDLE hCam, const LivePreviewSettings& settings, ImageBufferPool* pool = nullptr)
+    : m_hRec(hRec), m_hCam(hCam), m_settings(settings), m_pool(pool)
+  {
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+  }
+
+  ~LivePreview()
+  {
+    m_pool->release(m_roiImage);
+    m_pool->release(m_image);
+  }
+
+  LivePreview(const LivePreview&) = delete;
+  LivePreview& operator=(const LivePreview&) = delete;
+
+  //Gets the image size from the recorder, clips the ROI and allocates the buffers
+  int init()
+  {
+    WORD imgWidth = 0, imgHeight = 0;
+    int iRet = PCO_RecorderGetSettings(m_hRec, m_hCam, NULL, NULL, NULL, &imgWidth, &imgHeight, NULL);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+
+    LivePreviewSettings& s = m_settings;
+    if (s.binning != 1 && s.binning != 2 && s.binning != 4)
+      return PCO_ERROR_WRONGVALUE;
+    if (s.roiX0 == 0 || s.roiY0 == 0 || s.roiX1 == 0 || s.roiY1 == 0)
+    {
+      s.roiX0 = 1;
+      s.roiY0 = 1;
+      s.roiX1 = imgWidth;
+      s.roiY1 = imgHeight;
+    }
+    s.roiX1 = std::min(s.roiX1, imgWidth);
+    s.roiY1 = std::min(s.roiY1, imgHeight);
+    if (s.roiX1 < s.roiX0 + s.binning - 1 || s.roiY1 < s.roiY0 + s.binning - 1)
+      return PCO_ERROR_WRONGVALUE;
+    //Only whole bins are copied
+    s.roiX1 -= (s.roiX1 - s.roiX0 + 1) % s.binning;
+    s.roiY1 -= (s.roiY1 - s.roiY0 + 1) % s.binning;
+
+    m_roiWidth = s.roiX1 - s.roiX0 + 1;
+    m_roiHeight = s.roiY1 - s.roiY0 + 1;
+    m_width = m_roiWidth / s.binning;
+    m_height = m_roiHeight / s.binning;
+    m_fullFrameBytes = (uint64_t)imgWidth * imgHeight * sizeof(WORD);
+
+    //The period is set by the rate cap or the budget, whatever is slower
+    double fps = s.maxFps > 0.0 ? s.maxFps : 1000.0;
+    if (s.budgetMBps > 0.0)
+      fps = std::min(fps, s.budgetMBps * 1e6 / transferBytes());
+    m_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+
+    m_pool->release(m_roiImage);
+    m_pool->release(m_image);
+    m_image = nullptr;
+    m_roiImage = m_pool->acquireImage<WORD>(m_roiWidth, m_roiHeight);
+    if (m_roiImage == nullptr)
+      return PCO_ERROR_NOMEMORY;
+    if (s.binning > 1)
+    {
+      m_image = m_pool->acquireImage<WORD>(m_width, m_height);
+      if (m_image == nullptr)
+        return PCO_ERROR_NOMEMORY;
+    }
+    m_stats = LivePreviewStats();
+    m_startTime = std::chrono::steady_clock::now();
+    m_nextTime = m_startTime;
+    return PCO_NOERROR;
+  }
+
+  //Copies and bins the latest image if the next preview slot is due, otherwise nothing is transferred
+  //updated is set to true if image() holds a new preview
+  int poll(bool* updated = nullptr)
+  {
+    if (updated != nullptr)
+      *updated = false;
+    const auto now = std::chrono::steady_clock::now();
+    m_stats.seconds = std::chrono::duration<double>(now - m_startTime).count();
+    if (now < m_nextTime)
+      return PCO_NOERROR;
+    //Fixed slots, a late call does not shift the following ones, but missed slots are not made up
+    m_nextTime += m_period;
+    if (m_nextTime < now)
+      m_nextTime = now + m_period;
+
+    int iRet = PCO_RecorderCopyImage(m_hRec, m_hCam, PCO_RECORDER_LATEST_IMAGE,
+      m_settings.roiX0, m_settings.roiY0, m_settings.roiX1, m_settings.roiY1,
+      m_roiImage, &m_imgNumber, NULL, NULL);
+    m_stats.copySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - now).count();
+    if (iRet != PCO_NOERROR)
+    {
+      //No image recorded yet
+      m_stats.errors++;
+      return iRet;
+    }
+    m_stats.frames++;
+    m_stats.bytes += transferBytes();
+
+    if (m_settings.binning == 2)
+      bin<2>();
+    else if (m_settings.binning == 4)
+      bin<4>();
+    if (updated != nullptr)
+      *updated = true;
+    return PCO_NOERROR;
+  }
+
+  //Waits for the next preview slot and gets the image
+  int next()
+  {
+    std::this_thread::sleep_until(m_nextTime);
+    bool updated = false;
+    return poll(&updated);
+  }
+
+  //The binned preview image, valid until the next poll
+  const WORD* image() const
+  {
+    return m_settings.binning > 1 ? m_image : m_roiImage;
+  }
+  WORD width() const
+  {
+    return m_width;
+  }
+  WORD height() const
+  {
+    return m_height;
+  }
+  DWORD imageNumber() const
+  {
+    return m_imgNumber;
+  }
+  const LivePreviewSettings& settings() const
+  {
+    return m_settings;
+  }
+  const LivePreviewStats& stats() const
+  {
+    return m_stats;
+  }
+
+  //Preview rate after rate cap and budget
+  double targetFps() const
+  {
+    return 1.0 / std::chrono::duration<double>(m_period).count();
+  }
+
+  uint64_t transferBytes() const
+  {
+    return (uint64_t)m_roiWidth * m_roiHeight * sizeof(WORD);
+  }
+
+  void printStats() const
+  {
+    const LivePreviewSettings& s = m_settings;
+    printf("Live preview: ROI %ux%u at (%u,%u), %ux%u binning, %ux%u image\n", m_roiWidth, m_roiHeight,
+      s.roiX0, s.roiY0, s.binning, s.binning, m_width, m_height);
+    printf("%u previews in %.2f s (%.1f/s, target %.1f/s), %u failed, %.2f ms per copy\n",
+      (unsigned)m_stats.frames, m_stats.seconds, m_stats.framesPerSecond(), targetFps(),
+      (unsigned)m_stats.errors, m_stats.frames ? m_stats.copySeconds * 1000.0 / m_stats.frames : 0.0);
+    printf("Link usage %.2f MB/s", m_stats.megabytesPerSecond());
+    if (s.budgetMBps > 0.0)
+      printf(" (budget %.2f MB/s)", s.budgetMBps);
+    printf(", full frames at the same rate %.2f MB/s\n",
+      m_stats.seconds > 0.0 ? m_stats.frames * (double)m_fullFrameBytes / m_stats.seconds / 1e6 : 0.0);
+  }
+
+private:
+  //Average of N x N pixels, rounded
+  template<int N>
+  void bin()
+  {
+    for (WORD y = 0; y < m_height; y++)
+    {
+      const WORD* src = m_roiImage + (size_t)y * N * m_roiWidth;
+      WORD* dst = m_image + (size_t)y * m_width;
+      for (WORD x = 0; x < m_width; x++)
+      {
+        uint32_t sum = 0;
+        for (int r = 0; r < N; r++)
+          for (int c = 0; c < N; c++)
+            sum += src[(size_t)r * m_roiWidth + x * N + c];
+        dst[x] = (WORD)((sum + N * N / 2) / (N * N));
+      }
+    }
+  }
+
+  HANDLE m_hRec;
+  HANDLE m_hCam;
+  LivePreviewSettings m_settings;
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  WORD* m_roiImage = nullptr;
+  WORD* m_image = nullptr;
+  WORD m_roiWidth = 0, m_roiHeight = 0;
+  WORD m_width = 0, m_height = 0;
+  DWORD m_imgNumber = 0;
+  uint64_t m_fullFrameBytes = 0;
+  std::chrono::steady_clock::duration m_period{};
+  std::chrono::steady_clock::time_point m_startTime;
+  std::chrono::steady_clock::time_point m_nextTime;
+  LivePreviewStats m_stats;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+// Helpers to decode the BCD coded fields of PCO_METADATA_STRUCT
+
+#include "PcoSdk.h"
+
+#include <cstdint>
+#include <ctime>
+
+inline unsigned fromBCD(BYTE value)
+{
+  return (value >> 4) * 10 + (value & 0x0F);
+}
+
+// Image counter, bIMAGE_COUNTER_BCD[0] holds the two lowest digits
+inline DWORD metadataImageCounter(const PCO_METADATA_STRUCT& metadata)
+{
+  return fromBCD(metadata.bIMAGE_COUNTER_BCD[0]) +
+    fromBCD(metadata.bIMAGE_COUNTER_BCD[1]) * 100 +
+    fromBCD(metadata.bIMAGE_COUNTER_BCD[2]) * 10000 +
+    fromBCD(metadata.bIMAGE_COUNTER_BCD[3]) * 1000000;
+}
+
+// Camera timestamp of the image in microseconds since 1970-01-01 (camera clock, UTC assumed)
+// Returns 0 if the metadata does not contain a valid time
+inline int64_t metadataTimestampUs(const PCO_METADATA_STRUCT& metadata)
+{
+  std::tm t = {};
+  t.tm_year = (int)fromBCD(metadata.bIMAGE_TIME_YEAR_BCD) + 100;
+  t.tm_mon = (int)fromBCD(metadata.bIMAGE_TIME_MON_BCD) - 1;
+  t.tm_mday = (int)fromBCD(metadata.bIMAGE_TIME_DAY_BCD);
+  t.tm_hour = (int)fromBCD(metadata.bIMAGE_TIME_HOUR_BCD);
+  t.tm_min = (int)fromBCD(metadata.bIMAGE_TIME_MIN_BCD);
+  t.tm_sec = (int)fromBCD(metadata.bIMAGE_TIME_SEC_BCD);
+  if (t.tm_mday == 0 || t.tm_mon < 0)
+    return 0;
+
+  //Days since epoch without timezone handling (timegm is not portable)
+  int year = t.tm_year + 1900;
+  int month = t.tm_mon + 1;
+  year -= month <= 2;
+  const int era = year / 400;
+  const int yoe = year - era * 400;
+  const int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + t.tm_mday - 1;
+  const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  const int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+  const int64_t us = fromBCD(metadata.bIMAGE_TIME_US_BCD[0]) +
+    fromBCD(metadata.bIMAGE_TIME_US_BCD[1]) * 100 +
+    fromBCD(metadata.bIMAGE_TIME_US_BCD[2]) * 10000;
+  return ((days * 24 + t.tm_hour) * 60 + t.tm_min) * 60000000LL + t.tm_sec * 1000000LL + us;
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+// Packed images with the dynamic resolution of the camera
+// Cameras with a dynamic resolution (wDynResDESC) of 12 or 14 bits deliver 16 bit
+// pixels, so a quarter (12 bit) or an eighth (14 bit) of every buffer is unused.
+// A PackedFrame stores the pixels as a continuous bit stream per row (pixel x at
+// bit x * bits, little endian), so a buffer of the same size holds 16 / bits times
+// more images, and every pass over the images moves less memory.
+//  - PackedFrameCodec packs and unpacks whole images or parts of rows, with SSE4.1
+//    or AVX2 for 12 and 14 bit if available (CpuIsa of CpuDispatch.h), any
+//    other bit count from 1 to 16 is done with scalar code
+//  - PackedFrame::pixel() reads a single pixel and PackedFrameCodec::unpackRow()
+//    a part of a row, so analysis code (ROI statistics, profiles, ...) does not
+//    need to unpack the whole image
+//  - PackedFrameRing keeps the latest images on the host in a fixed memory budget
+// The pixels have to be LSB aligned (BIT_ALIGNMENT_LSB), bits above the dynamic
+// resolution are dropped.
+// Rows start at 16 byte boundaries and the buffer has 16 bytes of padding at the
+// end, so the kernels can always load full vectors.
+
+#include "PcoSdk.h"
+#include "CpuDispatch.h"
+#include "ImageBufferPool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Bytes of one packed row, rounded up to 16 bytes
+inline size_t packedRowBytes(WORD width, WORD bits)
+{
+  return ((size_t)width * bits / 8 + (((size_t)width * bits) % 8 ? 1 : 0) + 15) & ~(size_t)15;
+}
+
+// Buffer size for a packed image including the padding at the end
+inline size_t packedImageBytes(WORD width, WORD height, WORD bits)
+{
+  return packedRowBytes(width, bits) * height + 16;
+}
+
+struct PackedFrame
+{
+  BYTE* data = nullptr;                              //At least packedImageBytes()
+  WORD imgWidth = 0;
+  WORD imgHeight = 0;
+  WORD bits = 16;
+  size_t rowBytes = 0;
+
+  PackedFrame() = default;
+  PackedFrame(BYTE* buffer, WORD width, WORD height, WORD dynRes)
+    : data(buffer), imgWidth(width), imgHeight(height), bits(std::min<WORD>(std::max<WORD>(dynRes, 1), 16)),
+    rowBytes(packedRowBytes(width, bits))
+  {
+  }
+
+  const BYTE* row(WORD y) const
+  {
+    return data + y * rowBytes;
+  }
+
+  BYTE* row(WORD y)
+  {
+    return data + y * rowBytes;
+  }
+
+  //Single pixel, without unpacking the row
+  WORD pixel(WORD x, WORD y) const
+  {
+    const size_t bit = (size_t)x * bits;
+    uint32_t word;
+    memcpy(&word, row(y) + bit / 8, sizeof(word));
+    return (WORD)((word >> (bit % 8)) & ((1u << bits) - 1));
+  }
+};
+
+class PackedFrameCodec
+{
+public:
+  explicit PackedFrameCodec(CpuIsa isa = bestCpuIsa())
+    : m_isa(std::min(isa, bestCpuIsa()))
+  {
+  }
+
+  CpuIsa isa() const
+  {
+    return m_isa;
+  }
+
+  //Packs an image of frame.imgWidth x frame.imgHeight 16 bit pixels into frame
+  int pack(const WORD* image, PackedFrame& frame) const
+  {
+    if (image == nullptr || frame.data == nullptr)
+      return PCO_ERROR_WRONGVALUE;
+    for (WORD y = 0; y < frame.imgHeight; y++)
+      packRow(image + (size_t)y * frame.imgWidth, frame.imgWidth, frame.bits, frame.row(y));
+    return PCO_NOERROR;
+  }
+
+  //Unpacks the whole image into 16 bit pixels
+  int unpack(const PackedFrame& frame, WORD* image) const
+  {
+    if (image == nullptr || frame.data == nullptr)
+      return PCO_ERROR_WRONGVALUE;
+    for (WORD y = 0; y < frame.imgHeight; y++)
+      unpackRow(frame, y, 0, frame.imgWidth, image + (size_t)y * frame.imgWidth);
+    return PCO_NOERROR;
+  }
+
+  //Unpacks count pixels of row y, starting at x0
+  void unpackRow(const PackedFrame& frame, WORD y, WORD x0, WORD count, WORD* out) const
+  {
+    const BYTE* row = frame.row(y);
+    const size_t end = std::min<size_t>((size_t)x0 + count, frame.imgWidth);
+    size_t x = x0;
+    //The vector kernels work on groups of 8 pixels, which start at a byte boundary
+    for (; x < end && (x % 8) != 0; x++)
+      *out++ = frame.pixel((WORD)x, y);
+#ifdef PCO_CPU_X86
+    size_t done = 0;
+    if (m_isa == CpuIsa::AVX2)
+      done = frame.bits == 12 ? unpack12Avx2(row + x * 12 / 8, end - x, out) :
+      frame.bits == 14 ? unpack14Avx2(row + x * 14 / 8, end - x, out) : 0;
+    else if (m_isa == CpuIsa::SSE41)
+      done = frame.bits == 12 ? unpack12Sse41(row + x * 12 / 8, end - x, out) :
+      frame.bits == 14 ? unpack14Sse41(row + x * 14 / 8, end - x, out) : 0;
+    x += done;
+    out += done;
+#endif
+    if (frame.bits == 16)
+    {
+      memcpy(out, row + x * 2, (end - x) * sizeof(WORD));
+      return;
+    }
+    for (; x < end; x++)
+      *out++ = frame.pixel((WORD)x, y);
+  }
+
+private:
+  void packRow(const WORD* src, WORD width, WORD bits, BYTE* dst) const
+  {
+    size_t x = 0;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      x = bits == 12 ? pack12Avx2(src, width, dst) : bits == 14 ? pack14Avx2(src, width, dst) : 0;
+    else if (m_isa == CpuIsa::SSE41)
+      x = bits == 12 ? pack12Sse41(src, width, dst) : bits == 14 ? pack14Sse41(src, width, dst) : 0;
+#endif
+    if (bits == 16)
+    {
+      memcpy(dst, src, (size_t)width * sizeof(WORD));
+      return;
+    }
+    //The vector kernels stop at a group of 8 pixels, so the rest starts at a byte boundary
+    BYTE* out = dst + x * bits / 8;
+    const uint32_t mask = (1u << bits) - 1;
+    uint64_t acc = 0;
+    unsigned accBits = 0;
+    for (; x < width; x++)
+    {
+      acc |= (uint64_t)(src[x] & mask) << accBits;
+      accBits += bits;
+      while (accBits >= 8)
+      {
+        *out++ = (BYTE)acc;
+        acc >>= 8;
+        accBits -= 8;
+      }
+    }
+    if (accBits > 0)
+      *out = (BYTE)acc;
+  }
+
+#ifdef PCO_CPU_X86
+  //12 bit: 8 pixels in 12 bytes, two pixels are joined to 24 bits with madd
+  PCO_TARGET_SSE41 static size_t pack12Sse41(const WORD* src, size_t width, BYTE* dst)
+  {
+    const __m128i mask = _mm_set1_epi16(0x0FFF);
+    const __m128i joinPairs = _mm_set1_epi32(0x10000001);
+    const __m128i bytes = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8, dst += 12)
+    {
+      const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + x)), mask);
+      const __m128i packed = _mm_shuffle_epi8(_mm_madd_epi16(v, joinPairs), bytes);
+      _mm_storel_epi64((__m128i*)dst, packed);
+      const int high = _mm_extract_epi32(packed, 2);
+      memcpy(dst + 8, &high, 4);
+    }
+    return x;
+  }
+
+  PCO_TARGET_SSE41 static size_t unpack12Sse41(const BYTE* src, size_t count, WORD* out)
+  {
+    const __m128i mask = _mm_set1_epi16(0x0FFF);
+    const __m128i words = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8, src += 12)
+    {
+      const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), words);
+      //Even pixels are the low 12 bits of their word, odd pixels the high 12 bits
+      _mm_storeu_si128((__m128i*)(out + x), _mm_blend_epi16(_mm_and_si128(v, mask), _mm_srli_epi16(v, 4), 0xAA));
+    }
+    return x;
+  }
+
+  //14 bit: 8 pixels in 14 bytes, pixel pairs are joined to 28 bits, then to 56 bits
+  PCO_TARGET_SSE41 static __m128i join14Sse41(__m128i v)
+  {
+    const __m128i pairs = _mm_madd_epi16(_mm_and_si128(v, _mm_set1_epi16(0x3FFF)), _mm_set1_epi32(0x40000001));
+    const __m128i low = _mm_and_si128(pairs, _mm_set1_epi64x(0xFFFFFFFF));
+    return _mm_or_si128(low, _mm_slli_epi64(_mm_srli_epi64(pairs, 32), 28));
+  }
+
+  PCO_TARGET_SSE41 static size_t pack14Sse41(const WORD* src, size_t width, BYTE* dst)
+  {
+    const __m128i bytes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, -1, -1);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8, dst += 14)
+    {
+      const __m128i packed = _mm_shuffle_epi8(join14Sse41(_mm_loadu_si128((const __m128i*)(src + x))), bytes);
+      _mm_storel_epi64((__m128i*)dst, packed);
+      const int high = _mm_extract_epi32(packed, 2);
+      const WORD last = (WORD)_mm_extract_epi16(packed, 6);
+      memcpy(dst + 8, &high, 4);
+      memcpy(dst + 12, &last, 2);
+    }
+    return x;
+  }
+
+  PCO_TARGET_SSE41 static size_t unpack14Sse41(const BYTE* src, size_t count, WORD* out)
+  {
+    //Pixel k starts at byte 14 * k / 8, bit 14 * k % 8: three bytes per pixel into 32 bit lanes,
+    //the multiply moves every pixel to bit 6 (no variable shift in SSE)
+    const __m128i first = _mm_setr_epi8(0, 1, 2, -1, 1, 2, 3, -1, 3, 4, 5, -1, 5, 6, 7, -1);
+    const __m128i second = _mm_setr_epi8(7, 8, 9, -1, 8, 9, 10, -1, 10, 11, 12, -1, 12, 13, 14, -1);
+    const __m128i align = _mm_setr_epi32(64, 1, 4, 16);
+    const __m128i mask = _mm_set1_epi32(0x3FFF);
+    size_t x = 0;
+    for (; x + 8 <= count; x += 8, src += 14)
+    {
+      const __m128i v = _mm_loadu_si128((const __m128i*)src);
+      const __m128i a = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, first), align), 6), mask);
+      const __m128i b = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, second), align), 6), mask);
+      _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi32(a, b));
+    }
+    return x;
+  }
+
+  //Loads 16 bytes at p into the low and at p + offset into the high lane
+  PCO_TARGET_AVX2 static __m256i loadLanes(const BYTE* p, size_t offset)
+  {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+      _mm_loadu_si128((const __m128i*)(p + offset)), 1);
+  }
+
+  PCO_TARGET_AVX2 static size_t pack12Avx2(const WORD* src, size_t width, BYTE* dst)
+  {
+    const __m256i mask = _mm256_set1_epi16(0x0FFF);
+    const __m256i joinPairs = _mm256_set1_epi32(0x10000001);
+    const __m256i bytes = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    //The 12 bytes of both lanes are moved together to 24 bytes
+    const __m256i together = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16, dst += 24)
+    {
+      const __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src + x)), mask);
+      const __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8(_mm256_madd_epi16(v, joinPairs), bytes), together);
+      _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(packed));
+      _mm_storel_epi64((__m128i*)(dst + 16), _mm256_extracti128_si256(packed, 1));
+    }
+    return x;
+  }
+
+  PCO_TARGET_AVX2 static size_t unpack12Avx2(const BYTE* src, size_t count, WORD* out)
+  {
+    const __m256i mask = _mm256_set1_epi16(0x0FFF);
+    const __m256i words = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+      0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16, src += 24)
+    {
+      const __m256i v = _mm256_shuffle_epi8(loadLanes(src, 12), words);
+      _mm256_storeu_si256((__m256i*)(out + x),
+        _mm256_blend_epi16(_mm256_and_si256(v, mask), _mm256_srli_epi16(v, 4), 0xAA));
+    }
+    return x;
+  }
+
+  PCO_TARGET_AVX2 static size_t pack14Avx2(const WORD* src, size_t width, BYTE* dst)
+  {
+    const __m256i bytes = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, -1, -1,
+      0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, -1, -1);
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16, dst += 28)
+    {
+      const __m256i v = _mm256_loadu_si256((const __m256i*)(src + x));
+      const __m256i pairs = _mm256_madd_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0x3FFF)),
+        _mm256_set1_epi32(0x40000001));
+      const __m256i joined = _mm256_or_si256(_mm256_and_si256(pairs, _mm256_set1_epi64x(0xFFFFFFFF)),
+        _mm256_slli_epi64(_mm256_srli_epi64(pairs, 32), 28));
+      const __m256i packed = _mm256_shuffle_epi8(joined, bytes);
+      //The first store writes 2 bytes too much, which are overwritten by the second
+      _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(packed));
+      const __m128i high = _mm256_extracti128_si256(packed, 1);
+      _mm_storel_epi64((__m128i*)(dst + 14), high);
+      const int word = _mm_extract_epi32(high, 2);
+      const WORD last = (WORD)_mm_extract_epi16(high, 6);
+      memcpy(dst + 22, &word, 4);
+      memcpy(dst + 26, &last, 2);
+    }
+    return x;
+  }
+
+  PCO_TARGET_AVX2 static size_t unpack14Avx2(const BYTE* src, size_t count, WORD* out)
+  {
+    const __m256i first = _mm256_setr_epi8(0, 1, 2, -1, 1, 2, 3, -1, 3, 4, 5, -1, 5, 6, 7, -1,
+      0, 1, 2, -1, 1, 2, 3, -1, 3, 4, 5, -1, 5, 6, 7, -1);
+    const __m256i second = _mm256_setr_epi8(7, 8, 9, -1, 8, 9, 10, -1, 10, 11, 12, -1, 12, 13, 14, -1,
+      7, 8, 9, -1, 8, 9, 10, -1, 10, 11, 12, -1, 12, 13, 14, -1);
+    const __m256i shifts = _mm256_setr_epi32(0, 6, 4, 2, 0, 6, 4, 2);
+    const __m256i mask = _mm256_set1_epi32(0x3FFF);
+    size_t x = 0;
+    for (; x + 16 <= count; x += 16, src += 28)
+    {
+      const __m256i v = loadLanes(src, 14);
+      const __m256i a = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(v, first), shifts), mask);
+      const __m256i b = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(v, second), shifts), mask);
+      //packus works per lane, which gives pixels 0-7 in the low and 8-15 in the high lane
+      _mm256_storeu_si256((__m256i*)(out + x), _mm256_packus_epi32(a, b));
+    }
+    return x;
+  }
+#endif
+
+  CpuIsa m_isa;
+};
+
+struct PackedFrameEntry
+{
+  PackedFrame frame;
+  DWORD imgNumber = 0;
+  PCO_METADATA_STRUCT metadata;
+};
+
+// The latest images in packed form, in a fixed memory budget on the host
+// With 12 bit a budget holds a third more images than with 16 bit buffers.
+// push() and back() are not synchronized, use them from one thread or lock outside.
+class PackedFrameRing
+{
+public:
+  PackedFrameRing(size_t budgetBytes, WORD imgWidth, WORD imgHeight, WORD bits, ImageBufferPool* pool = nullptr,
+    CpuIsa isa = bestCpuIsa())
+    : m_pool(pool), m_codec(isa), m_imageBytes(packedImageBytes(imgWidth, imgHeight, bits))
+  {
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+    const size_t count = framesFor(budgetBytes, imgWidth, imgHeight, bits);
+    m_buffer = count ? static_cast<BYTE*>(m_pool->acquire(count * m_imageBytes)) : nullptr;
+    if (m_buffer != nullptr)
+    {
+      m_slots.resize(count);
+      for (size_t i = 0; i < count; i++)
+      {
+        m_slots[i].frame = PackedFrame(m_buffer + i * m_imageBytes, imgWidth, imgHeight, bits);
+        m_slots[i].metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+      }
+    }
+  }
+
+  ~PackedFrameRing()
+  {
+    m_pool->release(m_buffer);
+  }
+
+  PackedFrameRing(const PackedFrameRing&) = delete;
+  PackedFrameRing& operator=(const PackedFrameRing&) = delete;
+
+  //Images a budget holds, with bits 16 for unpacked images
+  static DWORD framesFor(size_t budgetBytes, WORD imgWidth, WORD imgHeight, WORD bits)
+  {
+    return (DWORD)(budgetBytes / packedImageBytes(imgWidth, imgHeight, bits));
+  }
+
+  DWORD capacity() const
+  {
+    return (DWORD)m_slots.size();
+  }
+
+  //Images in the ring, up to capacity()
+  DWORD size() const
+  {
+    return (DWORD)std::min<uint64_t>(m_pushed, m_slots.size());
+  }
+
+  const PackedFrameCodec& codec() const
+  {
+    return m_codec;
+  }
+
+  //Packs the image into the ring, the oldest image is overwritten when the ring is full
+  int push(const WORD* image, DWORD imgNumber, const PCO_METADATA_STRUCT* metadata = nullptr)
+  {
+    if (m_slots.empty())
+      return PCO_ERROR_NOMEMORY;
+    PackedFrameEntry& slot = m_slots[m_pushed % m_slots.size()];
+    int iRet = m_codec.pack(image, slot.frame);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    slot.imgNumber = imgNumber;
+    if (metadata != nullptr)
+      slot.metadata = *metadata;
+    m_pushed++;
+    return PCO_NOERROR;
+  }
+
+  //Image in the ring, 0 is the newest, age has to be below size()
+  const PackedFrameEntry& back(DWORD age) const
+  {
+    return m_slots[(m_pushed - 1 - age) % m_slots.size()];
+  }
+
+private:
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  PackedFrameCodec m_codec;
+  size_t m_imageBytes;
+  BYTE* m_buffer = nullptr;
+  std::vector<PackedFrameEntry> m_slots;
+  uint64_t m_pushed = 0;
+};
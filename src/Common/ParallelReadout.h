@@ -0,0 +1,182 @@
+#pragma once
+
+// Parallel readout of a finished PCO_RECORDER_MEMORY_SEQUENCE recording
+// The image indices are handed out to a pool of worker threads one by one.
+// Every worker copies the image into its own buffer and runs the process
+// callback on it, so copy and processing of different images run in parallel.
+// If an ordered callback is given, it is called strictly in index order (one
+// call at a time), after the process callback of that image has finished.
+// Workers wait for their turn there, so at most threadCount images are in flight.
+// With setFrameStats() every worker computes the statistics of its image right
+// after the copy (see FrameStats.h), before the process callback. Each worker
+// has its own FrameStatsKernel for that.
+
+#include "PcoSdk.h"
+#include "FrameStats.h"
+#include "ImageBufferPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ReadoutFrame
+{
+  DWORD index = 0;
+  DWORD imgNumber = 0;
+  WORD* image = nullptr;
+  WORD imgWidth = 0;
+  WORD imgHeight = 0;
+  PCO_METADATA_STRUCT metadata;
+  FrameStats stats;                                  //Only valid with statistics enabled
+};
+
+struct ReadoutStats
+{
+  DWORD frames = 0;
+  unsigned threads = 0;
+  double seconds = 0.0;
+
+  double framesPerSecond() const
+  {
+    return seconds > 0.0 ? frames / seconds : 0.0;
+  }
+};
+
+class ParallelReadout
+{
+public:
+  using FrameCallback = std::function<void(ReadoutFrame& frame)>;
+
+  //threadCount 0 uses one thread per hardware thread
+  ParallelReadout(HANDLE hRec, HANDLE hCam, WORD imgWidth, WORD imgHeight,
+    unsigned threadCount = 0, ImageBufferPool* pool = nullptr)
+    : m_hRec(hRec), m_hCam(hCam), m_imgWidth(imgWidth), m_imgHeight(imgHeight), m_pool(pool)
+  {
+    m_threadCount = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+  }
+
+  //Reads the images [first, first + count), returns the first error (or PCO_NOERROR)
+  //process is called on the worker threads in any order, ordered in index order
+  int run(DWORD first, DWORD count, FrameCallback process, FrameCallback ordered = nullptr)
+  {
+    m_next = first;
+    m_end = first + count;
+    m_nextOrdered = first;
+    m_abort = false;
+    m_error = PCO_NOERROR;
+    m_delivered = 0;
+
+    auto startTime = std::chrono::steady_clock::now();
+    unsigned threads = (unsigned)std::min<DWORD>(m_threadCount, std::max<DWORD>(count, 1));
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+      workers.emplace_back(&ParallelReadout::worker, this, std::cref(process), std::cref(ordered));
+    for (auto& w : workers)
+      w.join();
+
+    m_stats.frames = m_delivered;
+    m_stats.threads = threads;
+    m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    return m_error;
+  }
+
+  const ReadoutStats& stats() const
+  {
+    return m_stats;
+  }
+
+  //Computes the statistics of every image into ReadoutFrame::stats, call before run()
+  void setFrameStats(const FrameStatsSettings& settings)
+  {
+    m_statsSettings.reset(new FrameStatsSettings(settings));
+  }
+
+private:
+  void worker(const FrameCallback& process, const FrameCallback& ordered)
+  {
+    ReadoutFrame frame;
+    frame.imgWidth = m_imgWidth;
+    frame.imgHeight = m_imgHeight;
+    frame.image = m_pool->acquireImage<WORD>(m_imgWidth, m_imgHeight);
+    frame.metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    std::unique_ptr<FrameStatsKernel> statsKernel;
+    if (m_statsSettings)
+      statsKernel.reset(new FrameStatsKernel(*m_statsSettings));
+
+    while (!m_abort)
+    {
+      DWORD index = m_next.fetch_add(1);
+      if (index >= m_end)
+        break;
+
+      frame.index = index;
+      int iRet = PCO_RecorderCopyImage(m_hRec, m_hCam, index,
+        1, 1, m_imgWidth, m_imgHeight, frame.image,
+        &frame.imgNumber, &frame.metadata, NULL);
+      if (iRet != PCO_NOERROR)
+      {
+        fail(iRet);
+        break;
+      }
+      if (statsKernel)
+        statsKernel->compute(frame.image, m_imgWidth, m_imgHeight, frame.stats);
+      if (process)
+        process(frame);
+
+      if (ordered)
+      {
+        std::unique_lock<std::mutex> lock(m_orderMutex);
+        m_orderCond.wait(lock, [this, index]() { return m_abort || m_nextOrdered == index; });
+        if (m_abort)
+          break;
+        ordered(frame);
+        m_nextOrdered++;
+        lock.unlock();
+        m_orderCond.notify_all();
+      }
+      m_delivered++;
+    }
+    m_pool->release(frame.image);
+  }
+
+  void fail(int error)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_orderMutex);
+      if (m_error == PCO_NOERROR)
+        m_error = error;
+      m_abort = true;
+    }
+    m_orderCond.notify_all();
+  }
+
+  HANDLE m_hRec;
+  HANDLE m_hCam;
+  WORD m_imgWidth;
+  WORD m_imgHeight;
+  unsigned m_threadCount;
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  std::unique_ptr<FrameStatsSettings> m_statsSettings;
+
+  std::atomic<DWORD> m_next{ 0 };
+  DWORD m_end = 0;
+  std::mutex m_orderMutex;
+  std::condition_variable m_orderCond;
+  DWORD m_nextOrdered = 0;
+  std::atomic<bool> m_abort{ false };
+  int m_error = PCO_NOERROR;
+  std::atomic<DWORD> m_delivered{ 0 };
+  ReadoutStats m_stats;
+};
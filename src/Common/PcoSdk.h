@@ -0,0 +1,29 @@
+#pragma once
+
+// pco SDK and pco.recorder includes used by the helpers in this folder
+// The samples include the same headers themselves, all of them are guarded
+
+#ifdef PCO_LINUX
+#include <pco_linux_defs.h>
+#include <sc2_sdkaddendum.h>
+#include <pco_device.h>
+#include <pco_camexport.h>
+#else
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+
+#include <Windows.h>
+#include <tchar.h>
+#endif
+
+//SDK Includes
+#include <sc2_defs.h>
+#include <sc2_common.h>
+#include <pco_err.h>
+#include <sc2_sdkstructures.h>
+#include <sc2_camexport.h>
+
+//Recorder Includes
+#include <pco_recorder_export.h>
+#include <pco_recorder_defines.h>
@@ -0,0 +1,412 @@
+#pragma once
+
+// Streaming raw image container
+// Images are appended to a data file at a fixed, 4 KB aligned stride after a
+// 4 KB header. They are collected in a staging buffer and written with large
+// sequential writes. For every image a compact entry with the image number,
+// the main metadata fields and the byte offset is appended to a side index
+// file (<path>.idx). Both files can be memory mapped for reading back.
+//
+// Data file:  RawStreamHeader, padded to 4 KB | image 0 | image 1 | ...
+// Index file: RawIndexHeader | RawIndexEntry 0 | RawIndexEntry 1 | ...
+
+#include "PcoSdk.h"
+#include "Metadata.h"
+#include "ImageBufferPool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef PCO_LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const size_t RawStreamAlignment = 4096;
+
+struct RawStreamHeader
+{
+  char magic[8];                                     //"PCOSTRM1"
+  uint32_t version;
+  uint32_t headerBytes;                              //Offset of the first image
+  uint16_t imgWidth;
+  uint16_t imgHeight;
+  uint16_t bytesPerPixel;
+  uint16_t reserved;
+  uint64_t frameStride;                              //Distance between two images
+  uint64_t frameCount;                               //Written on close
+};
+
+struct RawIndexHeader
+{
+  char magic[8];                                     //"PCOSIDX1"
+  uint32_t version;
+  uint32_t entryBytes;
+  uint64_t entryCount;                               //Written on close
+  uint64_t reserved;
+};
+
+struct RawIndexEntry
+{
+  uint64_t offset;                                   //Byte offset in the data file
+  int64_t timestampUs;                               //Camera timestamp, see metadataTimestampUs()
+  uint32_t imgNumber;
+  uint32_t exposureTime;
+  uint32_t framerateMilliHz;
+  uint32_t serialNumber;
+  uint16_t exposureBase;
+  uint16_t imgWidth;
+  uint16_t imgHeight;
+  int16_t sensorTemperature;
+  uint8_t bitResolution;
+  uint8_t triggerMode;
+  uint16_t reserved[3];
+};
+
+static_assert(sizeof(RawStreamHeader) <= RawStreamAlignment, "header must fit into the first block");
+static_assert(sizeof(RawIndexHeader) == 32, "unexpected index header layout");
+static_assert(sizeof(RawIndexEntry) == 48, "unexpected index entry layout");
+
+inline uint64_t rawStreamFrameStride(WORD imgWidth, WORD imgHeight)
+{
+  uint64_t bytes = (uint64_t)imgWidth * imgHeight * sizeof(WORD);
+  return (bytes + RawStreamAlignment - 1) / RawStreamAlignment * RawStreamAlignment;
+}
+
+inline RawStreamHeader makeRawStreamHeader(WORD imgWidth, WORD imgHeight, uint64_t frameCount)
+{
+  RawStreamHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "PCOSTRM1", 8);
+  header.version = 1;
+  header.headerBytes = (uint32_t)RawStreamAlignment;
+  header.imgWidth = imgWidth;
+  header.imgHeight = imgHeight;
+  header.bytesPerPixel = sizeof(WORD);
+  header.frameStride = rawStreamFrameStride(imgWidth, imgHeight);
+  header.frameCount = frameCount;
+  return header;
+}
+
+inline RawIndexHeader makeRawIndexHeader(uint64_t entryCount)
+{
+  RawIndexHeader indexHeader;
+  std::memset(&indexHeader, 0, sizeof(indexHeader));
+  std::memcpy(indexHeader.magic, "PCOSIDX1", 8);
+  indexHeader.version = 1;
+  indexHeader.entryBytes = sizeof(RawIndexEntry);
+  indexHeader.entryCount = entryCount;
+  return indexHeader;
+}
+
+inline RawIndexEntry makeRawIndexEntry(uint64_t offset, DWORD imgNumber, WORD imgWidth, WORD imgHeight,
+  const PCO_METADATA_STRUCT* metadata)
+{
+  RawIndexEntry entry;
+  std::memset(&entry, 0, sizeof(entry));
+  entry.offset = offset;
+  entry.imgNumber = imgNumber;
+  entry.imgWidth = imgWidth;
+  entry.imgHeight = imgHeight;
+  if (metadata != nullptr)
+  {
+    entry.timestampUs = metadataTimestampUs(*metadata);
+    entry.exposureTime = metadata->dwEXPOSURE_TIME;
+    entry.exposureBase = metadata->wEXPOSURE_TIME_BASE;
+    entry.framerateMilliHz = metadata->dwFRAMERATE_MILLIHZ;
+    entry.serialNumber = metadata->dwCAMERA_SERIAL_NUMBER;
+    entry.sensorTemperature = metadata->sSENSOR_TEMPERATURE;
+    entry.bitResolution = metadata->bBIT_RESOLUTION;
+    entry.triggerMode = metadata->bTRIGGER_MODE;
+  }
+  return entry;
+}
+
+class RawStreamWriter
+{
+public:
+  RawStreamWriter() = default;
+
+  ~RawStreamWriter()
+  {
+    close();
+  }
+
+  RawStreamWriter(const RawStreamWriter&) = delete;
+  RawStreamWriter& operator=(const RawStreamWriter&) = delete;
+
+  //Creates path and path.idx, images are written in blocks of about writeBlockBytes
+  int open(const std::string& path, WORD imgWidth, WORD imgHeight, size_t writeBlockBytes = 16 * 1024 * 1024)
+  {
+    close();
+    m_imgWidth = imgWidth;
+    m_imgHeight = imgHeight;
+    m_stride = rawStreamFrameStride(imgWidth, imgHeight);
+    m_stagingFrames = (size_t)std::max<uint64_t>(writeBlockBytes / m_stride, 1);
+    m_staging = static_cast<char*>(m_pool.acquire((size_t)(m_stagingFrames * m_stride)));
+    if (m_staging == nullptr)
+      return PCO_ERROR_NOMEMORY;
+    //Padding between the images stays zero
+    std::memset(m_staging, 0, (size_t)(m_stagingFrames * m_stride));
+
+    m_data = std::fopen(path.c_str(), "wb");
+    m_index = std::fopen((path + ".idx").c_str(), "wb");
+    if (m_data == nullptr || m_index == nullptr)
+    {
+      close();
+      return PCO_ERROR_NOFILE;
+    }
+    //The staging buffer already collects large blocks
+    std::setvbuf(m_data, nullptr, _IONBF, 0);
+
+    m_frames = 0;
+    m_stagedFrames = 0;
+    m_bytes = RawStreamAlignment;
+    int iRet = writeHeaders();
+    if (iRet != PCO_NOERROR)
+      close();
+    return iRet;
+  }
+
+  int append(const WORD* image, DWORD imgNumber, const PCO_METADATA_STRUCT* metadata)
+  {
+    if (m_data == nullptr)
+      return PCO_ERROR_NOTINIT;
+    const uint64_t offset = RawStreamAlignment + m_frames * m_stride;
+    std::memcpy(m_staging + m_stagedFrames * m_stride, image, (size_t)m_imgWidth * m_imgHeight * sizeof(WORD));
+    m_stagedFrames++;
+    m_frames++;
+
+    RawIndexEntry entry = makeRawIndexEntry(offset, imgNumber, m_imgWidth, m_imgHeight, metadata);
+    if (std::fwrite(&entry, sizeof(entry), 1, m_index) != 1)
+      return PCO_ERROR_DISKFULL;
+
+    if (m_stagedFrames == m_stagingFrames)
+      return flush();
+    return PCO_NOERROR;
+  }
+
+  int flush()
+  {
+    if (m_data == nullptr || m_stagedFrames == 0)
+      return PCO_NOERROR;
+    size_t bytes = (size_t)(m_stagedFrames * m_stride);
+    m_stagedFrames = 0;
+    if (std::fwrite(m_staging, 1, bytes, m_data) != bytes)
+      return PCO_ERROR_DISKFULL;
+    m_bytes += bytes;
+    return PCO_NOERROR;
+  }
+
+  //Flushes the remaining images and writes the final image count into the headers
+  int close()
+  {
+    int iRet = PCO_NOERROR;
+    if (m_data != nullptr && m_index != nullptr)
+    {
+      iRet = flush();
+      if (iRet == PCO_NOERROR)
+        iRet = writeHeaders();
+    }
+    if (m_data != nullptr)
+      std::fclose(m_data);
+    if (m_index != nullptr)
+      std::fclose(m_index);
+    m_data = nullptr;
+    m_index = nullptr;
+    m_pool.release(m_staging);
+    m_staging = nullptr;
+    return iRet;
+  }
+
+  uint64_t framesWritten() const
+  {
+    return m_frames;
+  }
+
+  uint64_t bytesWritten() const
+  {
+    return m_bytes;
+  }
+
+private:
+  int writeHeaders()
+  {
+    RawStreamHeader header = makeRawStreamHeader(m_imgWidth, m_imgHeight, m_frames);
+    RawIndexHeader indexHeader = makeRawIndexHeader(m_frames);
+
+    //Header block is padded to 4 KB, so the images stay aligned
+    char block[RawStreamAlignment] = {};
+    std::memcpy(block, &header, sizeof(header));
+    if (std::fseek(m_data, 0, SEEK_SET) != 0 || std::fwrite(block, 1, sizeof(block), m_data) != sizeof(block) ||
+      std::fseek(m_index, 0, SEEK_SET) != 0 || std::fwrite(&indexHeader, sizeof(indexHeader), 1, m_index) != 1)
+      return PCO_ERROR_DISKFULL;
+    std::fflush(m_index);
+    //Continue appending at the end
+    if (std::fseek(m_data, 0, SEEK_END) != 0 || std::fseek(m_index, 0, SEEK_END) != 0)
+      return PCO_ERROR_NOFILE;
+    return PCO_NOERROR;
+  }
+
+  ImageBufferPool m_pool;
+  std::FILE* m_data = nullptr;
+  std::FILE* m_index = nullptr;
+  WORD m_imgWidth = 0;
+  WORD m_imgHeight = 0;
+  uint64_t m_stride = 0;
+  char* m_staging = nullptr;
+  size_t m_stagingFrames = 0;
+  size_t m_stagedFrames = 0;
+  uint64_t m_frames = 0;
+  uint64_t m_bytes = 0;
+};
+
+// Read only memory mapping of a whole file
+class MappedFile
+{
+public:
+  MappedFile() = default;
+
+  ~MappedFile()
+  {
+    close();
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool open(const std::string& path)
+  {
+    close();
+#ifdef PCO_LINUX
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        m_data = static_cast<const char*>(data);
+        m_size = (size_t)st.st_size;
+      }
+    }
+    ::close(fd);
+#else
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+      m_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (m_mapping != NULL)
+      {
+        m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        m_size = m_data ? (size_t)size.QuadPart : 0;
+      }
+    }
+    CloseHandle(file);
+#endif
+    return m_data != nullptr;
+  }
+
+  void close()
+  {
+#ifdef PCO_LINUX
+    if (m_data != nullptr)
+      munmap(const_cast<char*>(m_data), m_size);
+#else
+    if (m_data != nullptr)
+      UnmapViewOfFile(m_data);
+    if (m_mapping != NULL)
+      CloseHandle(m_mapping);
+    m_mapping = NULL;
+#endif
+    m_data = nullptr;
+    m_size = 0;
+  }
+
+  const char* data() const
+  {
+    return m_data;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+private:
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+#ifndef PCO_LINUX
+  HANDLE m_mapping = NULL;
+#endif
+};
+
+class RawStreamReader
+{
+public:
+  //Maps path and path.idx, also works for streams which were not closed properly
+  int open(const std::string& path)
+  {
+    if (!m_dataFile.open(path) || !m_indexFile.open(path + ".idx"))
+      return PCO_ERROR_NOFILE;
+    if (m_dataFile.size() < sizeof(RawStreamHeader) || m_indexFile.size() < sizeof(RawIndexHeader))
+      return PCO_ERROR_WRONGVALUE;
+    std::memcpy(&m_header, m_dataFile.data(), sizeof(m_header));
+    RawIndexHeader indexHeader;
+    std::memcpy(&indexHeader, m_indexFile.data(), sizeof(indexHeader));
+    if (std::memcmp(m_header.magic, "PCOSTRM1", 8) != 0 || std::memcmp(indexHeader.magic, "PCOSIDX1", 8) != 0 ||
+      indexHeader.entryBytes != sizeof(RawIndexEntry))
+      return PCO_ERROR_WRONGVALUE;
+
+    //Count only entries whose image is completely in the data file
+    m_entries = reinterpret_cast<const RawIndexEntry*>(m_indexFile.data() + sizeof(RawIndexHeader));
+    m_count = (m_indexFile.size() - sizeof(RawIndexHeader)) / sizeof(RawIndexEntry);
+    while (m_count > 0 && m_entries[m_count - 1].offset + m_header.frameStride > m_dataFile.size())
+      m_count--;
+    return PCO_NOERROR;
+  }
+
+  uint64_t frameCount() const
+  {
+    return m_count;
+  }
+
+  WORD imgWidth() const
+  {
+    return m_header.imgWidth;
+  }
+
+  WORD imgHeight() const
+  {
+    return m_header.imgHeight;
+  }
+
+  const RawIndexEntry& entry(uint64_t i) const
+  {
+    return m_entries[i];
+  }
+
+  //Pointer into the mapped data file, no copy
+  const WORD* image(uint64_t i) const
+  {
+    return reinterpret_cast<const WORD*>(m_dataFile.data() + m_entries[i].offset);
+  }
+
+private:
+  MappedFile m_dataFile;
+  MappedFile m_indexFile;
+  RawStreamHeader m_header = {};
+  const RawIndexEntry* m_entries = nullptr;
+  uint64_t m_count = 0;
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+// Distribution of the recorder memory over several cameras
+// PCO_RecorderCreate shares the memory according to the image distribution:
+// the maximum image count of every camera is proportional to its distribution
+// value, the frame size of every camera is taken into account by the recorder.
+// With the same value for all cameras, every camera gets the same image count,
+// so a camera with a higher frame rate is full first while memory of the other
+// cameras stays unused.
+// createRecorderForDuration() sets the distribution proportional to the
+// expected frame rates, so all cameras can record for the same time. The image
+// counts are then set for a target duration, or to the maximum counts (with a
+// target of 0), which uses all recorder memory and fills all cameras at the
+// same time.
+
+#include "PcoSdk.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+struct RecorderMemoryShare
+{
+  HANDLE hCam = NULL;
+  double frameRate = 0.0;                            //Expected images per second
+  DWORD distribution = 1;
+  WORD imgWidth = 0;
+  WORD imgHeight = 0;
+  DWORD maxImgCount = 0;                             //From PCO_RecorderCreate
+  DWORD reqImgCount = 0;                             //For PCO_RecorderInit
+
+  double megabytes() const
+  {
+    return (double)reqImgCount * imgWidth * imgHeight * sizeof(WORD) / 1e6;
+  }
+  //Recording time until the camera is full
+  double seconds() const
+  {
+    return frameRate > 0.0 ? reqImgCount / frameRate : 0.0;
+  }
+  double maxSeconds() const
+  {
+    return frameRate > 0.0 ? maxImgCount / frameRate : 0.0;
+  }
+};
+
+struct RecorderMemoryPlan
+{
+  std::vector<RecorderMemoryShare> cameras;
+  double targetSeconds = 0.0;                        //0 for all memory
+
+  std::vector<DWORD> reqImgCounts() const
+  {
+    std::vector<DWORD> counts;
+    for (const RecorderMemoryShare& c : cameras)
+      counts.push_back(c.reqImgCount);
+    return counts;
+  }
+
+  //Longest recording all cameras can do with the memory of the recorder
+  double maxSeconds() const
+  {
+    double seconds = 0.0;
+    for (size_t i = 0; i < cameras.size(); i++)
+      seconds = i == 0 ? cameras[i].maxSeconds() : std::min(seconds, cameras[i].maxSeconds());
+    return seconds;
+  }
+};
+
+// Frame rate of the camera with the current settings (armed), from the runtime of the camera operation code
+inline double cameraFrameRate(HANDLE hCam)
+{
+  DWORD seconds = 0, nanoseconds = 0;
+  if (PCO_GetCOCRuntime(hCam, &seconds, &nanoseconds) != PCO_NOERROR)
+    return 0.0;
+  const double period = seconds + nanoseconds * 1e-9;
+  return period > 0.0 ? 1.0 / period : 0.0;
+}
+
+// Distribution values proportional to the frame rates, the fastest camera gets 1000
+inline std::vector<DWORD> recorderDistribution(const std::vector<double>& frameRates)
+{
+  const double maxRate = frameRates.empty() ? 0.0 : *std::max_element(frameRates.begin(), frameRates.end());
+  std::vector<DWORD> distribution;
+  for (double rate : frameRates)
+    distribution.push_back(maxRate > 0.0 ? std::max<DWORD>((DWORD)std::lround(rate / maxRate * 1000.0), 1) : 1);
+  return distribution;
+}
+
+// Creates the recorder with a distribution according to frameRates (one per camera) and plans the image
+// counts for targetSeconds (0 for all memory). The counts for PCO_RecorderInit are plan.reqImgCounts().
+// If the memory is not enough for targetSeconds, all cameras get the maximum image count instead.
+inline int createRecorderForDuration(HANDLE* phRec, std::vector<HANDLE>& hCams, const std::vector<double>& frameRates,
+  WORD mode, double targetSeconds, RecorderMemoryPlan& plan, const char* drive = "C")
+{
+  if (frameRates.size() != hCams.size() || hCams.empty())
+    return PCO_ERROR_WRONGVALUE;
+
+  std::vector<DWORD> distribution = recorderDistribution(frameRates);
+  std::vector<DWORD> maxImgCounts(hCams.size(), 0);
+  int iRet = PCO_RecorderCreate(phRec, hCams.data(), distribution.data(), (WORD)hCams.size(), mode, drive,
+    maxImgCounts.data());
+  if (iRet != PCO_NOERROR)
+    return iRet;
+
+  plan = RecorderMemoryPlan();
+  plan.targetSeconds = targetSeconds;
+  for (size_t i = 0; i < hCams.size(); i++)
+  {
+    RecorderMemoryShare share;
+    share.hCam = hCams[i];
+    share.frameRate = frameRates[i];
+    share.distribution = distribution[i];
+    share.maxImgCount = maxImgCounts[i];
+    iRet = PCO_RecorderGetSettings(*phRec, hCams[i], NULL, NULL, NULL, &share.imgWidth, &share.imgHeight, NULL);
+    if (iRet != PCO_NOERROR)
+      return iRet;
+    share.reqImgCount = share.maxImgCount;
+    if (targetSeconds > 0.0 && share.frameRate > 0.0)
+      share.reqImgCount = (DWORD)std::min<double>(std::ceil(share.frameRate * targetSeconds), share.maxImgCount);
+    share.reqImgCount = std::max<DWORD>(share.reqImgCount, 1);
+    plan.cameras.push_back(share);
+  }
+  return PCO_NOERROR;
+}
+
+inline void printRecorderMemoryPlan(const RecorderMemoryPlan& plan)
+{
+  printf("%-8s%10s%14s%8s%12s%12s%10s%12s\n", "Camera", "fps", "size", "share", "max images", "images", "MB",
+    "seconds");
+  double megabytes = 0.0;
+  for (size_t i = 0; i < plan.cameras.size(); i++)
+  {
+    const RecorderMemoryShare& c = plan.cameras[i];
+    char size[32];
+    snprintf(size, sizeof(size), "%ux%u", c.imgWidth, c.imgHeight);
+    printf("%-8u%10.1f%14s%8u%12u%12u%10.1f%12.2f\n", (unsigned)i, c.frameRate, size, (unsigned)c.distribution,
+      (unsigned)c.maxImgCount, (unsigned)c.reqImgCount, c.megabytes(), c.seconds());
+    megabytes += c.megabytes();
+  }
+  if (plan.targetSeconds > 0.0)
+    printf("Target %.2f s, ", plan.targetSeconds);
+  printf("%.1f MB for all cameras, the memory is enough for %.2f s\n", megabytes, plan.maxSeconds());
+  if (plan.targetSeconds > plan.maxSeconds())
+    printf("Warning: the target duration does not fit into the recorder memory\n");
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Lock-free queue for one producer and one consumer thread
+// Fixed capacity ring buffer, push and pop never block and never allocate.
+// Several threads may push if they serialize the calls (e.g. with a mutex),
+// the same holds for pop.
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template <class T>
+class SpscQueue
+{
+public:
+  //Capacity is rounded up to a power of two
+  explicit SpscQueue(size_t capacity)
+  {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    m_items.resize(size);
+    m_mask = size - 1;
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  size_t capacity() const
+  {
+    return m_items.size();
+  }
+
+  //Returns false if the queue is full, item is only moved from on success
+  bool push(T&& item)
+  {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == m_items.size())
+      return false;
+    m_items[tail & m_mask] = std::move(item);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  //Returns false if the queue is empty
+  bool pop(T& item)
+  {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
+    item = std::move(m_items[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const
+  {
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+  }
+
+private:
+  std::vector<T> m_items;
+  size_t m_mask = 0;
+  //Separate cache lines, so producer and consumer do not invalidate each other
+  alignas(64) std::atomic<size_t> m_head{ 0 };
+  alignas(64) std::atomic<size_t> m_tail{ 0 };
+};
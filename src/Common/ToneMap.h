@@ -0,0 +1,390 @@
+#pragma once
+
+// 16 bit to 8 bit display conversion with precomputed lookup tables
+// The display settings (black and white level, contrast, gamma, transfer curve)
+// are folded into one table with an entry for every 16 bit value, so the
+// conversion of a pixel is a single table lookup. The tables are only rebuilt
+// by update() if the settings changed, which makes it cheap to call update()
+// for every frame of a live display.
+// There are two outputs for 16 bit mono data:
+//  - Mono: 8 bit gray, like PCO_Convert16TO8
+//  - BGR: 24 bit, gray or pseudo color palette, for display surfaces which need color
+// Color images are demosaiced first (see Demosaic.h), the 8 bit BGR result is
+// mapped with a table per channel, so every channel can have its own black and
+// white level (white balance) besides the common contrast, gamma and curve.
+// The AVX2 path looks up 8 pixels at once with gather instructions (the BGR
+// table holds a BGRX dword per value, which a byte shuffle packs to BGR). The
+// per channel tables are gathered the same way, 8 bytes of BGR data at a time
+// with the offset of their channel table added. The SSE4.1 path has no gather,
+// it uses the scalar loop.
+// Color saturation is a mix of the color channels and can not be part of a
+// per value table, it stays with the color conversion.
+
+#include "PcoSdk.h"
+#include "CpuDispatch.h"
+
+#include <pco_convstructures.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+enum class ToneMapCurve
+{
+  Linear,
+  Rec2020,                                           //BT.2020 (= BT.709) transfer function, PROCESS_REC2020
+  SRGB
+};
+
+enum class ToneMapPalette
+{
+  Gray,
+  Pseudo                                             //Blue, cyan, green, yellow, red
+};
+
+struct ToneMapSettings
+{
+  int dataBits = 16;                                 //Dynamic resolution, e.g. wDynResDESC
+  bool upperAligned = false;                         //Data is MSB aligned (BIT_ALIGNMENT_MSB)
+  int black = 0;                                     //Value shown as 0
+  int white = 0;                                     //Value shown as 255, 0: (1 << dataBits) - 1
+  int contrast = 0;                                  //-100 ... 100, slope around the middle gray
+  double gamma = 1.0;
+  ToneMapCurve curve = ToneMapCurve::Linear;
+  ToneMapPalette palette = ToneMapPalette::Gray;     //Only for BGR output
+
+  bool operator==(const ToneMapSettings& other) const
+  {
+    return dataBits == other.dataBits && upperAligned == other.upperAligned && black == other.black &&
+      white == other.white && contrast == other.contrast && gamma == other.gamma &&
+      curve == other.curve && palette == other.palette;
+  }
+
+  bool operator!=(const ToneMapSettings& other) const
+  {
+    return !(*this == other);
+  }
+};
+
+// Settings from the display struct of a converter (PCO_ConvertGetDisplay)
+inline ToneMapSettings makeToneMapSettings(const PCO_Display& display, int dataBits, bool upperAligned)
+{
+  ToneMapSettings settings;
+  settings.dataBits = dataBits;
+  settings.upperAligned = upperAligned;
+  settings.black = display.iScale_min;
+  settings.white = display.iScale_max;
+  settings.contrast = display.iContrast;
+  settings.gamma = display.iGamma > 0 ? display.iGamma / 100.0 : 1.0;
+  if (display.dwProcessingFlags & PROCESS_REC2020)
+    settings.curve = ToneMapCurve::Rec2020;
+  else if (display.iSRGB)
+    settings.curve = ToneMapCurve::SRGB;
+  return settings;
+}
+
+class ToneMapLut
+{
+public:
+  explicit ToneMapLut(CpuIsa isa = bestCpuIsa())
+    : m_isa(std::min(isa, bestCpuIsa())), m_mono(TableSize + 4, 0), m_bgrx(TableSize, 0), m_channels(3 * 256 + 4, 0)
+  {
+  }
+
+  //Rebuilds the tables if the settings differ from the current ones, returns true if rebuilt
+  bool update(const ToneMapSettings& settings)
+  {
+    if (m_valid && settings == m_settings)
+      return false;
+    m_settings = settings;
+    build();
+    m_valid = true;
+    m_rebuilds++;
+    return true;
+  }
+
+  //Rebuilds the per channel tables for BGR data if the settings differ from the current ones
+  //channels: blue, green and red, dataBits is always 8 and the palette is not used
+  bool updateChannels(const ToneMapSettings channels[3])
+  {
+    bool changed = !m_channelsValid;
+    for (int c = 0; c < 3; c++)
+    {
+      ToneMapSettings settings = channels[c];
+      settings.dataBits = 8;
+      settings.upperAligned = false;
+      settings.palette = ToneMapPalette::Gray;
+      if (settings != m_channelSettings[c])
+      {
+        m_channelSettings[c] = settings;
+        changed = true;
+      }
+    }
+    if (!changed)
+      return false;
+    std::vector<BYTE> curve;
+    for (int c = 0; c < 3; c++)
+    {
+      buildCurve(m_channelSettings[c], curve);
+      std::copy(curve.begin(), curve.end(), m_channels.begin() + c * 256);
+    }
+    m_channelsValid = true;
+    m_rebuilds++;
+    return true;
+  }
+
+  const ToneMapSettings& settings() const
+  {
+    return m_settings;
+  }
+
+  DWORD rebuilds() const
+  {
+    return m_rebuilds;
+  }
+
+  CpuIsa isa() const
+  {
+    return m_isa;
+  }
+
+  //count pixels to 8 bit gray
+  void toMono8(const WORD* src, BYTE* dst, size_t count) const
+  {
+    size_t i = 0;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      i = toMono8Avx2(src, dst, count);
+#endif
+    const BYTE* table = m_mono.data();
+    for (; i < count; i++)
+      dst[i] = table[src[i]];
+  }
+
+  //count pixels to 24 bit BGR
+  void toBgr8(const WORD* src, BYTE* dst, size_t count) const
+  {
+    size_t i = 0;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      i = toBgr8Avx2(src, dst, count);
+#endif
+    const uint32_t* table = m_bgrx.data();
+    for (; i < count; i++)
+    {
+      const uint32_t bgrx = table[src[i]];
+      dst[i * 3 + 0] = (BYTE)bgrx;
+      dst[i * 3 + 1] = (BYTE)(bgrx >> 8);
+      dst[i * 3 + 2] = (BYTE)(bgrx >> 16);
+    }
+  }
+
+  //count BGR pixels with the per channel tables, src and dst may be the same buffer
+  void bgr8ToBgr8(const BYTE* src, BYTE* dst, size_t count) const
+  {
+    size_t i = 0;
+#ifdef PCO_CPU_X86
+    if (m_isa == CpuIsa::AVX2)
+      i = bgr8ToBgr8Avx2(src, dst, count) * 3;
+#endif
+    const BYTE* blue = m_channels.data();
+    const BYTE* green = blue + 256;
+    const BYTE* red = green + 256;
+    for (; i < count * 3; i += 3)
+    {
+      dst[i + 0] = blue[src[i + 0]];
+      dst[i + 1] = green[src[i + 1]];
+      dst[i + 2] = red[src[i + 2]];
+    }
+  }
+
+  //Whole image, flip gives a bottom up image like CONVERT_MODE_OUT_FLIPIMAGE
+  int toMono8(const WORD* image, int width, int height, BYTE* out, bool flip = false) const
+  {
+    if (!m_valid || image == nullptr || out == nullptr || width <= 0 || height <= 0)
+      return PCO_ERROR_WRONGVALUE;
+    for (int y = 0; y < height; y++)
+      toMono8(image + (size_t)y * width, out + (size_t)(flip ? height - 1 - y : y) * width, width);
+    return PCO_NOERROR;
+  }
+
+  int toBgr8(const WORD* image, int width, int height, BYTE* out, bool flip = false) const
+  {
+    if (!m_valid || image == nullptr || out == nullptr || width <= 0 || height <= 0)
+      return PCO_ERROR_WRONGVALUE;
+    for (int y = 0; y < height; y++)
+      toBgr8(image + (size_t)y * width, out + (size_t)(flip ? height - 1 - y : y) * width * 3, width);
+    return PCO_NOERROR;
+  }
+
+  //In place (image == out) only without flip
+  int bgr8ToBgr8(const BYTE* image, int width, int height, BYTE* out, bool flip = false) const
+  {
+    if (!m_channelsValid || image == nullptr || out == nullptr || width <= 0 || height <= 0 ||
+      (flip && image == out))
+      return PCO_ERROR_WRONGVALUE;
+    const size_t stride = (size_t)width * 3;
+    for (int y = 0; y < height; y++)
+      bgr8ToBgr8(image + y * stride, out + (flip ? height - 1 - y : y) * stride, width);
+    return PCO_NOERROR;
+  }
+
+private:
+  static const size_t TableSize = 0x10000;
+
+  //Curve for every value of the dynamic range, the raw values then only select from it
+  static void buildCurve(const ToneMapSettings& s, std::vector<BYTE>& curve)
+  {
+    const int dataBits = std::min(std::max(s.dataBits, 1), 16);
+    const int maxValue = (1 << dataBits) - 1;
+    const int white = s.white > s.black ? s.white : std::max(maxValue, s.black + 1);
+    const double range = (double)(white - s.black);
+    const double slope = 1.0 + std::min(std::max(s.contrast, -100), 100) / 100.0;
+    const double invGamma = s.gamma > 0.0 ? 1.0 / s.gamma : 1.0;
+
+    curve.resize((size_t)maxValue + 1);
+    for (int v = 0; v <= maxValue; v++)
+    {
+      double x = std::min(std::max((v - s.black) / range, 0.0), 1.0);
+      x = std::min(std::max(0.5 + (x - 0.5) * slope, 0.0), 1.0);
+      if (invGamma != 1.0)
+        x = std::pow(x, invGamma);
+      if (s.curve == ToneMapCurve::Rec2020)
+        x = x < 0.018 ? 4.5 * x : 1.099 * std::pow(x, 0.45) - 0.099;
+      else if (s.curve == ToneMapCurve::SRGB)
+        x = x <= 0.0031308 ? 12.92 * x : 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+      curve[v] = (BYTE)std::lround(std::min(std::max(x, 0.0), 1.0) * 255.0);
+    }
+  }
+
+  void build()
+  {
+    const ToneMapSettings& s = m_settings;
+    const int dataBits = std::min(std::max(s.dataBits, 1), 16);
+    const int maxValue = (1 << dataBits) - 1;
+    const int shift = s.upperAligned ? 16 - dataBits : 0;
+    std::vector<BYTE> curve;
+    buildCurve(s, curve);
+
+    uint32_t palette[256];
+    for (int y = 0; y < 256; y++)
+      palette[y] = paletteEntry(s.palette, y);
+
+    for (size_t raw = 0; raw < TableSize; raw++)
+    {
+      const BYTE y = curve[std::min<size_t>(raw >> shift, maxValue)];
+      m_mono[raw] = y;
+      m_bgrx[raw] = palette[y];
+    }
+  }
+
+  static uint32_t bgrx(int b, int g, int r)
+  {
+    return (uint32_t)b | ((uint32_t)g << 8) | ((uint32_t)r << 16);
+  }
+
+  static uint32_t paletteEntry(ToneMapPalette palette, int y)
+  {
+    if (palette == ToneMapPalette::Gray)
+      return bgrx(y, y, y);
+    //Four ramps of 64 steps: blue -> cyan -> green -> yellow -> red
+    const int step = (y & 63) * 255 / 63;
+    switch (y >> 6)
+    {
+    case 0:
+      return bgrx(255, step, 0);
+    case 1:
+      return bgrx(255 - step, 255, 0);
+    case 2:
+      return bgrx(0, 255, step);
+    default:
+      return bgrx(0, 255 - step, 255);
+    }
+  }
+
+#ifdef PCO_CPU_X86
+  //Returns the number of converted pixels, the rest is done by the scalar loop
+  PCO_TARGET_AVX2 size_t toMono8Avx2(const WORD* src, BYTE* dst, size_t count) const
+  {
+    //A dword gather with scale 1 reads the table entry and the 3 following bytes
+    //(the table has 4 bytes padding), only the low byte is kept
+    const int* table = reinterpret_cast<const int*>(m_mono.data());
+    const __m256i lowByte = _mm256_set1_epi32(0xFF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+      const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+      const __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+      const __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+      const __m256i ylo = _mm256_and_si256(_mm256_i32gather_epi32(table, lo, 1), lowByte);
+      const __m256i yhi = _mm256_and_si256(_mm256_i32gather_epi32(table, hi, 1), lowByte);
+      //The pack works per 128 bit lane, the permute restores the pixel order
+      const __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(ylo, yhi), 0xD8);
+      const __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), bytes);
+    }
+    return i;
+  }
+
+  PCO_TARGET_AVX2 size_t toBgr8Avx2(const WORD* src, BYTE* dst, size_t count) const
+  {
+    const int* table = reinterpret_cast<const int*>(m_bgrx.data());
+    //BGRX BGRX BGRX BGRX -> BGR BGR BGR BGR in every 128 bit lane
+    const __m256i dropX = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+    //Every lane is stored with 16 bytes of which 12 are valid, so the last store
+    //writes 4 bytes beyond the 8 pixels, which have to belong to the image
+    for (; i + 10 <= count; i += 8)
+    {
+      const __m256i idx = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+      const __m256i bgr = _mm256_shuffle_epi8(_mm256_i32gather_epi32(table, idx, 4), dropX);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm256_castsi256_si128(bgr));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3 + 12), _mm256_extracti128_si256(bgr, 1));
+    }
+    return i;
+  }
+
+  PCO_TARGET_AVX2 size_t bgr8ToBgr8Avx2(const BYTE* src, BYTE* dst, size_t count) const
+  {
+    //Like toMono8Avx2 every gather reads 4 bytes of which the low one is kept (the tables have
+    //4 bytes padding). 8 pixels are 24 bytes, every group of 8 bytes starts with another channel.
+    const int* table = reinterpret_cast<const int*>(m_channels.data());
+    const __m256i offset0 = _mm256_setr_epi32(0, 256, 512, 0, 256, 512, 0, 256);
+    const __m256i offset1 = _mm256_setr_epi32(512, 0, 256, 512, 0, 256, 512, 0);
+    const __m256i offset2 = _mm256_setr_epi32(256, 512, 0, 256, 512, 0, 256, 512);
+    const __m256i lowByte = _mm256_set1_epi32(0xFF);
+    size_t i = 0;
+    //All 24 bytes are read before they are written, so src and dst may be the same
+    for (; i + 8 <= count; i += 8)
+    {
+      const BYTE* in = src + i * 3;
+      const __m256i v0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in)));
+      const __m256i v1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + 8)));
+      const __m256i v2 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + 16)));
+      const __m256i y0 = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_add_epi32(v0, offset0), 1), lowByte);
+      const __m256i y1 = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_add_epi32(v1, offset1), 1), lowByte);
+      const __m256i y2 = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_add_epi32(v2, offset2), 1), lowByte);
+      //The packs work per 128 bit lane, the permutes restore the byte order, the last 8 bytes are 0
+      const __m256i words01 = _mm256_permute4x64_epi64(_mm256_packus_epi32(y0, y1), 0xD8);
+      const __m256i words2 = _mm256_permute4x64_epi64(_mm256_packus_epi32(y2, _mm256_setzero_si256()), 0xD8);
+      const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words01, words2), 0xD8);
+      BYTE* out = dst + i * 3;
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(bytes));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), _mm256_extracti128_si256(bytes, 1));
+    }
+    return i;
+  }
+#endif
+
+  CpuIsa m_isa;
+  ToneMapSettings m_settings;
+  bool m_valid = false;
+  DWORD m_rebuilds = 0;
+  std::vector<BYTE> m_mono;
+  std::vector<uint32_t> m_bgrx;
+  ToneMapSettings m_channelSettings[3];
+  bool m_channelsValid = false;
+  std::vector<BYTE> m_channels;                      //Blue, green and red table, 256 entries each and padding
+};
@@ -0,0 +1,371 @@
+#pragma once
+
+// Work-stealing readout of a PCO_RECORDER_MEMORY_SEQUENCE recording of several cameras
+// Every image of every camera is one task (camera, image index). Each worker
+// owns a deque of tasks and the cameras are distributed round robin over the
+// workers. A worker polls the status of its own cameras and appends the newly
+// recorded images to its deque, so the readout can run while recording.
+// A worker takes its own tasks from the front (oldest image first). If its
+// deque is empty, it steals half of the tasks from the back of the fullest
+// deque, so the idle worker of a fast camera helps draining the backlog of a
+// slow one. The images of a camera are therefore delivered in any order.
+
+#include "PcoSdk.h"
+#include "FifoConsumer.h"
+#include "ImageBufferPool.h"
+#include "ParallelReadout.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WorkStealingStats
+{
+  DWORD frames = 0;
+  DWORD steals = 0;                                  //Steal operations
+  DWORD stolenTasks = 0;
+  unsigned workers = 0;
+  double seconds = 0.0;
+  std::vector<DWORD> workerFrames;                   //Images read per worker
+  std::vector<DWORD> cameraFrames;                   //Images read per camera
+
+  double framesPerSecond() const
+  {
+    return seconds > 0.0 ? frames / seconds : 0.0;
+  }
+};
+
+class WorkStealingReadout
+{
+public:
+  //Called on the worker threads, concurrently and in any order
+  using FrameCallback = std::function<void(WORD cam, ReadoutFrame& frame, unsigned worker)>;
+
+  //workerCount 0 uses one worker per hardware thread
+  WorkStealingReadout(HANDLE hRec, const std::vector<HANDLE>& hCams, unsigned workerCount = 0,
+    ImageBufferPool* pool = nullptr, const BackoffPolicy& policy = BackoffPolicy())
+    : m_hRec(hRec), m_pool(pool), m_policy(policy)
+  {
+    const unsigned workers = workerCount ? workerCount : std::max(1u, std::thread::hardware_concurrency());
+    if (m_pool == nullptr)
+    {
+      m_ownPool.reset(new ImageBufferPool());
+      m_pool = m_ownPool.get();
+    }
+    for (unsigned w = 0; w < workers; w++)
+      m_workers.emplace_back(new Worker());
+    for (size_t i = 0; i < hCams.size(); i++)
+    {
+      Camera cam;
+      cam.hCam = hCams[i];
+      m_cameras.push_back(cam);
+      m_workers[i % workers]->cameras.push_back((WORD)i);
+    }
+  }
+
+  ~WorkStealingReadout()
+  {
+    m_abort = true;
+    join();
+  }
+
+  WorkStealingReadout(const WorkStealingReadout&) = delete;
+  WorkStealingReadout& operator=(const WorkStealingReadout&) = delete;
+
+  //Starts the workers, they finish when all cameras stopped recording and all images are read
+  int start(FrameCallback process)
+  {
+    m_process = std::move(process);
+    m_abort = false;
+    m_error = PCO_NOERROR;
+    m_openCameras = (DWORD)m_cameras.size();
+    m_outstanding = 0;
+    for (Camera& cam : m_cameras)
+    {
+      int iRet = PCO_RecorderGetSettings(m_hRec, cam.hCam, NULL, NULL, NULL,
+        &cam.imgWidth, &cam.imgHeight, NULL);
+      if (iRet != PCO_NOERROR)
+        return iRet;
+      cam.queued = 0;
+      cam.done = false;
+      cam.frames = 0;
+    }
+    m_startTime = std::chrono::steady_clock::now();
+    for (unsigned w = 0; w < m_workers.size(); w++)
+      m_threads.emplace_back(&WorkStealingReadout::worker, this, w);
+    return PCO_NOERROR;
+  }
+
+  //Waits for the workers, returns the first error (or PCO_NOERROR)
+  int join()
+  {
+    if (m_threads.empty())
+      return m_error;
+    for (auto& t : m_threads)
+      t.join();
+    m_threads.clear();
+
+    m_stats = WorkStealingStats();
+    m_stats.workers = (unsigned)m_workers.size();
+    m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+    for (const auto& w : m_workers)
+    {
+      m_stats.frames += w->frames;
+      m_stats.steals += w->steals;
+      m_stats.stolenTasks += w->stolenTasks;
+      m_stats.workerFrames.push_back(w->frames);
+    }
+    for (const Camera& cam : m_cameras)
+      m_stats.cameraFrames.push_back(cam.frames);
+    return m_error;
+  }
+
+  //Reads everything that is recorded, for a recording which is already finished
+  int run(FrameCallback process)
+  {
+    int iRet = start(std::move(process));
+    int joinRet = join();
+    return iRet != PCO_NOERROR ? iRet : joinRet;
+  }
+
+  //Only from within the frame callback: keeps the image buffer instead of giving it back to the pool
+  //The buffer has to be released to the pool given in the constructor afterwards
+  WORD* takeImage(ReadoutFrame& frame)
+  {
+    WORD* image = frame.image;
+    frame.image = nullptr;
+    return image;
+  }
+
+  const WorkStealingStats& stats() const
+  {
+    return m_stats;
+  }
+
+  void printStats() const
+  {
+    printf("Readout: %u images in %.3f s (%.1f images/s) with %u workers, %u steals (%u images stolen)\n",
+      (unsigned)m_stats.frames, m_stats.seconds, m_stats.framesPerSecond(), m_stats.workers,
+      (unsigned)m_stats.steals, (unsigned)m_stats.stolenTasks);
+    printf("%-10s%10s\n", "Worker", "images");
+    for (size_t w = 0; w < m_stats.workerFrames.size(); w++)
+      printf("%-10u%10u\n", (unsigned)w, (unsigned)m_stats.workerFrames[w]);
+  }
+
+private:
+  struct Task
+  {
+    WORD cam;
+    DWORD index;
+  };
+
+  struct Camera
+  {
+    HANDLE hCam = NULL;
+    WORD imgWidth = 0;
+    WORD imgHeight = 0;
+    DWORD queued = 0;                                //Images handed out as tasks, only the owner changes it
+    bool done = false;
+    std::atomic<DWORD> frames{ 0 };
+
+    Camera() = default;
+    Camera(const Camera& other)
+      : hCam(other.hCam), imgWidth(other.imgWidth), imgHeight(other.imgHeight),
+      queued(other.queued), done(other.done), frames(other.frames.load())
+    {
+    }
+  };
+
+  struct Worker
+  {
+    std::vector<WORD> cameras;                       //Cameras whose status this worker polls
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    std::atomic<size_t> size{ 0 };                   //tasks.size(), readable without the lock
+    DWORD frames = 0;
+    DWORD steals = 0;
+    DWORD stolenTasks = 0;
+  };
+
+  void worker(unsigned w)
+  {
+    Worker& self = *m_workers[w];
+    Backoff backoff(m_policy);
+    auto lastPoll = std::chrono::steady_clock::time_point();
+    self.frames = self.steals = self.stolenTasks = 0;
+
+    while (!m_abort)
+    {
+      //New images are looked for when there is nothing to do, or at least every millisecond
+      const auto now = std::chrono::steady_clock::now();
+      if (self.size == 0 || now - lastPoll > std::chrono::milliseconds(1))
+      {
+        lastPoll = now;
+        if (!poll(self))
+          break;
+      }
+
+      Task task;
+      if (popOwn(self, task) || steal(w, task))
+      {
+        backoff.reset();
+        if (!execute(self, w, task))
+          break;
+        continue;
+      }
+      if (m_openCameras == 0 && m_outstanding == 0)
+        break;
+      backoff.wait();
+    }
+  }
+
+  //Appends the newly recorded images of the own cameras, returns false on error
+  bool poll(Worker& self)
+  {
+    for (WORD c : self.cameras)
+    {
+      Camera& cam = m_cameras[c];
+      if (cam.done)
+        continue;
+      bool isRunning = true;
+      DWORD procImgCount = 0;
+      int iRet = PCO_RecorderGetStatus(m_hRec, cam.hCam, &isRunning,
+        NULL, NULL, &procImgCount, NULL, NULL, NULL, NULL, NULL);
+      if (iRet != PCO_NOERROR)
+      {
+        fail(iRet);
+        return false;
+      }
+      if (procImgCount > cam.queued)
+      {
+        m_outstanding += procImgCount - cam.queued;
+        std::lock_guard<std::mutex> lock(self.mutex);
+        for (DWORD index = cam.queued; index < procImgCount; index++)
+          self.tasks.push_back(Task{ c, index });
+        self.size = self.tasks.size();
+        cam.queued = procImgCount;
+      }
+      if (!isRunning)
+      {
+        cam.done = true;
+        m_openCameras--;
+      }
+    }
+    return true;
+  }
+
+  bool popOwn(Worker& self, Task& task)
+  {
+    std::lock_guard<std::mutex> lock(self.mutex);
+    if (self.tasks.empty())
+      return false;
+    task = self.tasks.front();
+    self.tasks.pop_front();
+    self.size = self.tasks.size();
+    return true;
+  }
+
+  //Moves half of the tasks of the fullest other worker to the own deque and takes the first one
+  bool steal(unsigned w, Task& task)
+  {
+    unsigned victim = w;
+    size_t victimSize = 0;
+    for (unsigned v = 0; v < m_workers.size(); v++)
+    {
+      const size_t size = m_workers[v]->size;
+      if (v != w && size > victimSize)
+      {
+        victim = v;
+        victimSize = size;
+      }
+    }
+    if (victim == w)
+      return false;
+
+    std::vector<Task> stolen;
+    {
+      Worker& other = *m_workers[victim];
+      std::lock_guard<std::mutex> lock(other.mutex);
+      const size_t count = (other.tasks.size() + 1) / 2;
+      if (count == 0)
+        return false;
+      stolen.assign(other.tasks.end() - count, other.tasks.end());
+      other.tasks.erase(other.tasks.end() - count, other.tasks.end());
+      other.size = other.tasks.size();
+    }
+
+    Worker& self = *m_workers[w];
+    self.steals++;
+    self.stolenTasks += (DWORD)stolen.size();
+    task = stolen.front();
+    std::lock_guard<std::mutex> lock(self.mutex);
+    self.tasks.insert(self.tasks.end(), stolen.begin() + 1, stolen.end());
+    self.size = self.tasks.size();
+    return true;
+  }
+
+  //Copies the image of the task and runs the callback, returns false on error
+  bool execute(Worker& self, unsigned w, const Task& task)
+  {
+    Camera& cam = m_cameras[task.cam];
+    ReadoutFrame frame;
+    frame.index = task.index;
+    frame.imgWidth = cam.imgWidth;
+    frame.imgHeight = cam.imgHeight;
+    frame.metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    frame.image = m_pool->acquireImage<WORD>(cam.imgWidth, cam.imgHeight);
+    if (frame.image == nullptr)
+    {
+      fail(PCO_ERROR_NOMEMORY);
+      return false;
+    }
+
+    int iRet = PCO_RecorderCopyImage(m_hRec, cam.hCam, task.index,
+      1, 1, cam.imgWidth, cam.imgHeight, frame.image,
+      &frame.imgNumber, &frame.metadata, NULL);
+    if (iRet == PCO_NOERROR && m_process)
+      m_process(task.cam, frame, w);
+    m_pool->release(frame.image);
+    m_outstanding--;
+    if (iRet != PCO_NOERROR)
+    {
+      fail(iRet);
+      return false;
+    }
+    self.frames++;
+    cam.frames++;
+    return true;
+  }
+
+  void fail(int error)
+  {
+    std::lock_guard<std::mutex> lock(m_errorMutex);
+    if (m_error == PCO_NOERROR)
+      m_error = error;
+    m_abort = true;
+  }
+
+  HANDLE m_hRec;
+  std::unique_ptr<ImageBufferPool> m_ownPool;
+  ImageBufferPool* m_pool;
+  BackoffPolicy m_policy;
+  FrameCallback m_process;
+
+  std::vector<Camera> m_cameras;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<std::thread> m_threads;
+  std::atomic<DWORD> m_openCameras{ 0 };
+  std::atomic<DWORD> m_outstanding{ 0 };
+  std::atomic<bool> m_abort{ false };
+  std::mutex m_errorMutex;
+  int m_error = PCO_NOERROR;
+  std::chrono::steady_clock::time_point m_startTime;
+  WorkStealingStats m_stats;
+};
@@ -0,0 +1,193 @@
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#ifdef PCO_LINUX
+#include <pco_linux_defs.h>
+#include <sc2_sdkaddendum.h>
+#include <pco_device.h>
+#include <pco_camexport.h>
+#else
+#define NOMINMAX
+
+#include <Windows.h>
+#include <tchar.h>
+#endif
+
+//SDK Includes
+#define PCO_SENSOR_CREATE_OBJECT //To get PCO_SENSOR_TYPE_DEF
+#include <sc2_defs.h>
+#include <sc2_common.h>
+#include <pco_err.h>
+#include <sc2_sdkstructures.h>
+#include <sc2_camexport.h>
+
+//Recorder Includes
+#include <pco_recorder_export.h>
+#include <pco_recorder_defines.h>
+
+//Common sample helpers
+#include <EventCapture.h>
+#include <ImageBufferPool.h>
+#include <RawStream.h>
+
+#define CAMCOUNT    1
+int main()
+{
+    int iRet;
+    iRet = PCO_InitializeLib();
+    if (iRet)
+    {
+        return iRet;
+    }
+
+    HANDLE hRec = NULL;
+    HANDLE hCamArr[CAMCOUNT];
+    DWORD imgDistributionArr[CAMCOUNT];
+    DWORD maxImgCountArr[CAMCOUNT];
+    DWORD reqImgCountArr[CAMCOUNT];
+
+    //Some frequently used parameters for the camera
+    DWORD expTime = 10;
+    WORD expBase = TIMEBASE_MS;
+    WORD metaSize = 0, metaVersion = 0;
+
+    //Images before and after an event which are kept
+    DWORD preFrames = 50;
+    DWORD postFrames = 50;
+    //Length of the session and the times of the (simulated) events in seconds
+    double sessionSeconds = 5.0;
+    double eventSeconds[] = { 1.0, 2.2, 3.5 };
+
+    //Open camera and set to default state
+    PCO_OpenStruct camstruct;
+    std::memset(&camstruct, 0, sizeof(camstruct));
+    camstruct.wSize = sizeof(PCO_OpenStruct);
+    //set scanning mode
+    camstruct.wInterfaceType = 0xFFFF;
+
+    hCamArr[0] = 0;
+    //open next camera
+    iRet = PCO_OpenCameraEx(&hCamArr[0], &camstruct);
+    if (iRet != PCO_NOERROR)
+    {
+        printf("No camera found\n");
+        printf("Press <Enter> to end\n");
+        iRet = getchar();
+        PCO_CleanupLib();
+        return -1;
+    }
+    //Make sure recording is off
+    iRet = PCO_SetRecordingState(hCamArr[0], 0);
+    //Do some settings
+    iRet = PCO_SetTimestampMode(hCamArr[0], TIMESTAMP_MODE_OFF);
+    iRet = PCO_SetMetaDataMode(hCamArr[0], METADATA_MODE_ON,
+        &metaSize, &metaVersion);
+    iRet = PCO_SetBitAlignment(hCamArr[0], BIT_ALIGNMENT_LSB);
+    //Set Exposure time
+    iRet = PCO_SetDelayExposureTime(hCamArr[0], 0, expTime,
+        2, expBase);
+    //Arm camera
+    iRet = PCO_ArmCamera(hCamArr[0]);
+
+    //Set image distribution to 1 since only one camera is used
+    imgDistributionArr[0] = 1;
+
+    //Reset Recorder to make sure a no previous instance is running
+    iRet = PCO_RecorderResetLib(false);
+
+    //Create Recorder (mode: memory)
+    WORD mode = PCO_RECORDER_MODE_MEMORY;
+    iRet = PCO_RecorderCreate(&hRec, hCamArr, imgDistributionArr,
+        CAMCOUNT, mode, "C", maxImgCountArr);
+
+    //The clips of the events are copied from the ring buffer while recording (see EventCapture.h)
+    ImageBufferPool bufferPool(false);
+    EventCapture capture(hRec, hCamArr[0], preFrames, postFrames, &bufferPool);
+
+    //The ring buffer only needs to hold the pre-event images and the images recorded
+    //while these are copied (here the same number again), independent of the session length
+    reqImgCountArr[0] = capture.minRingImages(preFrames);
+    if (reqImgCountArr[0] > maxImgCountArr[0])
+        reqImgCountArr[0] = maxImgCountArr[0];
+
+    //Init Recorder, in the ring buffer the oldest images are overwritten
+    iRet = PCO_RecorderInit(hRec, reqImgCountArr, CAMCOUNT,
+        PCO_RECORDER_MEMORY_RINGBUF, 0, NULL, NULL);
+    if (iRet != PCO_NOERROR)
+    {
+        printf("Could not Init the recorder with the error code: %X\n", iRet);
+        printf("Press <Enter> to end\n");
+        iRet = getchar();
+        PCO_CleanupLib();
+        return -1;
+    }
+
+    //Get image size
+    WORD imgWidth = 0, imgHeight = 0;
+    iRet = PCO_RecorderGetSettings(hRec, hCamArr[0], NULL, NULL,
+        NULL, &imgWidth, &imgHeight, NULL);
+
+    //Start camera
+    iRet = PCO_RecorderStartRecord(hRec, NULL);
+
+    //////////////////////////////////////////////
+    //TODO: Process, Save or analyze the clips
+    //Here every clip is written to its own raw stream file (event_<n>.raw)
+    //////////////////////////////////////////////
+    iRet = capture.start([&](EventClip& clip)
+        {
+            std::string filename = "event_" + std::to_string(clip.event) + ".raw";
+            RawStreamWriter writer;
+            int err = writer.open(filename, imgWidth, imgHeight);
+            for (size_t i = 0; i < clip.frames.size() && err == PCO_NOERROR; i++)
+                err = writer.append(clip.frames[i].image, clip.frames[i].imgNumber, &clip.frames[i].metadata);
+            if (err == PCO_NOERROR)
+                err = writer.close();
+            printf("Event %d at image %d: %d images", clip.event, clip.eventImgNumber, (int)clip.frames.size());
+            if (!clip.frames.empty())
+                printf(" (%d to %d)", clip.frames.front().imgNumber, clip.frames.back().imgNumber);
+            printf(", %d lost, saved to %s (error %X)\n", clip.lost, filename.c_str(), err);
+            capture.release(clip);
+        });
+
+    //Record for the whole session, the events are only simulated here
+    //(e.g. an external signal, an analysis result or a user input)
+    auto sessionStart = std::chrono::steady_clock::now();
+    size_t nextEvent = 0;
+    while (std::chrono::duration<double>(std::chrono::steady_clock::now() - sessionStart).count() < sessionSeconds)
+    {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - sessionStart).count();
+        if (nextEvent < sizeof(eventSeconds) / sizeof(eventSeconds[0]) && elapsed >= eventSeconds[nextEvent])
+        {
+            iRet = capture.trigger();
+            nextEvent++;
+        }
+
+        DWORD warn = 0, err = 0, status = 0;
+        iRet = PCO_GetCameraHealthStatus(hCamArr[0],
+            &warn, &err, &status);
+        if (err != PCO_NOERROR) //Stop record on health error
+            PCO_RecorderStopRecord(hRec, hCamArr[0]);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds((10)));
+    }
+
+    //Complete the clips (waits for the post-event images) before recording is stopped
+    capture.stop();
+    iRet = PCO_RecorderStopRecord(hRec, hCamArr[0]);
+
+    capture.printStats();
+    printf("Ring buffer of %d images (%.1f MB) for a session of %.1f s\n", reqImgCountArr[0],
+        (double)reqImgCountArr[0] * imgWidth * imgHeight * sizeof(WORD) / 1e6, sessionSeconds);
+
+    //Delete Recorder
+    iRet = PCO_RecorderDelete(hRec);
+    //Close camera
+    iRet = PCO_CloseCamera(hCamArr[0]);
+
+    PCO_CleanupLib();
+    return 0;
+}
@@ -1,9 +1,11 @@
 #include <iostream>
 #include <cstring>
 #include <map>
+#include <memory>
 #include <string>
 #include <thread>
 #include <chrono>
+#include <vector>
 
 #ifdef PCO_LINUX
 #include <pco_linux_defs.h>
@@ -29,7 +31,12 @@
 #include <pco_recorder_export.h>
 #include <pco_recorder_defines.h>
 
-#define CAMCOUNT    2
+//Common sample helpers
+#include <CameraBringUp.h>
+#include <FrameSetAssembler.h>
+#include <ImageBufferPool.h>
+#include <RecorderMemoryPlan.h>
+#include <WorkStealingReadout.h>
 
 // This functions shows how you can sort cameras according to e.g.serial number
 // Here we s std::map to do the sorting in an ascending order
@@ -61,10 +68,7 @@ int main()
   }
 
   HANDLE hRec = nullptr;
-  HANDLE hCamArr[CAMCOUNT];
-  DWORD imgDistributionArr[CAMCOUNT];
-  DWORD maxImgCountArr[CAMCOUNT];
-  DWORD reqImgCountArr[CAMCOUNT];
+  std::vector<HANDLE> hCamArr;
 
   //Some frequently used parameters for the camera
   DWORD numberOfImages = 10;
@@ -74,52 +78,51 @@ int main()
   WORD triggerMode = TRIGGER_MODE_SOFTWARETRIGGER;
 
 
-  //open all cameras
-  PCO_OpenStruct camstruct;
-  for (int i = 0; i < CAMCOUNT; i++)
-  {
-    hCamArr[i] = 0;
-    //Reset open struct to scan all interfaces
-    memset(&camstruct, 0, sizeof(camstruct));
-    camstruct.wSize = sizeof(PCO_OpenStruct);
-    camstruct.wInterfaceType = 0xFFFF;
-
-    //open next camera
-    err = PCO_OpenCameraEx(&hCamArr[i], &camstruct);
-    if (err != PCO_NOERROR)
+  //open, configure and arm all cameras which are found
+  //This is done for several cameras at the same time, the function returns when all cameras are armed
+  CameraBringUp bringUp;
+  err = bringUpCameras(hCamArr, [&](HANDLE hCam)
     {
-      printf("Camera number %i not found\n", i);
-      printf("Press <Enter> to end\n");
-      err = getchar();
-      PCO_CleanupLib();
-      return -1;
-    }
-    // Do some settings to prepare each camera
-    // The following functions show only a very small subset of options
-
-    //Make sure recording is off
-    err = PCO_SetRecordingState(hCamArr[i], 0);
-    // Reset to default
-    err = PCO_ResetSettingsToDefault(hCamArr[i]);
-    //Do some settings
-    err = PCO_SetTimestampMode(hCamArr[i], TIMESTAMP_MODE_BINARYANDASCII);
-    err = PCO_SetBitAlignment(hCamArr[i], BIT_ALIGNMENT_LSB);
-    err = PCO_SetDelayExposureTime(hCamArr[i], 0, expTime, TIMEBASE_MS, expBase);
-    err = PCO_SetTriggerMode(hCamArr[i], triggerMode);
-    // Activate metadata
-    WORD metaSize = 0, metaVersion = 0;
-    err = PCO_SetMetaDataMode(hCamArr[i], METADATA_MODE_ON, &metaSize, &metaVersion);
-    //Arm camera after all settings are done
-    err = PCO_ArmCamera(hCamArr[i]);
+      // Do some settings to prepare each camera
+      // The following functions show only a very small subset of options
+      // (recording is already off and the settings are reset to default)
+      int iRet = PCO_SetTimestampMode(hCam, TIMESTAMP_MODE_BINARYANDASCII);
+      if (iRet == PCO_NOERROR)
+        iRet = PCO_SetBitAlignment(hCam, BIT_ALIGNMENT_LSB);
+      if (iRet == PCO_NOERROR)
+        iRet = PCO_SetDelayExposureTime(hCam, 0, expTime, TIMEBASE_MS, expBase);
+      if (iRet == PCO_NOERROR)
+        iRet = PCO_SetTriggerMode(hCam, triggerMode);
+      // Activate metadata
+      WORD metaSize = 0, metaVersion = 0;
+      if (iRet == PCO_NOERROR)
+        iRet = PCO_SetMetaDataMode(hCam, METADATA_MODE_ON, &metaSize, &metaVersion);
+      return iRet;
+    }, &bringUp);
+  const WORD camCount = (WORD)hCamArr.size();
+  if (camCount == 0 || err != PCO_NOERROR)
+  {
+    if (camCount == 0)
+      printf("No camera found\n");
+    else
+      printBringUp(bringUp);
+    printf("Press <Enter> to end\n");
+    err = getchar();
+    for (int i = 0; i < camCount; i++)
+      PCO_CloseCamera(hCamArr[i]);
+    PCO_CleanupLib();
+    return -1;
   }
+  printBringUp(bringUp);
+
   //Sort by SN
-  sortCamerasBySN(hCamArr, CAMCOUNT);
+  sortCamerasBySN(hCamArr.data(), camCount);
 
-  // Set image distribution to 1 to give every camera identical space for images in PC RAM
-  // If you know in advance, that e.g camera 2 records twice as much images as 1,
-  // then you can e.g set this here to 2 for camera 2
-  for (int i = 0; i < CAMCOUNT; i++)
-    imgDistributionArr[i] = 1;
+  // The image distribution shares the PC RAM between the cameras. It is set proportional to the expected
+  // frame rates, so all cameras can record for the same time (see RecorderMemoryPlan.h)
+  // Here all cameras get a software trigger every 500 ms. With a free running camera use
+  // cameraFrameRate(hCam) instead, which gives the frame rate of the armed camera
+  std::vector<double> frameRateArr(camCount, 2.0);
 
   //Reset Recorder to make sure a no previous instance is running
   err = PCO_RecorderResetLib(false);
@@ -129,17 +132,13 @@ int main()
   // PCO_RECORDER_MODE_MEMORY -> PC RAM
   // PCO_RECORDER_MODE_FILE -> PC Harddisk as file(s)
   // PCO_RECORDER_MODE_CAMRAM -> Don't store on PC at all, use camera internal memory (only if camera supports this)
+  // The required images of each camera are set for the duration of the recording
+  // (limited by the available memory), with a duration of 0 all memory would be used
   WORD mode = PCO_RECORDER_MODE_MEMORY;
-  err = PCO_RecorderCreate(&hRec, hCamArr, imgDistributionArr, CAMCOUNT, mode, "C", maxImgCountArr);
-
-  // Set required images for each cameras
-  // In this example we suppose same count for all cameras
-  for (int i = 0; i < CAMCOUNT; i++)
-  {
-    reqImgCountArr[i] = numberOfImages;
-    if (reqImgCountArr[i] > maxImgCountArr[i])
-      reqImgCountArr[i] = maxImgCountArr[i];
-  }
+  RecorderMemoryPlan memoryPlan;
+  err = createRecorderForDuration(&hRec, hCamArr, frameRateArr, mode, numberOfImages * 0.5, memoryPlan);
+  printRecorderMemoryPlan(memoryPlan);
+  std::vector<DWORD> reqImgCountArr = memoryPlan.reqImgCounts();
 
   //Init Recorder
   // With this type parameter you can choose the recorder type you want to use
@@ -148,88 +147,98 @@ int main()
   // For mode = PCO_RECORDER_MODE_FILE you can choose the file type ((multi)tif, (multi)dicom, b16, pcoraw)
   // For mode = PCO_RECORDER_MODE_CAMRAM you can define if you are going to read images in sequential order or not 
   //            (Sequential order will only do some small internal performance optimizations to read seqential images faster)
+  //In a sequence the images can be read by index in any order, already while recording
   WORD type = PCO_RECORDER_MEMORY_SEQUENCE;
-  err = PCO_RecorderInit(hRec, reqImgCountArr, CAMCOUNT, type, 0, nullptr, nullptr);
+  err = PCO_RecorderInit(hRec, reqImgCountArr.data(), camCount, type, 0, nullptr, nullptr);
+
+  //The image buffers are taken from a pool, and go back to the pool when a set is done
+  //Pre-allocate the buffers of the readout workers and of the sets which wait in the queue
+  ImageBufferPool bufferPool(false);
+  const unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+  const DWORD queueCapacity = 16;
+  err = reserveRecorderBuffers(bufferPool, hRec, hCamArr.data(), camCount, queueCapacity + 4);
+
+  //The images of all cameras which belong to the same trigger are grouped into frame sets
+  //(here by image number, FrameSetMatch::Timestamp would use the metadata timestamp)
+  //Sets which are not complete after 500 ms are discarded and counted
+  FrameSetAssembler assembler(camCount, FrameSetMatch::ImageNumber, 1000,
+    std::chrono::milliseconds(500), queueCapacity, [&](WORD, WORD* image) { bufferPool.release(image); });
+
+  //The images are read by a pool of workers, independent of the number of cameras
+  //Every image of every camera is a task, a worker which has nothing to do takes over tasks
+  //of the other workers, so a slow camera does not hold back the readout
+  WorkStealingReadout readout(hRec, hCamArr, workerCount, &bufferPool);
+
+  //////////////////////////////////////////////
+  //TODO: Process, Save or analyze the frame sets
+  //Here we just print them and save the images of the first set with metadata to tif files
+  //////////////////////////////////////////////
+  bool setSaved = false;
+  auto processFrameSets = [&]()
+    {
+      FrameSet set;
+      while (assembler.pop(set))
+      {
+        printf("Frame set with image number %d, timestamp skew %lld us\n", set.imgNumber, (long long)set.skewUs);
+        for (int i = 0; i < camCount && !setSaved; i++)
+        {
+          WORD imgWidth = 0, imgHeight = 0;
+          PCO_RecorderGetSettings(hRec, hCamArr[i], nullptr, nullptr, nullptr, &imgWidth, &imgHeight, nullptr);
+          std::string filename = "test_cam" + std::to_string(i) + ".tif";
+          PCO_RecorderSaveImage(set.frames[i].image, imgWidth, imgHeight, FILESAVE_IMAGE_BW_16, false,
+            filename.c_str(), true, &set.frames[i].metadata);
+        }
+        setSaved = true;
+        //give the buffers back to the pool
+        assembler.release(set);
+      }
+    };
 
   //Start all cameras
   err = PCO_RecorderStartRecord(hRec, nullptr);
+  err = readout.start([&assembler, &readout](WORD cam, ReadoutFrame& frame, unsigned)
+    {
+      //The buffer is handed over to the assembler without copying it
+      assembler.add(cam, readout.takeImage(frame), frame.imgNumber, frame.metadata);
+    });
 
-  // Wait until acquisition is finished
   // Send Softwaretrigger every 500 ms
-  bool acquisitionRunning = true;
-  DWORD procImgCount = 0;
-  while (acquisitionRunning)
+  for (DWORD t = 0; t < numberOfImages; t++)
   {
     //Send trigger commands
     WORD triggered = 0; //holds flag if trigger was successful
-    for (int i = 0; i < CAMCOUNT; i++)
+    for (int i = 0; i < camCount; i++)
       PCO_ForceTrigger(hCamArr[i], &triggered);
 
     std::this_thread::sleep_for(std::chrono::milliseconds((500)));
 
     //Check how the cameras are performing
     DWORD healthWarn = 0, healthErr = 0, status = 0;
-    bool runState = false;
-    acquisitionRunning = false;
-    for (int i = 0; i < CAMCOUNT; i++)
+    for (int i = 0; i < camCount; i++)
     {
       //Regularly checking camera health is also a good idea
       err = PCO_GetCameraHealthStatus(hCamArr[i], &healthWarn, &healthErr, &status);
       if (healthErr != PCO_NOERROR) //Stop only the camera that shows health error
         PCO_RecorderStopRecord(hRec, hCamArr[i]);
-
-      err = PCO_RecorderGetStatus(hRec, hCamArr[i], &runState,
-        nullptr, nullptr, &procImgCount, nullptr, nullptr, nullptr, nullptr, nullptr);
-
-      printf("Camera %i has image count %d \n", i, procImgCount);
-
-      //we loop until as long as at least one camera runs
-      acquisitionRunning |= runState;
-    }
-  }
-
-  //////////////////////////////////////////////
-  //TODO: Process, Save or analyze the image(s)
-  //Here we just read, save the first image of every camera with metadata to tif file
-  //////////////////////////////////////////////
-
-  // Read and save first image of every camera
-  // Only for demonstration, not very performant
-  for (int i = 0; i < CAMCOUNT; i++)
-  {
-    //Get image size of e.g. first camera
-    WORD imgWidth = 0, imgHeight = 0;
-    err = PCO_RecorderGetSettings(hRec, hCamArr[i], nullptr, nullptr, nullptr, &imgWidth, &imgHeight, nullptr);
-
-    //Allocate memory for one image
-    WORD* imgBuffer = nullptr;
-    imgBuffer = new WORD[(__int64)imgWidth * (__int64)imgHeight];
-    // Quit program if memory could not be allocated
-    if (imgBuffer == nullptr)
-    {
-      PCO_CleanupLib();
-      return 1;
     }
 
-    //Get image with metadata
-    PCO_METADATA_STRUCT metadata;
-    memset(&metadata, 0, sizeof(PCO_METADATA_STRUCT));
-    metadata.wSize = sizeof(PCO_METADATA_STRUCT);
-    err = PCO_RecorderCopyImage(hRec, hCamArr[i], 0, 1, 1, imgWidth, imgHeight, imgBuffer, nullptr, &metadata, nullptr);
-
-    std::string filename = "test_cam" + std::to_string(i) + ".tif";
-    if (err == PCO_NOERROR)
-      err = PCO_RecorderSaveImage(imgBuffer, imgWidth, imgHeight, FILESAVE_IMAGE_BW_16, false, filename.c_str(), true, &metadata);
-
-    //free the allocated buffer
-    delete[] imgBuffer;
+    processFrameSets();
   }
 
+  //Stop all cameras and wait until the workers have read the remaining images
+  err = PCO_RecorderStopRecord(hRec, nullptr);
+  err = readout.join();
+  if (err != PCO_NOERROR)
+    printf("Error in copy image: %x\n", err);
+  processFrameSets();
+  assembler.flush();
+  assembler.print();
+  readout.printStats();
 
   //Delete Recorder
   err = PCO_RecorderDelete(hRec);
   //Close cameras
-  for (int i = 0; i < CAMCOUNT; i++)
+  for (int i = 0; i < camCount; i++)
     err = PCO_CloseCamera(hCamArr[i]);
 
   PCO_CleanupLib();
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <cstring>
 #include <thread>
+#include <atomic>
+#include <vector>
 #include <chrono>
 
 #ifdef PCO_LINUX
@@ -27,6 +29,12 @@
 #include <pco_recorder_export.h>
 #include <pco_recorder_defines.h>
 
+//Common sample helpers
+#include <FrameCompression.h>
+#include <FrameStats.h>
+#include <ImageBufferPool.h>
+#include <ParallelReadout.h>
+
 #define CAMCOUNT    1
 int main()
 {
@@ -105,6 +113,12 @@ int main()
     iRet = PCO_RecorderGetSettings(hRec, hCamArr[0], NULL, NULL,
         NULL, &imgWidth, &imgHeight, NULL);
 
+    //Get the dynamic resolution for the compression
+    PCO_Description descStruct;
+    descStruct.wSize = sizeof(PCO_Description);
+    iRet = PCO_GetCameraDescription(hCamArr[0], &descStruct);
+    WORD dynRes = iRet == PCO_NOERROR ? descStruct.wDynResDESC : 16;
+
     //Start camera
     iRet = PCO_RecorderStartRecord(hRec, NULL);
 
@@ -126,9 +140,9 @@ int main()
         std::this_thread::sleep_for(std::chrono::milliseconds((100)));
     }
 
-    //Allocate memory for one image
-    WORD* imgBuffer = NULL;
-    imgBuffer = new WORD[(__int64)imgWidth * (__int64)imgHeight];
+    //Image buffers for the readout threads are taken from the buffer pool
+    //The buffers are page aligned, pass true to use huge pages for large sensors
+    ImageBufferPool bufferPool(false);
 
     //Get number of finally recorded images
     DWORD procImgCount = 0;
@@ -141,30 +155,50 @@ int main()
     //////////////////////////////////////////////
 
     //Get the images and print image counter
-    PCO_METADATA_STRUCT metadata;
-    metadata.wSize = sizeof(PCO_METADATA_STRUCT);
+    //The images are copied and processed by several threads in parallel
+    //(process callback), the ordered callback gets them in index order
     bool imageSaved = false;
-    DWORD imgNumber = 0;
-    for (DWORD i = 0; i < procImgCount; i++)
-    {
-        iRet = PCO_RecorderCopyImage(hRec, hCamArr[0], i,
-            1, 1, imgWidth, imgHeight, imgBuffer,
-            &imgNumber, &metadata, NULL);
-        if (iRet == PCO_NOERROR)
+    //Every image is compressed losslessly on the worker threads (see FrameCompression.h),
+    //the compressed buffer can be handed to any writer
+    FrameCompressor compressor(dynRes, BIT_ALIGNMENT_LSB);
+    std::atomic<unsigned long long> compressedBytes{ 0 };
+    ParallelReadout readout(hRec, hCamArr[0], imgWidth, imgHeight, 0, &bufferPool);
+    //The statistics of every image are computed by the worker right after its copy
+    FrameStatsSettings statsSettings;
+    statsSettings.bits = dynRes;
+    readout.setFrameStats(statsSettings);
+    iRet = readout.run(0, procImgCount,
+        [&](ReadoutFrame& frame)
+        {
+            //Per image processing, e.g. analysis, runs on the worker threads
+            size_t capacity = FrameCompressor::maxCompressedBytes(frame.imgWidth, frame.imgHeight);
+            BYTE* compressed = static_cast<BYTE*>(bufferPool.acquire(capacity));
+            size_t bytes = 0;
+            if (compressed != nullptr &&
+                compressor.compress(frame.image, frame.imgWidth, frame.imgHeight, compressed, capacity, bytes) == PCO_NOERROR)
+                compressedBytes += bytes;
+            bufferPool.release(compressed);
+        },
+        [&](ReadoutFrame& frame)
         {
-            printf("Image Number: %d \n", imgNumber);
+            printFrameStats(frame.imgNumber, frame.stats);
 
             //Save first image as tiff in the binary folder
             //just to have some output
             if (!imageSaved)
             {
-                iRet = PCO_RecorderExportImage(hRec, hCamArr[0], i, "test.tif", true);
-                if (iRet == PCO_NOERROR)
+                int err = PCO_RecorderExportImage(hRec, hCamArr[0], frame.index, "test.tif", true);
+                if (err == PCO_NOERROR)
                     imageSaved = true;
             }
-        }
-    }
-    delete[] imgBuffer;
+        });
+    printf("Read %d images with %u threads: %.1f images/s\n", readout.stats().frames,
+        readout.stats().threads, readout.stats().framesPerSecond());
+
+    if (compressedBytes > 0)
+        printf("Compressed %d images to %.1f MB (ratio %.2f)\n", readout.stats().frames, compressedBytes / 1e6,
+            (double)readout.stats().frames * imgWidth * imgHeight * sizeof(WORD) / compressedBytes);
+
     //Delete Recorder
     iRet = PCO_RecorderDelete(hRec);
     //Close camera
@@ -26,6 +26,11 @@
 #include <pco_recorder_export.h>
 #include <pco_recorder_defines.h>
 
+//Common sample helpers
+#include <CamRamReadout.h>
+#include <ImageBufferPool.h>
+#include <LivePreview.h>
+
 #define CAMCOUNT    1
 int main()
 {
@@ -107,7 +112,7 @@ int main()
     //Init Recorder for segment 1 as example, for sequential readout
     iRet = PCO_RecorderInit(hRec, reqImgCountArr, CAMCOUNT,
         PCO_RECORDER_CAMRAM_SEQUENTIAL, 0, NULL, &ramSegment);
-    (iRet != PCO_NOERROR)
+    if (iRet != PCO_NOERROR)
     {
         printf("Could not Init the camera with the error code: %X\n", iRet);
         printf("Press <Enter> to end\n");
@@ -125,76 +130,108 @@ int main()
     iRet = PCO_RecorderGetSettings(hRec, hCamArr[0], NULL,
         &maxImgCountArr[0], NULL, &imgWidth, &imgHeight, NULL);
 
-    //Allocate memory for image
-    WORD* imgBuffer = NULL;
-    imgBuffer = new WORD[(__int64)imgWidth * (__int64)imgHeight];
+    //Get memory for one image from the buffer pool
+    //The buffers are page aligned, pass true to use huge pages for large sensors
+    ImageBufferPool bufferPool(false);
+    WORD* imgBuffer = bufferPool.acquireImage<WORD>(imgWidth, imgHeight);
 
-    if (procImgCount > 0)
+    //The readout of the cameras internal memory runs in a pipeline: the next image is
+    //transferred while the current one is processed. The progress is saved in a checkpoint
+    //file, so an interrupted readout continues where it stopped (see CamRamReadout.h)
+    CamRamReadout camRamReadout(hRec, hCamArr[0], ramSegment, "camram_readout.chk", 3, &bufferPool);
+    CamRamReadout::FrameCallback processImage = [](ReadoutFrame& frame)
     {
-        //If there are already images in the ram segment,
-        //you can read them without any previous recording
-        // Note: CopyImage is indexed based, so this starts with 0
-        iRet = PCO_RecorderCopyImage(hRec, hCamArr[0], 0,
-            1, 1, imgWidth, imgHeight, imgBuffer, NULL, NULL, NULL);
+        printf("Image Number: %d \n", frame.imgNumber);
 
         //////////////////////////////////////////////
         //TODO: Process, Save or analyze the image(s)
+        // Save first image as tiff in the binary folder
+        // just to have some output
         //////////////////////////////////////////////
+        if (frame.index == 0)
+            PCO_RecorderSaveImage(frame.image, frame.imgWidth, frame.imgHeight,
+                FILESAVE_IMAGE_BW_16, false, "test.tif", true, &frame.metadata);
+        return PCO_NOERROR;
+    };
+
+    if (procImgCount > 0)
+    {
+        //If there are already images in the ram segment,
+        //you can read them without any previous recording
+        if (camRamReadout.hasCheckpoint(numberOfImages))
+        {
+            //Finish the readout of these images that was interrupted before
+            printf("Continue readout at index %d\n", camRamReadout.nextIndex());
+            iRet = camRamReadout.run(processImage, CamRamReadout::printProgress, numberOfImages);
+            camRamReadout.printStats();
+        }
+        else
+        {
+            // Note: CopyImage is indexed based, so this starts with 0
+            iRet = PCO_RecorderCopyImage(hRec, hCamArr[0], 0,
+                1, 1, imgWidth, imgHeight, imgBuffer, NULL, NULL, NULL);
+
+            //////////////////////////////////////////////
+            //TODO: Process, Save or analyze the image(s)
+            //////////////////////////////////////////////
+        }
     }
 
+    //If required you can get a live stream during record
+    //(only PCO_RECORDER_LATEST_IMAGE is allowed during record)
+    //The preview copies only the center of the image, at most 25 times per second
+    //and within a link budget, and bins it 4x4 on the host (see LivePreview.h)
+    LivePreviewSettings previewSettings;
+    previewSettings.roiX0 = imgWidth / 4 + 1;
+    previewSettings.roiY0 = imgHeight / 4 + 1;
+    previewSettings.roiX1 = imgWidth * 3 / 4;
+    previewSettings.roiY1 = imgHeight * 3 / 4;
+    previewSettings.binning = 4;
+    previewSettings.maxFps = 25.0;
+    previewSettings.budgetMBps = 20.0;
+    LivePreview preview(hRec, hCamArr[0], previewSettings, &bufferPool);
+    int previewRet = preview.init();
+
+    //The record overwrites the images in the ram segment, so a checkpoint of them is obsolete
+    camRamReadout.discardCheckpoint();
+
     //Start camera
     iRet = PCO_RecorderStartRecord(hRec, NULL);
 
     //Wait as long as you want (i.e. for some external event)
-    int waitTime = 0;
-    while (waitTime < 10)
+    const double previewSeconds = 2.0;
+    while (previewRet == PCO_NOERROR && preview.stats().seconds < previewSeconds)
     {
-        //If required you can get a live stream during record
-        //(only PCO_RECORDER_LATEST_IMAGE is allowed during record)
-        iRet = PCO_RecorderCopyImage(hRec, hCamArr[0],
-            PCO_RECORDER_LATEST_IMAGE,
-            1, 1, imgWidth, imgHeight, imgBuffer, NULL, NULL, NULL);
-        waitTime++;
+        //Sleeps until the next preview is due, fails as long as no image is recorded
+        if (preview.next() == PCO_NOERROR)
+        {
+            //////////////////////////////////////////////
+            //TODO: Display preview.image()
+            //////////////////////////////////////////////
+        }
     }
     //Stop record
     iRet = PCO_RecorderStopRecord(hRec, hCamArr[0]);
 
+    if (previewRet == PCO_NOERROR && preview.stats().frames > 0)
+    {
+        preview.printStats();
+        PCO_RecorderSaveImage((void*)preview.image(), preview.width(), preview.height(),
+            FILESAVE_IMAGE_BW_16, false, "test_preview.tif", true, NULL);
+    }
+
     //Get number of finally recorded images
     iRet = PCO_RecorderGetStatus(hRec, hCamArr[0], NULL, NULL, NULL,
         &procImgCount, NULL, NULL, NULL, NULL, NULL);
 
-    //////////////////////////////////////////////
-    //TODO: Process, Save or analyze the image(s)
-    // Here we just read, print image counter and save one tif file
-    //////////////////////////////////////////////
-
-    PCO_METADATA_STRUCT metadata;
-    metadata.wSize = sizeof(PCO_METADATA_STRUCT);
-    DWORD imgNumber = 0;
-    bool imageSaved = false;
     //Get the first "numberOfImages" images from
-    //the cameras internal memory
-    for (int i = 0; i < (int)numberOfImages; i++)
-    {
-        //Copy the image at index 5 into the buffer
-        iRet = PCO_RecorderCopyImage(hRec, hCamArr[0], i,
-            1, 1, imgWidth, imgHeight,
-            imgBuffer, &imgNumber, &metadata, NULL);
-        if (iRet == PCO_NOERROR)
-        {
-            printf("Image Number: %d \n", imgNumber);
-
-            //Save first image as tiff in the binary folder
-            //just to have some output
-            if (!imageSaved)
-            {
-                iRet = PCO_RecorderExportImage(hRec, hCamArr[0], i, "test.tif", true);
-                if (iRet == PCO_NOERROR)
-                    imageSaved = true;
-            }
-        }
-    }
-    delete[] imgBuffer;
+    //the cameras internal memory, with transfer rate and remaining time
+    iRet = camRamReadout.run(processImage, CamRamReadout::printProgress, numberOfImages);
+    camRamReadout.printStats();
+    if (!camRamReadout.complete())
+        printf("Readout stopped at index %d with error %X, it continues there on the next start\n",
+            camRamReadout.nextIndex(), iRet);
+    bufferPool.release(imgBuffer);
     //Delete Recorder
     iRet = PCO_RecorderDelete(hRec);
     //Close camera
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
 #include <chrono>
+#include <thread>
+#include <vector>
 
 #ifdef PCO_LINUX
 #include <pco_linux_defs.h>
@@ -26,10 +29,40 @@
 #include <pco_recorder_export.h>
 #include <pco_recorder_defines.h>
 
+//Common sample helpers
+#include <AsyncFrameWriter.h>
+#include <AutoExposure.h>
+#include <FifoConsumer.h>
+#include <FrameLoss.h>
+#include <FrameStats.h>
+#include <ImageBufferPool.h>
+#include <Latency.h>
+#include <PackedFrame.h>
+#include <RawStream.h>
+
 #define CAMCOUNT    1
 #define RECORD_TIME_IN_S 5
-int main()
+//Set to 1 to let the exposure time follow the lighting while recording (see AutoExposure.h)
+#ifndef AUTO_EXPOSURE
+#define AUTO_EXPOSURE 0
+#endif
+//Usage: SimpleExample_FIFO [-r MB]
+//  -r  also keep the latest images packed in a host ring of MB size (see PackedFrame.h), off by default
+int main(int argc, char* argv[])
 {
+    //The host ring packs every image on the acquisition thread, so it is only used on request
+    size_t hostRingBytes = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            hostRingBytes = (size_t)strtoul(argv[++i], nullptr, 10) << 20;
+        else
+        {
+            printf("Usage: %s [-r MB]\n", argv[0]);
+            return -1;
+        }
+    }
+
     int iRet;
     HANDLE hRec = NULL;
     HANDLE hCamArr[CAMCOUNT];
@@ -99,67 +132,207 @@ int main()
     iRet = PCO_RecorderGetSettings(hRec, hCamArr[0], NULL, NULL,
         NULL, &imgWidth, &imgHeight, NULL);
 
-    //Allocate memory for one image
-    WORD* imgBuffer = NULL;
-    imgBuffer = new WORD[(__int64)imgWidth * (__int64)imgHeight];
+    //Get the dynamic resolution for the packed host ring
+    PCO_Description descStruct;
+    descStruct.wSize = sizeof(PCO_Description);
+    iRet = PCO_GetCameraDescription(hCamArr[0], &descStruct);
+    WORD dynRes = iRet == PCO_NOERROR ? descStruct.wDynResDESC : 16;
 
-    //Get the images currently available
-    DWORD procImgCount = 0;
-    PCO_METADATA_STRUCT metadata;
-    metadata.wSize = sizeof(PCO_METADATA_STRUCT);
     bool imageSaved = false;
-    DWORD imgNumber = 0;
-    bool isRunning = true;
 
     //////////////////////////////////////////////
     //TODO: Process, Save or analyze the image(s) during acquisition
     //Here we just read, print image counter and save one tif file
     //////////////////////////////////////////////
 
+    //The consumer reads the images on its own acquisition thread
+    //While the FIFO is empty it polls a few times with yield and then sleeps
+    //with increasing intervals, instead of calling PCO_RecorderGetStatus back to back
+    //All images waiting in the FIFO are copied in one batch (up to batchSize)
+    BackoffPolicy policy;
+    policy.yieldCount = 4;
+    policy.minSleep = std::chrono::microseconds(100);
+    policy.maxSleep = std::chrono::microseconds(2000);
+    DWORD batchSize = 16;
+    //The image buffers are allocated up front, sized from PCO_RecorderGetSettings,
+    //so there is no allocation during acquisition.
+    //The buffers are page aligned, pass true to use huge pages for large sensors
+    ImageBufferPool bufferPool(false);
+    DWORD maxWritesInFlight = 32;
+    iRet = reserveRecorderBuffers(bufferPool, hRec, hCamArr, CAMCOUNT, batchSize + maxWritesInFlight);
+    if (iRet != PCO_NOERROR)
+        printf("Could not reserve the image buffers: %x\n", iRet);
+    FifoConsumer consumer(hRec, hCamArr[0], imgWidth, imgHeight, policy, batchSize, &bufferPool);
+
+    //Camera timestamp, host receive time and copy duration of every image
+    LatencyRecorder latency(CAMCOUNT);
+    consumer.setLatencyRecorder(&latency, 0);
+
+    //Gaps in the image numbers (images dropped by the FIFO) and fill level above 80%
+    FrameLossMonitor lossMonitor(CAMCOUNT, 0.8);
+    lossMonitor.setCapacity(0, reqImgCountArr[0]);
+    consumer.setLossMonitor(&lossMonitor, 0);
+
+    //Min, max, mean, variance, histogram and saturated pixels of every image,
+    //computed right after the copy while the image is still in the cache
+    FrameStatsSettings statsSettings;
+    statsSettings.bits = dynRes;
+    statsSettings.binCount = 256;
+    consumer.setFrameStats(statsSettings);
+    DWORD saturatedImages = 0;
+
+    //With AUTO_EXPOSURE the exposure time follows the lighting: the 99% percentile of the histogram is kept
+    //at 75% of the dynamic range. The new exposure is set while recording, without arming the camera again.
+    AutoExposure autoExposure(hCamArr[0]);
+    bool autoExposureOn = false;
+    if (AUTO_EXPOSURE)
+    {
+        iRet = autoExposure.init(dynRes);
+        autoExposureOn = iRet == PCO_NOERROR;
+        if (!autoExposureOn)
+            printf("Auto exposure could not be started: %x\n", iRet);
+    }
+
+    //Every image is appended to a raw stream file with a metadata index
+    //(stream.raw and stream.raw.idx in the binary folder)
+    //The writer works asynchronously (io_uring and O_DIRECT if available),
+    //the image buffers go back to the pool when they are written
+    AsyncFrameWriter streamWriter(maxWritesInFlight);
+    iRet = streamWriter.open("stream.raw", imgWidth, imgHeight,
+        [&](WORD* buffer) { bufferPool.release(buffer); });
+    if (iRet != PCO_NOERROR)
+        printf("Could not create the stream file: %x\n", iRet);
+
+    //With -r the latest images are also kept on the host with the dynamic resolution of the camera
+    //(see PackedFrame.h), so the same memory holds 16 / dynRes times more images
+    //Without it the ring has no memory and nothing is packed
+    PackedFrameRing hostRing(hostRingBytes, imgWidth, imgHeight, dynRes, &bufferPool);
+    DWORD unwrittenImages = 0;
+
     //Start Record
     iRet = PCO_RecorderStartRecord(hRec, nullptr);
-    auto start_time = std::chrono::high_resolution_clock::now();
-    auto record_time = std::chrono::seconds(RECORD_TIME_IN_S);
-    while (isRunning)
-    {
-        iRet = PCO_RecorderGetStatus(hRec, hCamArr[0], &isRunning,
-            NULL, NULL, &procImgCount,
-            NULL, NULL, NULL, NULL, NULL);
-        if (procImgCount > 0)
+    consumer.start([&](const WORD* image, DWORD imgNumber,
+        const PCO_METADATA_STRUCT& metadata, DWORD fillLevel)
         {
-            iRet = PCO_RecorderCopyImage(hRec, hCamArr[0], 0,
-                1, 1, imgWidth, imgHeight, imgBuffer,
-                &imgNumber, &metadata, NULL);
-            if (iRet != PCO_NOERROR)
+            const FrameStats* stats = consumer.imageStats(image);
+            if (stats != nullptr && stats->valid)
             {
-                printf("Error in copy image: %x\n", iRet);
-                PCO_RecorderStopRecord(hRec, nullptr);
+                printf("Fill level: %d \t", fillLevel);
+                printFrameStats(imgNumber, *stats);
+                if (stats->saturated > 0)
+                    saturatedImages++;
 
-                break;  //Break on error
+                double exposure = autoExposure.exposureSeconds();
+                if (autoExposureOn && autoExposure.update(*stats, &metadata) != PCO_NOERROR)
+                {
+                    printf("Exposure time could not be set, auto exposure is switched off\n");
+                    autoExposureOn = false;
+                }
+                if (autoExposure.exposureSeconds() != exposure)
+                    printf("Exposure time %.3f ms -> %.3f ms\n", exposure * 1e3, autoExposure.exposureSeconds() * 1e3);
             }
-            printf("Fill level: %d \tImage Number: %d\n",
-                procImgCount, imgNumber);
+            else
+                printf("Fill level: %d \tImage Number: %d\n",
+                    fillLevel, imgNumber);
 
-            // Save the image we have copied above as tiff in the binary folder
+            // Save the first image as tiff in the binary folder
             // just to have some output
-            // For Fifo the PCO_RecorderExportImage will always save the image you received 
-            // in the last PCO_RecorderCopyImage call
+            // Since the images are copied in batches, the image of the last PCO_RecorderCopyImage
+            // call, which PCO_RecorderExportImage would save for Fifo, is not necessarily this one.
+            // So we save the buffer we got instead
             if (!imageSaved)
             {
-                iRet = PCO_RecorderExportImage(hRec, hCamArr[0], 0, "test.tif", true);
-                if (iRet == PCO_NOERROR)
+                int err = PCO_RecorderSaveImage((void*)image, imgWidth, imgHeight,
+                    FILESAVE_IMAGE_BW_16, false, "test.tif", true,
+                    (PCO_METADATA_STRUCT*)&metadata);
+                if (err == PCO_NOERROR)
                     imageSaved = true;
             }
-        }
 
-        //Stop on time elapsed
-        if (std::chrono::high_resolution_clock::now() - start_time > record_time)
+            if (hostRingBytes > 0)
+                hostRing.push(image, imgNumber, &metadata);
+
+            //Hand the buffer over to the writer instead of copying it,
+            //the consumer gets a free buffer from the pool for the next image
+            //On an error the writer gives the buffer back to the pool itself
+            WORD* buffer = consumer.takeImage(image);
+            if (buffer == nullptr || streamWriter.submit(buffer, imgNumber, &metadata) != PCO_NOERROR)
+                unwrittenImages++;
+        });
+
+    //Stop on time elapsed, or earlier if the consumer stopped on an error
+    if (!consumer.waitFor(std::chrono::seconds(RECORD_TIME_IN_S)))
+        PCO_RecorderStopRecord(hRec, nullptr);
+    iRet = consumer.join();
+    if (iRet != PCO_NOERROR)
+        printf("Error in copy image: %x\n", iRet);
+
+    const FifoConsumerStats& stats = consumer.stats();
+    printf("Delivered %d images, %d of %d status polls were empty, %.1f images per batch\n",
+        stats.framesDelivered, stats.emptyPolls, stats.statusPolls, stats.framesPerBatch());
+    printf("Consumer CPU time: %.3f s of %.3f s (%.1f us per image)\n",
+        stats.cpuSeconds, stats.wallSeconds, stats.cpuSecondsPerFrame() * 1e6);
+    printf("Image buffers allocated: %zu (%zu MB)\n",
+        bufferPool.allocations(), bufferPool.allocatedBytes() >> 20);
+
+    printf("%d images with saturated pixels\n", saturatedImages);
+    if (AUTO_EXPOSURE)
+    {
+        autoExposure.printStats();
+        //Leave the camera with the exposure time it had before
+        iRet = autoExposure.restore();
+        if (iRet != PCO_NOERROR)
+            printf("Could not restore the exposure time: %x\n", iRet);
+    }
+
+    //Lost images and fill level, a setup is fine for the frame rate if no images are lost
+    lossMonitor.print();
+
+    //Latency percentiles, the samples of the last images are written to latency.csv in the binary folder
+    latency.print();
+    latency.writeCsv("latency.csv");
+
+    //Packed host ring: the newest image is analyzed without unpacking all of it,
+    //only the rows of a center ROI are unpacked
+    if (hostRingBytes > 0)
+        printf("Host ring of %zu MB holds %u images with %u bit (%u with 16 bit), contains %u images\n",
+            hostRingBytes >> 20, hostRing.capacity(), dynRes,
+            PackedFrameRing::framesFor(hostRingBytes, imgWidth, imgHeight, 16), hostRing.size());
+    if (hostRing.size() > 0)
+    {
+        const PackedFrameEntry& newest = hostRing.back(0);
+        WORD roiWidth = imgWidth / 4, roiHeight = imgHeight / 4;
+        std::vector<WORD> roiRow(roiWidth);
+        double sum = 0.0;
+        for (WORD y = (imgHeight - roiHeight) / 2; y < (imgHeight + roiHeight) / 2; y++)
         {
-            PCO_RecorderStopRecord(hRec, nullptr);
+            hostRing.codec().unpackRow(newest.frame, y, (imgWidth - roiWidth) / 2, roiWidth, roiRow.data());
+            for (WORD value : roiRow)
+                sum += value;
         }
+        printf("Image %d: center %ux%u mean %.1f, center pixel %u\n", newest.imgNumber, roiWidth, roiHeight,
+            roiWidth > 0 && roiHeight > 0 ? sum / ((double)roiWidth * roiHeight) : 0.0,
+            newest.frame.pixel(imgWidth / 2, imgHeight / 2));
+    }
+
+    //Close the stream and map it again to check what was written
+    iRet = streamWriter.close();
+    AsyncWriterStats writerStats = streamWriter.stats();
+    printf("Wrote %llu images with %s%s, %.1f MB/s (last second %.1f MB/s), up to %u writes in flight\n",
+        (unsigned long long)writerStats.framesWritten, writerStats.ioUring ? "io_uring" : "write threads",
+        writerStats.directIO ? " and direct IO" : "", writerStats.averageMBps(),
+        writerStats.lastSecondMBps, writerStats.maxInFlight);
+    if (unwrittenImages > 0)
+        printf("%d images could not be written to the stream\n", unwrittenImages);
+    RawStreamReader streamReader;
+    if (iRet == PCO_NOERROR && streamReader.open("stream.raw") == PCO_NOERROR &&
+        streamReader.frameCount() > 0)
+    {
+        printf("Stream contains %llu images, image numbers %d to %d\n",
+            (unsigned long long)streamReader.frameCount(), streamReader.entry(0).imgNumber,
+            streamReader.entry(streamReader.frameCount() - 1).imgNumber);
     }
 
-    delete[] imgBuffer;
     //Delete Recorder
     iRet = PCO_RecorderDelete(hRec);
     //Close camera